@@ -0,0 +1,144 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file admission.c
+ *  \brief microhttpd admission control and memory budget
+ *
+ *  Connections, per-client receive buffers, request header storage and uploads in progress are
+ *  counted against the limits in tMicroHttpdParams. Anything over budget is answered with a
+ *  pre-serialized 503 and closed, so a flood costs one send() per connection rather than memory.
+ *  Everything here runs on the event loop thread.
+ */
+#include <unistd.h>
+#include <sys/socket.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "transport.h"
+#include "admission.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+#if !defined(MSG_DONTWAIT)
+#define MSG_DONTWAIT 0
+#endif
+
+static const char SHED_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                    "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "Retry-After: 1\r\n"
+                                    "Connection: close\r\n"
+                                    "\r\n";
+
+static void microhttpd_ShedSocket(int socket, const char *response, uint32_t length);
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Called before a new connection allocates anything. When refused, the 503 has already been sent
+ *  on plain sockets, and the caller closes the socket; other transports get nothing before their
+ *  session is set up. */
+bool microhttpd_AdmitClient(struct md_context *ctx, int socket, const struct md_transport *transport)
+{
+   if(0 == ctx->params.max_clients || ctx->client_count < ctx->params.max_clients)
+      return true;
+
+   MH_DBG("%s: Refusing connection (%"PRIu32" clients)\n", __func__, ctx->client_count);
+   if(&md_transport_socket == transport)
+      microhttpd_ShedSocket(socket, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1);
+   return false;
+}
+
+/*! Account for buffered request data. Returns false, reserving nothing, if it would exceed the
+ *  budget. */
+bool microhttpd_BudgetReserve(struct md_context *ctx, uint32_t bytes)
+{
+   if(0 != ctx->params.max_buffered_bytes
+   && ctx->buffered_bytes + bytes > ctx->params.max_buffered_bytes)
+   {
+      MH_DBG("%s: %"PRIu32" bytes over budget (%"PRIu32" buffered)\n", __func__, bytes,
+         ctx->buffered_bytes);
+      return false;
+   }
+   ctx->buffered_bytes += bytes;
+   return true;
+}
+
+void microhttpd_BudgetRelease(struct md_context *ctx, uint32_t bytes)
+{
+   MH_ASSERT(ctx->buffered_bytes >= bytes);
+   ctx->buffered_bytes -= bytes;
+}
+
+/*! Account for a stored header entry of the given length. When over budget, the client has been
+ *  sent a 503 and should be dropped. */
+bool microhttpd_HeaderReserve(struct md_client *client, uint32_t length)
+{
+   uint32_t bytes = length + 1 + sizeof(char *);
+
+   if(!microhttpd_BudgetReserve(client->ctx, bytes))
+   {
+      microhttpd_Shed(client);
+      return false;
+   }
+   client->header_bytes += bytes;
+   return true;
+}
+
+bool microhttpd_AdmitUpload(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   if(0 != ctx->params.max_uploads && ctx->upload_count >= ctx->params.max_uploads)
+   {
+      MH_DBG("%s: Refusing upload (%"PRIu32" in progress)\n", __func__, ctx->upload_count);
+      return false;
+   }
+   ++(ctx->upload_count);
+   client->upload_active = true;
+   return true;
+}
+
+/*! Release everything a request held against the budget, once its header has been discarded */
+void microhttpd_RequestFinished(struct md_client *client)
+{
+   microhttpd_BudgetRelease(client->ctx, client->header_bytes);
+   client->header_bytes = 0;
+   if(client->upload_active)
+   {
+      --(client->ctx->upload_count);
+      client->upload_active = false;
+   }
+}
+
+/*! Answer an over-budget request; the caller then removes the client. Connections that are no
+ *  longer speaking HTTP are just closed. */
+void microhttpd_Shed(struct md_client *client)
+{
+   if(NULL == client->channel && NULL == client->websocket && NULL == client->h2)
+      microhttpd_Refuse(client, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1);
+}
+
+/*! Send a response the connection is closed right after, without waiting and ahead of any queued
+ *  output. Plain sockets are written directly. Other transports are written through, so a TLS
+ *  session gets it encrypted, but only once a request has arrived over them (before that, the TLS
+ *  handshake may not be done) and with nothing queued that the session is part way through. */
+void microhttpd_Refuse(struct md_client *client, const char *response, uint32_t length)
+{
+   struct iovec iov = { (void *) response, length };
+
+   if(&md_transport_socket == client->transport)
+      microhttpd_ShedSocket(client->socket, response, length);
+   else if(client->header_entry_count > 0 && 0 == client->tx_pending)
+      client->transport->writev(client, &iov, 1);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static void microhttpd_ShedSocket(int socket, const char *response, uint32_t length)
+{
+   if(socket >= 0)
+      send(socket, response, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
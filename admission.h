@@ -0,0 +1,24 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file admission.h
+ *  \brief microhttpd admission control and memory budget
+ */
+#ifndef _MICROHTTPD_ADMISSION_H
+#define _MICROHTTPD_ADMISSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+struct md_transport;
+
+bool microhttpd_AdmitClient(struct md_context *ctx, int socket, const struct md_transport *transport);
+bool microhttpd_BudgetReserve(struct md_context *ctx, uint32_t bytes);
+void microhttpd_BudgetRelease(struct md_context *ctx, uint32_t bytes);
+bool microhttpd_HeaderReserve(struct md_client *client, uint32_t length);
+bool microhttpd_AdmitUpload(struct md_client *client);
+void microhttpd_RequestFinished(struct md_client *client);
+void microhttpd_Shed(struct md_client *client);
+void microhttpd_Refuse(struct md_client *client, const char *response, uint32_t length);
+
+#endif /* _MICROHTTPD_ADMISSION_H */
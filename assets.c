@@ -0,0 +1,72 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file assets.c
+ *  \brief microhttpd bundled static assets
+ *
+ *  Asset tables are generated at build time by tools/assets.c. Every response is already serialized,
+ *  so serving an asset is one hash probe, one string compare and one send straight from const data.
+ */
+#include <string.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "helpers.h"
+#include "assets.h"
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Returns NULL if no asset has this URI */
+const tMicroHttpdAsset *microhttpd_AssetFind(const tMicroHttpdAssetTable *table, const char *uri)
+{
+   const tMicroHttpdAsset *asset;
+   uint32_t bucket;
+
+   if(NULL == table || 0 == table->asset_count)
+      return NULL;
+
+   bucket = microhttpd_AssetHash(0, uri) % table->bucket_count;
+   asset = &table->assets[microhttpd_AssetHash(table->seeds[bucket], uri) % table->asset_count];
+   return (strcmp(asset->uri, uri) == 0) ? asset : NULL;
+}
+
+/*! Send the asset for the request URI, if there is one. Returns false, having sent nothing, when the
+ *  request is left to the GET handlers. */
+bool microhttpd_ServeAsset(struct md_client *client)
+{
+   const tMicroHttpdAsset *asset = microhttpd_AssetFind(client->ctx->params.assets, client->uri);
+   bool head = (MICROHTTPD_METHOD_HEAD == client->method);
+   const char *value, *etag;
+   struct iovec iov;
+   bool gzip;
+
+   if(NULL == asset)
+      return false;
+
+   /* The variant is chosen first, since each has its own ETag to validate against */
+   gzip = NULL != asset->gzip_response
+      && string_token_weight(microhttpd_HeaderValue(client, "accept-encoding"), "gzip") > 0;
+   etag = gzip ? asset->gzip_etag : asset->etag;
+   value = microhttpd_HeaderValue(client, "if-none-match");
+   if(NULL != value && (strcmp(value, "*") == 0 || NULL != strstr(value, etag)))
+   {
+      iov.iov_base = (void *) (gzip ? asset->gzip_not_modified : asset->not_modified);
+      iov.iov_len = gzip ? asset->gzip_not_modified_length : asset->not_modified_length;
+   }
+   else if(gzip)
+   {
+      iov.iov_base = (void *) asset->gzip_response;
+      iov.iov_len = head ? asset->gzip_header_length : asset->gzip_response_length;
+   }
+   else
+   {
+      iov.iov_base = (void *) asset->response;
+      iov.iov_len = head ? asset->header_length : asset->response_length;
+   }
+
+   MH_DBG("%s: Sending asset '%s' (%"PRIu32" bytes)\n", __func__, asset->uri, (uint32_t) iov.iov_len);
+   if(microhttpd_ClientSend(client, &iov, 1) < 0)
+      MH_DBG("%s: Failed to send asset '%s'\n", __func__, asset->uri);
+   return true;
+}
@@ -0,0 +1,37 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file assets.h
+ *  \brief microhttpd bundled static assets
+ */
+#ifndef _MICROHTTPD_ASSETS_H
+#define _MICROHTTPD_ASSETS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+/*! Hash behind the asset tables' minimal perfect hash. Seed 0 selects a bucket; the bucket's seed
+ *  selects the slot. The build-time tool (tools/assets.c) uses this same function, so tables must be
+ *  regenerated if it ever changes. */
+static inline uint32_t microhttpd_AssetHash(uint32_t seed, const char *key)
+{
+   uint32_t hash = 2166136261u ^ seed;
+
+   while('\0' != *key)
+   {
+      hash ^= (uint8_t) *key++;
+      hash *= 16777619u;
+   }
+   /* Final avalanche, so that consecutive seeds give unrelated slots */
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6bu;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35u;
+   hash ^= hash >> 16;
+   return hash;
+}
+
+const tMicroHttpdAsset *microhttpd_AssetFind(const tMicroHttpdAssetTable *table, const char *uri);
+bool microhttpd_ServeAsset(struct md_client *client);
+
+#endif /* _MICROHTTPD_ASSETS_H */
@@ -0,0 +1,713 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file bench.c
+ *  \brief microhttpd loopback load-generation benchmark
+ *
+ *  Runs an embedded microhttpd server on a background thread and drives it with a multi-threaded
+ *  load generator over the loopback interface. Results are written as JSON so they can be compared
+ *  between releases.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "microhttpd/microhttpd.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
+
+#define BENCH_DEFAULT_PORT        8091
+#define BENCH_DEFAULT_DURATION    2     /* seconds per scenario */
+#define BENCH_DEFAULT_CLIENTS     8
+#define BENCH_RX_BUFFER_SIZE      16384
+#define BENCH_SMALL_BODY          "Hello there!\n"
+#define BENCH_LARGE_SIZE          (1024 * 1024)
+#define BENCH_UPLOAD_SIZE         (1024 * 1024)
+#define BENCH_BOUNDARY            "----microhttpdbenchboundary"
+#define BENCH_IO_BUFFER_SIZE      65536
+#define BENCH_DEFERRED_QUEUE_SIZE 1024
+#define BENCH_CPU_WORK_SIZE       (64 * 1024) /* Bytes hashed by each /cpu request */
+#define BENCH_PIPELINE_DEPTH      16          /* Requests sent back to back by pipelined scenarios */
+
+typedef struct
+{
+   const char *name;
+   const char *description;
+   bool keepalive;
+   bool concurrent;  /* use the configured client count rather than a single client */
+   const char *(*build_request)(uint32_t *length);
+   uint32_t pipeline; /* Responses to read for each request sent (0 is 1) */
+} tBenchScenario;
+
+typedef struct
+{
+   const tBenchScenario *scenario;
+   uint16_t port;
+   atomic_bool *stop;
+
+   uint64_t *latencies; /* nanoseconds */
+   uint64_t latency_count;
+   uint64_t latency_capacity;
+   uint64_t requests;
+   uint64_t errors;
+   uint64_t rejected; /* Non-2xx responses */
+   uint64_t bytes;
+} tBenchWorker;
+
+typedef struct
+{
+   const char *name;
+   uint32_t clients;
+   uint64_t requests;
+   uint64_t errors;
+   uint64_t rejected;
+   double elapsed;
+   double requests_per_sec;
+   double mb_per_sec;
+   double p50, p99, p999; /* microseconds */
+} tBenchResult;
+
+static const char *build_get_small(uint32_t *length);
+static const char *build_get_small_pipelined(uint32_t *length);
+static const char *build_get_deferred(uint32_t *length);
+static const char *build_get_cpu(uint32_t *length);
+static const char *build_get_large(uint32_t *length);
+static const char *build_post_upload(uint32_t *length);
+
+static const tBenchScenario scenarios[] =
+{
+   { "get_small_keepalive", "Small GET, one client, persistent connection", true, false, build_get_small },
+   { "get_small_close", "Small GET, one client, new connection per request", false, false, build_get_small },
+   { "get_small_concurrent", "Small GET, N clients, persistent connections", true, true, build_get_small },
+   { "get_small_pipelined", "Small GET, 16 pipelined per send, N clients, persistent connections", true, true, build_get_small_pipelined, BENCH_PIPELINE_DEPTH },
+   { "get_small_concurrent_close", "Small GET, N clients, new connection per request", false, true, build_get_small },
+   { "get_small_deferred", "Small GET completed by another thread, N clients, persistent connections", true, true, build_get_deferred },
+   { "get_cpu_concurrent", "CPU-heavy GET (see -w), N clients, persistent connections", true, true, build_get_cpu },
+   { "get_large", "1 MiB GET download, one client, persistent connection", true, false, build_get_large },
+   { "post_multipart_large", "1 MiB multipart POST upload, one client, persistent connection", true, false, build_post_upload },
+};
+
+static const struct
+{
+   const char *name;
+   tMicroHttpdEventBackend backend;
+} backends[] =
+{
+   { "auto", MICROHTTPD_EVENTS_AUTO },
+   { "select", MICROHTTPD_EVENTS_SELECT },
+   { "epoll", MICROHTTPD_EVENTS_EPOLL },
+   { "io_uring", MICROHTTPD_EVENTS_IO_URING },
+};
+
+static char *large_content;
+static char *upload_request;
+static uint32_t upload_request_length;
+
+/* Deferred responses waiting for the completer thread */
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t ready;
+   tMicroHttpdDeferred queue[BENCH_DEFERRED_QUEUE_SIZE];
+   uint32_t head, count;
+} deferred = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* ---------------------------------------------------------------------------------------------
+ * Embedded server
+ */
+
+static void handle_small(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   microhttpd_send_response(client, HTTP_OK, "text/plain", strlen(BENCH_SMALL_BODY), NULL,
+      BENCH_SMALL_BODY);
+}
+
+static void handle_large(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   microhttpd_send_response(client, HTTP_OK, "application/octet-stream", BENCH_LARGE_SIZE, NULL,
+      large_content);
+}
+
+static void handle_deferred(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   tMicroHttpdDeferred handle = microhttpd_defer(client);
+
+   pthread_mutex_lock(&deferred.lock);
+   if(NULL == handle || deferred.count == BENCH_DEFERRED_QUEUE_SIZE)
+   {
+      pthread_mutex_unlock(&deferred.lock);
+      if(NULL != handle)
+         microhttpd_complete(handle, HTTP_SERVICE_UNAVAILABLE, "text/plain", 0, NULL, NULL);
+      return;
+   }
+   deferred.queue[(deferred.head + deferred.count) % BENCH_DEFERRED_QUEUE_SIZE] = handle;
+   ++deferred.count;
+   pthread_cond_signal(&deferred.ready);
+   pthread_mutex_unlock(&deferred.lock);
+}
+
+/* Stands in for report generation or image encoding */
+static void handle_cpu(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   uint64_t hash = 14695981039346656037ULL;
+   char body[32];
+   int length;
+
+   for(uint32_t i = 0; i < BENCH_CPU_WORK_SIZE; ++i)
+      hash = (hash ^ (uint8_t) large_content[i]) * 1099511628211ULL;
+   length = snprintf(body, sizeof(body), "%016" PRIx64 "\n", hash);
+   microhttpd_send_response(client, HTTP_OK, "text/plain", length, NULL, body);
+}
+
+static void handle_not_found(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   microhttpd_send_response(client, HTTP_NOT_FOUND, "text/plain", 0, NULL, NULL);
+}
+
+static void handle_post(tMicroHttpdClient client, const char *uri, const char *filename,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length)
+{
+   if(finish)
+      microhttpd_send_response(client, HTTP_OK, "text/plain", 2, NULL, "OK");
+}
+
+static tMicroHttpdGetHandlerEntry get_handler_list[] =
+{
+   { "/small", handle_small, NULL },
+   { "/large", handle_large, NULL },
+   { "/deferred", handle_deferred, NULL },
+   { "/cpu", handle_cpu, NULL, MICROHTTPD_HANDLER_OFFLOAD },
+};
+
+static void *server_thread(void *arg)
+{
+   tMicroHttpdContext ctx = (tMicroHttpdContext) arg;
+   while(microhttpd_process(ctx) == 0);
+   return NULL;
+}
+
+/* Stands in for work done outside the event loop (e.g. a sensor read or a database query) */
+static void *completer_thread(void *arg)
+{
+   for(;;)
+   {
+      tMicroHttpdDeferred handle;
+
+      pthread_mutex_lock(&deferred.lock);
+      while(0 == deferred.count)
+         pthread_cond_wait(&deferred.ready, &deferred.lock);
+      handle = deferred.queue[deferred.head];
+      deferred.head = (deferred.head + 1) % BENCH_DEFERRED_QUEUE_SIZE;
+      --deferred.count;
+      pthread_mutex_unlock(&deferred.lock);
+
+      microhttpd_complete(handle, HTTP_OK, "text/plain", strlen(BENCH_SMALL_BODY), NULL,
+         BENCH_SMALL_BODY);
+   }
+   return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Requests
+ */
+
+static const char *build_get_small(uint32_t *length)
+{
+   static const char request[] = "GET /small HTTP/1.1\r\nHost: localhost\r\n\r\n";
+   *length = sizeof(request) - 1;
+   return request;
+}
+
+static const char *build_get_small_pipelined(uint32_t *length)
+{
+   static char request[BENCH_PIPELINE_DEPTH * 64];
+   static uint32_t request_length;
+   uint32_t single_length;
+   const char *single = build_get_small(&single_length);
+
+   if(0 == request_length)
+   {
+      for(uint32_t i = 0; i < BENCH_PIPELINE_DEPTH; ++i)
+      {
+         memcpy(&request[request_length], single, single_length);
+         request_length += single_length;
+      }
+   }
+   *length = request_length;
+   return request;
+}
+
+static const char *build_get_deferred(uint32_t *length)
+{
+   static const char request[] = "GET /deferred HTTP/1.1\r\nHost: localhost\r\n\r\n";
+   *length = sizeof(request) - 1;
+   return request;
+}
+
+static const char *build_get_cpu(uint32_t *length)
+{
+   static const char request[] = "GET /cpu HTTP/1.1\r\nHost: localhost\r\n\r\n";
+   *length = sizeof(request) - 1;
+   return request;
+}
+
+static const char *build_get_large(uint32_t *length)
+{
+   static const char request[] = "GET /large HTTP/1.1\r\nHost: localhost\r\n\r\n";
+   *length = sizeof(request) - 1;
+   return request;
+}
+
+static const char *build_post_upload(uint32_t *length)
+{
+   *length = upload_request_length;
+   return upload_request;
+}
+
+static bool prepare_upload_request(void)
+{
+   static const char part_header[] = "--" BENCH_BOUNDARY "\r\n"
+      "Content-Disposition: form-data; name=\"file\"; filename=\"bench.bin\"\r\n"
+      "Content-Type: application/octet-stream\r\n\r\n";
+   static const char part_trailer[] = "\r\n--" BENCH_BOUNDARY "--\r\n";
+   uint32_t body_length = (sizeof(part_header) - 1) + BENCH_UPLOAD_SIZE + (sizeof(part_trailer) - 1);
+   uint32_t offset;
+
+   upload_request = malloc(body_length + 256);
+   if(NULL == upload_request)
+      return false;
+
+   offset = sprintf(upload_request, "POST /upload HTTP/1.1\r\nHost: localhost\r\n"
+      "Content-Type: multipart/form-data; boundary=" BENCH_BOUNDARY "\r\n"
+      "Content-Length: %" PRIu32 "\r\n\r\n", body_length);
+   memcpy(&upload_request[offset], part_header, sizeof(part_header) - 1);
+   offset += sizeof(part_header) - 1;
+   memset(&upload_request[offset], 'u', BENCH_UPLOAD_SIZE);
+   offset += BENCH_UPLOAD_SIZE;
+   memcpy(&upload_request[offset], part_trailer, sizeof(part_trailer) - 1);
+   offset += sizeof(part_trailer) - 1;
+
+   upload_request_length = offset;
+   return true;
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Load generator
+ */
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_connect(uint16_t port)
+{
+   struct sockaddr_in addr = {0};
+   struct linger linger = { 1, 0 };
+   int s, enable = 1;
+
+   s = socket(AF_INET, SOCK_STREAM, 0);
+   if(s < 0)
+      return -1;
+   setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+   /* Reset on close so new-connection scenarios don't exhaust ephemeral ports in TIME_WAIT */
+   setsockopt(s, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if(connect(s, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+   {
+      close(s);
+      return -1;
+   }
+   return s;
+}
+
+static bool bench_send_all(int s, const char *data, uint32_t length)
+{
+   while(length > 0)
+   {
+      ssize_t result = send(s, data, length, MSG_NOSIGNAL);
+      if(result <= 0)
+      {
+         if(result < 0 && errno == EINTR)
+            continue;
+         return false;
+      }
+      data += result;
+      length -= result;
+   }
+   return true;
+}
+
+/* Read one complete response (header and Content-Length body). *carry holds the number of bytes at
+ *  the start of buffer already received, and on return the number received beyond this response,
+ *  moved to the start of buffer. Returns the size of the response, or -1 on failure. */
+static int64_t bench_read_response(int s, char *buffer, uint32_t buffer_size, uint32_t *carry,
+   uint32_t *status)
+{
+   uint32_t have = *carry, header_length = 0;
+   uint64_t content_length = 0, total;
+   char *end;
+
+   while(0 == header_length)
+   {
+      buffer[have] = '\0';
+      end = strstr(buffer, "\r\n\r\n");
+      if(NULL != end)
+      {
+         char *field = strstr(buffer, "Content-Length: ");
+         header_length = (end - buffer) + 4;
+         if(NULL == field || field > end)
+            return -1;
+         *status = strtoul(&buffer[9], NULL, 10);
+         content_length = strtoull(&field[16], NULL, 10);
+      }
+      else
+      {
+         ssize_t result;
+         if(have >= buffer_size - 1)
+            return -1;
+         result = recv(s, &buffer[have], buffer_size - have - 1, 0);
+         if(result <= 0)
+            return -1;
+         have += result;
+      }
+   }
+
+   total = header_length + content_length;
+   while(have < total)
+   {
+      ssize_t result;
+      if(total < buffer_size)
+         result = recv(s, &buffer[have], buffer_size - have - 1, 0);
+      else /* Only counted; never read past this response */
+         result = recv(s, buffer, (total - have < buffer_size) ? total - have : buffer_size, 0);
+      if(result <= 0)
+         return -1;
+      have += result;
+   }
+
+   *carry = have - total;
+   if(*carry > 0)
+      memmove(buffer, &buffer[total], *carry);
+   return (int64_t) total;
+}
+
+static bool bench_record(tBenchWorker *w, uint64_t latency)
+{
+   if(w->latency_count >= w->latency_capacity)
+   {
+      uint64_t capacity = (w->latency_capacity == 0) ? 65536 : w->latency_capacity * 2;
+      uint64_t *latencies = realloc(w->latencies, capacity * sizeof(*latencies));
+      if(NULL == latencies)
+         return false;
+      w->latencies = latencies;
+      w->latency_capacity = capacity;
+   }
+   w->latencies[w->latency_count++] = latency;
+   return true;
+}
+
+static void *worker_thread(void *arg)
+{
+   tBenchWorker *w = (tBenchWorker *) arg;
+   uint32_t request_length, status = 0, carry = 0;
+   uint32_t responses = (w->scenario->pipeline > 0) ? w->scenario->pipeline : 1;
+   const char *request = w->scenario->build_request(&request_length);
+   char *buffer;
+   int s = -1;
+
+   buffer = malloc(BENCH_IO_BUFFER_SIZE);
+   if(NULL == buffer)
+      return NULL;
+
+   while(!atomic_load_explicit(w->stop, memory_order_relaxed))
+   {
+      uint64_t start = now_ns(), latency;
+      int64_t received = 0;
+      uint32_t accepted = 0;
+
+      if(s < 0)
+      {
+         s = bench_connect(w->port);
+         if(s < 0)
+         {
+            ++(w->errors);
+            continue;
+         }
+         carry = 0;
+      }
+
+      if(!bench_send_all(s, request, request_length))
+         received = -1;
+      for(uint32_t i = 0; i < responses && received >= 0; ++i)
+      {
+         int64_t result = bench_read_response(s, buffer, BENCH_IO_BUFFER_SIZE, &carry, &status);
+
+         received = (result < 0) ? -1 : received + result;
+         if(result >= 0 && status >= 200 && status <= 299)
+            ++accepted;
+         else if(result >= 0)
+            ++(w->rejected);
+      }
+      if(received < 0)
+      {
+         ++(w->errors);
+         close(s);
+         s = -1;
+         continue;
+      }
+
+      if(!w->scenario->keepalive)
+      {
+         close(s);
+         s = -1;
+      }
+
+      latency = now_ns() - start;
+      for(uint32_t i = 0; i < accepted; ++i)
+         bench_record(w, latency);
+      w->bytes += request_length + received;
+      w->requests += accepted;
+   }
+
+   if(s >= 0)
+      close(s);
+   free(buffer);
+   return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+   return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, uint64_t count, double p)
+{
+   uint64_t idx;
+   if(0 == count)
+      return 0.0;
+   idx = (uint64_t) (p * (count - 1) + 0.5);
+   return sorted[idx] / 1000.0;
+}
+
+static bool run_scenario(const tBenchScenario *scenario, uint16_t port, uint32_t clients,
+   uint32_t duration, tBenchResult *result)
+{
+   tBenchWorker *workers;
+   pthread_t *threads;
+   atomic_bool stop;
+   uint64_t *all, total = 0, bytes = 0, start, elapsed;
+   struct timespec sleep_time = { duration, 0 };
+
+   if(!scenario->concurrent)
+      clients = 1;
+
+   workers = calloc(clients, sizeof(*workers));
+   threads = calloc(clients, sizeof(*threads));
+   if(NULL == workers || NULL == threads)
+      return false;
+
+   atomic_init(&stop, false);
+   start = now_ns();
+   for(uint32_t i = 0; i < clients; ++i)
+   {
+      workers[i].scenario = scenario;
+      workers[i].port = port;
+      workers[i].stop = &stop;
+      pthread_create(&threads[i], NULL, worker_thread, &workers[i]);
+   }
+
+   while(nanosleep(&sleep_time, &sleep_time) != 0 && errno == EINTR);
+   atomic_store(&stop, true);
+
+   memset(result, 0, sizeof(*result));
+   for(uint32_t i = 0; i < clients; ++i)
+   {
+      pthread_join(threads[i], NULL);
+      result->requests += workers[i].requests;
+      result->errors += workers[i].errors;
+      result->rejected += workers[i].rejected;
+      bytes += workers[i].bytes;
+      total += workers[i].latency_count;
+   }
+   elapsed = now_ns() - start;
+
+   all = malloc((total > 0 ? total : 1) * sizeof(*all));
+   if(NULL != all)
+   {
+      uint64_t offset = 0;
+      for(uint32_t i = 0; i < clients; ++i)
+      {
+         memcpy(&all[offset], workers[i].latencies, workers[i].latency_count * sizeof(*all));
+         offset += workers[i].latency_count;
+      }
+      qsort(all, total, sizeof(*all), compare_u64);
+      result->p50 = percentile(all, total, 0.50);
+      result->p99 = percentile(all, total, 0.99);
+      result->p999 = percentile(all, total, 0.999);
+      free(all);
+   }
+
+   result->name = scenario->name;
+   result->clients = clients;
+   result->elapsed = elapsed / 1e9;
+   result->requests_per_sec = result->requests / result->elapsed;
+   result->mb_per_sec = (bytes / 1e6) / result->elapsed;
+
+   for(uint32_t i = 0; i < clients; ++i)
+      free(workers[i].latencies);
+   free(workers);
+   free(threads);
+   return true;
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Main
+ */
+
+static void write_json(FILE *out, const char *backend, uint32_t workers, const tBenchResult *results,
+   uint32_t count, uint32_t duration)
+{
+   fprintf(out, "{\n  \"benchmark\": \"microhttpd\",\n  \"event_backend\": \"%s\",\n"
+      "  \"worker_threads\": %" PRIu32 ",\n  \"duration_per_scenario_s\": %" PRIu32 ",\n"
+      "  \"scenarios\": [\n", backend, workers, duration);
+   for(uint32_t i = 0; i < count; ++i)
+   {
+      const tBenchResult *r = &results[i];
+      fprintf(out, "    {\"name\": \"%s\", \"clients\": %" PRIu32 ", \"requests\": %" PRIu64 ", "
+         "\"errors\": %" PRIu64 ", \"rejected\": %" PRIu64 ", \"elapsed_s\": %.3f, "
+         "\"requests_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+         "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}}%s\n",
+         r->name, r->clients, r->requests, r->errors, r->rejected, r->elapsed, r->requests_per_sec,
+         r->mb_per_sec, r->p50, r->p99, r->p999, (i + 1 < count) ? "," : "");
+   }
+   fprintf(out, "  ]\n}\n");
+}
+
+static void usage(const char *program)
+{
+   fprintf(stderr, "Usage: %s [-p port] [-d seconds] [-c clients] [-s scenario] "
+      "[-b auto|select|epoll|io_uring] [-w workers] [-q queue_depth] [-o output.json]\n", program);
+   fprintf(stderr, "Scenarios:\n");
+   for(uint32_t i = 0; i < ARRAY_SIZE(scenarios); ++i)
+      fprintf(stderr, "  %-28s %s\n", scenarios[i].name, scenarios[i].description);
+}
+
+int main(int argc, char *argv[])
+{
+   tMicroHttpdParams params = {0};
+   tMicroHttpdContext ctx;
+   tBenchResult results[ARRAY_SIZE(scenarios)];
+   uint32_t result_count = 0, duration = BENCH_DEFAULT_DURATION, clients = BENCH_DEFAULT_CLIENTS;
+   uint16_t port = BENCH_DEFAULT_PORT;
+   const char *selected = NULL, *output = NULL;
+   pthread_t server, completer;
+   FILE *out = stdout;
+   int opt;
+
+   while((opt = getopt(argc, argv, "p:d:c:s:b:w:q:o:h")) != -1)
+   {
+      switch(opt)
+      {
+         case 'p': port = (uint16_t) strtoul(optarg, NULL, 10); break;
+         case 'd': duration = strtoul(optarg, NULL, 10); break;
+         case 'c': clients = strtoul(optarg, NULL, 10); break;
+         case 's': selected = optarg; break;
+         case 'o': output = optarg; break;
+         case 'w': params.worker_threads = strtoul(optarg, NULL, 10); break;
+         case 'q': params.worker_queue_depth = strtoul(optarg, NULL, 10); break;
+         case 'b':
+            for(uint32_t i = 0; i < ARRAY_SIZE(backends); ++i)
+            {
+               if(strcmp(optarg, backends[i].name) == 0)
+                  params.event_backend = backends[i].backend;
+            }
+            break;
+         default: usage(argv[0]); return -1;
+      }
+   }
+   if(0 == clients || 0 == duration)
+   {
+      usage(argv[0]);
+      return -1;
+   }
+
+   large_content = malloc(BENCH_LARGE_SIZE);
+   if(NULL == large_content || !prepare_upload_request())
+   {
+      fprintf(stderr, "Failed to allocate benchmark buffers\n");
+      return -1;
+   }
+   memset(large_content, 'd', BENCH_LARGE_SIZE);
+
+   params.server_port = port;
+   params.process_timeout = 100;
+   params.rx_buffer_size = BENCH_RX_BUFFER_SIZE;
+   params.get_handler_list = get_handler_list;
+   params.get_handler_count = ARRAY_SIZE(get_handler_list);
+   params.default_get_handler = handle_not_found;
+   params.post_handler = handle_post;
+
+   ctx = microhttpd_start(&params);
+   if(NULL == ctx)
+   {
+      fprintf(stderr, "Failed to initialize microhttpd on port %u\n", port);
+      return -1;
+   }
+   pthread_create(&server, NULL, server_thread, ctx);
+   pthread_create(&completer, NULL, completer_thread, NULL);
+   fprintf(stderr, "Using '%s' event backend\n", microhttpd_get_event_backend(ctx));
+
+   for(uint32_t i = 0; i < ARRAY_SIZE(scenarios); ++i)
+   {
+      if(NULL != selected && strcmp(selected, scenarios[i].name) != 0)
+         continue;
+      fprintf(stderr, "Running %s ...\n", scenarios[i].name);
+      if(run_scenario(&scenarios[i], port, clients, duration, &results[result_count]))
+         ++result_count;
+   }
+
+   if(0 == result_count)
+   {
+      fprintf(stderr, "No scenarios run\n");
+      usage(argv[0]);
+      return -1;
+   }
+
+   if(NULL != output)
+   {
+      out = fopen(output, "w");
+      if(NULL == out)
+      {
+         fprintf(stderr, "Failed to open '%s'\n", output);
+         return -1;
+      }
+   }
+   write_json(out, microhttpd_get_event_backend(ctx), params.worker_threads, results, result_count, duration);
+   if(out != stdout)
+      fclose(out);
+
+   return 0;
+}
@@ -0,0 +1,287 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file parser_bench.c
+ *  \brief microhttpd request parser microbenchmark
+ *
+ *  Drives recorded request byte streams through the full client state machine (header parsing,
+ *  dispatch and response) using the in-memory transport, so no sockets or kernel calls are
+ *  involved. Every stream is also delivered split at every possible offset and in every fragment
+ *  size, and the handler invocations and response bytes are checked against unfragmented delivery.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include "microhttpd_private.h"
+#include "client.h"
+#include "transport.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
+
+#define PARSER_BENCH_DEFAULT_ITERATIONS 200000
+#define PARSER_BENCH_RX_BUFFER_SIZE     4096
+
+typedef struct
+{
+   const char *name;
+   const char *data;
+} tRecordedStream;
+
+static const tRecordedStream streams[] =
+{
+   { "get_minimal",
+     "GET / HTTP/1.1\r\nHost: device\r\n\r\n" },
+   { "get_browser",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: 192.168.1.20:8090\r\n"
+     "Connection: keep-alive\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "Cache-Control: max-age=0\r\n\r\n" },
+   { "get_ajax_params",
+     "GET /ajax?Load_Voltage&channel=2&unit=mV HTTP/1.1\r\n"
+     "Host: 192.168.1.20:8090\r\n"
+     "Accept: */*\r\n"
+     "X-Requested-With: XMLHttpRequest\r\n\r\n" },
+   { "post_multipart",
+     "POST /upload HTTP/1.1\r\n"
+     "Host: 192.168.1.20:8090\r\n"
+     "Content-Type: multipart/form-data; boundary=----WebKitFormBoundary7MA4YWxkTrZu0gW\r\n"
+     "Content-Length: 219\r\n\r\n"
+     "------WebKitFormBoundary7MA4YWxkTrZu0gW\r\n"
+     "Content-Disposition: form-data; name=\"file\"; filename=\"config.txt\"\r\n"
+     "Content-Type: text/plain\r\n\r\n"
+     "interval=5\nthreshold=12.5\nname=solar\n"
+     "\r\n------WebKitFormBoundary7MA4YWxkTrZu0gW--\r\n" },
+};
+
+typedef struct
+{
+   const char *name;
+   uint32_t length;
+   uint64_t iterations;
+   double requests_per_sec;
+   double ns_per_request;
+   uint64_t split_deliveries;
+   uint64_t fragment_deliveries;
+   uint64_t failures;
+} tParserResult;
+
+static uint64_t handler_count;
+
+/* ---------------------------------------------------------------------------------------------
+ * Handlers
+ */
+
+static void handle_get(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   static const char content[] = "12345";
+   ++handler_count;
+   microhttpd_send_response(client, HTTP_OK, "text/html", sizeof(content) - 1, NULL, content);
+}
+
+static void handle_post(tMicroHttpdClient client, const char *uri, const char *filename,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length)
+{
+   if(finish)
+   {
+      ++handler_count;
+      microhttpd_send_response(client, HTTP_URI_FOUND, "text/html", 0, "Location: /\r\n", NULL);
+   }
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Helpers
+ */
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Deliver bytes [offset, end) of the stream, at most fragment_size bytes per receive */
+static bool deliver(struct md_context *ctx, struct md_client *client, struct md_memory_stream *stream,
+   uint32_t end)
+{
+   stream->rx_length = end;
+   while(stream->rx_offset < end)
+   {
+      if(microhttpd_HandleClientReceive(ctx, client) != 0 || stream->closed)
+         return false;
+   }
+   return true;
+}
+
+static bool check_stream(struct md_context *ctx, struct md_client *client, struct md_memory_stream *stream,
+   const tRecordedStream *recorded, uint32_t length, tParserResult *result)
+{
+   uint64_t reference_hash, reference_bytes, expected;
+
+   /* Reference: whole request in one receive */
+   microhttpd_MemoryStreamReset(stream, recorded->data, length, 0);
+   expected = handler_count + 1;
+   if(!deliver(ctx, client, stream, length) || handler_count != expected)
+      return false;
+   reference_hash = stream->tx_hash;
+   reference_bytes = stream->tx_bytes;
+
+   /* Two deliveries, split at every offset */
+   for(uint32_t split = 1; split < length; ++split)
+   {
+      microhttpd_MemoryStreamReset(stream, recorded->data, length, 0);
+      expected = handler_count + 1;
+      if(!deliver(ctx, client, stream, split) || !deliver(ctx, client, stream, length)
+      || handler_count != expected || stream->tx_hash != reference_hash
+      || stream->tx_bytes != reference_bytes)
+      {
+         fprintf(stderr, "%s: mismatch when split at offset %" PRIu32 "\n", recorded->name, split);
+         ++(result->failures);
+      }
+      ++(result->split_deliveries);
+   }
+
+   /* Fixed-size fragments of every size */
+   for(uint32_t fragment = 1; fragment < length; ++fragment)
+   {
+      microhttpd_MemoryStreamReset(stream, recorded->data, length, fragment);
+      expected = handler_count + 1;
+      if(!deliver(ctx, client, stream, length) || handler_count != expected
+      || stream->tx_hash != reference_hash || stream->tx_bytes != reference_bytes)
+      {
+         fprintf(stderr, "%s: mismatch with %" PRIu32 " byte fragments\n", recorded->name, fragment);
+         ++(result->failures);
+      }
+      ++(result->fragment_deliveries);
+   }
+
+   return true;
+}
+
+static void usage(const char *program)
+{
+   fprintf(stderr, "Usage: %s [-n iterations] [-o output.json]\n", program);
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Main
+ */
+
+int main(int argc, char *argv[])
+{
+   static tMicroHttpdGetHandlerEntry get_handler_list[] =
+   {
+      { "/", handle_get, NULL },
+   };
+   struct md_context ctx;
+   struct md_memory_stream stream;
+   struct sockaddr_in info = {0};
+   struct md_client *client;
+   tParserResult results[ARRAY_SIZE(streams)];
+   uint64_t iterations = PARSER_BENCH_DEFAULT_ITERATIONS, failures = 0;
+   const char *output = NULL;
+   FILE *out = stdout;
+   int opt;
+
+   while((opt = getopt(argc, argv, "n:o:h")) != -1)
+   {
+      switch(opt)
+      {
+         case 'n': iterations = strtoull(optarg, NULL, 10); break;
+         case 'o': output = optarg; break;
+         default: usage(argv[0]); return -1;
+      }
+   }
+
+   memset(&ctx, 0, sizeof(ctx));
+   ctx.params.rx_buffer_size = PARSER_BENCH_RX_BUFFER_SIZE;
+   ctx.params.get_handler_list = get_handler_list;
+   ctx.params.get_handler_count = ARRAY_SIZE(get_handler_list);
+   ctx.params.post_handler = handle_post;
+   ctx.wake_fd[0] = ctx.wake_fd[1] = -1;
+   ctx.rx_scratch = malloc(PARSER_BENCH_RX_BUFFER_SIZE);
+   ctx.running = true;
+
+   info.sin_family = AF_INET;
+   info.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   microhttpd_MemoryStreamReset(&stream, NULL, 0, 0);
+   if(microhttpd_NewClient(&ctx, -1, (struct sockaddr *) &info, sizeof(info), &md_transport_memory,
+      &stream) != 0)
+   {
+      fprintf(stderr, "Failed to create in-memory client\n");
+      return -1;
+   }
+   client = ctx.client_list;
+
+   for(uint32_t i = 0; i < ARRAY_SIZE(streams); ++i)
+   {
+      const tRecordedStream *recorded = &streams[i];
+      tParserResult *r = &results[i];
+      uint32_t length = strlen(recorded->data);
+      uint64_t start, elapsed, expected;
+
+      memset(r, 0, sizeof(*r));
+      r->name = recorded->name;
+      r->length = length;
+
+      fprintf(stderr, "Running %s ...\n", recorded->name);
+      if(!check_stream(&ctx, client, &stream, recorded, length, r))
+      {
+         fprintf(stderr, "%s: request was not handled\n", recorded->name);
+         return -1;
+      }
+
+      expected = handler_count + iterations;
+      start = now_ns();
+      for(uint64_t n = 0; n < iterations; ++n)
+      {
+         microhttpd_MemoryStreamReset(&stream, recorded->data, length, 0);
+         microhttpd_HandleClientReceive(&ctx, client);
+      }
+      elapsed = now_ns() - start;
+      if(handler_count != expected)
+         ++(r->failures);
+
+      r->iterations = iterations;
+      r->ns_per_request = (iterations > 0) ? (double) elapsed / iterations : 0.0;
+      r->requests_per_sec = (elapsed > 0) ? iterations / (elapsed / 1e9) : 0.0;
+      failures += r->failures;
+   }
+
+   if(NULL != output)
+   {
+      out = fopen(output, "w");
+      if(NULL == out)
+      {
+         fprintf(stderr, "Failed to open '%s'\n", output);
+         return -1;
+      }
+   }
+
+   fprintf(out, "{\n  \"benchmark\": \"microhttpd_parser\",\n  \"streams\": [\n");
+   for(uint32_t i = 0; i < ARRAY_SIZE(results); ++i)
+   {
+      const tParserResult *r = &results[i];
+      fprintf(out, "    {\"name\": \"%s\", \"bytes\": %" PRIu32 ", \"iterations\": %" PRIu64 ", "
+         "\"requests_per_sec\": %.0f, \"ns_per_request\": %.1f, \"split_deliveries\": %" PRIu64 ", "
+         "\"fragment_deliveries\": %" PRIu64 ", \"failures\": %" PRIu64 "}%s\n",
+         r->name, r->length, r->iterations, r->requests_per_sec, r->ns_per_request,
+         r->split_deliveries, r->fragment_deliveries, r->failures,
+         (i + 1 < ARRAY_SIZE(results)) ? "," : "");
+   }
+   fprintf(out, "  ]\n}\n");
+   if(out != stdout)
+      fclose(out);
+
+   microhttpd_RemoveClient(&ctx, client);
+   return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,413 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file cache.c
+ *  \brief microhttpd GET response cache
+ *
+ *  GET handler entries with a cache_ttl have their responses kept, exactly as sent, in reference-
+ *  counted transmit buffers, so a hit is queued to the client without a copy or a handler call.
+ *  Entries are found through a small chained hash table keyed on the URI and the route's selected
+ *  query parameters, and dropped least recently used first once the size budget is reached. A miss
+ *  makes the entry pending and captures the handler's response in a deferred response buffer;
+ *  requests for the same key that arrive before it's complete are parked as deferred requests and
+ *  completed with the same buffer, so concurrent misses call the handler once. Everything here runs
+ *  on the event loop thread.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "tx.h"
+#include "defer.h"
+#include "cache.h"
+#include "trace.h"
+
+static const tMicroHttpdGetHandlerEntry *microhttpd_CacheRoute(struct md_client *client);
+static uint32_t microhttpd_CacheKey(struct md_client *client, const char *params, char *key);
+static struct md_cache *microhttpd_CacheTable(struct md_context *ctx);
+static struct md_cache_entry *microhttpd_CacheFind(struct md_cache *cache, const char *key,
+   uint32_t length, uint32_t hash);
+static bool microhttpd_CacheWait(struct md_client *client, struct md_cache_entry *entry);
+static void microhttpd_CacheWake(struct md_cache_entry *entry, struct md_buffer *response,
+   uint32_t header_length, bool failed);
+static bool microhttpd_CacheStore(struct md_cache *cache, struct md_cache_entry *entry,
+   struct md_buffer *response, uint32_t header_length);
+static void microhttpd_CacheRemove(struct md_cache *cache, struct md_cache_entry *entry);
+static void microhttpd_CacheUnlink(struct md_cache *cache, struct md_cache_entry *entry);
+static uint32_t microhttpd_CacheHeaderLength(const struct md_buffer *response);
+static const char *microhttpd_CacheSearch(const char *data, uint32_t length, const char *pattern);
+static uint32_t microhttpd_CacheSize(const struct md_cache_entry *entry);
+static uint32_t microhttpd_CacheHash(const char *key, uint32_t length);
+static uint64_t microhttpd_CacheClock(void);
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Answer a GET or HEAD request from the cache, or park it behind the handler call already producing
+ *  its response. Returns false if the handlers have to be called; when that's to fill the cache,
+ *  client->cache is set and microhttpd_CacheFill() (or an offloaded completion) must follow. */
+bool microhttpd_CacheServe(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+   const tMicroHttpdGetHandlerEntry *route = microhttpd_CacheRoute(client);
+   struct md_cache *cache;
+   struct md_cache_entry *entry;
+   char key[MICROHTTPD_CACHE_MAX_KEY];
+   uint32_t length, hash;
+
+   /* Waiting for another request's response needs deferred responses */
+   if(NULL == route || 0 == route->cache_ttl || ctx->wake_fd[1] < 0)
+      return false;
+   length = microhttpd_CacheKey(client, route->cache_params, key);
+   if(0 == length || NULL == (cache = microhttpd_CacheTable(ctx)))
+      return false;
+
+   hash = microhttpd_CacheHash(key, length);
+   entry = microhttpd_CacheFind(cache, key, length, hash);
+   if(NULL != entry && entry->pending)
+      return microhttpd_CacheWait(client, entry);
+   if(NULL != entry && microhttpd_CacheClock() < entry->expires)
+   {
+      uint32_t send = (MICROHTTPD_METHOD_HEAD == client->method) ?
+         entry->header_length : entry->response->length;
+
+      /* Most recently used */
+      microhttpd_CacheUnlink(cache, entry);
+      entry->older = cache->newest;
+      if(NULL != cache->newest)
+         cache->newest->newer = entry;
+      else
+         cache->oldest = entry;
+      cache->newest = entry;
+
+      MH_TRACE(client, CACHE_HIT, send);
+      if(microhttpd_ClientSendBuffer(client, entry->response, 0, send) < 0)
+         MH_DBG("%s: Failed to send %"PRIu32" byte cached response\n", __func__, send);
+      return true;
+   }
+   if(MICROHTTPD_METHOD_HEAD == client->method)
+      return false; /* Its response has no body to keep */
+
+   if(NULL != entry)
+   {
+      /* Expired; refill in place */
+      cache->size -= microhttpd_CacheSize(entry);
+      microhttpd_CacheUnlink(cache, entry);
+      microhttpd_BufferRelease(entry->response);
+      entry->response = NULL;
+   }
+   else
+   {
+      entry = (struct md_cache_entry *) malloc(sizeof(*entry) + length);
+      if(NULL == entry)
+         return false;
+      memset(entry, 0, sizeof(*entry));
+      memcpy(entry->key, key, length);
+      entry->key_length = length;
+      entry->hash = hash;
+      entry->next = cache->buckets[hash & (MICROHTTPD_CACHE_BUCKETS - 1)];
+      cache->buckets[hash & (MICROHTTPD_CACHE_BUCKETS - 1)] = entry;
+   }
+   entry->pending = true;
+   entry->ttl = route->cache_ttl;
+   client->cache = entry;
+   MH_DBG("%s: Filling '%s'\n", __func__, client->uri);
+   return false;
+}
+
+/*! Call the handlers with their response captured, then keep it and send it. A handler that defers
+ *  leaves the capture in place until microhttpd_complete(). */
+void microhttpd_CacheFill(struct md_client *client, void (*work)(struct md_client *client))
+{
+   struct md_deferred *deferred = microhttpd_DeferredCreate(client, 1);
+
+   if(NULL == deferred)
+   {
+      work(client); /* Sent as usual; the entry is dropped when the request finishes */
+      return;
+   }
+   deferred->capture = true;
+   work(client);
+   if(deferred->user_deferred)
+   {
+      microhttpd_UpdateClient(client->ctx, client);
+      return;
+   }
+
+   client->deferred = NULL;
+   microhttpd_CacheFilled(client, deferred);
+   if(!deferred->failed && NULL != deferred->response
+   && microhttpd_ClientSendBuffer(client, deferred->response, 0, deferred->response->length) < 0)
+      MH_DBG("%s: Failed to send %"PRIu32" byte response\n", __func__, deferred->response->length);
+   microhttpd_DeferredRelease(deferred);
+}
+
+/*! The response to a request that was filling the cache is complete. Hand it to the requests that
+ *  waited for it, and keep it if it can be reused. */
+void microhttpd_CacheFilled(struct md_client *client, struct md_deferred *deferred)
+{
+   struct md_cache *cache = client->ctx->cache;
+   struct md_cache_entry *entry = client->cache;
+   struct md_buffer *response = deferred->failed ? NULL : deferred->response;
+   uint32_t header_length = (NULL != response) ? microhttpd_CacheHeaderLength(response) : 0;
+
+   client->cache = NULL;
+   microhttpd_CacheWake(entry, response, header_length, deferred->failed);
+   if(!microhttpd_CacheStore(cache, entry, response, header_length))
+   {
+      microhttpd_CacheRemove(cache, entry);
+      return;
+   }
+   MH_TRACE(client, CACHE_STORE, response->length);
+}
+
+/*! The request finished without its response being captured (or its client is being freed) */
+void microhttpd_CacheCancel(struct md_client *client)
+{
+   struct md_cache_entry *entry = client->cache;
+
+   if(NULL == entry)
+      return;
+   client->cache = NULL;
+   microhttpd_CacheWake(entry, NULL, 0, true);
+   microhttpd_CacheRemove(client->ctx->cache, entry);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! The first GET handler entry matching the URI, which decides whether the response is cached */
+static const tMicroHttpdGetHandlerEntry *microhttpd_CacheRoute(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   for(uint32_t idx = 0; idx < ctx->params.get_handler_count; ++idx)
+   {
+      const tMicroHttpdGetHandlerEntry *entry = &ctx->params.get_handler_list[idx];
+
+      if(memcmp(entry->uri, client->uri, strlen(entry->uri)) == 0)
+         return entry;
+   }
+   return NULL;
+}
+
+/*! Build the request's key, with values length-prefixed so no two parameter lists look alike.
+ *  Returns its length, or 0 if it doesn't fit. */
+static uint32_t microhttpd_CacheKey(struct md_client *client, const char *params, char *key)
+{
+   uint32_t length = strlen(client->uri) + 1;
+
+   if(length > MICROHTTPD_CACHE_MAX_KEY)
+      return 0;
+   memcpy(key, client->uri, length);
+
+   while(NULL != params && '\0' != *params)
+   {
+      const char *end = strchr(params, ',');
+      char name[MICROHTTPD_CACHE_MAX_KEY];
+      const char *value;
+      uint32_t name_length, value_length;
+
+      if(NULL == end)
+         end = params + strlen(params);
+      name_length = end - params;
+      if(name_length >= sizeof(name))
+         return 0;
+      memcpy(name, params, name_length);
+      name[name_length] = '\0';
+      params = ('\0' == *end) ? end : end + 1;
+      if(0 == name_length)
+         continue;
+
+      value = microhttpd_get_param((tMicroHttpdClient) client, name, &value_length);
+      if(length + 1 + ((NULL != value) ? sizeof(value_length) + value_length : 0) > MICROHTTPD_CACHE_MAX_KEY)
+         return 0;
+      key[length++] = (NULL != value);
+      if(NULL != value)
+      {
+         memcpy(&key[length], &value_length, sizeof(value_length));
+         length += sizeof(value_length);
+         memcpy(&key[length], value, value_length);
+         length += value_length;
+      }
+   }
+   return length;
+}
+
+static struct md_cache *microhttpd_CacheTable(struct md_context *ctx)
+{
+   if(NULL == ctx->cache)
+   {
+      ctx->cache = (struct md_cache *) calloc(1, sizeof(*ctx->cache));
+      if(NULL == ctx->cache)
+      {
+         MH_DBG("%s: Failed to allocate response cache\n", __func__);
+         return NULL;
+      }
+      ctx->cache->budget = (0 != ctx->params.cache_size) ?
+         ctx->params.cache_size : MICROHTTPD_CACHE_DEFAULT_SIZE;
+   }
+   return ctx->cache;
+}
+
+static struct md_cache_entry *microhttpd_CacheFind(struct md_cache *cache, const char *key,
+   uint32_t length, uint32_t hash)
+{
+   struct md_cache_entry *entry;
+
+   for(entry = cache->buckets[hash & (MICROHTTPD_CACHE_BUCKETS - 1)]; NULL != entry; entry = entry->next)
+   {
+      if(entry->hash == hash && entry->key_length == length && memcmp(entry->key, key, length) == 0)
+         return entry;
+   }
+   return NULL;
+}
+
+/*! Park the request until the pending response is complete */
+static bool microhttpd_CacheWait(struct md_client *client, struct md_cache_entry *entry)
+{
+   if(NULL == microhttpd_DeferredCreate(client, 1))
+      return false; /* Call the handlers itself */
+   client->cache_next = entry->waiters;
+   entry->waiters = client;
+   microhttpd_UpdateClient(client->ctx, client);
+   MH_DBG("%s: Waiting for '%s'\n", __func__, client->uri);
+   return true;
+}
+
+/*! Complete every request waiting for the entry with its response. They're sent with the other
+ *  completions on the next pass. */
+static void microhttpd_CacheWake(struct md_cache_entry *entry, struct md_buffer *response,
+   uint32_t header_length, bool failed)
+{
+   while(NULL != entry->waiters)
+   {
+      struct md_client *client = entry->waiters;
+      struct md_deferred *deferred = client->deferred;
+
+      entry->waiters = client->cache_next;
+      client->cache_next = NULL;
+      deferred->failed = failed;
+      if(NULL != response && MICROHTTPD_METHOD_HEAD == client->method)
+         microhttpd_DeferredAppend(deferred, response->data, header_length);
+      else if(NULL != response)
+         deferred->response = microhttpd_BufferRef(response);
+      atomic_flag_test_and_set(&deferred->completed);
+      microhttpd_DeferredComplete(deferred);
+   }
+}
+
+/*! Keep a complete response as the entry's, evicting others to make room. Only 200 responses with
+ *  a Content-Length are kept, since they mean the same thing to every client. */
+static bool microhttpd_CacheStore(struct md_cache *cache, struct md_cache_entry *entry,
+   struct md_buffer *response, uint32_t header_length)
+{
+   uint32_t size;
+
+   if(NULL == response || 0 == header_length || response->length < 12
+   || memcmp(&response->data[8], " 200", 4) != 0
+   || NULL == microhttpd_CacheSearch(response->data, header_length, "\r\nContent-Length:"))
+   {
+      return false;
+   }
+
+   entry->response = microhttpd_BufferRef(response);
+   entry->header_length = header_length;
+   size = microhttpd_CacheSize(entry);
+   if(size > cache->budget)
+   {
+      MH_DBG("%s: %"PRIu32" byte response is larger than the cache\n", __func__, size);
+      return false;
+   }
+   while(cache->size + size > cache->budget)
+      microhttpd_CacheRemove(cache, cache->oldest);
+
+   entry->pending = false;
+   entry->expires = microhttpd_CacheClock() + entry->ttl;
+   entry->newer = NULL;
+   entry->older = cache->newest;
+   if(NULL != cache->newest)
+      cache->newest->newer = entry;
+   else
+      cache->oldest = entry;
+   cache->newest = entry;
+   cache->size += size;
+   return true;
+}
+
+static void microhttpd_CacheRemove(struct md_cache *cache, struct md_cache_entry *entry)
+{
+   struct md_cache_entry **link = &cache->buckets[entry->hash & (MICROHTTPD_CACHE_BUCKETS - 1)];
+
+   while(*link != entry)
+      link = &(*link)->next;
+   *link = entry->next;
+   if(!entry->pending)
+   {
+      cache->size -= microhttpd_CacheSize(entry);
+      microhttpd_CacheUnlink(cache, entry);
+   }
+   if(NULL != entry->response)
+      microhttpd_BufferRelease(entry->response);
+   free(entry);
+}
+
+/*! Take a stored entry out of the recency list */
+static void microhttpd_CacheUnlink(struct md_cache *cache, struct md_cache_entry *entry)
+{
+   if(NULL != entry->newer)
+      entry->newer->older = entry->older;
+   else
+      cache->newest = entry->older;
+   if(NULL != entry->older)
+      entry->older->newer = entry->newer;
+   else
+      cache->oldest = entry->newer;
+   entry->newer = entry->older = NULL;
+}
+
+static uint32_t microhttpd_CacheHeaderLength(const struct md_buffer *response)
+{
+   const char *end = microhttpd_CacheSearch(response->data, response->length, "\r\n\r\n");
+   return (NULL != end) ? (uint32_t) (end - response->data) + 4 : 0;
+}
+
+static const char *microhttpd_CacheSearch(const char *data, uint32_t length, const char *pattern)
+{
+   uint32_t pattern_length = strlen(pattern);
+
+   for(uint32_t idx = 0; idx + pattern_length <= length; ++idx)
+   {
+      if(data[idx] == pattern[0] && memcmp(&data[idx], pattern, pattern_length) == 0)
+         return &data[idx];
+   }
+   return NULL;
+}
+
+static uint32_t microhttpd_CacheSize(const struct md_cache_entry *entry)
+{
+   return sizeof(*entry) + entry->key_length + entry->response->length;
+}
+
+/* FNV-1a */
+static uint32_t microhttpd_CacheHash(const char *key, uint32_t length)
+{
+   uint32_t hash = 2166136261u;
+
+   while(length-- > 0)
+   {
+      hash ^= (uint8_t) *key++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+static uint64_t microhttpd_CacheClock(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,54 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file cache.h
+ *  \brief microhttpd GET response cache
+ */
+#ifndef _MICROHTTPD_CACHE_H
+#define _MICROHTTPD_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if !defined(MICROHTTPD_CACHE_DEFAULT_SIZE)
+#define MICROHTTPD_CACHE_DEFAULT_SIZE (256 * 1024)
+#endif
+#if !defined(MICROHTTPD_CACHE_MAX_KEY)
+#define MICROHTTPD_CACHE_MAX_KEY      256 /* URI and parameters; requests with longer keys aren't cached */
+#endif
+#define MICROHTTPD_CACHE_BUCKETS      64  /* A power of two */
+
+struct md_buffer;
+struct md_deferred;
+
+struct md_cache_entry
+{
+   struct md_buffer *response;    /* Header and body as sent; NULL while pending */
+   uint32_t header_length;        /* What a HEAD request gets */
+   uint64_t expires;              /* Monotonic milliseconds */
+   uint32_t ttl;
+   bool pending;                  /* A handler is producing the response */
+   struct md_client *waiters;     /* Requests for it in the meantime, parked as deferred */
+
+   struct md_cache_entry *next;   /* Hash chain */
+   struct md_cache_entry *newer, *older; /* Recency, for stored responses only */
+   uint32_t hash;
+   uint32_t key_length;
+   char key[];                    /* URI, NUL, then each of cache_params as a presence byte and, if
+                                   *  present, its value's length and the value */
+};
+
+struct md_cache
+{
+   struct md_cache_entry *buckets[MICROHTTPD_CACHE_BUCKETS];
+   struct md_cache_entry *newest, *oldest;
+   uint32_t size;                 /* Bytes held by stored entries */
+   uint32_t budget;
+};
+
+bool microhttpd_CacheServe(struct md_client *client);
+void microhttpd_CacheFill(struct md_client *client, void (*work)(struct md_client *client));
+void microhttpd_CacheFilled(struct md_client *client, struct md_deferred *deferred);
+void microhttpd_CacheCancel(struct md_client *client);
+
+#endif /* _MICROHTTPD_CACHE_H */
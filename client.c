@@ -7,40 +7,79 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#if !defined(LWIP_SOCKET)
+#include <arpa/inet.h>
+#endif
 #include "debug.h"
 #include "helpers.h"
 #include "client.h"
+#include "tx.h"
+#include "events.h"
+#include "defer.h"
+#include "sse.h"
+#include "websocket.h"
+#include "h2.h"
+#include "json.h"
+#include "admission.h"
+#include "listener.h"
+#include "ratelimit.h"
+#include "proxy.h"
+#include "trace.h"
 
-int microhttpd_NewClient(struct md_context *ctx, int nSocket, struct sockaddr_in *socket_info)
+static int microhttpd_ClientReceive(struct md_context *ctx, struct md_client *client);
+static int microhttpd_ProcessClient(struct md_context *ctx, struct md_client *client);
+static bool microhttpd_RxAlloc(struct md_context *ctx, struct md_client *client);
+static void microhttpd_RxFree(struct md_client *client);
+
+int microhttpd_NewClient(struct md_context *ctx, int nSocket, const struct sockaddr *peer,
+   socklen_t peer_length, const struct md_transport *transport, void *transport_data)
 {
    struct md_client *client;
-   uint8_t *addr = (uint8_t *) &socket_info->sin_addr.s_addr;
-   uint16_t port = ntohs(socket_info->sin_port);
+
+   if(!microhttpd_AdmitClient(ctx, nSocket, transport))
+      return -1;
 
    client = (struct md_client *) malloc(sizeof(*client));
    if(NULL == client)
       return -1;
    memset(client, 0, sizeof(*client));
-   snprintf(client->source_address, sizeof(client->source_address) - 1, 
-      "%u.%u.%u.%u:%u", addr[0], addr[1], addr[2], addr[3], port);
-   MH_DBG("%s: New client connected from %s\n", __func__, client->source_address);
+   MH_DBG("%s: New client connected\n", __func__);
+#if defined(MICROHTTPD_TRACE)
+   client->trace_connection = microhttpd_TraceConnection();
+#endif
+   MH_TRACE(client, ACCEPT, nSocket);
 
    client->socket = nSocket;
-   memcpy(&client->socket_info, socket_info, sizeof(client->socket_info));
+   client->transport = transport;
+   client->transport_data = transport_data;
+   if(NULL != peer && peer_length <= sizeof(client->peer))
+   {
+      memcpy(&client->peer, peer, peer_length);
+      client->peer_length = peer_length;
+   }
    client->rx_buffer_size = ctx->params.rx_buffer_size;
-   client->rx_buffer = malloc(client->rx_buffer_size);
-   if(client->rx_buffer == NULL)
+
+   client->ctx = ctx;
+   microhttpd_ResetState(client);
+   if(!microhttpd_AdmitAddress(client))
    {
-      MH_DBG("%s: Failed to allocate receive buffer\n", __func__);
       free(client);
       return -1;
    }
 
-   client->ctx = ctx;
-   microhttpd_ResetState(client);
+   if(NULL != ctx->backend && NULL != ctx->backend->add_client
+   && ctx->backend->add_client(ctx, client) != 0)
+   {
+      MH_DBG("%s: Event backend failed to add client\n", __func__);
+      microhttpd_ReleaseAddress(client);
+      free(client);
+      return -1;
+   }
 
    client->next = ctx->client_list; /* Always add to the head of the list */
    ctx->client_list = client;
+   ++(ctx->client_count);
 
    return 0;
 }
@@ -50,7 +89,30 @@ int microhttpd_RemoveClient(struct md_context *ctx, struct md_client *client)
    struct md_client *cur, *prev;
    int found = 0;
 
-   close(client->socket);
+   MH_TRACE(client, CLOSE, 0);
+   if(NULL != client->stream)
+   {
+      /* HTTP/2 stream; unknown to the backend and not on the client list */
+      client->transport->close(client);
+      microhttpd_ProxyRemoved(client);
+      if(client->pipeline_yielded)
+      {
+         client->pipeline_yielded = false;
+         --(ctx->pipeline_yielded);
+      }
+      if(!microhttpd_DeferredClientRemoved(client))
+         microhttpd_FreeClient(client);
+      return 0;
+   }
+
+   if(NULL != ctx->backend && NULL != ctx->backend->remove_client)
+      ctx->backend->remove_client(ctx, client);
+   client->transport->close(client);
+   microhttpd_ChannelLeave(client);
+   microhttpd_WebSocketRemoved(client);
+   microhttpd_H2Removed(client);
+   microhttpd_ProxyRemoved(client);
+   microhttpd_ReleaseAddress(client);
 
    for(prev = NULL, cur = ctx->client_list; !found && cur != NULL; prev = cur, cur = cur->next)
    {
@@ -70,35 +132,394 @@ int microhttpd_RemoveClient(struct md_context *ctx, struct md_client *client)
       return -1;
    }
    MH_DBG("%s: Client removed\n", __func__);
+   if(NULL == client->upstream)
+      --(ctx->client_count); /* Upstream connections are counted in upstream_count */
+   if(client->pipeline_yielded)
+   {
+      client->pipeline_yielded = false;
+      --(ctx->pipeline_yielded);
+   }
 
+   if(!microhttpd_DeferredClientRemoved(client)) /* Otherwise freed when the request completes */
+      microhttpd_FreeClient(client);
+   return 0;
+}
+
+/*! Release a client that has already been removed from the event backend and client list */
+void microhttpd_FreeClient(struct md_client *client)
+{
    microhttpd_ResetState(client);
-   free(client->rx_buffer);
+   microhttpd_ConnectionDataFree(client);
+   microhttpd_TxClear(client);
+   microhttpd_JsonFree(client);
+   microhttpd_ProxyFree(client);
+   if(!client->rx_borrowed)
+      microhttpd_RxFree(client);
    free(client);
-   return 0;
 }
 
+/*! Receive from the client's transport and run the state machine, until the transport has nothing
+ *  more without waiting. Returns 0 if the client is still connected, or -1 if it has been removed. */
 int microhttpd_HandleClientReceive(struct md_context *ctx, struct md_client *client)
+{
+   int result;
+
+   do
+   {
+      result = microhttpd_ClientReceive(ctx, client);
+   } while(0 == result && NULL != client->transport->pending && NULL == client->deferred
+        && !client->paused && client->transport->pending(client));
+   return result;
+}
+
+/*! Run the state machine over data received by an event backend. The data may be modified in place,
+ *  and is no longer referenced when this function returns. Returns 0 if the client is still
+ *  connected, or -1 if it has been removed. */
+int microhttpd_HandleClientData(struct md_context *ctx, struct md_client *client, char *data,
+   uint32_t length)
+{
+   if(NULL == client->rx_buffer && length <= client->rx_buffer_size)
+   {
+      /* Process directly from the caller's buffer */
+      client->rx_buffer = data;
+      client->rx_size = length;
+      client->rx_borrowed = true;
+      if(microhttpd_ProcessClient(ctx, client) != 0)
+         return -1;
+
+      client->rx_borrowed = false;
+      client->rx_buffer = NULL;
+      if(0 == client->rx_size)
+         return 0;
+
+      /* Partial request; keep the remainder */
+      if(!microhttpd_RxAlloc(ctx, client))
+      {
+         microhttpd_RemoveClient(ctx, client);
+         return -1;
+      }
+      memcpy(client->rx_buffer, data, client->rx_size);
+      return 0;
+   }
+
+   while(length > 0)
+   {
+      uint32_t chunk;
+
+      if(NULL == client->rx_buffer)
+      {
+         if(length <= client->rx_buffer_size)
+            return microhttpd_HandleClientData(ctx, client, data, length);
+         if(!microhttpd_RxAlloc(ctx, client))
+         {
+            microhttpd_RemoveClient(ctx, client);
+            return -1;
+         }
+      }
+
+      chunk = client->rx_buffer_size - client->rx_size;
+
+      if(0 == chunk)
+      {
+         MH_DBG("%s: Receive buffer full\n", __func__);
+         microhttpd_RemoveClient(ctx, client);
+         return -1;
+      }
+      if(chunk > length)
+         chunk = length;
+      memcpy(&client->rx_buffer[client->rx_size], data, chunk);
+      client->rx_size += chunk;
+      data += chunk;
+      length -= chunk;
+
+      if(microhttpd_ProcessClient(ctx, client) != 0)
+         return -1;
+   }
+
+   return 0;
+}
+
+int microhttpd_HandleClientError(struct md_context *ctx, struct md_client *client)
+{
+   MH_DBG("%s: Socket error\n", __func__);
+   microhttpd_RemoveClient(ctx, client);
+   return -1;
+}
+
+/*! Continue writing queued data once the transport can accept more. Returns 0 if the client is still
+ *  connected, or -1 if it has been removed. */
+int microhttpd_HandleClientWritable(struct md_context *ctx, struct md_client *client)
+{
+   int result = microhttpd_TxFlush(client);
+
+   if(result < 0)
+   {
+      microhttpd_RemoveClient(ctx, client);
+      return -1;
+   }
+   if(0 == result)
+   {
+      if(microhttpd_CloseIfSent(ctx, client))
+         return -1;
+      microhttpd_UpdateClient(ctx, client); /* Nothing left to wait for */
+   }
+   return 0;
+}
+
+/*! Send a response, or queue it behind data that's already waiting to be written. What the transport
+ *  doesn't take right away is queued too, so a slow reader never holds up the loop. Returns the
+ *  number of bytes accepted or -1 on failure. */
+int32_t microhttpd_ClientSend(struct md_client *client, struct iovec *iov, uint32_t count)
+{
+   int32_t total = 0, written = 0;
+   bool queued = false;
+
+   if(client->corked)
+   {
+      /* Responses to pipelined requests go out together once the received data is processed */
+      for(uint32_t i = 0; i < count; ++i)
+         total += iov[i].iov_len;
+      if(client->tx_pending + total <= MICROHTTPD_CORK_MAX)
+      {
+         for(uint32_t i = 0; i < count; ++i)
+         {
+            if(!microhttpd_TxQueueCopy(client, iov[i].iov_base, iov[i].iov_len))
+               return -1;
+         }
+         return total;
+      }
+      microhttpd_UpdateClient(client->ctx, client); /* Too large to hold back; send what's queued first */
+      total = 0;
+   }
+
+   if(0 == client->tx_pending && (written = microhttpd_TransportWrite(client, iov, count)) < 0)
+      return -1;
+
+   for(uint32_t i = 0; i < count; ++i)
+   {
+      total += iov[i].iov_len;
+      if((uint32_t) written >= iov[i].iov_len)
+      {
+         written -= iov[i].iov_len;
+         continue;
+      }
+      if(!microhttpd_TxQueueCopy(client, (const char *) iov[i].iov_base + written, iov[i].iov_len - written))
+         return -1;
+      written = 0;
+      queued = true;
+   }
+   if(queued)
+      microhttpd_UpdateClient(client->ctx, client);
+   return total;
+}
+
+/*! As microhttpd_ClientSend(), for data in a transmit buffer. Whatever has to wait is queued as a
+ *  reference to the buffer rather than copied. */
+int32_t microhttpd_ClientSendBuffer(struct md_client *client, struct md_buffer *buffer, uint32_t offset,
+   uint32_t length)
+{
+   struct iovec iov = { &buffer->data[offset], length };
+   int32_t written = 0;
+
+   if(client->corked)
+   {
+      if(client->tx_pending + length <= MICROHTTPD_CORK_MAX)
+         return microhttpd_TxQueueBuffer(client, buffer, offset, length) ? (int32_t) length : -1;
+      microhttpd_UpdateClient(client->ctx, client); /* Too large to hold back; send what's queued first */
+   }
+
+   if(0 == client->tx_pending && (written = microhttpd_TransportWrite(client, &iov, 1)) < 0)
+      return -1;
+   if((uint32_t) written == length)
+      return length;
+
+   if(!microhttpd_TxQueueBuffer(client, buffer, offset + written, length - written))
+      return -1;
+   microhttpd_UpdateClient(client->ctx, client);
+   return length;
+}
+
+/*! Close a connection whose response was to be its last, once that response has been written.
+ *  Returns true if the client was removed. */
+bool microhttpd_CloseIfSent(struct md_context *ctx, struct md_client *client)
+{
+   if(!client->close_after_response || client->tx_pending > 0)
+      return false;
+   MH_DBG("%s: Closing %s after its response\n", __func__, microhttpd_SourceAddress(client));
+   microhttpd_RemoveClient(ctx, client);
+   return true;
+}
+
+/*! Tell the event backend the client's parked state or transmit queue changed. Backends may start
+ *  writing queued data, but never remove the client from here. */
+void microhttpd_UpdateClient(struct md_context *ctx, struct md_client *client)
+{
+   if(NULL != ctx->backend && NULL != ctx->backend->update_client)
+      ctx->backend->update_client(ctx, client);
+   else if(client->tx_pending > 0)
+      microhttpd_TxFlush(client); /* No event backend (in-memory clients) */
+}
+
+/*! The peer's address, looked up the first time it's needed */
+const struct sockaddr_storage *microhttpd_ClientPeer(struct md_client *client)
+{
+   if(0 == client->peer_length && client->socket >= 0)
+   {
+      socklen_t length = sizeof(client->peer);
+      if(getpeername(client->socket, (struct sockaddr *) &client->peer, &length) == 0)
+         client->peer_length = length;
+   }
+   return &client->peer;
+}
+
+/*! The client's address as text, formatted the first time it's asked for. Peers of a Unix domain
+ *  socket have no address. */
+const char *microhttpd_SourceAddress(struct md_client *client)
+{
+   if('\0' != client->source_address[0])
+      return client->source_address;
+
+   microhttpd_ClientPeer(client);
+   if(AF_INET == client->peer.ss_family)
+   {
+      struct sockaddr_in *in = (struct sockaddr_in *) &client->peer;
+      uint8_t *addr = (uint8_t *) &in->sin_addr.s_addr;
+
+      snprintf(client->source_address, sizeof(client->source_address), "%u.%u.%u.%u:%u",
+         addr[0], addr[1], addr[2], addr[3], ntohs(in->sin_port));
+   }
+#if defined(AF_INET6)
+   else if(AF_INET6 == client->peer.ss_family)
+   {
+      struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &client->peer;
+      char text[INET6_ADDRSTRLEN];
+
+      if(NULL == inet_ntop(AF_INET6, &in6->sin6_addr, text, sizeof(text)))
+         text[0] = '\0';
+      snprintf(client->source_address, sizeof(client->source_address), "[%s]:%u", text,
+         ntohs(in6->sin6_port));
+   }
+#endif
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+   else if(AF_UNIX == client->peer.ss_family)
+      strcpy(client->source_address, "unix");
+#endif
+   else
+      strcpy(client->source_address, "unknown");
+
+   return client->source_address;
+}
+
+/*! A deferred response has been sent; continue with any requests received in the meantime. Returns
+ *  0 if the client is still connected, or -1 if it has been removed. */
+int microhttpd_ResumeClient(struct md_context *ctx, struct md_client *client)
+{
+   microhttpd_ResetState(client);
+   if(NULL != client->stream)
+   {
+      microhttpd_RemoveClient(ctx, client); /* A stream carries a single request */
+      return -1;
+   }
+   microhttpd_UpdateClient(ctx, client);
+   if(0 != client->rx_size && microhttpd_ProcessClient(ctx, client) != 0)
+      return -1;
+   if(NULL != client->transport->pending && NULL == client->deferred && client->transport->pending(client))
+      return microhttpd_HandleClientReceive(ctx, client); /* The socket won't report it */
+   return 0;
+}
+
+/*! Continue clients that reached pipeline_max with requests still buffered, now that every other
+ *  connection has had a turn */
+void microhttpd_ProcessPipelined(struct md_context *ctx)
+{
+   struct md_client *client, *next;
+
+   for(client = ctx->client_list; NULL != client && ctx->pipeline_yielded > 0; client = next)
+   {
+      next = client->next;
+      if(!client->pipeline_yielded)
+         continue;
+      client->pipeline_yielded = false;
+      --(ctx->pipeline_yielded);
+      microhttpd_ProcessClient(ctx, client);
+   }
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int microhttpd_ClientReceive(struct md_context *ctx, struct md_client *client)
 {
    int32_t space_left = client->rx_buffer_size - client->rx_size;
    int32_t length;
-   uint32_t consumed;
-   bool error, cont;
+
+   if(NULL == client->rx_buffer && NULL != ctx->rx_scratch)
+   {
+      /* Nothing pending; receive into the shared buffer and keep only what's left over */
+      length = client->transport->recv(client, ctx->rx_scratch, client->rx_buffer_size);
+      if(length < 0 && EAGAIN == errno)
+         return 0;
+      if(length <= 0)
+      {
+         MH_DBG("%s: Read failed (%"PRIi32")\n", __func__, length);
+         microhttpd_RemoveClient(ctx, client);
+         return -1;
+      }
+      MH_DBG("%s: Received %"PRIu32" bytes\n", __func__, length);
+      MH_TRACE(client, READ, length);
+      return microhttpd_HandleClientData(ctx, client, ctx->rx_scratch, length);
+   }
 
    if(space_left <= 0)
    {
       MH_DBG("%s: Invalid space remaining (%"PRIi32")\n", __func__, space_left);
-      return microhttpd_RemoveClient(ctx, client);
+      microhttpd_RemoveClient(ctx, client);
+      return -1;
+   }
+   if(NULL == client->rx_buffer)
+   {
+      if(!microhttpd_RxAlloc(ctx, client))
+      {
+         microhttpd_RemoveClient(ctx, client);
+         return -1;
+      }
    }
    MH_DBG("%s: Receive at offset %"PRIu32", %"PRIu32" bytes remaining\n",
       __func__, client->rx_size, space_left);
-   length = read(client->socket, &client->rx_buffer[client->rx_size], space_left); 
+   length = client->transport->recv(client, &client->rx_buffer[client->rx_size], space_left);
+   if(length < 0 && EAGAIN == errno)
+      return 0;
    if(length <= 0)
    {
       MH_DBG("%s: Read failed (%"PRIi32")\n", __func__, length);
-      return microhttpd_RemoveClient(ctx, client);
+      microhttpd_RemoveClient(ctx, client);
+      return -1;
    }
    client->rx_size += length;
    MH_DBG("%s: Received %"PRIu32" bytes (total now %"PRIu32")\n", __func__, length, client->rx_size);
+   MH_TRACE(client, READ, length);
+
+   return microhttpd_ProcessClient(ctx, client);
+}
+
+static int microhttpd_ProcessClient(struct md_context *ctx, struct md_client *client)
+{
+   uint32_t consumed, pipeline_max = UINT32_MAX;
+   bool error, cont;
+
+   /* Without a wakeup, there's no way to come back for requests left buffered */
+   if(ctx->wake_fd[1] >= 0)
+   {
+      pipeline_max = (ctx->params.pipeline_max > 0) ?
+         ctx->params.pipeline_max : MICROHTTPD_DEFAULT_PIPELINE_MAX;
+   }
+   client->pipeline_count = 0;
+   /* Other transports (io_uring) already queue every send until the end of the pass */
+   client->corked = (client->transport == &md_transport_socket);
+#if defined(MICROHTTPD_TLS)
+   client->corked |= (client->transport == &md_transport_tls);
+#endif
 
    cont = true;
    do
@@ -110,7 +531,8 @@ int microhttpd_HandleClientReceive(struct md_context *ctx, struct md_client *cli
       if(error)
       {
          MH_DBG("%s: State machine error\n", __func__);
-         return microhttpd_RemoveClient(ctx, client);
+         microhttpd_RemoveClient(ctx, client);
+         return -1;
       }
 
       if(consumed > 0)
@@ -119,19 +541,63 @@ int microhttpd_HandleClientReceive(struct md_context *ctx, struct md_client *cli
          {
             MH_DBG("%s: Rx buffer underrun (consumed %"PRIu32" of %"PRIu32" bytes)\n",
                __func__, consumed, client->rx_size);
-            return microhttpd_RemoveClient(ctx, client);
+            microhttpd_RemoveClient(ctx, client);
+            return -1;
          }
          
          string_shift(client->rx_buffer, consumed, client->rx_size);
          client->rx_size -= consumed;
       }
-   } while(cont);
+   } while(cont && client->pipeline_count < pipeline_max);
+
+   if(cont && client->rx_size > 0 && !client->pipeline_yielded)
+   {
+      MH_DBG("%s: Yielding after %"PRIu32" requests\n", __func__, client->pipeline_count);
+      client->pipeline_yielded = true;
+      ++(ctx->pipeline_yielded);
+   }
+   if(client->corked)
+   {
+      client->corked = false;
+      if(client->tx_pending > 0)
+         microhttpd_UpdateClient(ctx, client);
+   }
+   if(microhttpd_CloseIfSent(ctx, client))
+      return -1;
+
+   if(0 == client->rx_size && NULL != client->rx_buffer && !client->rx_borrowed)
+   {
+      /* Don't hold a receive buffer while idle */
+      microhttpd_RxFree(client);
+   }
 
    return 0;
 }
 
-int microhttpd_HandleClientError(struct md_context *ctx, struct md_client *client)
+/*! Allocate a receive buffer within the memory budget. When over budget, the client has been sent a
+ *  503 and should be removed. */
+static bool microhttpd_RxAlloc(struct md_context *ctx, struct md_client *client)
 {
-   MH_DBG("%s: Socket error\n", __func__);
-   return microhttpd_RemoveClient(ctx, client);
+   if(!microhttpd_BudgetReserve(ctx, client->rx_buffer_size))
+   {
+      microhttpd_Shed(client);
+      return false;
+   }
+   client->rx_buffer = malloc(client->rx_buffer_size);
+   if(NULL == client->rx_buffer)
+   {
+      MH_DBG("%s: Failed to allocate receive buffer\n", __func__);
+      microhttpd_BudgetRelease(ctx, client->rx_buffer_size);
+      return false;
+   }
+   return true;
+}
+
+static void microhttpd_RxFree(struct md_client *client)
+{
+   if(NULL == client->rx_buffer)
+      return;
+   free(client->rx_buffer);
+   client->rx_buffer = NULL;
+   microhttpd_BudgetRelease(client->ctx, client->rx_buffer_size);
 }
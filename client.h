@@ -7,10 +7,34 @@
 #define _MICROHTTPD_CLIENT_H
 
 #include "microhttpd_private.h"
+#include "transport.h"
 
-int microhttpd_NewClient(struct md_context *ctx, int nSocket, struct sockaddr_in *socket_info);
+struct md_buffer;
+
+#if !defined(MICROHTTPD_CORK_MAX)
+#define MICROHTTPD_CORK_MAX              (16 * 1024) /* Output held back while pipelined requests are processed */
+#endif
+#if !defined(MICROHTTPD_DEFAULT_PIPELINE_MAX)
+#define MICROHTTPD_DEFAULT_PIPELINE_MAX  16
+#endif
+
+int microhttpd_NewClient(struct md_context *ctx, int nSocket, const struct sockaddr *peer,
+   socklen_t peer_length, const struct md_transport *transport, void *transport_data);
 int microhttpd_RemoveClient(struct md_context *ctx, struct md_client *client);
+void microhttpd_FreeClient(struct md_client *client);
 int microhttpd_HandleClientReceive(struct md_context *ctx, struct md_client *client);
+int microhttpd_HandleClientData(struct md_context *ctx, struct md_client *client, char *data,
+   uint32_t length);
 int microhttpd_HandleClientError(struct md_context *ctx, struct md_client *client);
+int microhttpd_HandleClientWritable(struct md_context *ctx, struct md_client *client);
+int32_t microhttpd_ClientSend(struct md_client *client, struct iovec *iov, uint32_t count);
+int32_t microhttpd_ClientSendBuffer(struct md_client *client, struct md_buffer *buffer, uint32_t offset,
+   uint32_t length);
+void microhttpd_UpdateClient(struct md_context *ctx, struct md_client *client);
+bool microhttpd_CloseIfSent(struct md_context *ctx, struct md_client *client);
+int microhttpd_ResumeClient(struct md_context *ctx, struct md_client *client);
+void microhttpd_ProcessPipelined(struct md_context *ctx);
+const struct sockaddr_storage *microhttpd_ClientPeer(struct md_client *client);
+const char *microhttpd_SourceAddress(struct md_client *client);
 
 #endif /* _MICROHTTPD_CLIENT_H */
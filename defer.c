@@ -0,0 +1,314 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file defer.c
+ *  \brief microhttpd deferred responses
+ *
+ *  A deferred request parks its client until microhttpd_complete() is called. Completions may come
+ *  from any thread; they are pushed onto a lock-free stack in the context and the event loop is
+ *  woken through an eventfd (or a pipe where eventfd isn't available) to send them.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#if defined(__linux__) && !defined(LWIP_SOCKET)
+#include <sys/eventfd.h>
+#define MICROHTTPD_HAVE_EVENTFD
+#endif
+#include "debug.h"
+#include "client.h"
+#include "tx.h"
+#include "defer.h"
+#include "cache.h"
+#include "trace.h"
+
+static char *microhttpd_DeferredReserve(struct md_deferred *deferred, uint32_t length);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+tMicroHttpdDeferred microhttpd_defer(tMicroHttpdClient client)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_deferred *deferred = c->deferred;
+
+   if(NULL != deferred)
+   {
+      /* Called from an offloaded handler, or one whose response is being cached; completion now
+       *  waits for microhttpd_complete() */
+      if(NULL != deferred->work || deferred->capture)
+         deferred->user_deferred = true;
+      return (tMicroHttpdDeferred) deferred;
+   }
+
+   if(c->ctx->wake_fd[1] < 0)
+   {
+      MH_DBG("%s: Deferred responses not supported on this platform\n", __func__);
+      return NULL;
+   }
+
+   deferred = microhttpd_DeferredCreate(c, 1);
+   if(NULL == deferred)
+      return NULL;
+   microhttpd_UpdateClient(c->ctx, c);
+   return (tMicroHttpdDeferred) deferred;
+}
+
+int microhttpd_complete(tMicroHttpdDeferred handle, uint16_t code, const char *content_type,
+   uint32_t content_length, const char *extra_header_options, const char *content)
+{
+   struct md_deferred *deferred = (struct md_deferred *) handle;
+   bool result;
+
+   if(NULL == deferred || atomic_flag_test_and_set(&deferred->completed))
+   {
+      MH_DBG("%s: Invalid or already completed\n", __func__);
+      return -1;
+   }
+
+   /* Format the response here so the event loop only has to send it. A response that can't be
+    *  stored still completes the request, which closes the client. */
+   result = microhttpd_DeferredRespond(deferred, code, content_type, content_length,
+      extra_header_options, content);
+   microhttpd_DeferredComplete(deferred);
+   return result ? 0 : -1;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+int microhttpd_WakeInit(struct md_context *ctx)
+{
+#if defined(MICROHTTPD_HAVE_EVENTFD)
+   ctx->wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if(ctx->wake_fd[0] < 0)
+   {
+      MH_DBG("%s: eventfd failed (errno %d)\n", __func__, errno);
+      return -1;
+   }
+   ctx->wake_fd[1] = ctx->wake_fd[0];
+#elif !defined(LWIP_SOCKET)
+   if(pipe(ctx->wake_fd) != 0)
+   {
+      MH_DBG("%s: pipe failed (errno %d)\n", __func__, errno);
+      return -1;
+   }
+   for(int i = 0; i < 2; ++i)
+      fcntl(ctx->wake_fd[i], F_SETFL, fcntl(ctx->wake_fd[i], F_GETFL, 0) | O_NONBLOCK);
+#else
+   ctx->wake_fd[0] = ctx->wake_fd[1] = -1; /* No deferred responses */
+#endif
+   return 0;
+}
+
+void microhttpd_WakeShutdown(struct md_context *ctx)
+{
+   if(ctx->wake_fd[0] >= 0)
+      close(ctx->wake_fd[0]);
+   if(ctx->wake_fd[1] >= 0 && ctx->wake_fd[1] != ctx->wake_fd[0])
+      close(ctx->wake_fd[1]);
+   ctx->wake_fd[0] = ctx->wake_fd[1] = -1;
+}
+
+void microhttpd_WakeSignal(struct md_context *ctx)
+{
+   uint64_t value = 1;
+   ssize_t result;
+
+   do
+   {
+      result = write(ctx->wake_fd[1], &value, (ctx->wake_fd[0] == ctx->wake_fd[1]) ? sizeof(value) : 1);
+   } while(result < 0 && errno == EINTR);
+   /* EAGAIN means a wakeup is already pending */
+}
+
+void microhttpd_WakeDrain(struct md_context *ctx)
+{
+   uint64_t value[8];
+
+   while(read(ctx->wake_fd[0], value, sizeof(value)) > 0)
+   {
+      if(ctx->wake_fd[0] == ctx->wake_fd[1])
+         break; /* eventfd is reset by a single read */
+   }
+}
+
+struct md_deferred *microhttpd_DeferredCreate(struct md_client *client, uint32_t refcount)
+{
+   struct md_deferred *deferred;
+
+   deferred = (struct md_deferred *) malloc(sizeof(*deferred));
+   if(NULL == deferred)
+   {
+      MH_DBG("%s: Failed to allocate deferred response\n", __func__);
+      return NULL;
+   }
+   memset(deferred, 0, sizeof(*deferred));
+   deferred->ctx = client->ctx;
+   deferred->client = client;
+   atomic_init(&deferred->refcount, refcount);
+   atomic_flag_clear(&deferred->completed);
+
+   MH_TRACE(client, DEFER, 0);
+   client->deferred = deferred;
+   return deferred;
+}
+
+void microhttpd_DeferredRelease(struct md_deferred *deferred)
+{
+   if(atomic_fetch_sub_explicit(&deferred->refcount, 1, memory_order_acq_rel) > 1)
+      return;
+   if(NULL != deferred->response)
+      microhttpd_BufferRelease(deferred->response);
+   free(deferred);
+}
+
+bool microhttpd_DeferredAppend(struct md_deferred *deferred, const void *data, uint32_t length)
+{
+   char *tail = microhttpd_DeferredReserve(deferred, length);
+
+   if(NULL == tail)
+      return false;
+   memcpy(tail, data, length);
+   deferred->response->length += length;
+   return true;
+}
+
+bool microhttpd_DeferredRespond(struct md_deferred *deferred, uint16_t code, const char *content_type,
+   uint32_t content_length, const char *extra_header_options, const char *content)
+{
+   uint32_t length = microhttpd_ResponseHeaderSize(content_type, extra_header_options);
+   char *tail;
+
+   if(MICROHTTPD_METHOD_HEAD == deferred->client->method)
+      content = NULL; /* Header only */
+   if(NULL != content)
+      length += content_length;
+   tail = microhttpd_DeferredReserve(deferred, length);
+   if(NULL == tail)
+      return false;
+
+   length = microhttpd_FormatResponseHeader(tail, code, content_type, content_length,
+      extra_header_options, false);
+   if(NULL != content)
+   {
+      memcpy(&tail[length], content, content_length);
+      length += content_length;
+   }
+   deferred->response->length += length;
+   return true;
+}
+
+/*! Queue the deferred request for the event loop. Callable from any thread, once per request. */
+void microhttpd_DeferredComplete(struct md_deferred *deferred)
+{
+   struct md_context *ctx = deferred->ctx;
+   struct md_deferred *head;
+
+   head = atomic_load_explicit(&ctx->completions, memory_order_relaxed);
+   do
+   {
+      deferred->next = head;
+   } while(!atomic_compare_exchange_weak_explicit(&ctx->completions, &head, deferred,
+      memory_order_release, memory_order_relaxed));
+
+   if(NULL == head)
+      microhttpd_WakeSignal(ctx); /* The event loop only needs one wakeup per batch */
+}
+
+/*! Send every queued completion. Runs on the event loop thread. */
+void microhttpd_ProcessCompletions(struct md_context *ctx)
+{
+   struct md_deferred *list, *reversed = NULL, *next;
+
+   list = atomic_exchange_explicit(&ctx->completions, NULL, memory_order_acquire);
+   if(NULL == list)
+      return;
+
+   /* Oldest first */
+   for(; list != NULL; list = next)
+   {
+      next = list->next;
+      list->next = reversed;
+      reversed = list;
+   }
+
+   for(list = reversed; list != NULL; list = next)
+   {
+      struct md_client *client = list->client;
+      struct iovec iov = { NULL, 0 };
+
+      next = list->next;
+      client->deferred = NULL;
+      if(NULL != list->response)
+      {
+         iov.iov_base = list->response->data;
+         iov.iov_len = list->response->length;
+      }
+      MH_TRACE(client, COMPLETE, iov.iov_len);
+      if(NULL != client->cache)
+         microhttpd_CacheFilled(client, list); /* Before anything else, for the requests waiting on it */
+
+      if(list->orphan)
+      {
+         microhttpd_FreeClient(client); /* Connection closed while the response was pending */
+      }
+      else if(list->failed || (iov.iov_len > 0 && microhttpd_ClientSend(client, &iov, 1) < 0))
+      {
+         MH_DBG("%s: Failed to send deferred response\n", __func__);
+         microhttpd_RemoveClient(ctx, client);
+      }
+      else
+      {
+         microhttpd_ResumeClient(ctx, client);
+      }
+      microhttpd_DeferredRelease(list);
+   }
+}
+
+/*! The client's connection has been closed. Returns true if a deferred request still refers to the
+ *  client, in which case it's freed once the request completes. */
+bool microhttpd_DeferredClientRemoved(struct md_client *client)
+{
+   if(NULL == client->deferred)
+      return false;
+   client->deferred->orphan = true;
+   return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! Make room for length more bytes of response, returning where they go */
+static char *microhttpd_DeferredReserve(struct md_deferred *deferred, uint32_t length)
+{
+   struct md_buffer *buffer = deferred->response;
+   uint32_t used = (NULL != buffer) ? buffer->length : 0;
+   uint32_t capacity;
+
+   if(NULL != buffer && buffer->capacity - used >= length)
+      return &buffer->data[used];
+
+   capacity = (NULL != buffer) ? buffer->capacity * 2 : 0;
+   if(capacity < used + length)
+      capacity = used + length;
+   buffer = microhttpd_BufferAlloc(capacity);
+   if(NULL == buffer)
+   {
+      deferred->failed = true;
+      return NULL;
+   }
+   if(NULL != deferred->response)
+   {
+      memcpy(buffer->data, deferred->response->data, used);
+      buffer->length = used;
+      microhttpd_BufferRelease(deferred->response);
+   }
+   deferred->response = buffer;
+   return &buffer->data[used];
+}
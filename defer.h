@@ -0,0 +1,53 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file defer.h
+ *  \brief microhttpd deferred responses
+ */
+#ifndef _MICROHTTPD_DEFER_H
+#define _MICROHTTPD_DEFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "microhttpd_private.h"
+
+struct md_buffer;
+
+/*! A request whose response is produced later, possibly by another thread. The client, and with it
+ *  the request's URI and parameters, stays allocated until the completion has been processed by the
+ *  event loop, even if the connection is closed in the meantime. */
+struct md_deferred
+{
+   struct md_context *ctx;
+   struct md_client *client;
+   atomic_uint refcount;      /* The completion, plus the worker while offloaded work runs */
+
+   atomic_flag completed;
+   struct md_buffer *response; /* Responses written by the owner of the request, sent on completion */
+   bool failed;                /* Response could not be stored; the client is closed */
+
+   /* Handler invocation run on the worker pool */
+   void (*work)(struct md_client *client);
+   bool user_deferred;         /* The offloaded handler called microhttpd_defer() */
+   bool capture;               /* Response collected for the cache; sent when the handler returns */
+
+   bool orphan;                /* Client was removed; free it once completed (event loop only) */
+   struct md_deferred *next;   /* Completion queue link */
+};
+
+int microhttpd_WakeInit(struct md_context *ctx);
+void microhttpd_WakeShutdown(struct md_context *ctx);
+void microhttpd_WakeSignal(struct md_context *ctx);
+void microhttpd_WakeDrain(struct md_context *ctx);
+
+struct md_deferred *microhttpd_DeferredCreate(struct md_client *client, uint32_t refcount);
+void microhttpd_DeferredRelease(struct md_deferred *deferred);
+bool microhttpd_DeferredAppend(struct md_deferred *deferred, const void *data, uint32_t length);
+bool microhttpd_DeferredRespond(struct md_deferred *deferred, uint16_t code, const char *content_type,
+   uint32_t content_length, const char *extra_header_options, const char *content);
+void microhttpd_DeferredComplete(struct md_deferred *deferred);
+
+void microhttpd_ProcessCompletions(struct md_context *ctx);
+bool microhttpd_DeferredClientRemoved(struct md_client *client);
+
+#endif /* _MICROHTTPD_DEFER_H */
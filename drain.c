@@ -0,0 +1,120 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file drain.c
+ *  \brief microhttpd graceful shutdown
+ *
+ *  Draining starts on the pass after microhttpd_drain() is called: the backend stops accepting and
+ *  the listening sockets are closed, leaving them to any successor they were passed to. Event
+ *  streams are closed, WebSockets sent a 1001 close and HTTP/2 connections a GOAWAY. From then on,
+ *  every pass closes the connections that are between requests, so each keep-alive connection
+ *  finishes what it has in flight and then goes; at the deadline, whatever remains is closed.
+ */
+#include <time.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "events.h"
+#include "listener.h"
+#include "defer.h"
+#include "h2.h"
+#include "drain.h"
+#include "microhttpd/microhttpd.h"
+
+#define WEBSOCKET_GOING_AWAY 1001
+
+static bool microhttpd_ClientIdle(struct md_client *client);
+static uint64_t microhttpd_DrainClock(void);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+int microhttpd_drain(tMicroHttpdContext context, uint32_t timeout_ms)
+{
+   struct md_context *ctx = (struct md_context *) context;
+
+   if(!ctx->running)
+      return -1;
+   if(!ctx->draining)
+   {
+      MH_DBG("%s: Draining %"PRIu32" clients within %"PRIu32" ms\n", __func__, ctx->client_count,
+         timeout_ms);
+      ctx->draining = true;
+      ctx->drain_deadline = microhttpd_DrainClock() + timeout_ms;
+   }
+   microhttpd_WakeSignal(ctx); /* Don't wait for events before starting */
+   return 0;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! How long the backend may wait for events, shortened so the deadline isn't missed */
+uint32_t microhttpd_DrainTimeout(struct md_context *ctx, uint32_t timeout_ms)
+{
+   uint64_t now;
+
+   if(!ctx->draining)
+      return timeout_ms;
+   now = microhttpd_DrainClock();
+   if(now >= ctx->drain_deadline)
+      return 1;
+   if(0 == timeout_ms || ctx->drain_deadline - now < timeout_ms)
+      return (uint32_t) (ctx->drain_deadline - now);
+   return timeout_ms;
+}
+
+/*! Called after each pass while draining. Returns true once the last connection is closed. */
+bool microhttpd_DrainProcess(struct md_context *ctx)
+{
+   struct md_client *client, *next;
+   bool expired;
+
+   if(ctx->listener_count > 0)
+   {
+      if(NULL != ctx->backend->stop_accepting)
+         ctx->backend->stop_accepting(ctx);
+      microhttpd_ListenersStop(ctx);
+
+      for(client = ctx->client_list; NULL != client; client = next)
+      {
+         next = client->next;
+         if(NULL != client->channel)
+            microhttpd_RemoveClient(ctx, client);
+         else if(NULL != client->websocket)
+            microhttpd_websocket_close((tMicroHttpdClient) client, WEBSOCKET_GOING_AWAY);
+         else
+            microhttpd_H2GoAway(client);
+      }
+   }
+
+   expired = (microhttpd_DrainClock() >= ctx->drain_deadline);
+   for(client = ctx->client_list; NULL != client; client = next)
+   {
+      next = client->next;
+      if(expired || microhttpd_ClientIdle(client))
+         microhttpd_RemoveClient(ctx, client);
+   }
+
+   return (0 == ctx->client_count && 0 == ctx->upstream_count);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! Between requests, with nothing received or left to send */
+static bool microhttpd_ClientIdle(struct md_client *client)
+{
+   return 0 == client->rx_size && 0 == client->tx_pending && 0 == client->header_entry_count
+       && NULL == client->deferred && NULL == client->websocket && NULL == client->channel
+       && NULL == client->proxy_peer && !microhttpd_H2Busy(client);
+}
+
+static uint64_t microhttpd_DrainClock(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,16 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file drain.h
+ *  \brief microhttpd graceful shutdown
+ */
+#ifndef _MICROHTTPD_DRAIN_H
+#define _MICROHTTPD_DRAIN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+uint32_t microhttpd_DrainTimeout(struct md_context *ctx, uint32_t timeout_ms);
+bool microhttpd_DrainProcess(struct md_context *ctx);
+
+#endif /* _MICROHTTPD_DRAIN_H */
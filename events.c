@@ -0,0 +1,118 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file events.c
+ *  \brief microhttpd event backend selection
+ */
+#include <unistd.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "events.h"
+
+static const struct md_event_backend *backends[] =
+{
+#if defined(MICROHTTPD_HAVE_IO_URING)
+   &md_events_uring,
+#endif
+#if defined(MICROHTTPD_HAVE_EPOLL)
+   &md_events_epoll,
+#endif
+   &md_events_select
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Common Functions
+ */
+
+int microhttpd_EventsInit(struct md_context *ctx)
+{
+   const struct md_event_backend *requested = NULL;
+   uint32_t idx;
+
+   switch(ctx->params.event_backend)
+   {
+      case MICROHTTPD_EVENTS_SELECT:
+         requested = &md_events_select;
+         break;
+      case MICROHTTPD_EVENTS_EXTERNAL:
+         requested = &md_events_external;
+         break;
+#if defined(MICROHTTPD_HAVE_EPOLL)
+      case MICROHTTPD_EVENTS_EPOLL:
+         requested = &md_events_epoll;
+         break;
+#endif
+#if defined(MICROHTTPD_HAVE_IO_URING)
+      case MICROHTTPD_EVENTS_IO_URING:
+         requested = &md_events_uring;
+         break;
+#endif
+      default:
+         break;
+   }
+
+   /* Try the requested backend first, then fall back through the rest in order of preference. An
+    *  application that brings its own loop never calls microhttpd_process(), so there's nothing to
+    *  fall back to. */
+   if(NULL != requested && requested->init(ctx) == 0)
+   {
+      ctx->backend = requested;
+   }
+   else if(&md_events_external == requested)
+   {
+      MH_DBG("%s: '%s' event backend unavailable\n", __func__, requested->name);
+   }
+   else
+   {
+      if(NULL != requested)
+      {
+         MH_DBG("%s: '%s' event backend unavailable\n", __func__, requested->name);
+      }
+      for(idx = 0; NULL == ctx->backend && idx < ARRAY_SIZE(backends); ++idx)
+      {
+         if(backends[idx] != requested && backends[idx]->init(ctx) == 0)
+            ctx->backend = backends[idx];
+      }
+   }
+
+   if(NULL == ctx->backend)
+      return -1;
+
+   MH_DBG("%s: Using '%s' event backend\n", __func__, ctx->backend->name);
+   return 0;
+}
+
+/*! Accept a single pending connection on a listening socket. Returns 0 if a client was added,
+ *  or -1 if none was pending or it could not be added. */
+int microhttpd_AcceptClient(struct md_context *ctx, struct md_listener *listener)
+{
+   const struct md_transport *transport = &md_transport_socket;
+   struct sockaddr_storage peer;
+   socklen_t length = sizeof(peer);
+   int nSocket, enable = 1;
+
+   nSocket = accept(listener->socket, (struct sockaddr *) &peer, &length);
+   if(nSocket < 0)
+   {
+      MH_DBG("%s: Failed to accept client (%d)\n", __func__, nSocket);
+      return -1;
+   }
+
+   /* Responses are written in as few sends as possible, so don't let Nagle hold them back */
+   if(!listener->local && setsockopt(nSocket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+   {
+      MH_DBG("%s: Failed to enable TCP_NODELAY\n", __func__); /* Don't treat this as a fatal error */
+   }
+
+#if defined(MICROHTTPD_TLS)
+   if(listener->tls)
+      transport = &md_transport_tls;
+#endif
+   if(microhttpd_NewClient(ctx, nSocket, (struct sockaddr *) &peer, length, transport, NULL) != 0)
+   {
+      close(nSocket);
+      return -1;
+   }
+   return 0;
+}
@@ -0,0 +1,58 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file events.h
+ *  \brief microhttpd event backend interface
+ */
+#ifndef _MICROHTTPD_EVENTS_H
+#define _MICROHTTPD_EVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if defined(__linux__) && !defined(LWIP_SOCKET)
+#if !defined(MICROHTTPD_NO_EPOLL)
+#define MICROHTTPD_HAVE_EPOLL
+#endif
+#if !defined(MICROHTTPD_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) /* Multishot receive and provided buffer rings (Linux 6.0) */
+#define MICROHTTPD_HAVE_IO_URING
+#endif
+#endif
+#endif
+#endif
+
+/*! An event backend waits for activity on the listening socket, the wake descriptor and all
+ *  clients, then dispatches it to the client state machine. init returns 0 when the backend is
+ *  usable on this system; process returns 0 on success (including timeout) and negative on a fatal
+ *  error. Paused clients aren't read from by any backend until update_client is called with paused
+ *  cleared; backends that can also stop reading from clients waiting on a deferred response. */
+struct md_event_backend
+{
+   const char *name;
+   int (*init)(struct md_context *ctx);
+   void (*shutdown)(struct md_context *ctx);
+   int (*process)(struct md_context *ctx, uint32_t timeout_ms);
+   int (*add_client)(struct md_context *ctx, struct md_client *client);
+   void (*remove_client)(struct md_context *ctx, struct md_client *client);
+   void (*update_client)(struct md_context *ctx, struct md_client *client); /* Parked state changed */
+   void (*stop_accepting)(struct md_context *ctx); /* Before the listening sockets are closed */
+   const struct md_transport *transport; /* For connections the server opens; NULL for md_transport_socket */
+};
+
+extern const struct md_event_backend md_events_select;
+extern const struct md_event_backend md_events_external; /* Driven by the application's own loop */
+#if defined(MICROHTTPD_HAVE_EPOLL)
+extern const struct md_event_backend md_events_epoll;
+#endif
+#if defined(MICROHTTPD_HAVE_IO_URING)
+extern const struct md_event_backend md_events_uring;
+#endif
+
+int microhttpd_EventsInit(struct md_context *ctx);
+int microhttpd_AcceptClient(struct md_context *ctx, struct md_listener *listener);
+void microhttpd_ExternalEvent(struct md_context *ctx, int fd, uint32_t events);
+
+#endif /* _MICROHTTPD_EVENTS_H */
@@ -0,0 +1,212 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file events_epoll.c
+ *  \brief microhttpd epoll event backend (Linux)
+ */
+#include "events.h"
+#if defined(MICROHTTPD_HAVE_EPOLL)
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "defer.h"
+#include "tx.h"
+
+#define MICROHTTPD_EPOLL_MAX_EVENTS 64
+
+struct md_epoll
+{
+   int fd;
+   struct epoll_event events[MICROHTTPD_EPOLL_MAX_EVENTS];
+};
+
+static int events_EpollInit(struct md_context *ctx);
+static void events_EpollShutdown(struct md_context *ctx);
+static int events_EpollProcess(struct md_context *ctx, uint32_t timeout_ms);
+static int events_EpollAddClient(struct md_context *ctx, struct md_client *client);
+static void events_EpollRemoveClient(struct md_context *ctx, struct md_client *client);
+static void events_EpollUpdateClient(struct md_context *ctx, struct md_client *client);
+static void events_EpollStopAccepting(struct md_context *ctx);
+
+const struct md_event_backend md_events_epoll =
+{
+   "epoll",
+   events_EpollInit,
+   events_EpollShutdown,
+   events_EpollProcess,
+   events_EpollAddClient,
+   events_EpollRemoveClient,
+   events_EpollUpdateClient,
+   events_EpollStopAccepting,
+   NULL
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int events_EpollInit(struct md_context *ctx)
+{
+   struct md_epoll *ep;
+   struct epoll_event event = {0};
+
+   ep = (struct md_epoll *) malloc(sizeof(*ep));
+   if(NULL == ep)
+      return -1;
+
+   ep->fd = epoll_create1(EPOLL_CLOEXEC);
+   if(ep->fd < 0)
+   {
+      MH_DBG("%s: epoll_create1 failed (errno %d)\n", __func__, errno);
+      free(ep);
+      return -1;
+   }
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      event.events = EPOLLIN;
+      event.data.ptr = &ctx->listeners[idx];
+      if(epoll_ctl(ep->fd, EPOLL_CTL_ADD, ctx->listeners[idx].socket, &event) != 0)
+      {
+         MH_DBG("%s: Failed to add listening socket (errno %d)\n", __func__, errno);
+         close(ep->fd);
+         free(ep);
+         return -1;
+      }
+   }
+
+   event.events = EPOLLIN;
+   event.data.ptr = ctx->wake_fd; /* Completion wakeup */
+   if(ctx->wake_fd[0] >= 0 && epoll_ctl(ep->fd, EPOLL_CTL_ADD, ctx->wake_fd[0], &event) != 0)
+   {
+      MH_DBG("%s: Failed to add wake descriptor (errno %d)\n", __func__, errno);
+      close(ep->fd);
+      free(ep);
+      return -1;
+   }
+
+   ctx->backend_data = ep;
+   return 0;
+}
+
+static void events_EpollShutdown(struct md_context *ctx)
+{
+   struct md_epoll *ep = (struct md_epoll *) ctx->backend_data;
+
+   close(ep->fd);
+   free(ep);
+   ctx->backend_data = NULL;
+}
+
+static int events_EpollProcess(struct md_context *ctx, uint32_t timeout_ms)
+{
+   struct md_epoll *ep = (struct md_epoll *) ctx->backend_data;
+   int count, idx;
+
+   count = epoll_wait(ep->fd, ep->events, ARRAY_SIZE(ep->events), (timeout_ms > 0) ? (int) timeout_ms : -1);
+   if(count < 0)
+   {
+      if(errno == EINTR)
+         return 0;
+      MH_DBG("%s: epoll_wait failed (errno %d)\n", __func__, errno);
+      return -1;
+   }
+
+   for(idx = 0; idx < count; ++idx)
+   {
+      struct epoll_event *event = &ep->events[idx];
+      struct md_client *client = (struct md_client *) event->data.ptr;
+      struct md_listener *listener = (struct md_listener *) event->data.ptr;
+
+      if(listener >= ctx->listeners && listener < &ctx->listeners[ctx->listener_count])
+      {
+         /* Drain the accept queue */
+         for(int n = 0; n < MICROHTTPD_MAX_QUEUED_CONNECTIONS; ++n)
+         {
+            if(microhttpd_AcceptClient(ctx, listener) != 0)
+               break;
+         }
+      }
+      else if(event->data.ptr == (void *) ctx->wake_fd)
+         microhttpd_WakeDrain(ctx); /* Completions are sent after this returns */
+      else
+      {
+         if((event->events & EPOLLOUT) && microhttpd_HandleClientWritable(ctx, client) != 0)
+            continue;
+         if(event->events & EPOLLIN)
+            microhttpd_HandleClientReceive(ctx, client); /* Also detects hangup via a zero-length read */
+         else if(event->events & (EPOLLERR | EPOLLHUP))
+            microhttpd_HandleClientError(ctx, client);
+      }
+   }
+
+   return 0;
+}
+
+static int events_EpollAddClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_epoll *ep = (struct md_epoll *) ctx->backend_data;
+   struct epoll_event event = {0};
+
+   if(client->socket < 0)
+      return 0; /* Not socket-backed */
+
+   event.events = EPOLLIN;
+   event.data.ptr = client;
+   if(epoll_ctl(ep->fd, EPOLL_CTL_ADD, client->socket, &event) != 0)
+   {
+      MH_DBG("%s: epoll_ctl failed (errno %d)\n", __func__, errno);
+      return -1;
+   }
+   client->backend_data = (void *) (uintptr_t) event.events; /* Current interest */
+   return 0;
+}
+
+static void events_EpollRemoveClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_epoll *ep = (struct md_epoll *) ctx->backend_data;
+
+   if(client->socket >= 0)
+      epoll_ctl(ep->fd, EPOLL_CTL_DEL, client->socket, NULL);
+}
+
+static void events_EpollUpdateClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_epoll *ep = (struct md_epoll *) ctx->backend_data;
+   struct epoll_event event = {0};
+
+   if(client->socket < 0)
+      return;
+
+   /* Errors and hangups are always reported, even for a parked client. Queued data is written
+    *  right away; only what the socket can't take waits for EPOLLOUT (which also reports errors). */
+   event.events = (NULL != client->deferred || client->paused) ? 0 : EPOLLIN;
+   if(client->tx_pending > 0 && microhttpd_TxFlush(client) != 0)
+      event.events |= EPOLLOUT;
+   if(event.events == (uint32_t) (uintptr_t) client->backend_data)
+      return;
+
+   event.data.ptr = client;
+   if(epoll_ctl(ep->fd, EPOLL_CTL_MOD, client->socket, &event) != 0)
+      MH_DBG("%s: epoll_ctl failed (errno %d)\n", __func__, errno);
+   else
+      client->backend_data = (void *) (uintptr_t) event.events;
+}
+
+/*! Closing isn't enough: a listening socket passed to another process stays registered */
+static void events_EpollStopAccepting(struct md_context *ctx)
+{
+   struct md_epoll *ep = (struct md_epoll *) ctx->backend_data;
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      if(epoll_ctl(ep->fd, EPOLL_CTL_DEL, ctx->listeners[idx].socket, NULL) != 0)
+         MH_DBG("%s: Failed to remove listening socket (errno %d)\n", __func__, errno);
+   }
+}
+
+#endif /* MICROHTTPD_HAVE_EPOLL */
@@ -0,0 +1,213 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file events_external.c
+ *  \brief microhttpd event backend for an application-owned event loop
+ *
+ *  Nothing here waits. Each descriptor the server needs watched is handed to the application's
+ *  watch handler along with the events of interest, which the handler registers with its own loop
+ *  (epoll, libuv, GLib...); the application passes whatever that loop reports back through
+ *  microhttpd_handle_event(). The interest is the same as the epoll backend's, so a parked client
+ *  isn't watched at all until it's resumed.
+ */
+#include <stdlib.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "events.h"
+#include "defer.h"
+#include "tx.h"
+
+#define MICROHTTPD_EXTERNAL_MIN_CLIENTS 64
+
+struct md_external
+{
+   struct md_client **clients; /* Indexed by socket */
+   uint32_t capacity;
+};
+
+static int events_ExternalInit(struct md_context *ctx);
+static void events_ExternalShutdown(struct md_context *ctx);
+static int events_ExternalProcess(struct md_context *ctx, uint32_t timeout_ms);
+static int events_ExternalAddClient(struct md_context *ctx, struct md_client *client);
+static void events_ExternalRemoveClient(struct md_context *ctx, struct md_client *client);
+static void events_ExternalUpdateClient(struct md_context *ctx, struct md_client *client);
+static void events_ExternalStopAccepting(struct md_context *ctx);
+static void events_ExternalWatch(struct md_context *ctx, int fd, uint32_t events);
+
+const struct md_event_backend md_events_external =
+{
+   "external",
+   events_ExternalInit,
+   events_ExternalShutdown,
+   events_ExternalProcess,
+   events_ExternalAddClient,
+   events_ExternalRemoveClient,
+   events_ExternalUpdateClient,
+   events_ExternalStopAccepting,
+   NULL
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Dispatch events the application's loop reported for a descriptor. Descriptors that are no
+ *  longer watched (closed earlier in the same iteration of that loop, say) are ignored. */
+void microhttpd_ExternalEvent(struct md_context *ctx, int fd, uint32_t events)
+{
+   struct md_external *ext = (struct md_external *) ctx->backend_data;
+   struct md_client *client;
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      if(ctx->listeners[idx].socket != fd)
+         continue;
+      /* Drain the accept queue */
+      for(int n = 0; n < MICROHTTPD_MAX_QUEUED_CONNECTIONS; ++n)
+      {
+         if(microhttpd_AcceptClient(ctx, &ctx->listeners[idx]) != 0)
+            break;
+      }
+      return;
+   }
+
+   if(fd >= 0 && fd == ctx->wake_fd[0])
+   {
+      microhttpd_WakeDrain(ctx); /* Completions are sent after this returns */
+      return;
+   }
+
+   if(fd < 0 || (uint32_t) fd >= ext->capacity || NULL == (client = ext->clients[fd]))
+      return;
+   if((events & MICROHTTPD_EVENT_WRITE) && microhttpd_HandleClientWritable(ctx, client) != 0)
+      return;
+   if(events & MICROHTTPD_EVENT_READ)
+      microhttpd_HandleClientReceive(ctx, client); /* Also detects hangup via a zero-length read */
+   else if(events & MICROHTTPD_EVENT_ERROR)
+      microhttpd_HandleClientError(ctx, client);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int events_ExternalInit(struct md_context *ctx)
+{
+   struct md_external *ext;
+
+   if(NULL == ctx->params.watch_handler)
+   {
+      MH_DBG("%s: No watch handler\n", __func__);
+      return -1;
+   }
+
+   ext = (struct md_external *) malloc(sizeof(*ext));
+   if(NULL == ext)
+      return -1;
+   ext->clients = NULL;
+   ext->capacity = 0;
+   ctx->backend_data = ext;
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+      events_ExternalWatch(ctx, ctx->listeners[idx].socket, MICROHTTPD_EVENT_READ);
+   if(ctx->wake_fd[0] >= 0)
+      events_ExternalWatch(ctx, ctx->wake_fd[0], MICROHTTPD_EVENT_READ); /* Completion wakeup */
+   return 0;
+}
+
+/*! Also called once a drain has finished, when the listeners are already gone */
+static void events_ExternalShutdown(struct md_context *ctx)
+{
+   struct md_external *ext = (struct md_external *) ctx->backend_data;
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+      events_ExternalWatch(ctx, ctx->listeners[idx].socket, 0);
+   if(ctx->wake_fd[0] >= 0)
+      events_ExternalWatch(ctx, ctx->wake_fd[0], 0);
+
+   free(ext->clients);
+   free(ext);
+   ctx->backend_data = NULL;
+}
+
+/*! The application's loop does the waiting */
+static int events_ExternalProcess(struct md_context *ctx, uint32_t timeout_ms)
+{
+   (void) ctx;
+   (void) timeout_ms;
+   MH_DBG("%s: Use microhttpd_handle_event() and microhttpd_handle_timers() instead\n", __func__);
+   return -1;
+}
+
+static int events_ExternalAddClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_external *ext = (struct md_external *) ctx->backend_data;
+
+   if(client->socket < 0)
+      return 0; /* Not socket-backed */
+
+   if((uint32_t) client->socket >= ext->capacity)
+   {
+      uint32_t capacity = MAX(ext->capacity * 2, MICROHTTPD_EXTERNAL_MIN_CLIENTS);
+      struct md_client **clients;
+
+      if(capacity <= (uint32_t) client->socket)
+         capacity = (uint32_t) client->socket + 1;
+      clients = (struct md_client **) realloc(ext->clients, capacity * sizeof(*clients));
+      if(NULL == clients)
+      {
+         MH_DBG("%s: Failed to grow client table to %"PRIu32" entries\n", __func__, capacity);
+         return -1;
+      }
+      for(uint32_t idx = ext->capacity; idx < capacity; ++idx)
+         clients[idx] = NULL;
+      ext->clients = clients;
+      ext->capacity = capacity;
+   }
+
+   ext->clients[client->socket] = client;
+   client->backend_data = (void *) (uintptr_t) MICROHTTPD_EVENT_READ; /* Current interest */
+   events_ExternalWatch(ctx, client->socket, MICROHTTPD_EVENT_READ);
+   return 0;
+}
+
+static void events_ExternalRemoveClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_external *ext = (struct md_external *) ctx->backend_data;
+
+   if(client->socket < 0 || (uint32_t) client->socket >= ext->capacity)
+      return;
+   ext->clients[client->socket] = NULL;
+   events_ExternalWatch(ctx, client->socket, 0); /* Before it's closed */
+}
+
+static void events_ExternalUpdateClient(struct md_context *ctx, struct md_client *client)
+{
+   uint32_t events;
+
+   if(client->socket < 0)
+      return;
+
+   /* Queued data is written right away; only what the socket can't take waits for writability */
+   events = (NULL != client->deferred || client->paused) ? 0 : MICROHTTPD_EVENT_READ;
+   if(client->tx_pending > 0 && microhttpd_TxFlush(client) != 0)
+      events |= MICROHTTPD_EVENT_WRITE;
+   if(events == (uint32_t) (uintptr_t) client->backend_data)
+      return;
+
+   client->backend_data = (void *) (uintptr_t) events;
+   events_ExternalWatch(ctx, client->socket, events);
+}
+
+static void events_ExternalStopAccepting(struct md_context *ctx)
+{
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+      events_ExternalWatch(ctx, ctx->listeners[idx].socket, 0);
+}
+
+static void events_ExternalWatch(struct md_context *ctx, int fd, uint32_t events)
+{
+   MH_DBG("%s: Descriptor %d, events 0x%02"PRIx32"\n", __func__, fd, events);
+   ctx->params.watch_handler(fd, events, ctx->params.watch_cookie);
+}
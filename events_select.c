@@ -0,0 +1,149 @@
+/*! \copyright 2018 - 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file events_select.c
+ *  \brief microhttpd select() event backend
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "events.h"
+#include "defer.h"
+#include "tx.h"
+
+static int events_SelectInit(struct md_context *ctx);
+static int events_SelectProcess(struct md_context *ctx, uint32_t timeout_ms);
+static void events_SelectUpdateClient(struct md_context *ctx, struct md_client *client);
+
+const struct md_event_backend md_events_select =
+{
+   "select",
+   events_SelectInit,
+   NULL,
+   events_SelectProcess,
+   NULL,
+   NULL,
+   events_SelectUpdateClient,
+   NULL,
+   NULL
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int events_SelectInit(struct md_context *ctx)
+{
+   return 0; /* Always available */
+}
+
+static int events_SelectProcess(struct md_context *ctx, uint32_t timeout_ms)
+{
+   int fd_max = -1, nResult;
+   uint32_t client_count = 0, idx;
+   fd_set fdRead;
+   fd_set fdWrite;
+   fd_set fdError;
+   struct md_client *client, **client_list;
+   struct timeval timeout, *pTimeout = NULL;
+
+   if(timeout_ms > 0)
+   {
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_usec = (timeout_ms % 1000) * 1000;
+      pTimeout = &timeout;
+   }
+   
+   FD_ZERO(&fdRead);
+   FD_ZERO(&fdWrite);
+   FD_ZERO(&fdError);
+   for(idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      FD_SET(ctx->listeners[idx].socket, &fdRead);
+      FD_SET(ctx->listeners[idx].socket, &fdError);
+      fd_max = MAX(fd_max, ctx->listeners[idx].socket);
+   }
+   if(ctx->wake_fd[0] >= 0)
+   {
+      FD_SET(ctx->wake_fd[0], &fdRead);
+      fd_max = MAX(fd_max, ctx->wake_fd[0]);
+   }
+   for(client = ctx->client_list; client != NULL; client = (struct md_client *) client->next)
+   {
+      fd_max = MAX(fd_max, client->socket);
+      if(NULL == client->deferred && !client->paused)
+         FD_SET(client->socket, &fdRead); /* Parked clients are only watched for errors */
+      if(client->tx_pending > 0)
+         FD_SET(client->socket, &fdWrite);
+      FD_SET(client->socket, &fdError);
+      ++client_count;
+   }
+
+   // Make a copy of the client list that was used to populate the upcoming select call. This
+   //  is necessary since the client list can change (shrink) as select events are processed.
+   client_list = (struct md_client **) malloc(sizeof(struct md_client *) * client_count);
+   client = ctx->client_list;
+   for(int i = 0; i < client_count; ++i)
+   {
+      client_list[i] = client;
+      client = client->next;
+   }
+
+   MH_DBG("%s: Waiting for %"PRIu32" clients\n", __func__, client_count);
+
+   nResult = select(fd_max + 1, &fdRead, &fdWrite, &fdError, pTimeout);
+   if(nResult == 0)
+   {
+      free(client_list);
+      return 0;  /* Nothing received within timeout */
+   }
+   if(nResult < 0)
+   {
+      MH_DBG("%s: select failed (errno %d)\n", __func__, errno);
+      // Go through the list of clients and prune any closed sockets
+      for(int i = 0; i < client_count; ++i)
+      {
+         if(fcntl(client_list[i]->socket, F_GETFD) != 0)
+            microhttpd_RemoveClient(ctx, client_list[i]);
+      }
+      free(client_list);
+      return -1;
+   }
+
+   if(ctx->wake_fd[0] >= 0 && FD_ISSET(ctx->wake_fd[0], &fdRead))
+      microhttpd_WakeDrain(ctx); /* Completions are sent after this returns */
+
+   /* First, process any data received from clients */
+   for(int i = 0; i < client_count; ++i)
+   {
+      client = client_list[i];
+      if(FD_ISSET(client->socket, &fdError))
+         microhttpd_HandleClientError(ctx, client);
+      else if(FD_ISSET(client->socket, &fdWrite) && microhttpd_HandleClientWritable(ctx, client) != 0)
+         continue;
+      else if(FD_ISSET(client->socket, &fdRead))
+         microhttpd_HandleClientReceive(ctx, client);
+   }
+   free(client_list);
+
+   /* Finally, accept any new clients */
+   for(idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      if(FD_ISSET(ctx->listeners[idx].socket, &fdRead))
+         microhttpd_AcceptClient(ctx, &ctx->listeners[idx]);
+   }
+
+   return 0; 
+}
+
+static void events_SelectUpdateClient(struct md_context *ctx, struct md_client *client)
+{
+   /* Write what the socket takes now; the rest (or an error) is picked up by the next select() */
+   if(client->tx_pending > 0)
+      microhttpd_TxFlush(client);
+}
@@ -0,0 +1,764 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file events_uring.c
+ *  \brief microhttpd io_uring event backend (Linux 6.0 or later)
+ *
+ *  Connections are accepted with one multishot accept per listener, and each client has one multishot
+ *  receive which draws from a ring of provided buffers, so idle clients hold no receive memory.
+ *  Responses written by handlers are queued on the client and submitted as one sendmsg per client,
+ *  together with all other pending work, in the io_uring_enter call that waits for completions.
+ *  Parked clients keep their receive armed; anything they send is buffered until they resume. A
+ *  paused client's receive is cancelled, and armed again once it's resumed.
+ */
+#include "events.h"
+#if defined(MICROHTTPD_HAVE_IO_URING)
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "tx.h"
+#include "defer.h"
+#include "trace.h"
+
+#if !defined(MICROHTTPD_URING_ENTRIES)
+#define MICROHTTPD_URING_ENTRIES     256
+#endif
+#if !defined(MICROHTTPD_URING_BUFFERS)
+#define MICROHTTPD_URING_BUFFERS     128  /* Provided receive buffers; must be a power of 2 */
+#endif
+#define MICROHTTPD_URING_BUFFER_GROUP 0
+#define MICROHTTPD_URING_MAX_IOV     16
+
+/* Operation tag, stored in the low bits of each request's user_data */
+#define URING_OP_ACCEPT  0
+#define URING_OP_RECV    1
+#define URING_OP_SEND    2
+#define URING_OP_WAKE    3
+#define URING_OP_MASK    3
+
+struct md_uring_conn
+{
+   struct md_client *client;  /* NULL once the client has been removed */
+   int fd;
+   bool recv_armed;
+   bool recv_cancelling; /* Paused; the multishot receive ends with -ECANCELED */
+   bool send_inflight;
+   bool dirty;
+   bool busy;  /* A completion for this connection is being handled */
+   struct md_uring_conn *next_dirty;
+
+   /* In-flight send */
+   struct msghdr msg;
+   struct iovec iov[MICROHTTPD_URING_MAX_IOV];
+
+   /* Queue inherited from a removed client whose send is still in flight */
+   struct md_tx_entry *orphan_head;
+};
+
+struct md_uring
+{
+   int fd;
+
+   /* Submission queue */
+   void *sq_ring;
+   size_t sq_ring_size;
+   unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+   unsigned sq_entries;
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+   unsigned to_submit;
+
+   /* Completion queue */
+   void *cq_ring;
+   size_t cq_ring_size;
+   unsigned *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_cqe *cqes;
+
+   /* Provided receive buffers */
+   struct io_uring_buf_ring *buf_ring;
+   size_t buf_ring_size;
+   char *buffers;
+   uint32_t buffer_size;
+   uint16_t buf_tail;
+
+   bool accept_armed[MICROHTTPD_MAX_LISTENERS];
+   bool wake_armed;
+   struct md_uring_conn *dirty;
+};
+
+static int events_UringInit(struct md_context *ctx);
+static void events_UringShutdown(struct md_context *ctx);
+static int events_UringProcess(struct md_context *ctx, uint32_t timeout_ms);
+static int events_UringAddClient(struct md_context *ctx, struct md_client *client);
+static void events_UringRemoveClient(struct md_context *ctx, struct md_client *client);
+static void events_UringUpdateClient(struct md_context *ctx, struct md_client *client);
+static void events_UringStopAccepting(struct md_context *ctx);
+
+static int32_t transport_UringRecv(struct md_client *client, void *buffer, uint32_t length);
+static int32_t transport_UringSend(struct md_client *client, const void *buffer, uint32_t length);
+static int32_t transport_UringWritev(struct md_client *client, const struct iovec *iov, uint32_t count);
+static void transport_UringClose(struct md_client *client);
+
+/* Clients accepted by the ring queue their output; the backend submits it */
+static const struct md_transport md_transport_uring =
+{
+   "io_uring",
+   transport_UringRecv,
+   transport_UringSend,
+   transport_UringWritev,
+   transport_UringClose,
+   NULL
+};
+
+/* Connections the server opens (to a proxy upstream) are driven by the ring the same way */
+const struct md_event_backend md_events_uring =
+{
+   "io_uring",
+   events_UringInit,
+   events_UringShutdown,
+   events_UringProcess,
+   events_UringAddClient,
+   events_UringRemoveClient,
+   events_UringUpdateClient,
+   events_UringStopAccepting,
+   &md_transport_uring
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Ring Helpers
+ */
+
+static int uring_Setup(unsigned entries, struct io_uring_params *p)
+{
+   return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_Enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+   size_t argsz)
+{
+   return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_Register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+   return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool uring_KernelSupported(void)
+{
+   struct utsname name;
+   unsigned major = 0, minor = 0;
+
+   if(uname(&name) != 0 || sscanf(name.release, "%u.%u", &major, &minor) != 2)
+      return false;
+   return major >= 6; /* Multishot receive and provided buffer rings */
+}
+
+static int uring_Submit(struct md_uring *ring, unsigned min_complete, struct timespec *timeout)
+{
+   struct io_uring_getevents_arg arg = {0};
+   unsigned flags = 0;
+   int result;
+
+   if(min_complete > 0)
+   {
+      flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      arg.ts = (uint64_t) (uintptr_t) timeout;
+   }
+
+   result = uring_Enter(ring->fd, ring->to_submit, min_complete, flags,
+      (min_complete > 0) ? &arg : NULL, (min_complete > 0) ? sizeof(arg) : 0);
+   if(result < 0)
+      return -errno;
+
+   ring->to_submit -= ((unsigned) result > ring->to_submit) ? ring->to_submit : (unsigned) result;
+   return result;
+}
+
+static struct io_uring_sqe *uring_GetSqe(struct md_uring *ring)
+{
+   unsigned head, tail;
+   struct io_uring_sqe *sqe;
+
+   tail = *ring->sq_tail;
+   head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+   if(tail - head >= ring->sq_entries)
+   {
+      /* Full; hand what we have to the kernel */
+      if(uring_Submit(ring, 0, NULL) < 0)
+         return NULL;
+      head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+      if(tail - head >= ring->sq_entries)
+         return NULL;
+   }
+
+   sqe = &ring->sqes[tail & *ring->sq_mask];
+   memset(sqe, 0, sizeof(*sqe));
+   atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1, memory_order_release);
+   ++(ring->to_submit);
+   return sqe;
+}
+
+static void uring_RecycleBuffer(struct md_uring *ring, uint16_t bid)
+{
+   struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (MICROHTTPD_URING_BUFFERS - 1)];
+
+   buf->addr = (uint64_t) (uintptr_t) &ring->buffers[(uint32_t) bid * ring->buffer_size];
+   buf->len = ring->buffer_size;
+   buf->bid = bid;
+   ++(ring->buf_tail);
+}
+
+static void uring_PublishBuffers(struct md_uring *ring)
+{
+   atomic_store_explicit((_Atomic uint16_t *) &ring->buf_ring->tail, ring->buf_tail, memory_order_release);
+}
+
+static bool uring_ArmAccept(struct md_context *ctx, struct md_uring *ring, uint32_t idx)
+{
+   struct io_uring_sqe *sqe = uring_GetSqe(ring);
+
+   if(NULL == sqe)
+      return false;
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = ctx->listeners[idx].socket;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_CLOEXEC;
+   sqe->user_data = (uint64_t) (uintptr_t) &ctx->listeners[idx] | URING_OP_ACCEPT;
+   ring->accept_armed[idx] = true;
+   return true;
+}
+
+static bool uring_ArmWake(struct md_context *ctx, struct md_uring *ring)
+{
+   struct io_uring_sqe *sqe = uring_GetSqe(ring);
+
+   if(NULL == sqe)
+      return false;
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = ctx->wake_fd[0];
+   sqe->poll32_events = POLLIN;
+   sqe->len = IORING_POLL_ADD_MULTI;
+   sqe->user_data = URING_OP_WAKE;
+   ring->wake_armed = true;
+   return true;
+}
+
+static bool uring_ArmRecv(struct md_uring *ring, struct md_uring_conn *conn)
+{
+   struct io_uring_sqe *sqe = uring_GetSqe(ring);
+
+   if(NULL == sqe)
+      return false;
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = conn->fd;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = MICROHTTPD_URING_BUFFER_GROUP;
+   sqe->user_data = (uint64_t) (uintptr_t) conn | URING_OP_RECV;
+   conn->recv_armed = true;
+   return true;
+}
+
+static bool uring_CancelRecv(struct md_uring *ring, struct md_uring_conn *conn)
+{
+   struct io_uring_sqe *sqe = uring_GetSqe(ring);
+
+   if(NULL == sqe)
+      return false;
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->addr = (uint64_t) (uintptr_t) conn | URING_OP_RECV;
+   sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+   sqe->user_data = URING_OP_RECV; /* No connection */
+   conn->recv_cancelling = true;
+   return true;
+}
+
+static bool uring_ArmSend(struct md_uring *ring, struct md_uring_conn *conn)
+{
+   struct io_uring_sqe *sqe;
+   uint32_t count;
+
+   count = microhttpd_TxFill(conn->client, conn->iov, MICROHTTPD_URING_MAX_IOV);
+   if(0 == count)
+      return true;
+
+   sqe = uring_GetSqe(ring);
+   if(NULL == sqe)
+      return false;
+   memset(&conn->msg, 0, sizeof(conn->msg));
+   conn->msg.msg_iov = conn->iov;
+   conn->msg.msg_iovlen = count;
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->fd = conn->fd;
+   sqe->addr = (uint64_t) (uintptr_t) &conn->msg;
+   sqe->len = 1;
+   sqe->msg_flags = MSG_NOSIGNAL;
+   sqe->user_data = (uint64_t) (uintptr_t) conn | URING_OP_SEND;
+   conn->send_inflight = true;
+   return true;
+}
+
+static void uring_MarkDirty(struct md_uring *ring, struct md_uring_conn *conn)
+{
+   if(conn->dirty)
+      return;
+   conn->dirty = true;
+   conn->next_dirty = ring->dirty;
+   ring->dirty = conn;
+}
+
+/* Release a connection once the client is gone and the kernel holds no more references to it */
+static void uring_ReleaseConn(struct md_uring_conn *conn)
+{
+   if(NULL != conn->client || conn->recv_armed || conn->send_inflight || conn->dirty || conn->busy)
+      return;
+
+   while(NULL != conn->orphan_head)
+   {
+      struct md_tx_entry *entry = conn->orphan_head;
+      conn->orphan_head = entry->next;
+      microhttpd_BufferRelease(entry->buffer);
+      free(entry);
+   }
+   close(conn->fd);
+   free(conn);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Completions
+ */
+
+static void uring_HandleAccept(struct md_context *ctx, struct md_uring *ring, struct md_listener *listener,
+   struct io_uring_cqe *cqe)
+{
+   int enable = 1;
+
+   if(NULL == listener)
+   {
+      MH_DBG("%s: Accept cancel failed (%d)\n", __func__, cqe->res); /* Only failures are reported */
+      return;
+   }
+   if(!(cqe->flags & IORING_CQE_F_MORE))
+      ring->accept_armed[listener - ctx->listeners] = false;
+
+   if(cqe->res < 0)
+   {
+      MH_DBG("%s: Accept failed (%d)\n", __func__, cqe->res);
+      return;
+   }
+
+   /* The peer address is only looked up if something asks for it */
+   if(!listener->local)
+      setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+   if(microhttpd_NewClient(ctx, cqe->res, NULL, 0, &md_transport_uring, NULL) != 0)
+      close(cqe->res);
+}
+
+static void uring_HandleRecv(struct md_context *ctx, struct md_uring *ring, struct md_uring_conn *conn,
+   struct io_uring_cqe *cqe)
+{
+   bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+   uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+   if(NULL == conn)
+   {
+      MH_DBG("%s: Receive cancel failed (%d)\n", __func__, cqe->res); /* It had already finished */
+      return;
+   }
+   if(!(cqe->flags & IORING_CQE_F_MORE))
+      conn->recv_armed = conn->recv_cancelling = false;
+
+   conn->busy = true;
+   if(NULL != conn->client)
+   {
+      if(cqe->res > 0 && has_buffer)
+      {
+         MH_TRACE(conn->client, READ, cqe->res);
+         microhttpd_HandleClientData(ctx, conn->client,
+            &ring->buffers[(uint32_t) bid * ring->buffer_size], cqe->res);
+      }
+      else if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+      {
+         MH_DBG("%s: Receive finished (%d)\n", __func__, cqe->res);
+         microhttpd_RemoveClient(ctx, conn->client); /* Orderly shutdown or error */
+      }
+   }
+
+   if(has_buffer)
+      uring_RecycleBuffer(ring, bid);
+
+   if(NULL != conn->client && !conn->recv_armed && !conn->client->paused)
+      uring_ArmRecv(ring, conn); /* Buffers ran out or the kernel ended the multishot request */
+   conn->busy = false;
+   uring_ReleaseConn(conn);
+}
+
+static void uring_HandleSend(struct md_context *ctx, struct md_uring *ring, struct md_uring_conn *conn,
+   struct io_uring_cqe *cqe)
+{
+   conn->send_inflight = false;
+
+   conn->busy = true;
+   if(NULL != conn->client)
+   {
+      if(cqe->res < 0)
+      {
+         MH_DBG("%s: Send failed (%d)\n", __func__, cqe->res);
+         microhttpd_RemoveClient(ctx, conn->client);
+      }
+      else
+      {
+         microhttpd_TxConsume(conn->client, cqe->res);
+         if(conn->client->tx_pending > 0)
+            uring_MarkDirty(ring, conn);
+         else
+            microhttpd_CloseIfSent(ctx, conn->client);
+      }
+   }
+   conn->busy = false;
+   uring_ReleaseConn(conn);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Backend
+ */
+
+static int events_UringInit(struct md_context *ctx)
+{
+   struct io_uring_params p;
+   struct io_uring_buf_reg reg;
+   struct md_uring *ring;
+   size_t cq_size;
+
+   if(NULL != ctx->tls)
+   {
+      MH_DBG("%s: TLS clients need the socket for OpenSSL\n", __func__); /* Received data bypasses the transport */
+      return -1;
+   }
+   if(!uring_KernelSupported())
+   {
+      MH_DBG("%s: Kernel too old for io_uring backend\n", __func__);
+      return -1;
+   }
+
+   ring = (struct md_uring *) malloc(sizeof(*ring));
+   if(NULL == ring)
+      return -1;
+   memset(ring, 0, sizeof(*ring));
+
+   memset(&p, 0, sizeof(p));
+   p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+   p.cq_entries = MICROHTTPD_URING_ENTRIES * 4;
+   ring->fd = uring_Setup(MICROHTTPD_URING_ENTRIES, &p);
+   if(ring->fd < 0)
+   {
+      MH_DBG("%s: io_uring_setup failed (errno %d)\n", __func__, errno);
+      free(ring);
+      return -1;
+   }
+   if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+   {
+      MH_DBG("%s: Required io_uring features unavailable\n", __func__);
+      close(ring->fd);
+      free(ring);
+      return -1;
+   }
+
+   /* Map submission and completion rings (a single mapping, given IORING_FEAT_SINGLE_MMAP) */
+   ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if(cq_size > ring->sq_ring_size)
+      ring->sq_ring_size = cq_size;
+   ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQ_RING);
+   ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQES);
+   if(MAP_FAILED == ring->sq_ring || MAP_FAILED == (void *) ring->sqes)
+   {
+      MH_DBG("%s: Failed to map rings\n", __func__);
+      if(MAP_FAILED != ring->sq_ring)
+         munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      free(ring);
+      return -1;
+   }
+   ring->cq_ring = ring->sq_ring;
+
+   ring->sq_head = (unsigned *) ((char *) ring->sq_ring + p.sq_off.head);
+   ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + p.sq_off.tail);
+   ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+   ring->sq_array = (unsigned *) ((char *) ring->sq_ring + p.sq_off.array);
+   ring->sq_entries = p.sq_entries;
+   for(unsigned i = 0; i < p.sq_entries; ++i)
+      ring->sq_array[i] = i;
+
+   ring->cq_head = (unsigned *) ((char *) ring->cq_ring + p.cq_off.head);
+   ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + p.cq_off.tail);
+   ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+
+   /* Provided buffer ring for multishot receive */
+   ring->buffer_size = ctx->params.rx_buffer_size;
+   ring->buf_ring_size = MICROHTTPD_URING_BUFFERS * sizeof(struct io_uring_buf);
+   ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   ring->buffers = malloc((size_t) MICROHTTPD_URING_BUFFERS * ring->buffer_size);
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+   reg.ring_entries = MICROHTTPD_URING_BUFFERS;
+   reg.bgid = MICROHTTPD_URING_BUFFER_GROUP;
+   if(MAP_FAILED == (void *) ring->buf_ring || NULL == ring->buffers
+   || uring_Register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+   {
+      MH_DBG("%s: Failed to register provided buffer ring\n", __func__);
+      if(MAP_FAILED != (void *) ring->buf_ring)
+         munmap(ring->buf_ring, ring->buf_ring_size);
+      free(ring->buffers);
+      munmap(ring->sqes, ring->sqes_size);
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      free(ring);
+      return -1;
+   }
+   for(uint16_t bid = 0; bid < MICROHTTPD_URING_BUFFERS; ++bid)
+      uring_RecycleBuffer(ring, bid);
+   uring_PublishBuffers(ring);
+
+   ctx->backend_data = ring;
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      if(!uring_ArmAccept(ctx, ring, idx))
+      {
+         events_UringShutdown(ctx);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+static void events_UringShutdown(struct md_context *ctx)
+{
+   struct md_uring *ring = (struct md_uring *) ctx->backend_data;
+
+   /* Closing the ring cancels all outstanding requests */
+   munmap(ring->buf_ring, ring->buf_ring_size);
+   free(ring->buffers);
+   munmap(ring->sqes, ring->sqes_size);
+   munmap(ring->sq_ring, ring->sq_ring_size);
+   close(ring->fd);
+   free(ring);
+   ctx->backend_data = NULL;
+}
+
+static int events_UringProcess(struct md_context *ctx, uint32_t timeout_ms)
+{
+   struct md_uring *ring = (struct md_uring *) ctx->backend_data;
+   struct timespec timeout, *pTimeout = NULL;
+   unsigned head, tail;
+   int result;
+
+   /* Queue sends for every client that produced output since the last pass */
+   while(NULL != ring->dirty)
+   {
+      struct md_uring_conn *conn = ring->dirty;
+      ring->dirty = conn->next_dirty;
+      conn->dirty = false;
+      if(NULL != conn->client && !conn->send_inflight)
+         uring_ArmSend(ring, conn);
+      uring_ReleaseConn(conn);
+   }
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      if(!ring->accept_armed[idx])
+         uring_ArmAccept(ctx, ring, idx);
+   }
+   if(!ring->wake_armed && ctx->wake_fd[0] >= 0)
+      uring_ArmWake(ctx, ring);
+
+   if(timeout_ms > 0)
+   {
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      pTimeout = &timeout;
+   }
+
+   /* Submit everything and wait, in one system call */
+   result = uring_Submit(ring, 1, pTimeout);
+   if(result < 0 && result != -ETIME && result != -EINTR && result != -EBUSY)
+   {
+      MH_DBG("%s: io_uring_enter failed (%d)\n", __func__, result);
+      return -1;
+   }
+
+   head = *ring->cq_head;
+   tail = atomic_load_explicit((_Atomic unsigned *) ring->cq_tail, memory_order_acquire);
+   while(head != tail)
+   {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      struct md_uring_conn *conn = (struct md_uring_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+
+      switch(cqe->user_data & URING_OP_MASK)
+      {
+         case URING_OP_ACCEPT:
+            uring_HandleAccept(ctx, ring,
+               (struct md_listener *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK), cqe);
+            break;
+         case URING_OP_RECV:
+            uring_HandleRecv(ctx, ring, conn, cqe);
+            break;
+         case URING_OP_SEND:
+            uring_HandleSend(ctx, ring, conn, cqe);
+            break;
+         case URING_OP_WAKE:
+            if(!(cqe->flags & IORING_CQE_F_MORE))
+               ring->wake_armed = false;
+            microhttpd_WakeDrain(ctx); /* Completions are sent after this returns */
+            break;
+         default:
+            break;
+      }
+
+      ++head;
+      atomic_store_explicit((_Atomic unsigned *) ring->cq_head, head, memory_order_release);
+      tail = atomic_load_explicit((_Atomic unsigned *) ring->cq_tail, memory_order_acquire);
+   }
+   uring_PublishBuffers(ring);
+
+   return 0;
+}
+
+static int events_UringAddClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_uring *ring = (struct md_uring *) ctx->backend_data;
+   struct md_uring_conn *conn;
+
+   if(client->transport != &md_transport_uring)
+      return 0; /* Not accepted by the ring */
+
+   conn = (struct md_uring_conn *) malloc(sizeof(*conn));
+   if(NULL == conn)
+      return -1;
+   memset(conn, 0, sizeof(*conn));
+   conn->client = client;
+   conn->fd = client->socket;
+   if(!uring_ArmRecv(ring, conn))
+   {
+      free(conn);
+      return -1;
+   }
+   client->backend_data = conn;
+   return 0;
+}
+
+static void events_UringRemoveClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_uring_conn *conn = (struct md_uring_conn *) client->backend_data;
+
+   if(NULL == conn)
+      return;
+
+   if(conn->send_inflight)
+   {
+      /* The kernel is still reading from the queued buffers; keep them until it's done */
+      conn->orphan_head = client->tx_head;
+      client->tx_head = client->tx_tail = NULL;
+      client->tx_pending = 0;
+   }
+   if(conn->recv_armed || conn->send_inflight)
+      shutdown(conn->fd, SHUT_RDWR); /* Completes the outstanding requests */
+
+   conn->client = NULL;
+   client->backend_data = NULL;
+   client->socket = -1; /* The connection closes the descriptor */
+   uring_ReleaseConn(conn);
+}
+
+static void events_UringUpdateClient(struct md_context *ctx, struct md_client *client)
+{
+   struct md_uring *ring = (struct md_uring *) ctx->backend_data;
+   struct md_uring_conn *conn = (struct md_uring_conn *) client->backend_data;
+
+   if(NULL == conn)
+      return;
+   if(client->paused && conn->recv_armed && !conn->recv_cancelling)
+      uring_CancelRecv(ring, conn);
+   else if(!client->paused && !conn->recv_armed)
+      uring_ArmRecv(ring, conn);
+
+   /* Data queued directly on the client (e.g. a shared broadcast buffer) goes out with the next submit */
+   if(client->tx_pending > 0)
+      uring_MarkDirty(ring, conn);
+}
+
+/*! Cancel the multishot accepts; the ring holds its own reference to each listening socket, so
+ *  closing them wouldn't */
+static void events_UringStopAccepting(struct md_context *ctx)
+{
+   struct md_uring *ring = (struct md_uring *) ctx->backend_data;
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      struct io_uring_sqe *sqe;
+
+      if(!ring->accept_armed[idx] || NULL == (sqe = uring_GetSqe(ring)))
+         continue;
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uint64_t) (uintptr_t) &ctx->listeners[idx] | URING_OP_ACCEPT;
+      sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+      sqe->user_data = URING_OP_ACCEPT; /* No listener */
+   }
+   if(uring_Submit(ring, 0, NULL) < 0)
+      MH_DBG("%s: Failed to submit accept cancellation\n", __func__);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Transport
+ */
+
+static int32_t transport_UringRecv(struct md_client *client, void *buffer, uint32_t length)
+{
+   return -1; /* Received data is delivered by the ring */
+}
+
+static int32_t transport_UringSend(struct md_client *client, const void *buffer, uint32_t length)
+{
+   struct iovec iov = { (void *) buffer, length };
+   return transport_UringWritev(client, &iov, 1);
+}
+
+static int32_t transport_UringWritev(struct md_client *client, const struct iovec *iov, uint32_t count)
+{
+   struct md_uring_conn *conn = (struct md_uring_conn *) client->backend_data;
+   int32_t total = 0;
+
+   if(NULL == conn)
+      return -1;
+
+   for(uint32_t i = 0; i < count; ++i)
+   {
+      if(!microhttpd_TxQueueCopy(client, iov[i].iov_base, iov[i].iov_len))
+         return -1;
+      total += iov[i].iov_len;
+   }
+   uring_MarkDirty((struct md_uring *) client->ctx->backend_data, conn);
+   return total;
+}
+
+static void transport_UringClose(struct md_client *client)
+{
+   /* Descriptor is closed by the backend once outstanding requests complete */
+}
+
+#endif /* MICROHTTPD_HAVE_IO_URING */
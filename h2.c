@@ -0,0 +1,1613 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file h2.c
+ *  \brief microhttpd cleartext HTTP/2 (RFC 9113)
+ *
+ *  With params.http2 set, a connection on a non-TLS listener switches to HTTP/2 when it opens with
+ *  the connection preface (prior knowledge) or asks for it with "Upgrade: h2c". Its state machine
+ *  then reads frames. Each stream gets a client of its own, kept off the client list, which is fed
+ *  its request as HTTP/1.1 text rebuilt from the header block, followed by the stream's DATA; it
+ *  runs the usual states and handlers. Its transport turns the HTTP/1.1 response they send into
+ *  HEADERS and DATA frames on the connection, holding DATA back while the peer's flow-control
+ *  windows are closed. Server push and priorities aren't implemented, and response headers are
+ *  never Huffman-coded.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "h2.h"
+#include "trace.h"
+
+#define H2_PREFACE             "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH      24
+#define H2_PREFACE_LINE_LENGTH 14      /* "PRI * HTTP/2.0", as the HTTP/1.1 parser sees it */
+#define H2_FRAME_HEADER        9
+#define H2_FRAME_SIZE          16384   /* Largest frame sent or accepted */
+#define H2_DEFAULT_WINDOW      65535
+#define H2_MAX_WINDOW          0x7fffffff
+#define H2_MAX_SETTINGS        16      /* In an HTTP2-Settings header */
+
+/* Frame types */
+#define H2_DATA                0x0
+#define H2_HEADERS             0x1
+#define H2_PRIORITY            0x2
+#define H2_RST_STREAM          0x3
+#define H2_SETTINGS            0x4
+#define H2_PUSH_PROMISE        0x5
+#define H2_PING                0x6
+#define H2_GOAWAY              0x7
+#define H2_WINDOW_UPDATE       0x8
+#define H2_CONTINUATION        0x9
+
+/* Frame flags */
+#define H2_FLAG_END_STREAM     0x01
+#define H2_FLAG_ACK            0x01
+#define H2_FLAG_END_HEADERS    0x04
+#define H2_FLAG_PADDED         0x08
+#define H2_FLAG_PRIORITY       0x20
+
+/* Error codes */
+#define H2_NO_ERROR            0x0
+#define H2_PROTOCOL_ERROR      0x1
+#define H2_INTERNAL_ERROR      0x2
+#define H2_FLOW_CONTROL_ERROR  0x3
+#define H2_STREAM_CLOSED       0x5
+#define H2_FRAME_SIZE_ERROR    0x6
+#define H2_REFUSED_STREAM      0x7
+#define H2_COMPRESSION_ERROR   0x9
+#define H2_ENHANCE_YOUR_CALM   0xb
+
+/* Settings */
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+
+static const char UPGRADE_RESPONSE[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                       "Connection: Upgrade\r\n"
+                                       "Upgrade: h2c\r\n"
+                                       "\r\n";
+
+/* Only meaningful to a single HTTP/1.1 connection: a request carrying one is malformed, and
+ *  they're left out of responses */
+static const char *const CONNECTION_FIELDS[] =
+{
+   "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"
+};
+
+/*! Request rebuilt as HTTP/1.1 text while its header block is decoded */
+struct md_h2_request
+{
+   char *text;
+   uint32_t length, capacity;
+   char *method, *path, *authority;
+   char *cookie;            /* Cookie fields, joined with "; " */
+   uint32_t cookie_length;
+   bool line_written;       /* Request line written; no more pseudo-header fields */
+   bool malformed;
+   bool failed;             /* Out of memory, or too large */
+};
+
+static bool state_H2Preface(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_H2Frame(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_H2Payload(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_H2Data(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_H2Closing(struct md_client *client, uint32_t *consumed, bool *error);
+static bool microhttpd_H2Enabled(struct md_client *client);
+static struct md_h2 *microhttpd_H2Start(struct md_client *client);
+static bool microhttpd_H2HandleFrame(struct md_client *client, uint8_t type, uint8_t flags, uint32_t stream_id,
+   const uint8_t *payload, uint32_t length);
+static bool microhttpd_H2Headers(struct md_client *client, uint8_t flags, uint32_t stream_id,
+   const uint8_t *payload, uint32_t length);
+static bool microhttpd_H2Continuation(struct md_client *client, uint8_t flags, const uint8_t *payload,
+   uint32_t length);
+static bool microhttpd_H2HeaderBlock(struct md_client *client, uint32_t stream_id, bool end_stream,
+   const uint8_t *block, uint32_t length);
+static uint32_t microhttpd_H2Settings(struct md_h2 *h2, const uint8_t *payload, uint32_t length);
+static bool microhttpd_H2WindowUpdate(struct md_client *client, uint32_t stream_id, const uint8_t *payload);
+static void microhttpd_H2Received(struct md_h2 *h2, uint32_t stream_id, uint32_t length, bool end_stream);
+static bool microhttpd_H2Fail(struct md_client *client, uint32_t code);
+static void microhttpd_H2RequestField(void *cookie, const char *name, uint32_t name_length, const char *value,
+   uint32_t value_length);
+static void microhttpd_H2IgnoreField(void *cookie, const char *name, uint32_t name_length, const char *value,
+   uint32_t value_length);
+static bool microhttpd_H2RequestLine(struct md_h2_request *request);
+static bool microhttpd_H2RequestEnd(struct md_h2_request *request);
+static bool microhttpd_H2RequestAppend(struct md_h2_request *request, const char *data, uint32_t length);
+static void microhttpd_H2RequestFree(struct md_h2_request *request);
+static bool microhttpd_H2UpgradeRequest(struct md_client *client, struct md_h2_request *request);
+static bool microhttpd_H2ConnectionField(const char *name, uint32_t name_length);
+static struct md_h2_stream *microhttpd_H2StreamOpen(struct md_client *connection, uint32_t id);
+static struct md_h2_stream *microhttpd_H2StreamFind(struct md_h2 *h2, uint32_t id);
+static void microhttpd_H2StreamDispatch(struct md_h2_stream *stream, char *data, uint32_t length);
+static void microhttpd_H2StreamCheck(struct md_h2_stream *stream);
+static void microhttpd_H2RemoteClosed(struct md_h2_stream *stream);
+static void microhttpd_H2StreamAbort(struct md_h2_stream *stream, uint32_t code, bool send);
+static void microhttpd_H2StreamReset(struct md_h2_stream *stream, uint32_t code, bool send);
+static void microhttpd_H2StreamRelease(struct md_h2_stream *stream);
+static bool microhttpd_H2Output(struct md_h2_stream *stream, const char *data, uint32_t length);
+static bool microhttpd_H2ResponseHeader(struct md_h2_stream *stream, const char *data, uint32_t length,
+   uint32_t *used);
+static const char *microhttpd_H2HeaderEnd(const char *data, uint32_t length);
+static bool microhttpd_H2SendHeaders(struct md_h2_stream *stream, const char *text, uint32_t length);
+static bool microhttpd_H2Data(struct md_h2_stream *stream, const char *data, uint32_t length, bool end);
+static int32_t microhttpd_H2DataSend(struct md_h2_stream *stream, const char *data, uint32_t length, bool end);
+static void microhttpd_H2Flush(struct md_h2_stream *stream);
+static void microhttpd_H2FlushAll(struct md_h2 *h2);
+static bool microhttpd_H2SendFrame(struct md_h2 *h2, uint8_t type, uint8_t flags, uint32_t stream_id,
+   const void *payload, uint32_t length);
+static bool microhttpd_H2SendSettings(struct md_h2 *h2);
+static void microhttpd_H2SendRst(struct md_h2 *h2, uint32_t stream_id, uint32_t code);
+static void microhttpd_H2SendWindowUpdate(struct md_h2 *h2, uint32_t stream_id, uint32_t increment);
+static void microhttpd_H2SendGoAway(struct md_h2 *h2, uint32_t code);
+static int32_t microhttpd_Base64UrlDecode(const char *in, uint8_t *out, uint32_t max);
+static uint32_t microhttpd_H2Get32(const uint8_t *in);
+static void microhttpd_H2Put32(uint8_t *out, uint32_t value);
+
+static int32_t transport_H2Recv(struct md_client *client, void *buffer, uint32_t length);
+static int32_t transport_H2Send(struct md_client *client, const void *buffer, uint32_t length);
+static int32_t transport_H2Writev(struct md_client *client, const struct iovec *iov, uint32_t count);
+static void transport_H2Close(struct md_client *client);
+
+const struct md_transport md_transport_h2 =
+{
+   "h2",
+   transport_H2Recv,
+   transport_H2Send,
+   transport_H2Writev,
+   transport_H2Close,
+   NULL
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Called with the first line of a request, before it's stored. Returns true if it starts the
+ *  HTTP/2 connection preface, the connection having switched to HTTP/2. */
+bool microhttpd_H2PriorKnowledge(struct md_client *client, uint32_t line_length)
+{
+   if(H2_PREFACE_LINE_LENGTH != line_length || !microhttpd_H2Enabled(client)
+   || memcmp(client->rx_buffer, H2_PREFACE, H2_PREFACE_LINE_LENGTH) != 0)
+      return false;
+   if(NULL == microhttpd_H2Start(client))
+      return false;
+   MH_DBG("%s: HTTP/2 with prior knowledge\n", __func__);
+   client->state = state_H2Preface;
+   return true;
+}
+
+/*! Called once a request's header is complete. Returns true if it asked to upgrade to h2c and the
+ *  connection has switched to HTTP/2, the request having become stream 1. */
+bool microhttpd_H2Upgrade(struct md_client *client)
+{
+   const char *upgrade = microhttpd_HeaderValue(client, "upgrade");
+   const char *settings = microhttpd_HeaderValue(client, "http2-settings");
+   const char *content_length = microhttpd_HeaderValue(client, "content-length");
+   uint8_t payload[H2_MAX_SETTINGS * 6];
+   struct md_h2_request request;
+   struct md_h2_stream *stream;
+   struct md_h2 *h2;
+   struct iovec iov;
+   int32_t length;
+
+   /* A request with a body is answered over HTTP/1.1 instead */
+   if(!microhttpd_H2Enabled(client) || NULL == upgrade || !string_has_token(upgrade, "h2c")
+   || NULL == settings || (NULL != content_length && 0 != strtoul(content_length, NULL, 10))
+   || NULL != microhttpd_HeaderValue(client, "transfer-encoding"))
+      return false;
+   length = microhttpd_Base64UrlDecode(settings, payload, sizeof(payload));
+   if(length < 0 || 0 != length % 6)
+   {
+      MH_DBG("%s: Invalid HTTP2-Settings\n", __func__);
+      return false;
+   }
+
+   memset(&request, 0, sizeof(request));
+   if(!microhttpd_H2UpgradeRequest(client, &request))
+   {
+      microhttpd_H2RequestFree(&request);
+      return false;
+   }
+   h2 = microhttpd_H2Start(client);
+   if(NULL == h2)
+   {
+      microhttpd_H2RequestFree(&request);
+      return false;
+   }
+   if(microhttpd_H2Settings(h2, payload, length) != H2_NO_ERROR)
+   {
+      MH_DBG("%s: Invalid HTTP2-Settings\n", __func__);
+      microhttpd_H2Removed(client);
+      microhttpd_H2RequestFree(&request);
+      return false;
+   }
+
+   MH_DBG("%s: Upgrading to h2c\n", __func__);
+   iov.iov_base = (void *) UPGRADE_RESPONSE;
+   iov.iov_len = sizeof(UPGRADE_RESPONSE) - 1;
+   if(microhttpd_ClientSend(client, &iov, 1) < 0)
+      MH_DBG("%s: Failed to send response\n", __func__);
+   microhttpd_H2SendSettings(h2);
+   microhttpd_ResetState(client);
+   client->state = state_H2Preface;
+
+   /* The request is stream 1, already half-closed */
+   h2->last_stream_id = 1;
+   stream = microhttpd_H2StreamOpen(client, 1);
+   if(NULL == stream)
+      microhttpd_H2Fail(client, H2_INTERNAL_ERROR);
+   else
+   {
+      stream->remote_closed = true;
+      ++(client->pipeline_count);
+      microhttpd_H2StreamDispatch(stream, request.text, request.length);
+   }
+   microhttpd_H2RequestFree(&request);
+   return true;
+}
+
+/*! A stream's request has been handled; anything more it's given is ignored */
+bool state_H2StreamDone(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   *consumed = client->rx_size;
+   return false;
+}
+
+/*! Called as a connection is removed: its streams are reset and their clients removed */
+void microhttpd_H2Removed(struct md_client *client)
+{
+   struct md_h2 *h2 = client->h2;
+
+   if(NULL == h2)
+      return;
+   h2->client = NULL; /* Nothing more can be sent */
+   client->h2 = NULL;
+   while(NULL != h2->streams)
+      microhttpd_H2StreamReset(h2->streams, H2_NO_ERROR, false);
+
+   free(h2->frame);
+   free(h2->block);
+   microhttpd_HpackFree(&h2->decoder);
+   microhttpd_HpackFree(&h2->encoder);
+   free(h2);
+}
+
+/*! Refuse new streams, letting those in progress finish */
+void microhttpd_H2GoAway(struct md_client *client)
+{
+   if(NULL != client->h2 && !client->h2->goaway_sent)
+      microhttpd_H2SendGoAway(client->h2, H2_NO_ERROR);
+}
+
+/*! Streams are in progress */
+bool microhttpd_H2Busy(struct md_client *client)
+{
+   return NULL != client->h2 && client->h2->stream_count > 0;
+}
+
+/*! The connection a stream's request arrived on; any other client is its own connection */
+struct md_client *microhttpd_H2Connection(struct md_client *client)
+{
+   if(NULL != client->stream && NULL != client->stream->h2->client)
+      return client->stream->h2->client;
+   return client;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * States
+ */
+
+static bool state_H2Preface(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_h2 *h2 = client->h2;
+
+   MH_TRACE(client, STATE_H2_PREFACE, client->rx_size);
+   if(client->rx_size < H2_PREFACE_LENGTH)
+      return false;
+   if(memcmp(client->rx_buffer, H2_PREFACE, H2_PREFACE_LENGTH) != 0)
+   {
+      MH_DBG("%s: Invalid connection preface\n", __func__);
+      *error = true;
+      return false;
+   }
+   *consumed = H2_PREFACE_LENGTH;
+   if(!h2->settings_sent && !microhttpd_H2SendSettings(h2))
+   {
+      *error = true;
+      return false;
+   }
+   client->state = state_H2Frame;
+   return true;
+}
+
+static bool state_H2Frame(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_h2 *h2 = client->h2;
+   const uint8_t *rx = (const uint8_t *) client->rx_buffer;
+   uint32_t length, stream_id, header = H2_FRAME_HEADER;
+   uint8_t type, flags;
+
+   MH_TRACE(client, STATE_H2_FRAME, client->rx_size);
+   if(client->rx_size < H2_FRAME_HEADER)
+      return false;
+   length = ((uint32_t) rx[0] << 16) | ((uint32_t) rx[1] << 8) | rx[2];
+   type = rx[3];
+   flags = rx[4];
+   stream_id = microhttpd_H2Get32(&rx[5]) & H2_MAX_WINDOW;
+
+   if(length > H2_FRAME_SIZE)
+      return microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+   if(0 != h2->block_stream && (H2_CONTINUATION != type || stream_id != h2->block_stream))
+      return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR); /* Nothing may interrupt a header block */
+
+   if(H2_DATA == type)
+   {
+      /* Passed to the stream as it arrives */
+      if(0 == stream_id || stream_id > h2->last_stream_id)
+         return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+      h2->data_padding = 0;
+      if(flags & H2_FLAG_PADDED)
+      {
+         if(client->rx_size <= H2_FRAME_HEADER)
+            return false;
+         h2->data_padding = rx[H2_FRAME_HEADER];
+         if(h2->data_padding >= length)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         ++header;
+      }
+      h2->data_stream = stream_id;
+      h2->data_remaining = length - (header - H2_FRAME_HEADER) - h2->data_padding;
+      h2->data_end = (flags & H2_FLAG_END_STREAM) != 0;
+      microhttpd_H2Received(h2, stream_id, length, h2->data_end);
+      *consumed = header;
+      client->state = state_H2Data;
+      return true;
+   }
+
+   if(H2_FRAME_HEADER + length > client->rx_size)
+   {
+      if(H2_FRAME_HEADER + length <= client->rx_buffer_size)
+         return false; /* Handled in place once it's all here */
+
+      /* Larger than the receive buffer; collect it separately */
+      h2->frame = (uint8_t *) malloc(length);
+      if(NULL == h2->frame)
+      {
+         MH_DBG("%s: Failed to allocate %"PRIu32" byte frame\n", __func__, length);
+         *error = true;
+         return false;
+      }
+      h2->frame_length = length;
+      h2->frame_received = 0;
+      h2->frame_type = type;
+      h2->frame_flags = flags;
+      h2->frame_stream = stream_id;
+      *consumed = H2_FRAME_HEADER;
+      client->state = state_H2Payload;
+      return true;
+   }
+
+   *consumed = H2_FRAME_HEADER + length;
+   return microhttpd_H2HandleFrame(client, type, flags, stream_id, &rx[H2_FRAME_HEADER], length);
+}
+
+static bool state_H2Payload(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_h2 *h2 = client->h2;
+   uint32_t chunk = h2->frame_length - h2->frame_received;
+   bool result;
+
+   if(chunk > client->rx_size)
+      chunk = client->rx_size;
+   if(0 == chunk)
+      return false;
+   memcpy(&h2->frame[h2->frame_received], client->rx_buffer, chunk);
+   h2->frame_received += chunk;
+   *consumed = chunk;
+   if(h2->frame_received < h2->frame_length)
+      return true;
+
+   client->state = state_H2Frame;
+   result = microhttpd_H2HandleFrame(client, h2->frame_type, h2->frame_flags, h2->frame_stream, h2->frame,
+      h2->frame_length);
+   free(h2->frame);
+   h2->frame = NULL;
+   return result;
+}
+
+static bool state_H2Data(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_h2 *h2 = client->h2;
+   struct md_h2_stream *stream;
+   uint32_t chunk;
+
+   MH_TRACE(client, STATE_H2_DATA, client->rx_size);
+   if(h2->data_remaining > 0)
+   {
+      chunk = (client->rx_size < h2->data_remaining) ? client->rx_size : h2->data_remaining;
+      if(0 == chunk)
+         return false;
+
+      /* The stream may have been reset since the last chunk */
+      stream = microhttpd_H2StreamFind(h2, h2->data_stream);
+      if(NULL != stream && NULL != stream->client && !stream->remote_closed
+      && microhttpd_HandleClientData(client->ctx, stream->client, client->rx_buffer, chunk) == 0)
+         microhttpd_H2StreamCheck(stream);
+      h2->data_remaining -= chunk;
+      *consumed = chunk;
+      return true;
+   }
+   if(h2->data_padding > 0)
+   {
+      chunk = (client->rx_size < h2->data_padding) ? client->rx_size : h2->data_padding;
+      if(0 == chunk)
+         return false;
+      h2->data_padding -= chunk;
+      *consumed = chunk;
+      return true;
+   }
+
+   client->state = state_H2Frame;
+   stream = microhttpd_H2StreamFind(h2, h2->data_stream);
+   if(NULL != stream && h2->data_end)
+      microhttpd_H2RemoteClosed(stream);
+   return true;
+}
+
+/*! GOAWAY has been sent for a connection error; everything else received is discarded */
+static bool state_H2Closing(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_H2_CLOSING, client->rx_size);
+   *consumed = client->rx_size;
+   return false;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static bool microhttpd_H2Enabled(struct md_client *client)
+{
+#if defined(MICROHTTPD_TLS)
+   if(client->transport == &md_transport_tls)
+      return false; /* HTTP/2 over TLS is negotiated with ALPN instead */
+#endif
+   return client->ctx->params.http2 && NULL == client->h2 && NULL == client->stream
+       && NULL == client->websocket && NULL == client->channel;
+}
+
+static struct md_h2 *microhttpd_H2Start(struct md_client *client)
+{
+   struct md_h2 *h2 = (struct md_h2 *) malloc(sizeof(*h2));
+
+   if(NULL == h2)
+   {
+      MH_DBG("%s: Failed to allocate connection\n", __func__);
+      return NULL;
+   }
+   memset(h2, 0, sizeof(*h2));
+   h2->client = client;
+   microhttpd_HpackInit(&h2->decoder, MICROHTTPD_HPACK_TABLE_SIZE);
+   microhttpd_HpackInit(&h2->encoder, MICROHTTPD_HPACK_TABLE_SIZE);
+   h2->max_streams = (client->ctx->params.http2_max_streams > 0) ?
+      client->ctx->params.http2_max_streams : MICROHTTPD_H2_DEFAULT_MAX_STREAMS;
+   h2->send_window = H2_DEFAULT_WINDOW;
+   h2->initial_window = H2_DEFAULT_WINDOW;
+   client->h2 = h2;
+   return h2;
+}
+
+/*! Handle a complete frame other than DATA. Returns the state machine's continue flag. */
+static bool microhttpd_H2HandleFrame(struct md_client *client, uint8_t type, uint8_t flags, uint32_t stream_id,
+   const uint8_t *payload, uint32_t length)
+{
+   struct md_h2 *h2 = client->h2;
+   struct md_h2_stream *stream;
+   uint32_t code;
+
+   switch(type)
+   {
+      case H2_HEADERS:
+         return microhttpd_H2Headers(client, flags, stream_id, payload, length);
+
+      case H2_CONTINUATION:
+         if(0 == h2->block_stream)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         return microhttpd_H2Continuation(client, flags, payload, length);
+
+      case H2_PRIORITY:
+         if(0 == stream_id)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         return true; /* Streams are served in the order they arrive */
+
+      case H2_RST_STREAM:
+         if(0 == stream_id || stream_id > h2->last_stream_id)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         if(4 != length)
+            return microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+         MH_DBG("%s: Stream %"PRIu32" reset (%"PRIu32")\n", __func__, stream_id, microhttpd_H2Get32(payload));
+         stream = microhttpd_H2StreamFind(h2, stream_id);
+         if(NULL != stream)
+            microhttpd_H2StreamReset(stream, H2_NO_ERROR, false);
+         return true;
+
+      case H2_SETTINGS:
+         if(0 != stream_id)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         if(flags & H2_FLAG_ACK)
+            return (0 == length) ? true : microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+         if(0 != length % 6)
+            return microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+         code = microhttpd_H2Settings(h2, payload, length);
+         if(H2_NO_ERROR != code)
+            return microhttpd_H2Fail(client, code);
+         microhttpd_H2SendFrame(h2, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+         microhttpd_H2FlushAll(h2); /* The initial window may have grown */
+         return true;
+
+      case H2_PUSH_PROMISE:
+         return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR); /* Clients can't push */
+
+      case H2_PING:
+         if(0 != stream_id)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         if(8 != length)
+            return microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+         if(!(flags & H2_FLAG_ACK))
+            microhttpd_H2SendFrame(h2, H2_PING, H2_FLAG_ACK, 0, payload, length);
+         return true;
+
+      case H2_GOAWAY:
+         if(0 != stream_id)
+            return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+         MH_DBG("%s: Peer going away\n", __func__);
+         return true; /* Streams in progress finish; the peer closes the connection */
+
+      case H2_WINDOW_UPDATE:
+         if(4 != length)
+            return microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+         return microhttpd_H2WindowUpdate(client, stream_id, payload);
+
+      default:
+         return true; /* Unknown frame types are ignored */
+   }
+}
+
+static bool microhttpd_H2Headers(struct md_client *client, uint8_t flags, uint32_t stream_id,
+   const uint8_t *payload, uint32_t length)
+{
+   struct md_h2 *h2 = client->h2;
+   uint32_t offset = 0, padding = 0;
+
+   if(0 == stream_id || 0 == (stream_id & 1))
+      return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+   if(flags & H2_FLAG_PADDED)
+   {
+      if(0 == length)
+         return microhttpd_H2Fail(client, H2_FRAME_SIZE_ERROR);
+      padding = payload[0];
+      offset = 1;
+   }
+   if(flags & H2_FLAG_PRIORITY)
+      offset += 5;
+   if(offset + padding > length)
+      return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+   payload += offset;
+   length -= offset + padding;
+
+   if(flags & H2_FLAG_END_HEADERS)
+      return microhttpd_H2HeaderBlock(client, stream_id, (flags & H2_FLAG_END_STREAM) != 0, payload, length);
+
+   /* Continued in CONTINUATION frames */
+   h2->block = (uint8_t *) malloc((length > 0) ? length : 1);
+   if(NULL == h2->block)
+      return microhttpd_H2Fail(client, H2_INTERNAL_ERROR);
+   memcpy(h2->block, payload, length);
+   h2->block_length = length;
+   h2->block_stream = stream_id;
+   h2->block_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+   return true;
+}
+
+static bool microhttpd_H2Continuation(struct md_client *client, uint8_t flags, const uint8_t *payload,
+   uint32_t length)
+{
+   struct md_h2 *h2 = client->h2;
+   uint8_t *block;
+   uint32_t stream_id;
+   bool result;
+
+   if(h2->block_length + length > MICROHTTPD_H2_MAX_HEADER_BLOCK)
+   {
+      MH_DBG("%s: Header block over %u bytes\n", __func__, MICROHTTPD_H2_MAX_HEADER_BLOCK);
+      return microhttpd_H2Fail(client, H2_ENHANCE_YOUR_CALM);
+   }
+   block = (uint8_t *) realloc(h2->block, h2->block_length + length + 1);
+   if(NULL == block)
+      return microhttpd_H2Fail(client, H2_INTERNAL_ERROR);
+   memcpy(&block[h2->block_length], payload, length);
+   h2->block = block;
+   h2->block_length += length;
+   if(!(flags & H2_FLAG_END_HEADERS))
+      return true;
+
+   stream_id = h2->block_stream;
+   h2->block_stream = 0;
+   result = microhttpd_H2HeaderBlock(client, stream_id, h2->block_end_stream, block, h2->block_length);
+   free(h2->block);
+   h2->block = NULL;
+   h2->block_length = 0;
+   return result;
+}
+
+/*! Start a stream with a complete header block, or take the trailers of one in progress */
+static bool microhttpd_H2HeaderBlock(struct md_client *client, uint32_t stream_id, bool end_stream,
+   const uint8_t *block, uint32_t length)
+{
+   struct md_h2 *h2 = client->h2;
+   struct md_h2_stream *stream = microhttpd_H2StreamFind(h2, stream_id);
+   struct md_h2_request request;
+   uint32_t code = H2_NO_ERROR;
+
+   if(NULL != stream || stream_id <= h2->last_stream_id)
+   {
+      /* Trailers, or a stream that's already closed. Either way the block is decoded, to keep the
+       *  table in step with the peer's. */
+      if(microhttpd_HpackDecode(&h2->decoder, block, length, microhttpd_H2IgnoreField, NULL) != 0)
+         return microhttpd_H2Fail(client, H2_COMPRESSION_ERROR);
+      if(NULL != stream && end_stream)
+         microhttpd_H2RemoteClosed(stream);
+      return true;
+   }
+
+   h2->last_stream_id = stream_id;
+   memset(&request, 0, sizeof(request));
+   if(microhttpd_HpackDecode(&h2->decoder, block, length, microhttpd_H2RequestField, &request) != 0)
+   {
+      microhttpd_H2RequestFree(&request);
+      return microhttpd_H2Fail(client, H2_COMPRESSION_ERROR);
+   }
+   if(!request.malformed && !request.failed)
+      microhttpd_H2RequestEnd(&request);
+
+   if(h2->stream_count >= h2->max_streams || h2->goaway_sent)
+      code = H2_REFUSED_STREAM;
+   else if(request.malformed)
+      code = H2_PROTOCOL_ERROR;
+   else if(request.failed || NULL == (stream = microhttpd_H2StreamOpen(client, stream_id)))
+      code = H2_INTERNAL_ERROR;
+   if(H2_NO_ERROR != code)
+   {
+      MH_DBG("%s: Stream %"PRIu32" refused (%"PRIu32")\n", __func__, stream_id, code);
+      microhttpd_H2SendRst(h2, stream_id, code);
+      microhttpd_H2RequestFree(&request);
+      return true;
+   }
+
+   stream->remote_closed = end_stream;
+   ++(client->pipeline_count); /* Counts toward pipeline_max, like a pipelined request */
+   microhttpd_H2StreamDispatch(stream, request.text, request.length);
+   microhttpd_H2RequestFree(&request);
+   return true;
+}
+
+/*! Apply the peer's settings. Returns an error code for the connection, or H2_NO_ERROR. */
+static uint32_t microhttpd_H2Settings(struct md_h2 *h2, const uint8_t *payload, uint32_t length)
+{
+   struct md_h2_stream *stream;
+
+   for(uint32_t offset = 0; offset + 6 <= length; offset += 6)
+   {
+      uint16_t id = ((uint16_t) payload[offset] << 8) | payload[offset + 1];
+      uint32_t value = microhttpd_H2Get32(&payload[offset + 2]);
+      int64_t delta;
+
+      switch(id)
+      {
+         case H2_SETTINGS_HEADER_TABLE_SIZE:
+            microhttpd_HpackResize(&h2->encoder, value);
+            break;
+         case H2_SETTINGS_ENABLE_PUSH:
+            if(value > 1)
+               return H2_PROTOCOL_ERROR;
+            break;
+         case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if(value > H2_MAX_WINDOW)
+               return H2_FLOW_CONTROL_ERROR;
+            delta = (int64_t) value - h2->initial_window;
+            for(stream = h2->streams; NULL != stream; stream = stream->next)
+            {
+               if(stream->send_window + delta > H2_MAX_WINDOW)
+                  return H2_FLOW_CONTROL_ERROR;
+               stream->send_window += (int32_t) delta;
+            }
+            h2->initial_window = (int32_t) value;
+            break;
+         case H2_SETTINGS_MAX_FRAME_SIZE:
+            if(value < H2_FRAME_SIZE || value > 0xffffff)
+               return H2_PROTOCOL_ERROR;
+            break; /* Frames sent are never larger than the minimum */
+         default:
+            break;
+      }
+   }
+   return H2_NO_ERROR;
+}
+
+static bool microhttpd_H2WindowUpdate(struct md_client *client, uint32_t stream_id, const uint8_t *payload)
+{
+   struct md_h2 *h2 = client->h2;
+   uint32_t increment = microhttpd_H2Get32(payload) & H2_MAX_WINDOW;
+   struct md_h2_stream *stream;
+
+   if(0 == stream_id)
+   {
+      if(0 == increment)
+         return microhttpd_H2Fail(client, H2_PROTOCOL_ERROR);
+      if((int64_t) h2->send_window + increment > H2_MAX_WINDOW)
+         return microhttpd_H2Fail(client, H2_FLOW_CONTROL_ERROR);
+      h2->send_window += increment;
+      microhttpd_H2FlushAll(h2);
+      return true;
+   }
+
+   stream = microhttpd_H2StreamFind(h2, stream_id);
+   if(NULL == stream)
+      return true; /* Closed already */
+   if(0 == increment)
+      microhttpd_H2StreamReset(stream, H2_PROTOCOL_ERROR, true);
+   else if((int64_t) stream->send_window + increment > H2_MAX_WINDOW)
+      microhttpd_H2StreamReset(stream, H2_FLOW_CONTROL_ERROR, true);
+   else
+   {
+      stream->send_window += increment;
+      microhttpd_H2Flush(stream);
+   }
+   return true;
+}
+
+/*! Account for a DATA frame, reopening the peer's windows once half of either has been used. Data
+ *  is consumed as it arrives, so there's no reason to hold the window back. */
+static void microhttpd_H2Received(struct md_h2 *h2, uint32_t stream_id, uint32_t length, bool end_stream)
+{
+   struct md_h2_stream *stream;
+
+   h2->recv_unacked += length;
+   if(h2->recv_unacked >= H2_DEFAULT_WINDOW / 2)
+   {
+      microhttpd_H2SendWindowUpdate(h2, 0, h2->recv_unacked);
+      h2->recv_unacked = 0;
+   }
+
+   stream = microhttpd_H2StreamFind(h2, stream_id);
+   if(NULL == stream || NULL == stream->client || end_stream)
+      return;
+   stream->recv_unacked += length;
+   if(stream->recv_unacked >= H2_DEFAULT_WINDOW / 2)
+   {
+      microhttpd_H2SendWindowUpdate(h2, stream_id, stream->recv_unacked);
+      stream->recv_unacked = 0;
+   }
+}
+
+/*! Connection error: send GOAWAY, reset every stream and discard the rest of the input. Returns the
+ *  state machine's continue flag. */
+static bool microhttpd_H2Fail(struct md_client *client, uint32_t code)
+{
+   struct md_h2 *h2 = client->h2;
+
+   MH_DBG("%s: Connection error %"PRIu32"\n", __func__, code);
+   microhttpd_H2SendGoAway(h2, code);
+   while(NULL != h2->streams)
+      microhttpd_H2StreamReset(h2->streams, code, false);
+   client->state = state_H2Closing;
+   return true;
+}
+
+/*! Decoded request field; pseudo-header fields become the request line */
+static void microhttpd_H2RequestField(void *cookie, const char *name, uint32_t name_length, const char *value,
+   uint32_t value_length)
+{
+   struct md_h2_request *request = (struct md_h2_request *) cookie;
+   uint32_t idx;
+
+   if(request->malformed || request->failed)
+      return;
+   for(idx = 0; idx < name_length; ++idx)
+   {
+      char c = name[idx];
+      if((c >= 'A' && c <= 'Z') || c <= ' ' || 0x7f == c || (':' == c && idx > 0))
+         break;
+   }
+   if(0 == name_length || idx < name_length || NULL != memchr(value, '\r', value_length)
+   || NULL != memchr(value, '\n', value_length) || strlen(value) != value_length)
+   {
+      request->malformed = true;
+      return;
+   }
+
+   if(':' == name[0])
+   {
+      char **target = NULL;
+
+      if(strcmp(name, ":method") == 0)
+         target = &request->method;
+      else if(strcmp(name, ":path") == 0)
+         target = &request->path;
+      else if(strcmp(name, ":authority") == 0)
+         target = &request->authority;
+      else if(strcmp(name, ":scheme") == 0)
+         return;
+      if(NULL == target || NULL != *target || request->line_written)
+      {
+         request->malformed = true; /* Unknown, repeated, or after a regular field */
+         return;
+      }
+      *target = (char *) malloc(value_length + 1);
+      if(NULL == *target)
+      {
+         request->failed = true;
+         return;
+      }
+      memcpy(*target, value, value_length + 1);
+      return;
+   }
+
+   if(!request->line_written && !microhttpd_H2RequestLine(request))
+      return;
+   if(microhttpd_H2ConnectionField(name, name_length)
+   || (strcmp(name, "te") == 0 && strcmp(value, "trailers") != 0))
+   {
+      request->malformed = true;
+      return;
+   }
+   if(strcmp(name, "host") == 0 && NULL != request->authority)
+      return; /* :authority takes its place */
+   if(strcmp(name, "cookie") == 0)
+   {
+      /* Sent as separate fields to compress better; HTTP/1.1 has them in one */
+      char *cookie = (char *) realloc(request->cookie, request->cookie_length + value_length + 3);
+
+      if(NULL == cookie)
+      {
+         request->failed = true;
+         return;
+      }
+      if(request->cookie_length > 0)
+      {
+         memcpy(&cookie[request->cookie_length], "; ", 2);
+         request->cookie_length += 2;
+      }
+      memcpy(&cookie[request->cookie_length], value, value_length);
+      request->cookie_length += value_length;
+      request->cookie = cookie;
+      return;
+   }
+
+   if(microhttpd_H2RequestAppend(request, name, name_length))
+      microhttpd_H2RequestAppend(request, ": ", 2);
+   if(microhttpd_H2RequestAppend(request, value, value_length))
+      microhttpd_H2RequestAppend(request, "\r\n", 2);
+}
+
+static void microhttpd_H2IgnoreField(void *cookie, const char *name, uint32_t name_length, const char *value,
+   uint32_t value_length)
+{
+   /* Trailers and refused streams are only decoded to keep the table in step */
+}
+
+static bool microhttpd_H2RequestLine(struct md_h2_request *request)
+{
+   if(NULL == request->method || NULL == request->path || '\0' == request->path[0]
+   || NULL != strchr(request->path, ' ') || NULL != strchr(request->method, ' '))
+   {
+      request->malformed = true;
+      return false;
+   }
+   request->line_written = true;
+   microhttpd_H2RequestAppend(request, request->method, strlen(request->method));
+   microhttpd_H2RequestAppend(request, " ", 1);
+   microhttpd_H2RequestAppend(request, request->path, strlen(request->path));
+   microhttpd_H2RequestAppend(request, " HTTP/2\r\n", 9);
+   if(NULL != request->authority)
+   {
+      microhttpd_H2RequestAppend(request, "host: ", 6);
+      microhttpd_H2RequestAppend(request, request->authority, strlen(request->authority));
+      microhttpd_H2RequestAppend(request, "\r\n", 2);
+   }
+   return !request->failed;
+}
+
+static bool microhttpd_H2RequestEnd(struct md_h2_request *request)
+{
+   if(!request->line_written && !microhttpd_H2RequestLine(request))
+      return false;
+   if(request->cookie_length > 0)
+   {
+      microhttpd_H2RequestAppend(request, "cookie: ", 8);
+      microhttpd_H2RequestAppend(request, request->cookie, request->cookie_length);
+      microhttpd_H2RequestAppend(request, "\r\n", 2);
+   }
+   microhttpd_H2RequestAppend(request, "\r\n", 2);
+   return !request->failed;
+}
+
+static bool microhttpd_H2RequestAppend(struct md_h2_request *request, const char *data, uint32_t length)
+{
+   if(request->failed)
+      return false;
+   if(request->length + length > request->capacity)
+   {
+      uint32_t capacity = (0 == request->capacity) ? 256 : request->capacity;
+      char *text;
+
+      while(capacity < request->length + length)
+         capacity *= 2;
+      if(capacity > MICROHTTPD_H2_MAX_HEADER_LIST
+      || NULL == (text = (char *) realloc(request->text, capacity)))
+      {
+         MH_DBG("%s: Failed to grow request to %"PRIu32" bytes\n", __func__, capacity);
+         request->failed = true;
+         return false;
+      }
+      request->text = text;
+      request->capacity = capacity;
+   }
+   memcpy(&request->text[request->length], data, length);
+   request->length += length;
+   return true;
+}
+
+static void microhttpd_H2RequestFree(struct md_h2_request *request)
+{
+   free(request->text);
+   free(request->method);
+   free(request->path);
+   free(request->authority);
+   free(request->cookie);
+}
+
+/*! The upgrade request again as HTTP/1.1 text, without the fields that asked for the upgrade */
+static bool microhttpd_H2UpgradeRequest(struct md_client *client, struct md_h2_request *request)
+{
+   microhttpd_H2RequestAppend(request, client->header_entries[0], strlen(client->header_entries[0]));
+   microhttpd_H2RequestAppend(request, "\r\n", 2);
+   for(uint32_t idx = 1; idx < client->header_entry_count; ++idx)
+   {
+      const char *entry = client->header_entries[idx];
+      const char *colon = strchr(entry, ':');
+      uint32_t name_length = (NULL != colon) ? (uint32_t) (colon - entry) : strlen(entry);
+
+      if(microhttpd_H2ConnectionField(entry, name_length)
+      || (14 == name_length && strncmp(entry, "http2-settings", 14) == 0)
+      || (2 == name_length && strncmp(entry, "te", 2) == 0))
+         continue;
+      microhttpd_H2RequestAppend(request, entry, strlen(entry));
+      microhttpd_H2RequestAppend(request, "\r\n", 2);
+   }
+   microhttpd_H2RequestAppend(request, "\r\n", 2);
+   return !request->failed;
+}
+
+static bool microhttpd_H2ConnectionField(const char *name, uint32_t name_length)
+{
+   for(uint32_t idx = 0; idx < ARRAY_SIZE(CONNECTION_FIELDS); ++idx)
+   {
+      if(strncmp(CONNECTION_FIELDS[idx], name, name_length) == 0 && '\0' == CONNECTION_FIELDS[idx][name_length])
+         return true;
+   }
+   return false;
+}
+
+/*! A stream and the client that handles its request */
+static struct md_h2_stream *microhttpd_H2StreamOpen(struct md_client *connection, uint32_t id)
+{
+   struct md_h2 *h2 = connection->h2;
+   struct md_h2_stream *stream;
+   struct md_client *client;
+
+   stream = (struct md_h2_stream *) malloc(sizeof(*stream));
+   client = (struct md_client *) malloc(sizeof(*client));
+   if(NULL == stream || NULL == client)
+   {
+      MH_DBG("%s: Failed to allocate stream %"PRIu32"\n", __func__, id);
+      free(stream);
+      free(client);
+      return NULL;
+   }
+   memset(stream, 0, sizeof(*stream));
+   memset(client, 0, sizeof(*client));
+
+   stream->h2 = h2;
+   stream->client = client;
+   stream->id = id;
+   stream->send_window = h2->initial_window;
+   stream->next = h2->streams;
+   h2->streams = stream;
+   ++(h2->stream_count);
+
+   client->ctx = connection->ctx;
+   client->socket = -1;
+   client->transport = &md_transport_h2;
+   client->transport_data = stream;
+   client->stream = stream;
+   memcpy(&client->peer, microhttpd_ClientPeer(connection), sizeof(client->peer));
+   client->peer_length = connection->peer_length;
+   client->address = connection->address; /* Counted once, for the connection */
+   client->rx_buffer_size = connection->rx_buffer_size;
+#if defined(MICROHTTPD_TRACE)
+   client->trace_connection = connection->trace_connection;
+   client->trace_request = id - 1; /* A stream's requests are numbered by stream */
+#endif
+   microhttpd_ResetState(client);
+   MH_TRACE(client, H2_STREAM, id);
+   return stream;
+}
+
+static struct md_h2_stream *microhttpd_H2StreamFind(struct md_h2 *h2, uint32_t id)
+{
+   struct md_h2_stream *stream;
+
+   for(stream = h2->streams; NULL != stream; stream = stream->next)
+   {
+      if(stream->id == id)
+         return stream;
+   }
+   return NULL;
+}
+
+static void microhttpd_H2StreamDispatch(struct md_h2_stream *stream, char *data, uint32_t length)
+{
+   if(microhttpd_HandleClientData(stream->client->ctx, stream->client, data, length) == 0)
+      microhttpd_H2StreamCheck(stream);
+}
+
+/*! Remove the stream's client once its request has been handled, or if the request ended early */
+static void microhttpd_H2StreamCheck(struct md_h2_stream *stream)
+{
+   struct md_client *client = stream->client;
+
+   if(NULL == client)
+      return;
+   if(state_H2StreamDone == client->state
+   || (stream->remote_closed && NULL == client->deferred && NULL == client->proxy_peer))
+      microhttpd_RemoveClient(client->ctx, client);
+}
+
+static void microhttpd_H2RemoteClosed(struct md_h2_stream *stream)
+{
+   stream->remote_closed = true;
+   microhttpd_H2StreamCheck(stream);
+}
+
+/*! Stop a stream's response without touching its client, which may be sending */
+static void microhttpd_H2StreamAbort(struct md_h2_stream *stream, uint32_t code, bool send)
+{
+   if(send && !stream->ended)
+      microhttpd_H2SendRst(stream->h2, stream->id, code);
+   stream->ended = true;
+   stream->remote_closed = true; /* Nothing more is expected either way */
+   stream->response = H2_RESPONSE_SENT;
+   free(stream->pending);
+   stream->pending = NULL;
+   stream->pending_length = stream->pending_capacity = 0;
+   stream->pending_end = false;
+}
+
+/*! Abort a stream and remove its client. The stream is freed. */
+static void microhttpd_H2StreamReset(struct md_h2_stream *stream, uint32_t code, bool send)
+{
+   microhttpd_H2StreamAbort(stream, code, send);
+   if(NULL != stream->client)
+      microhttpd_RemoveClient(stream->client->ctx, stream->client); /* Releases the stream */
+   else
+      microhttpd_H2StreamRelease(stream);
+}
+
+/*! Free a stream once its client is gone and its response has been sent in full */
+static void microhttpd_H2StreamRelease(struct md_h2_stream *stream)
+{
+   struct md_h2 *h2 = stream->h2;
+   struct md_h2_stream **link = &h2->streams;
+
+   if(NULL != stream->client || !stream->ended)
+      return;
+   if(!stream->remote_closed)
+      microhttpd_H2SendRst(h2, stream->id, H2_NO_ERROR); /* Answered; the rest of the request isn't needed */
+
+   while(*link != stream)
+      link = &(*link)->next;
+   *link = stream->next;
+   --(h2->stream_count);
+   free(stream->header);
+   free(stream->pending);
+   free(stream);
+}
+
+/*! Translate part of the HTTP/1.1 response written by the stream's client. Returns false if the
+ *  stream or connection has failed. */
+static bool microhttpd_H2Output(struct md_h2_stream *stream, const char *data, uint32_t length)
+{
+   while(length > 0)
+   {
+      uint32_t used = length;
+      bool end;
+
+      if(H2_RESPONSE_HEADER == stream->response)
+      {
+         if(!microhttpd_H2ResponseHeader(stream, data, length, &used))
+            return false;
+      }
+      else if(H2_RESPONSE_BODY == stream->response)
+      {
+         if(stream->length_known)
+         {
+            if(used > stream->body_remaining)
+               used = stream->body_remaining;
+            stream->body_remaining -= used;
+         }
+         end = stream->length_known && 0 == stream->body_remaining;
+         if(end)
+            stream->response = H2_RESPONSE_SENT;
+         if(!microhttpd_H2Data(stream, data, used, end))
+            return false;
+      }
+      else
+      {
+         MH_DBG("%s: Stream %"PRIu32": %"PRIu32" bytes after the response\n", __func__, stream->id, length);
+         return true;
+      }
+      data += used;
+      length -= used;
+   }
+   return true;
+}
+
+/*! Collect the response header; once it's complete, send it as HEADERS. used is set to the number of
+ *  bytes taken from data. */
+static bool microhttpd_H2ResponseHeader(struct md_h2_stream *stream, const char *data, uint32_t length,
+   uint32_t *used)
+{
+   uint32_t previous = stream->header_length, start;
+   const char *end;
+   char *header;
+   bool result;
+
+   if(0 == previous)
+   {
+      end = microhttpd_H2HeaderEnd(data, length);
+      if(NULL != end)
+      {
+         *used = end + 4 - data;
+         return microhttpd_H2SendHeaders(stream, data, *used);
+      }
+   }
+
+   /* Arriving in pieces */
+   if(previous + length > MICROHTTPD_H2_MAX_HEADER_BLOCK)
+   {
+      MH_DBG("%s: Stream %"PRIu32": Response header too large\n", __func__, stream->id);
+      microhttpd_H2StreamAbort(stream, H2_INTERNAL_ERROR, true);
+      return false;
+   }
+   header = (char *) realloc(stream->header, previous + length);
+   if(NULL == header)
+   {
+      microhttpd_H2StreamAbort(stream, H2_INTERNAL_ERROR, true);
+      return false;
+   }
+   memcpy(&header[previous], data, length);
+   stream->header = header;
+   stream->header_length += length;
+
+   start = (previous > 3) ? previous - 3 : 0;
+   end = microhttpd_H2HeaderEnd(&header[start], stream->header_length - start);
+   if(NULL == end)
+   {
+      *used = length;
+      return true;
+   }
+   *used = end + 4 - header - previous;
+   result = microhttpd_H2SendHeaders(stream, header, end + 4 - header);
+   free(stream->header);
+   stream->header = NULL;
+   stream->header_length = 0;
+   return result;
+}
+
+/*! The blank line ending a header */
+static const char *microhttpd_H2HeaderEnd(const char *data, uint32_t length)
+{
+   for(uint32_t offset = 0; offset + 4 <= length; ++offset)
+   {
+      if(memcmp(&data[offset], "\r\n\r\n", 4) == 0)
+         return &data[offset];
+   }
+   return NULL;
+}
+
+/*! Encode a complete HTTP/1.1 response header as HEADERS (and CONTINUATION) frames */
+static bool microhttpd_H2SendHeaders(struct md_h2_stream *stream, const char *text, uint32_t length)
+{
+   struct md_h2 *h2 = stream->h2;
+   uint32_t lines = 1, status, block_length, offset;
+   char *copy, *line, *next, *end;
+   uint8_t *block, flags = 0;
+   bool no_body, result = true;
+   char code[4];
+
+   if(length < 12 || strncmp(text, "HTTP/1.", 7) != 0 || ' ' != text[8]
+   || text[9] < '1' || text[9] > '5' || text[10] < '0' || text[10] > '9' || text[11] < '0' || text[11] > '9')
+   {
+      MH_DBG("%s: Stream %"PRIu32": Invalid response status line\n", __func__, stream->id);
+      microhttpd_H2StreamAbort(stream, H2_INTERNAL_ERROR, true);
+      return false;
+   }
+   memcpy(code, &text[9], 3);
+   code[3] = '\0';
+   status = strtoul(code, NULL, 10);
+
+   for(offset = 0; offset < length; ++offset)
+   {
+      if('\n' == text[offset])
+         ++lines;
+   }
+   copy = (char *) malloc(length + 1);
+   block = (uint8_t *) malloc(6 + MICROHTTPD_HPACK_FIELD_MAX(7, 3) + length + 12 * lines);
+   if(NULL == copy || NULL == block)
+   {
+      free(copy);
+      free(block);
+      microhttpd_H2StreamAbort(stream, H2_INTERNAL_ERROR, true);
+      return false;
+   }
+   memcpy(copy, text, length);
+   copy[length] = '\0';
+
+   block_length = microhttpd_HpackEncodeStart(&h2->encoder, block);
+   block_length += microhttpd_HpackEncode(&h2->encoder, &block[block_length], ":status", 7, code, 3);
+   stream->length_known = false;
+   line = strstr(copy, "\r\n") + 2;
+   for(; '\r' != *line; line = next)
+   {
+      char *colon, *value;
+
+      end = strstr(line, "\r\n");
+      if(NULL == end)
+         break; /* Embedded NUL */
+      next = end + 2;
+      *end = '\0';
+      colon = strchr(line, ':');
+      if(NULL == colon)
+         continue;
+      *colon = '\0';
+      lower(line);
+      value = colon + 1;
+      while(' ' == *value || '\t' == *value)
+         ++value;
+      while(end > value && (' ' == end[-1] || '\t' == end[-1]))
+         *--end = '\0';
+
+      if(microhttpd_H2ConnectionField(line, colon - line))
+         continue;
+      if(strcmp(line, "content-length") == 0)
+      {
+         stream->length_known = true;
+         stream->body_remaining = strtoul(value, NULL, 10);
+      }
+      block_length += microhttpd_HpackEncode(&h2->encoder, &block[block_length], line, colon - line, value,
+         end - value);
+   }
+   free(copy);
+
+   if(status < 200)
+      no_body = false; /* Informational; the final response follows */
+   else
+   {
+      no_body = 204 == status || 304 == status || (stream->length_known && 0 == stream->body_remaining)
+         || (NULL != stream->client && MICROHTTPD_METHOD_HEAD == stream->client->method);
+      stream->response = no_body ? H2_RESPONSE_SENT : H2_RESPONSE_BODY;
+      if(no_body)
+         flags = H2_FLAG_END_STREAM;
+   }
+
+   for(offset = 0; result && offset < block_length; )
+   {
+      uint32_t chunk = (block_length - offset > H2_FRAME_SIZE) ? H2_FRAME_SIZE : block_length - offset;
+
+      if(offset + chunk == block_length)
+         flags |= H2_FLAG_END_HEADERS;
+      result = microhttpd_H2SendFrame(h2, (0 == offset) ? H2_HEADERS : H2_CONTINUATION, flags, stream->id,
+         &block[offset], chunk);
+      flags &= ~H2_FLAG_END_STREAM;
+      offset += chunk;
+   }
+   free(block);
+   if(no_body)
+      stream->ended = true;
+   return result;
+}
+
+/*! Send body data as far as the flow-control windows allow, holding back the rest */
+static bool microhttpd_H2Data(struct md_h2_stream *stream, const char *data, uint32_t length, bool end)
+{
+   int32_t sent;
+
+   if(stream->ended)
+      return true;
+   if(0 == stream->pending_length && !stream->pending_end)
+   {
+      sent = microhttpd_H2DataSend(stream, data, length, end);
+      if(sent < 0)
+         return false;
+      data += sent;
+      length -= sent;
+      if(0 == length && (!end || stream->ended))
+         return true;
+   }
+
+   if(stream->pending_length + length > stream->pending_capacity)
+   {
+      uint32_t capacity = stream->pending_length + length;
+      char *pending = (char *) realloc(stream->pending, capacity);
+
+      if(NULL == pending)
+      {
+         microhttpd_H2StreamAbort(stream, H2_INTERNAL_ERROR, true);
+         return false;
+      }
+      stream->pending = pending;
+      stream->pending_capacity = capacity;
+   }
+   if(length > 0)
+      memcpy(&stream->pending[stream->pending_length], data, length);
+   stream->pending_length += length;
+   stream->pending_end |= end;
+   return true;
+}
+
+/*! Send DATA frames within the windows. Returns the number of bytes sent, or -1 if the connection
+ *  failed. */
+static int32_t microhttpd_H2DataSend(struct md_h2_stream *stream, const char *data, uint32_t length, bool end)
+{
+   struct md_h2 *h2 = stream->h2;
+   uint32_t sent = 0;
+
+   if(0 == length && !end)
+      return 0;
+   do
+   {
+      int32_t window = (h2->send_window < stream->send_window) ? h2->send_window : stream->send_window;
+      uint32_t chunk = length - sent;
+      uint8_t flags;
+
+      if(chunk > H2_FRAME_SIZE)
+         chunk = H2_FRAME_SIZE;
+      if(window <= 0)
+         chunk = 0;
+      else if(chunk > (uint32_t) window)
+         chunk = window;
+      if(0 == chunk && sent < length)
+         break; /* Window closed */
+
+      flags = (end && sent + chunk == length) ? H2_FLAG_END_STREAM : 0;
+      if(!microhttpd_H2SendFrame(h2, H2_DATA, flags, stream->id, &data[sent], chunk))
+         return -1;
+      h2->send_window -= chunk;
+      stream->send_window -= chunk;
+      sent += chunk;
+      if(flags)
+         stream->ended = true;
+   } while(sent < length);
+   return sent;
+}
+
+/*! Send what flow control held back, now that a window has opened */
+static void microhttpd_H2Flush(struct md_h2_stream *stream)
+{
+   int32_t sent;
+
+   if(0 == stream->pending_length && !stream->pending_end)
+      return;
+   sent = microhttpd_H2DataSend(stream, stream->pending, stream->pending_length, stream->pending_end);
+   if(sent < 0)
+      return;
+   stream->pending_length -= sent;
+   memmove(stream->pending, &stream->pending[sent], stream->pending_length);
+   if(0 == stream->pending_length && (stream->ended || !stream->pending_end))
+   {
+      free(stream->pending);
+      stream->pending = NULL;
+      stream->pending_capacity = 0;
+      stream->pending_end = false;
+   }
+   if(stream->ended)
+      microhttpd_H2StreamRelease(stream);
+}
+
+static void microhttpd_H2FlushAll(struct md_h2 *h2)
+{
+   struct md_h2_stream *stream, *next;
+
+   for(stream = h2->streams; NULL != stream && h2->send_window > 0; stream = next)
+   {
+      next = stream->next;
+      microhttpd_H2Flush(stream);
+   }
+}
+
+static bool microhttpd_H2SendFrame(struct md_h2 *h2, uint8_t type, uint8_t flags, uint32_t stream_id,
+   const void *payload, uint32_t length)
+{
+   uint8_t header[H2_FRAME_HEADER];
+   struct iovec iov[2];
+
+   if(NULL == h2->client)
+      return false;
+   header[0] = (uint8_t) (length >> 16);
+   header[1] = (uint8_t) (length >> 8);
+   header[2] = (uint8_t) length;
+   header[3] = type;
+   header[4] = flags;
+   microhttpd_H2Put32(&header[5], stream_id);
+   iov[0].iov_base = header;
+   iov[0].iov_len = sizeof(header);
+   iov[1].iov_base = (void *) payload;
+   iov[1].iov_len = length;
+   if(microhttpd_ClientSend(h2->client, iov, 2) < 0)
+   {
+      MH_DBG("%s: Failed to send frame type %u\n", __func__, type);
+      return false;
+   }
+   return true;
+}
+
+static bool microhttpd_H2SendSettings(struct md_h2 *h2)
+{
+   uint8_t payload[6];
+
+   payload[0] = 0;
+   payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+   microhttpd_H2Put32(&payload[2], h2->max_streams);
+   h2->settings_sent = true;
+   return microhttpd_H2SendFrame(h2, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static void microhttpd_H2SendRst(struct md_h2 *h2, uint32_t stream_id, uint32_t code)
+{
+   uint8_t payload[4];
+
+   microhttpd_H2Put32(payload, code);
+   microhttpd_H2SendFrame(h2, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void microhttpd_H2SendWindowUpdate(struct md_h2 *h2, uint32_t stream_id, uint32_t increment)
+{
+   uint8_t payload[4];
+
+   microhttpd_H2Put32(payload, increment);
+   microhttpd_H2SendFrame(h2, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void microhttpd_H2SendGoAway(struct md_h2 *h2, uint32_t code)
+{
+   uint8_t payload[8];
+
+   microhttpd_H2Put32(payload, h2->last_stream_id);
+   microhttpd_H2Put32(&payload[4], code);
+   microhttpd_H2SendFrame(h2, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+   h2->goaway_sent = true;
+}
+
+/*! Decode base64url (RFC 4648 section 5) with or without padding. Returns the decoded length, or
+ *  -1 if it's invalid or longer than max. */
+static int32_t microhttpd_Base64UrlDecode(const char *in, uint8_t *out, uint32_t max)
+{
+   uint32_t value = 0, bits = 0, length = 0;
+
+   for(; '\0' != *in && '=' != *in; ++in)
+   {
+      char c = *in;
+      uint32_t digit;
+
+      if(c >= 'A' && c <= 'Z')
+         digit = c - 'A';
+      else if(c >= 'a' && c <= 'z')
+         digit = c - 'a' + 26;
+      else if(c >= '0' && c <= '9')
+         digit = c - '0' + 52;
+      else if('-' == c)
+         digit = 62;
+      else if('_' == c)
+         digit = 63;
+      else
+         return -1;
+
+      value = (value << 6) | digit;
+      bits += 6;
+      if(bits >= 8)
+      {
+         bits -= 8;
+         if(length >= max)
+            return -1;
+         out[length++] = (uint8_t) (value >> bits);
+      }
+   }
+   return length;
+}
+
+static uint32_t microhttpd_H2Get32(const uint8_t *in)
+{
+   return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) | ((uint32_t) in[2] << 8) | in[3];
+}
+
+static void microhttpd_H2Put32(uint8_t *out, uint32_t value)
+{
+   out[0] = (uint8_t) (value >> 24);
+   out[1] = (uint8_t) (value >> 16);
+   out[2] = (uint8_t) (value >> 8);
+   out[3] = (uint8_t) value;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Stream Transport
+ */
+
+static int32_t transport_H2Recv(struct md_client *client, void *buffer, uint32_t length)
+{
+   errno = EAGAIN;
+   return -1; /* Received in the connection's DATA frames */
+}
+
+static int32_t transport_H2Send(struct md_client *client, const void *buffer, uint32_t length)
+{
+   struct iovec iov = { (void *) buffer, length };
+   return transport_H2Writev(client, &iov, 1);
+}
+
+static int32_t transport_H2Writev(struct md_client *client, const struct iovec *iov, uint32_t count)
+{
+   struct md_h2_stream *stream = (struct md_h2_stream *) client->transport_data;
+   int32_t total = 0;
+
+   for(uint32_t idx = 0; idx < count; ++idx)
+   {
+      if(NULL == stream || !microhttpd_H2Output(stream, iov[idx].iov_base, iov[idx].iov_len))
+      {
+         errno = EPIPE;
+         return -1;
+      }
+      total += iov[idx].iov_len;
+   }
+   return total;
+}
+
+/*! The stream's client is being removed. A response it didn't finish is ended, if its length
+ *  wasn't given, or reset. */
+static void transport_H2Close(struct md_client *client)
+{
+   struct md_h2_stream *stream = (struct md_h2_stream *) client->transport_data;
+
+   client->transport_data = NULL;
+   client->stream = NULL;
+   if(NULL == stream)
+      return;
+   stream->client = NULL;
+   if(H2_RESPONSE_BODY == stream->response && !stream->length_known)
+   {
+      stream->response = H2_RESPONSE_SENT;
+      microhttpd_H2Data(stream, NULL, 0, true);
+   }
+   if(H2_RESPONSE_SENT != stream->response)
+   {
+      MH_DBG("%s: Stream %"PRIu32": Response incomplete\n", __func__, stream->id);
+      microhttpd_H2StreamAbort(stream, H2_INTERNAL_ERROR, true);
+   }
+   microhttpd_H2StreamRelease(stream);
+}
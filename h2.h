@@ -0,0 +1,98 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file h2.h
+ *  \brief microhttpd cleartext HTTP/2 (RFC 9113)
+ */
+#ifndef _MICROHTTPD_H2_H
+#define _MICROHTTPD_H2_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+#include "hpack.h"
+
+#if !defined(MICROHTTPD_H2_DEFAULT_MAX_STREAMS)
+#define MICROHTTPD_H2_DEFAULT_MAX_STREAMS 32
+#endif
+#if !defined(MICROHTTPD_H2_MAX_HEADER_BLOCK)
+#define MICROHTTPD_H2_MAX_HEADER_BLOCK    (16 * 1024) /* Larger header blocks close the connection */
+#endif
+#if !defined(MICROHTTPD_H2_MAX_HEADER_LIST)
+#define MICROHTTPD_H2_MAX_HEADER_LIST     (64 * 1024) /* Decoded; larger requests are reset */
+#endif
+
+/* Response translation */
+#define H2_RESPONSE_HEADER 0  /* Collecting the HTTP/1.1 response header */
+#define H2_RESPONSE_BODY   1  /* Passing the body on as DATA */
+#define H2_RESPONSE_SENT   2  /* Complete; END_STREAM sent, or queued behind flow control */
+
+/*! A request on a multiplexed connection. Its client runs the usual state machine and handlers;
+ *  the response they send is translated into frames on the connection. */
+struct md_h2_stream
+{
+   struct md_h2 *h2;
+   struct md_client *client;  /* The request, until it's finished */
+   uint32_t id;
+   int32_t send_window;       /* Negative if the peer shrank its initial window */
+   uint32_t recv_unacked;     /* DATA received since the last WINDOW_UPDATE */
+   bool remote_closed;        /* END_STREAM received */
+   bool ended;                /* END_STREAM or RST_STREAM sent */
+
+   uint8_t response;          /* H2_RESPONSE_* */
+   char *header;              /* Response header received in pieces */
+   uint32_t header_length;
+   bool length_known;
+   uint32_t body_remaining;
+
+   /* DATA held back by flow control */
+   char *pending;
+   uint32_t pending_length, pending_capacity;
+   bool pending_end;          /* END_STREAM follows it */
+
+   struct md_h2_stream *next;
+};
+
+struct md_h2
+{
+   struct md_client *client;  /* The connection; NULL once it's closed */
+   struct md_hpack_table decoder, encoder;
+
+   struct md_h2_stream *streams;
+   uint32_t stream_count;
+   uint32_t max_streams;
+   uint32_t last_stream_id;   /* Highest the peer has opened */
+
+   int32_t send_window;       /* Connection flow control */
+   int32_t initial_window;    /* Peer's SETTINGS_INITIAL_WINDOW_SIZE */
+   uint32_t recv_unacked;
+   bool settings_sent;
+   bool goaway_sent;
+
+   /* Frame larger than the receive buffer, collected before it's handled */
+   uint8_t *frame;
+   uint32_t frame_length, frame_received;
+   uint8_t frame_type, frame_flags;
+   uint32_t frame_stream;
+
+   /* Header block continued in CONTINUATION frames */
+   uint8_t *block;
+   uint32_t block_length;
+   uint32_t block_stream;     /* 0 when no block is open */
+   bool block_end_stream;
+
+   /* DATA frame being received */
+   uint32_t data_stream;
+   uint32_t data_remaining;
+   uint32_t data_padding;
+   bool data_end;
+};
+
+bool microhttpd_H2PriorKnowledge(struct md_client *client, uint32_t line_length);
+bool microhttpd_H2Upgrade(struct md_client *client);
+bool state_H2StreamDone(struct md_client *client, uint32_t *consumed, bool *error);
+void microhttpd_H2Removed(struct md_client *client);
+void microhttpd_H2GoAway(struct md_client *client);
+bool microhttpd_H2Busy(struct md_client *client);
+struct md_client *microhttpd_H2Connection(struct md_client *client);
+
+#endif /* _MICROHTTPD_H2_H */
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include "debug.h"
 #include "helpers.h"
@@ -19,6 +20,90 @@ char *lower(char* s)
    return s;
 }
 
+/*! Lower-case a header entry's field name, leaving its (possibly case-sensitive) value untouched */
+char *lower_field_name(char *s)
+{
+   char *tmp;
+   for(tmp = s; *tmp != '\0' && *tmp != ':'; ++tmp)
+      *tmp = tolower((unsigned char) *tmp);
+   return s;
+}
+
+/*! True if a comma-separated header value (e.g. "keep-alive, Upgrade") contains token, ignoring case */
+bool string_has_token(const char *list, const char *token)
+{
+   uint32_t length = strlen(token);
+
+   while(NULL != list && *list != '\0')
+   {
+      while(*list == ' ' || *list == '\t' || *list == ',')
+         ++list;
+      if(strncasecmp(list, token, length) == 0
+      && (list[length] == '\0' || list[length] == ',' || list[length] == ' ' || list[length] == '\t'))
+      {
+         return true;
+      }
+      list = strchr(list, ',');
+   }
+
+   return false;
+}
+
+/*! Thousandths from the qvalue ("1", "0.5", ...) in [value, end), or 0 if it's malformed */
+static uint32_t string_qvalue(const char *value, const char *end)
+{
+   uint32_t weight, scale = 100;
+
+   if(value >= end || (*value != '0' && *value != '1'))
+      return 0;
+   weight = (*value++ - '0') * 1000;
+   if(value < end && *value == '.')
+   {
+      for(++value; value < end && isdigit((unsigned char) *value) && scale > 0; ++value, scale /= 10)
+         weight += (*value - '0') * scale;
+   }
+   while(value < end && (*value == ' ' || *value == '\t'))
+      ++value;
+   if(value < end && *value != ';')
+      return 0;
+   return (weight > 1000) ? 0 : weight;
+}
+
+/*! How much a comma-separated header value with q weights (e.g. Accept-Encoding: "gzip;q=0.5, *")
+ *  wants token, ignoring case, in thousandths. "*" answers for a token that isn't listed by name; 0
+ *  means it's refused (q=0) or not listed at all. */
+uint32_t string_token_weight(const char *list, const char *token)
+{
+   uint32_t length = strlen(token), any = 0;
+
+   while(NULL != list && *list != '\0')
+   {
+      const char *end, *param;
+      uint32_t name_length, weight = 1000;
+
+      while(*list == ' ' || *list == '\t' || *list == ',')
+         ++list;
+      end = list + strcspn(list, ",");
+      name_length = strcspn(list, " \t;,");
+      for(param = list + name_length; NULL != (param = memchr(param, ';', end - param)); )
+      {
+         ++param;
+         while(*param == ' ' || *param == '\t')
+            ++param;
+         if(strncasecmp(param, "q=", 2) == 0)
+            weight = string_qvalue(param + 2, end);
+      }
+
+      if(name_length == length && strncasecmp(list, token, length) == 0)
+         return weight;
+      if(name_length == 1 && *list == '*')
+         any = weight;
+      list = end;
+   }
+
+   return any;
+}
+
 char *string_find(char *string, uint32_t string_length, char *delimiter,
    uint32_t delimiter_length)
 {
@@ -54,6 +139,52 @@ void string_shift(char *string, uint32_t shift, uint32_t length)
    }
 }
 
+int hex_digit(char c)
+{
+   if(c >= '0' && c <= '9')
+      return c - '0';
+   c = tolower((unsigned char) c);
+   if(c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+   return -1;
+}
+
+/*! Percent-decode [src, end) into dst, which may be src itself (decoding only ever shrinks), and return
+ *  the new end. Malformed escapes and %00 are copied unchanged. With plus_as_space, '+' decodes to ' '
+ *  as in query strings and form data. The result is not NUL-terminated. */
+char *string_percent_decode(char *dst, const char *src, const char *end, bool plus_as_space)
+{
+   if(dst == src)
+   {
+      /* Nothing moves until the first escape */
+      while(src < end && *src != '%' && !(plus_as_space && *src == '+'))
+         ++src;
+      dst = (char *) src;
+   }
+
+   while(src < end)
+   {
+      int high, low;
+
+      if(*src == '%' && end - src >= 3 && (high = hex_digit(src[1])) >= 0
+      && (low = hex_digit(src[2])) >= 0 && (high | low) != 0)
+      {
+         *dst++ = (char) ((high << 4) | low);
+         src += 3;
+      }
+      else if(plus_as_space && *src == '+')
+      {
+         *dst++ = ' ';
+         ++src;
+      }
+      else
+      {
+         *dst++ = *src++;
+      }
+   }
+   return dst;
+}
+
 char *string_chop(char **string, uint32_t *string_length, char *delimiter,
    uint32_t delimiter_length)
 {
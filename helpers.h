@@ -13,9 +13,14 @@
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 char *lower(char* s);
+char *lower_field_name(char *s);
+bool string_has_token(const char *list, const char *token);
+uint32_t string_token_weight(const char *list, const char *token);
 char *string_find(char *string, uint32_t string_length, char *delimiter,
    uint32_t delimiter_length);
 void string_shift(char *string, uint32_t shift, uint32_t length);
+int hex_digit(char c);
+char *string_percent_decode(char *dst, const char *src, const char *end, bool plus_as_space);
 char *string_chop(char **string, uint32_t *string_length, char *delimiter,
    uint32_t delimiter_length);
 
@@ -0,0 +1,532 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file hpack.c
+ *  \brief microhttpd HPACK header compression (RFC 7541)
+ *
+ *  The decoder handles every representation, Huffman-coded strings included, and keeps the dynamic
+ *  table the peer's encoder expects. The encoder indexes fields that repeat from one response to
+ *  the next, so a connection's later responses mostly shrink to a byte per field; values that
+ *  change every time (lengths, dates, validators) are sent as literals so they don't churn the
+ *  table. Encoded strings are never Huffman-coded.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "hpack.h"
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_HUFFMAN_EOS    256
+
+typedef struct
+{
+   const char *name;
+   const char *value;
+} tHpackField;
+
+static const tHpackField STATIC_TABLE[] =
+{
+   { ":authority", "" },
+   { ":method", "GET" },
+   { ":method", "POST" },
+   { ":path", "/" },
+   { ":path", "/index.html" },
+   { ":scheme", "http" },
+   { ":scheme", "https" },
+   { ":status", "200" },
+   { ":status", "204" },
+   { ":status", "206" },
+   { ":status", "304" },
+   { ":status", "400" },
+   { ":status", "404" },
+   { ":status", "500" },
+   { "accept-charset", "" },
+   { "accept-encoding", "gzip, deflate" },
+   { "accept-language", "" },
+   { "accept-ranges", "" },
+   { "accept", "" },
+   { "access-control-allow-origin", "" },
+   { "age", "" },
+   { "allow", "" },
+   { "authorization", "" },
+   { "cache-control", "" },
+   { "content-disposition", "" },
+   { "content-encoding", "" },
+   { "content-language", "" },
+   { "content-length", "" },
+   { "content-location", "" },
+   { "content-range", "" },
+   { "content-type", "" },
+   { "cookie", "" },
+   { "date", "" },
+   { "etag", "" },
+   { "expect", "" },
+   { "expires", "" },
+   { "from", "" },
+   { "host", "" },
+   { "if-match", "" },
+   { "if-modified-since", "" },
+   { "if-none-match", "" },
+   { "if-range", "" },
+   { "if-unmodified-since", "" },
+   { "last-modified", "" },
+   { "link", "" },
+   { "location", "" },
+   { "max-forwards", "" },
+   { "proxy-authenticate", "" },
+   { "proxy-authorization", "" },
+   { "range", "" },
+   { "referer", "" },
+   { "refresh", "" },
+   { "retry-after", "" },
+   { "server", "" },
+   { "set-cookie", "" },
+   { "strict-transport-security", "" },
+   { "transfer-encoding", "" },
+   { "user-agent", "" },
+   { "vary", "" },
+   { "via", "" },
+   { "www-authenticate", "" }
+};
+
+/* Response fields whose values rarely repeat; not worth a dynamic table entry */
+static const char *const UNINDEXED_FIELDS[] =
+{
+   "content-length", "date", "etag", "last-modified", "location", "set-cookie"
+};
+
+/* The Huffman code is canonical, so it's fully described by the number of codes of each length
+ *  (0 to 30 bits) and the symbols in code order */
+static const uint8_t HUFFMAN_COUNTS[31] =
+{
+   0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const uint16_t HUFFMAN_SYMBOLS[257] =
+{
+   48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61,
+   65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72,
+   73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120,
+   121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93,
+   126, 94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167,
+   172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+   163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135,
+   137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+   180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171, 206, 215, 225, 236,
+   237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+   255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253,
+   254, 2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+   30, 31, 127, 220, 249, 10, 13, 22, 256
+};
+
+static bool microhttpd_HpackLookup(struct md_hpack_table *table, uint32_t index, const char **name,
+   uint32_t *name_length, const char **value, uint32_t *value_length);
+static bool microhttpd_HpackInsert(struct md_hpack_table *table, const char *name, uint32_t name_length,
+   const char *value, uint32_t value_length);
+static void microhttpd_HpackEvict(struct md_hpack_table *table, uint32_t room);
+static struct md_hpack_entry *microhttpd_HpackEntry(struct md_hpack_table *table, uint32_t index);
+static bool microhttpd_HpackInteger(const uint8_t **in, const uint8_t *end, uint8_t prefix,
+   uint32_t *value);
+static bool microhttpd_HpackString(const uint8_t **in, const uint8_t *end, char *out, uint32_t *length);
+static bool microhttpd_HuffmanDecode(const uint8_t *in, uint32_t length, char *out, uint32_t *out_length);
+static uint32_t microhttpd_HpackPutInteger(uint8_t *out, uint8_t flags, uint8_t prefix, uint32_t value);
+static uint32_t microhttpd_HpackPutString(uint8_t *out, const char *data, uint32_t length);
+static bool microhttpd_HpackIndexable(const char *name, uint32_t name_length);
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+void microhttpd_HpackInit(struct md_hpack_table *table, uint32_t limit)
+{
+   memset(table, 0, sizeof(*table));
+   table->limit = table->max_size = limit;
+   table->capacity = limit / HPACK_ENTRY_OVERHEAD + 1;
+}
+
+void microhttpd_HpackFree(struct md_hpack_table *table)
+{
+   table->max_size = 0;
+   microhttpd_HpackEvict(table, 0);
+   free(table->entries);
+   table->entries = NULL;
+}
+
+/*! Decode a complete header block, passing each field to the callback. Returns -1 if the block is
+ *  malformed, after which the table no longer matches the peer's and the connection must close. */
+int microhttpd_HpackDecode(struct md_hpack_table *table, const uint8_t *block, uint32_t length,
+   md_hpack_field field, void *cookie)
+{
+   const uint8_t *in = block, *end = block + length;
+   char *scratch = malloc(2 * length + 2); /* Huffman codes are at least 5 bits */
+   bool started = false;
+   int result = 0;
+
+   if(NULL == scratch)
+   {
+      MH_DBG("%s: Failed to allocate %"PRIu32" byte buffer\n", __func__, 2 * length + 2);
+      return -1;
+   }
+
+   while(in < end && 0 == result)
+   {
+      const char *name, *value;
+      uint32_t name_length, value_length, index;
+      uint8_t first = *in;
+      char *out = scratch;
+
+      if(first & 0x80)
+      {
+         /* Indexed field */
+         if(!microhttpd_HpackInteger(&in, end, 7, &index)
+         || !microhttpd_HpackLookup(table, index, &name, &name_length, &value, &value_length))
+         {
+            result = -1;
+            break;
+         }
+         field(cookie, name, name_length, value, value_length);
+         started = true;
+         continue;
+      }
+      if((first & 0xe0) == 0x20)
+      {
+         /* Dynamic table size update; only before the first field */
+         if(started || !microhttpd_HpackInteger(&in, end, 5, &index) || index > table->limit)
+         {
+            result = -1;
+            break;
+         }
+         table->max_size = index;
+         microhttpd_HpackEvict(table, 0);
+         continue;
+      }
+
+      /* Literal, with incremental indexing (01), without indexing (0000) or never indexed (0001) */
+      if(!microhttpd_HpackInteger(&in, end, (first & 0x40) ? 6 : 4, &index))
+      {
+         result = -1;
+         break;
+      }
+      if(0 == index)
+      {
+         if(!microhttpd_HpackString(&in, end, out, &name_length))
+         {
+            result = -1;
+            break;
+         }
+         name = out;
+         out += name_length + 1;
+      }
+      else if(!microhttpd_HpackLookup(table, index, &name, &name_length, NULL, NULL))
+      {
+         result = -1;
+         break;
+      }
+      if(!microhttpd_HpackString(&in, end, out, &value_length))
+      {
+         result = -1;
+         break;
+      }
+      field(cookie, name, name_length, out, value_length);
+      started = true;
+      if((first & 0x40) && !microhttpd_HpackInsert(table, name, name_length, out, value_length))
+         result = -1;
+   }
+
+   free(scratch);
+   if(0 != result)
+      MH_DBG("%s: Malformed header block at offset %u\n", __func__, (unsigned) (in - block));
+   return result;
+}
+
+/*! Encoder: the peer's decoder allows at most max_size bytes; the encoder uses no more than its limit */
+void microhttpd_HpackResize(struct md_hpack_table *table, uint32_t max_size)
+{
+   if(max_size > table->limit)
+      max_size = table->limit;
+   if(max_size == table->max_size)
+      return;
+   table->max_size = max_size;
+   table->resized = true;
+   microhttpd_HpackEvict(table, 0);
+}
+
+/*! Start a header block, writing the size update it must begin with if there is one (at most 6
+ *  bytes). Returns the number of bytes written. */
+uint32_t microhttpd_HpackEncodeStart(struct md_hpack_table *table, uint8_t *out)
+{
+   if(!table->resized)
+      return 0;
+   table->resized = false;
+   return microhttpd_HpackPutInteger(out, 0x20, 5, table->max_size);
+}
+
+/*! Encode a field with a lower case name into out, which has room for MICROHTTPD_HPACK_FIELD_MAX
+ *  bytes. Returns the number of bytes written. */
+uint32_t microhttpd_HpackEncode(struct md_hpack_table *table, uint8_t *out, const char *name,
+   uint32_t name_length, const char *value, uint32_t value_length)
+{
+   const uint32_t static_count = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+   uint32_t idx, name_index = 0, length;
+   bool indexing;
+
+   for(idx = 0; idx < static_count; ++idx)
+   {
+      const tHpackField *entry = &STATIC_TABLE[idx];
+
+      if(strncmp(entry->name, name, name_length) != 0 || '\0' != entry->name[name_length])
+         continue;
+      if(strncmp(entry->value, value, value_length) == 0 && '\0' == entry->value[value_length])
+         return microhttpd_HpackPutInteger(out, 0x80, 7, idx + 1);
+      if(0 == name_index)
+         name_index = idx + 1;
+   }
+   for(idx = 0; idx < table->count; ++idx)
+   {
+      struct md_hpack_entry *entry = microhttpd_HpackEntry(table, idx);
+
+      if(entry->name_length != name_length || memcmp(entry->name, name, name_length) != 0)
+         continue;
+      if(entry->value_length == value_length && memcmp(entry->value, value, value_length) == 0)
+         return microhttpd_HpackPutInteger(out, 0x80, 7, static_count + 1 + idx);
+      if(0 == name_index)
+         name_index = static_count + 1 + idx;
+   }
+
+   /* The name's index refers to the table as it was before this field is added. A failed insert
+    *  leaves the table as it was, and the field is sent without indexing instead. */
+   indexing = microhttpd_HpackIndexable(name, name_length)
+      && microhttpd_HpackInsert(table, name, name_length, value, value_length);
+   length = microhttpd_HpackPutInteger(out, indexing ? 0x40 : 0x00, indexing ? 6 : 4, name_index);
+   if(0 == name_index)
+      length += microhttpd_HpackPutString(&out[length], name, name_length);
+   length += microhttpd_HpackPutString(&out[length], value, value_length);
+   return length;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static bool microhttpd_HpackLookup(struct md_hpack_table *table, uint32_t index, const char **name,
+   uint32_t *name_length, const char **value, uint32_t *value_length)
+{
+   const uint32_t static_count = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+   struct md_hpack_entry *entry;
+
+   if(0 == index)
+      return false;
+   if(index <= static_count)
+   {
+      *name = STATIC_TABLE[index - 1].name;
+      *name_length = strlen(*name);
+      if(NULL != value)
+      {
+         *value = STATIC_TABLE[index - 1].value;
+         *value_length = strlen(*value);
+      }
+      return true;
+   }
+   if(index - static_count > table->count)
+      return false;
+
+   entry = microhttpd_HpackEntry(table, index - static_count - 1);
+   *name = entry->name;
+   *name_length = entry->name_length;
+   if(NULL != value)
+   {
+      *value = entry->value;
+      *value_length = entry->value_length;
+   }
+   return true;
+}
+
+/*! Add an entry, evicting the oldest to make room. The name and value may belong to an entry that's
+ *  evicted, so they're copied first. */
+static bool microhttpd_HpackInsert(struct md_hpack_table *table, const char *name, uint32_t name_length,
+   const char *value, uint32_t value_length)
+{
+   uint32_t size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+   struct md_hpack_entry entry;
+
+   if(size > table->max_size)
+   {
+      microhttpd_HpackEvict(table, size); /* Too large for the table; it's emptied instead */
+      return true;
+   }
+   if(NULL == table->entries)
+   {
+      table->entries = (struct md_hpack_entry *) malloc(table->capacity * sizeof(table->entries[0]));
+      if(NULL == table->entries)
+         return false;
+   }
+
+   entry.name = malloc(name_length + value_length + 2);
+   if(NULL == entry.name)
+   {
+      MH_DBG("%s: Failed to allocate %"PRIu32" byte entry\n", __func__, size);
+      return false;
+   }
+   memcpy(entry.name, name, name_length);
+   entry.name[name_length] = '\0';
+   entry.value = &entry.name[name_length + 1];
+   memcpy(entry.value, value, value_length);
+   entry.value[value_length] = '\0';
+   entry.name_length = name_length;
+   entry.value_length = value_length;
+
+   microhttpd_HpackEvict(table, size);
+   table->head = (table->head + 1) % table->capacity;
+   table->entries[table->head] = entry;
+   ++(table->count);
+   table->size += size;
+   return true;
+}
+
+/*! Evict the oldest entries until room more bytes fit */
+static void microhttpd_HpackEvict(struct md_hpack_table *table, uint32_t room)
+{
+   while(table->count > 0 && table->size + room > table->max_size)
+   {
+      struct md_hpack_entry *entry = microhttpd_HpackEntry(table, table->count - 1);
+
+      table->size -= entry->name_length + entry->value_length + HPACK_ENTRY_OVERHEAD;
+      free(entry->name);
+      --(table->count);
+   }
+}
+
+/*! Entry by age, 0 being the newest */
+static struct md_hpack_entry *microhttpd_HpackEntry(struct md_hpack_table *table, uint32_t index)
+{
+   return &table->entries[(table->head + table->capacity - index) % table->capacity];
+}
+
+static bool microhttpd_HpackInteger(const uint8_t **in, const uint8_t *end, uint8_t prefix,
+   uint32_t *value)
+{
+   const uint8_t *next = *in;
+   uint32_t max = (1u << prefix) - 1, result, shift = 0;
+   uint8_t byte;
+
+   if(next >= end)
+      return false;
+   result = *next++ & max;
+   if(result == max)
+   {
+      do
+      {
+         if(next >= end || shift > 21)
+            return false; /* Truncated, or beyond 2^28 */
+         byte = *next++;
+         result += (uint32_t) (byte & 0x7f) << shift;
+         shift += 7;
+      } while(byte & 0x80);
+   }
+   *in = next;
+   *value = result;
+   return true;
+}
+
+/*! Decode a string literal into out, NUL-terminated */
+static bool microhttpd_HpackString(const uint8_t **in, const uint8_t *end, char *out, uint32_t *length)
+{
+   bool huffman;
+   uint32_t encoded;
+
+   if(*in >= end)
+      return false;
+   huffman = (**in & 0x80) != 0;
+   if(!microhttpd_HpackInteger(in, end, 7, &encoded) || encoded > (uint32_t) (end - *in))
+      return false;
+
+   if(huffman)
+   {
+      if(!microhttpd_HuffmanDecode(*in, encoded, out, length))
+         return false;
+   }
+   else
+   {
+      memcpy(out, *in, encoded);
+      *length = encoded;
+   }
+   out[*length] = '\0';
+   *in += encoded;
+   return true;
+}
+
+/*! One bit at a time: each code is compared against the range of codes of its length. Padding must
+ *  be fewer than 8 bits, all ones (a prefix of EOS). */
+static bool microhttpd_HuffmanDecode(const uint8_t *in, uint32_t length, char *out, uint32_t *out_length)
+{
+   uint32_t code = 0, first = 0, index = 0, bits = 0, written = 0;
+
+   for(uint32_t idx = 0; idx < length; ++idx)
+   {
+      for(int shift = 7; shift >= 0; --shift)
+      {
+         uint32_t count;
+
+         code = (code << 1) | ((in[idx] >> shift) & 1);
+         if(++bits >= sizeof(HUFFMAN_COUNTS))
+            return false;
+         count = HUFFMAN_COUNTS[bits];
+         if(code - first < count)
+         {
+            uint16_t symbol = HUFFMAN_SYMBOLS[index + code - first];
+
+            if(HPACK_HUFFMAN_EOS == symbol)
+               return false;
+            out[written++] = (char) symbol;
+            code = first = index = bits = 0;
+            continue;
+         }
+         index += count;
+         first = (first + count) << 1;
+      }
+   }
+
+   if(bits > 7 || code != (1u << bits) - 1)
+      return false;
+   *out_length = written;
+   return true;
+}
+
+static uint32_t microhttpd_HpackPutInteger(uint8_t *out, uint8_t flags, uint8_t prefix, uint32_t value)
+{
+   uint32_t max = (1u << prefix) - 1, length = 0;
+
+   if(value < max)
+   {
+      out[0] = flags | value;
+      return 1;
+   }
+   out[length++] = flags | max;
+   value -= max;
+   while(value >= 0x80)
+   {
+      out[length++] = (value & 0x7f) | 0x80;
+      value >>= 7;
+   }
+   out[length++] = value;
+   return length;
+}
+
+static uint32_t microhttpd_HpackPutString(uint8_t *out, const char *data, uint32_t length)
+{
+   uint32_t prefix = microhttpd_HpackPutInteger(out, 0x00, 7, length);
+
+   memcpy(&out[prefix], data, length);
+   return prefix + length;
+}
+
+static bool microhttpd_HpackIndexable(const char *name, uint32_t name_length)
+{
+   for(uint32_t idx = 0; idx < sizeof(UNINDEXED_FIELDS) / sizeof(UNINDEXED_FIELDS[0]); ++idx)
+   {
+      const char *field = UNINDEXED_FIELDS[idx];
+
+      if(strncmp(field, name, name_length) == 0 && '\0' == field[name_length])
+         return false;
+   }
+   return true;
+}
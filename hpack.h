@@ -0,0 +1,50 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file hpack.h
+ *  \brief microhttpd HPACK header compression (RFC 7541)
+ */
+#ifndef _MICROHTTPD_HPACK_H
+#define _MICROHTTPD_HPACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MICROHTTPD_HPACK_TABLE_SIZE 4096 /* Default, and the most the encoder uses */
+
+/* Room needed to encode one field */
+#define MICROHTTPD_HPACK_FIELD_MAX(name_length, value_length) ((name_length) + (value_length) + 12)
+
+struct md_hpack_entry
+{
+   char *name;    /* Name and value share one allocation, each NUL-terminated */
+   char *value;
+   uint32_t name_length, value_length;
+};
+
+/*! Dynamic table: a ring of entries, newest at head. Each connection has one per direction. */
+struct md_hpack_table
+{
+   struct md_hpack_entry *entries; /* Allocated with the first entry */
+   uint32_t capacity;  /* Slots; enough for limit bytes of the smallest entries */
+   uint32_t head;
+   uint32_t count;
+   uint32_t size;      /* Sum of entry sizes, as RFC 7541 counts them */
+   uint32_t max_size;  /* Current maximum, set by size updates */
+   uint32_t limit;     /* Most max_size may be */
+   bool resized;       /* Encoder: the next header block starts with a size update */
+};
+
+/*! Receives each decoded field. name and value are NUL-terminated and valid only for the call. */
+typedef void (*md_hpack_field)(void *cookie, const char *name, uint32_t name_length, const char *value,
+   uint32_t value_length);
+
+void microhttpd_HpackInit(struct md_hpack_table *table, uint32_t limit);
+void microhttpd_HpackFree(struct md_hpack_table *table);
+int microhttpd_HpackDecode(struct md_hpack_table *table, const uint8_t *block, uint32_t length,
+   md_hpack_field field, void *cookie);
+void microhttpd_HpackResize(struct md_hpack_table *table, uint32_t max_size);
+uint32_t microhttpd_HpackEncodeStart(struct md_hpack_table *table, uint8_t *out);
+uint32_t microhttpd_HpackEncode(struct md_hpack_table *table, uint8_t *out, const char *name,
+   uint32_t name_length, const char *value, uint32_t value_length);
+
+#endif /* _MICROHTTPD_HPACK_H */
@@ -14,20 +14,54 @@ extern "C" {
 #endif
 
 #define HTTP_CONTINUE            100
+#define HTTP_SWITCHING_PROTOCOLS 101
 #define HTTP_OK                  200
 #define HTTP_CREATED             201
 #define HTTP_ACCEPTED            202
+#define HTTP_NO_CONTENT          204
 #define HTTP_URI_FOUND           302
+#define HTTP_NOT_MODIFIED        304
 #define HTTP_TEMPORARY_REDIRECT  307
 #define HTTP_PERMANENT_REDIRECT  308
 #define HTTP_BAD_REQUEST         400
 #define HTTP_UNAUTHORIZED        401
 #define HTTP_FORBIDDEN           403
 #define HTTP_NOT_FOUND           404
+#define HTTP_METHOD_NOT_ALLOWED  405
+#define HTTP_PAYLOAD_TOO_LARGE   413
+#define HTTP_TOO_MANY_REQUESTS   429
+#define HTTP_NOT_IMPLEMENTED     501
+#define HTTP_BAD_GATEWAY         502
+#define HTTP_SERVICE_UNAVAILABLE 503
+#define HTTP_GATEWAY_TIMEOUT     504
+
+typedef enum
+{
+   MICROHTTPD_EVENTS_AUTO = 0,  /* Best available: io_uring, then epoll, then select */
+   MICROHTTPD_EVENTS_SELECT,
+   MICROHTTPD_EVENTS_EPOLL,
+   MICROHTTPD_EVENTS_IO_URING,
+   MICROHTTPD_EVENTS_EXTERNAL   /* The application's own loop; see microhttpd_handle_event() */
+} tMicroHttpdEventBackend;
+
+/* Events for the external event backend */
+#define MICROHTTPD_EVENT_READ  0x01
+#define MICROHTTPD_EVENT_WRITE 0x02
+#define MICROHTTPD_EVENT_ERROR 0x04 /* Error or hangup; reported whatever the interest */
+
+/* Called with the events to watch a descriptor for, replacing any earlier interest; 0 means stop
+ *  watching it (it may be closed right after). The application's loop must be level-triggered. */
+typedef void (*tMicroHttpdWatchHandler)(int fd, uint32_t events, void *cookie);
 
 typedef void *tMicroHttpdContext;
 typedef void *tMicroHttpdClient;
+typedef void *tMicroHttpdDeferred;
 
+/* Handler flags */
+#define MICROHTTPD_HANDLER_OFFLOAD 0x01 /* Run on the worker pool instead of the event loop */
+
+/* The URI passed to handlers is percent-decoded, and each param_list entry is a decoded "key=value"
+ *  (or bare "key") from the query string. */
 typedef void (*tMicroHttpdGetHandler)(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
 typedef struct
@@ -35,15 +69,130 @@ typedef struct
    const char *uri;
    tMicroHttpdGetHandler handler;
    void *cookie;
+   uint32_t flags; /* MICROHTTPD_HANDLER_* */
+
+   /* Response cache. For cache_ttl milliseconds after a 200 response with a Content-Length is sent,
+    *  GET and HEAD requests for the same URI and cache_params values are answered with it instead
+    *  of calling the handler, so the response must depend on nothing else, and the handler can't
+    *  start an event stream or WebSocket. cache_params is a comma separated list of query parameter
+    *  names, or NULL for the URI alone. Requests that arrive while a deferred or offloaded handler
+    *  is producing the response wait for it. The first matching entry's settings apply. */
+   uint32_t cache_ttl;       /* 0 calls the handler for every request */
+   const char *cache_params;
 } tMicroHttpdGetHandlerEntry;
 
+/* Request methods, combined as flags in tMicroHttpdRouteEntry */
+#define MICROHTTPD_METHOD_GET     0x01
+#define MICROHTTPD_METHOD_HEAD    0x02 /* Answered by the GET handlers, with the body left out */
+#define MICROHTTPD_METHOD_POST    0x04
+#define MICROHTTPD_METHOD_PUT     0x08
+#define MICROHTTPD_METHOD_DELETE  0x10
+#define MICROHTTPD_METHOD_PATCH   0x20
+#define MICROHTTPD_METHOD_OPTIONS 0x40
+
+/* Handler for a PUT, DELETE, PATCH or OPTIONS route. The request body, if any, is passed as it
+ *  arrives: start is set on the first call and finish on the last, which is also the first when
+ *  there is no body. The response is sent on the finish call. A client that sent "Expect:
+ *  100-continue" is sent 100 Continue right away. */
+typedef void (*tMicroHttpdRouteHandler)(tMicroHttpdClient client, const char *method, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length);
+typedef struct
+{
+   uint32_t methods; /* MICROHTTPD_METHOD_PUT, _DELETE, _PATCH and/or _OPTIONS */
+   const char *uri;  /* Prefix, as for GET handlers; the first matching route is used */
+   tMicroHttpdRouteHandler handler;
+   void *cookie;
+} tMicroHttpdRouteEntry;
+
+/* Reverse proxy route. Matching requests are forwarded, with the URI as received, to an HTTP/1.1
+ *  server on loopback or a Unix domain socket over a pool of keep-alive connections, and the
+ *  response is relayed back; bodies are passed on in both directions as they arrive. Beyond
+ *  max_connections requests in flight, requests get 503 Service Unavailable; one the upstream can't
+ *  be reached for gets 502 Bad Gateway, and one it stops responding to 504 Gateway Timeout. */
+typedef struct
+{
+   uint32_t methods;          /* MICROHTTPD_METHOD_* forwarded */
+   const char *uri;           /* Prefix, as for GET handlers; checked ahead of every other handler */
+   const char *upstream;      /* IPv4 or IPv6 literal, or "unix:/path/to/socket" */
+   uint16_t port;             /* Not used for Unix domain sockets */
+   uint32_t max_connections;  /* Requests in flight, each on its own connection (default 8) */
+   uint32_t timeout;          /* milliseconds without progress before a request is abandoned (default 30000) */
+   uint32_t idle_timeout;     /* milliseconds an unused connection is kept open (default 30000) */
+} tMicroHttpdProxyEntry;
+
+/* WebSocket opcodes */
+#define MICROHTTPD_WEBSOCKET_TEXT   0x1
+#define MICROHTTPD_WEBSOCKET_BINARY 0x2
+#define MICROHTTPD_WEBSOCKET_CLOSE  0x8
+#define MICROHTTPD_WEBSOCKET_PING   0x9
+#define MICROHTTPD_WEBSOCKET_PONG   0xA
+
+/* Called with each complete TEXT or BINARY message (data is not NUL-terminated), and once with
+ *  MICROHTTPD_WEBSOCKET_CLOSE and no data when the connection is gone. */
+typedef void (*tMicroHttpdWebSocketHandler)(tMicroHttpdClient client, uint8_t opcode,
+   const char *data, uint32_t length, void *cookie);
+
+/* Called with start set before any of the body, with the body's data as it arrives, then with finish
+ *  set to send the response. A response sent from the start call refuses the upload instead (e.g. 413
+ *  for a total_length that's too large): the body is skipped and the handler isn't called again. A
+ *  client that sent "Expect: 100-continue" is only sent 100 Continue once the start call has returned
+ *  without a response, so a refused upload is never transmitted. For such a multipart/form-data
+ *  upload the start call comes before the part header is read: filename is NULL until the data, and
+ *  total_length is that of the whole body. */
 typedef void (*tMicroHttpdPostHandler)(tMicroHttpdClient client, const char *uri, const char *filename,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
    bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length);
 
+/* Called with each field of an application/x-www-form-urlencoded POST body, percent-decoded, as the
+ *  body arrives. name and value are NUL-terminated. A value that doesn't fit in form_field_size bytes
+ *  along with its name is passed in pieces, with complete set on the last. */
+typedef void (*tMicroHttpdFormHandler)(tMicroHttpdClient client, const char *name, const char *value,
+   const uint32_t value_length, bool complete, void *cookie);
+
+/* Listening socket. address is an IPv4 or IPv6 literal ("::" for all IPv6 interfaces),
+ *  "unix:/path/to/socket" for a Unix domain socket, or "fd:<n>" to take over descriptor n, a socket
+ *  inherited from the parent process or received with microhttpd_receive_listeners(); NULL or ""
+ *  listens on all IPv4 interfaces. */
+typedef struct
+{
+   const char *address;
+   uint16_t port;            /* Not used for Unix domain sockets */
+   bool tls;                 /* Serve HTTPS; needs a library built with MICROHTTPD_TLS */
+} tMicroHttpdListener;
+
+#define MICROHTTPD_TLS_TICKET_KEY_LENGTH 80
+
+/* Static assets bundled at build time (see microhttpd_add_assets() in CMakeLists.txt). Each response
+ *  is pre-serialized, header and body together; assets are located with a minimal perfect hash. */
+typedef struct
+{
+   const char *uri;
+   const uint8_t *response;          /* 200 response: header, then body */
+   uint32_t response_length;
+   uint32_t header_length;
+   const uint8_t *gzip_response;     /* Gzip-encoded variant, or NULL */
+   uint32_t gzip_response_length;
+   uint32_t gzip_header_length;
+   const uint8_t *not_modified;      /* 304 response, for a matching If-None-Match */
+   uint32_t not_modified_length;
+   const uint8_t *gzip_not_modified; /* 304 response for the gzip-encoded variant, or NULL */
+   uint32_t gzip_not_modified_length;
+   const char *etag;                 /* Quoted */
+   const char *gzip_etag;            /* Quoted; the gzip-encoded variant's, or NULL */
+} tMicroHttpdAsset;
+
+typedef struct
+{
+   const tMicroHttpdAsset *assets;
+   uint32_t asset_count;
+   const uint32_t *seeds;            /* Per-bucket hash seed, chosen so no two assets share a slot */
+   uint32_t bucket_count;
+} tMicroHttpdAssetTable;
+
 typedef struct
 {
-   uint16_t server_port;
+   uint16_t server_port;     /* Used when listener_count is 0: all IPv4 interfaces on this port */
    uint32_t process_timeout; /* milliseconds */
    uint32_t rx_buffer_size;
 
@@ -52,20 +201,193 @@ typedef struct
    uint32_t get_handler_count;
    tMicroHttpdGetHandler default_get_handler;
    void *default_get_handler_cookie;
+   uint32_t default_get_handler_flags;
+   uint32_t cache_size;         /* Bytes of cached GET responses (default 256 KiB) */
 
    /* POST */
    tMicroHttpdPostHandler post_handler;
    void *post_handler_cookie;
+   uint32_t post_handler_flags; /* MICROHTTPD_HANDLER_OFFLOAD applies to the finish call */
+
+   /* Form fields, between the POST handler's start and finish calls, which get no data for a form.
+    *  The POST handler's finish call still sends the response, so it's required: without one, a form
+    *  is refused with 405 like any other POST. Without a form handler, forms are passed to the POST
+    *  handler as they are, like any body that isn't multipart. */
+   tMicroHttpdFormHandler form_handler;
+   void *form_handler_cookie;
+   uint32_t form_field_size;    /* Decoded name and value held at once (default 256) */
+
+   /* PUT, DELETE, PATCH and OPTIONS. Other requests for a URI without a route are answered with
+    *  405 Method Not Allowed (OPTIONS with 204 No Content) and the methods it does allow. */
+   tMicroHttpdRouteEntry *route_list;
+   uint32_t route_count;
+
+   /* Reverse proxy routes, for any of the methods above */
+   const tMicroHttpdProxyEntry *proxy_list;
+   uint32_t proxy_count;
+
+   /* Event handling */
+   tMicroHttpdEventBackend event_backend;
+   tMicroHttpdWatchHandler watch_handler; /* Required for MICROHTTPD_EVENTS_EXTERNAL */
+   void *watch_cookie;
+
+   /* Worker pool for MICROHTTPD_HANDLER_OFFLOAD handlers */
+   uint32_t worker_threads;     /* 0 runs offloaded handlers on the event loop */
+   uint32_t worker_queue_depth; /* Per worker; requests beyond this get 503 (default 16) */
+
+   /* WebSocket keepalive: ping every interval, close connections silent for a whole interval */
+   uint32_t websocket_ping_interval; /* milliseconds; 0 disables */
+
+   /* Admission control, 0 for unlimited. Over budget, connections and requests get 503 with Retry-After. */
+   uint32_t max_clients;
+   uint32_t max_buffered_bytes; /* Receive buffers and request headers, across all clients */
+   uint32_t max_uploads;        /* POST requests in progress */
+
+   /* Bundled static assets, served ahead of the GET handlers */
+   const tMicroHttpdAssetTable *assets;
+
+   /* Pipelined requests answered per connection before other connections get a turn (default 16) */
+   uint32_t pipeline_max;
+
+   /* Listening sockets, all served by the same event loop; only read by microhttpd_start() */
+   const tMicroHttpdListener *listeners;
+   uint32_t listener_count;
+
+   /* Per client address limits, 0 for unlimited; Unix domain socket clients aren't limited. Over a
+    *  limit, connections and requests get rate_limit_response. */
+   uint32_t max_connections_per_address;
+   uint32_t requests_per_second;        /* Token bucket refill rate */
+   uint32_t request_burst;              /* Token bucket size (default requests_per_second) */
+   uint32_t address_table_size;         /* Addresses tracked at once (default 256) */
+   const char *rate_limit_response;     /* Complete response (default 429 with Retry-After: 1) */
+
+   /* TLS, for listeners with tls set. Sessions resume from a cache or a ticket; give each server
+    *  instance the same ticket key to let clients resume across restarts. The application must
+    *  ignore SIGPIPE. */
+   const char *tls_certificate;         /* PEM file: certificate, then any intermediates */
+   const char *tls_private_key;         /* PEM file */
+   uint32_t tls_session_cache_size;     /* Sessions cached (default 20480) */
+   const uint8_t *tls_ticket_key;       /* MICROHTTPD_TLS_TICKET_KEY_LENGTH bytes, or NULL for random */
+
+   /* Cleartext HTTP/2 on non-TLS listeners, for clients that open with the connection preface or
+    *  send "Upgrade: h2c". Each stream is handled as its own request by the handlers above; event
+    *  streams and WebSockets aren't available on them. */
+   bool http2;
+   uint32_t http2_max_streams;          /* Concurrent streams per connection (default 32) */
 
 } tMicroHttpdParams;
 
 tMicroHttpdContext microhttpd_start(tMicroHttpdParams *params);
+
+/* Run one pass of the event loop. Returns 0, negative on a fatal error, or 1 once a drain has
+ *  finished, after which the context must not be used. */
 int microhttpd_process(tMicroHttpdContext context);
+const char *microhttpd_get_event_backend(tMicroHttpdContext context);
+
+/* With MICROHTTPD_EVENTS_EXTERNAL, the application's loop waits instead of microhttpd_process(),
+ *  which isn't used. The watch handler is first called from microhttpd_start(). Pass each event
+ *  the loop reports for a watched descriptor to microhttpd_handle_event(), and call
+ *  microhttpd_handle_timers() once the time given by microhttpd_get_timeout() (-1 for none) has
+ *  passed; ask for it again after each call, since handling events can move it. process_timeout is
+ *  how often timers are due regardless (0 for only when needed). Both handle functions return as
+ *  microhttpd_process() does; once a drain has finished, every descriptor has been unwatched. */
+int microhttpd_handle_event(tMicroHttpdContext context, int fd, uint32_t events);
+int microhttpd_handle_timers(tMicroHttpdContext context);
+int32_t microhttpd_get_timeout(tMicroHttpdContext context);
 
 int microhttpd_send_response(tMicroHttpdClient client, uint16_t code, const char *content_type,
    uint32_t content_length, const char *extra_header_options, const char *content);
 int microhttpd_send_data(tMicroHttpdClient client, uint32_t length, const char *content);
 
+/* Value of the first query parameter named key ("" if it has no value), or NULL if there is none.
+ *  length, if not NULL, receives the value's length. The value stays valid as long as the handler's
+ *  param_list. */
+const char *microhttpd_get_param(tMicroHttpdClient client, const char *key, uint32_t *length);
+
+/* Client address, e.g. "192.168.1.10:52144", "[2001:db8::1]:52144" or "unix". Formatted on first use
+ *  and kept for the life of the connection. */
+const char *microhttpd_get_source_address(tMicroHttpdClient client);
+
+/* Request method, e.g. "GET" or "HEAD". A GET handler may skip producing a body for HEAD; whatever
+ *  it sends is reduced to the header anyway. */
+const char *microhttpd_get_method(tMicroHttpdClient client);
+
+/* Application data. Request data belongs to the request being handled: it's kept from call to call
+ *  of an upload's handler, through a deferred or offloaded response, and for as long as an event
+ *  stream or WebSocket is open, then passed to its destructor (if not NULL) once the request is
+ *  finished or its connection is gone. Connection data is kept until the connection closes, and is
+ *  shared by all the streams of an HTTP/2 connection. Setting either again destroys the previous
+ *  data unless it's the same pointer. Destructors are called on the thread running
+ *  microhttpd_process(). The get functions return NULL if nothing has been set. */
+typedef void (*tMicroHttpdDataDestructor)(void *data);
+void microhttpd_set_request_data(tMicroHttpdClient client, void *data, tMicroHttpdDataDestructor destructor);
+void *microhttpd_get_request_data(tMicroHttpdClient client);
+void microhttpd_set_connection_data(tMicroHttpdClient client, void *data, tMicroHttpdDataDestructor destructor);
+void *microhttpd_get_connection_data(tMicroHttpdClient client);
+
+/* JSON responses. microhttpd_json_begin() starts an application/json response, then the document is
+ *  written a value at a time: key names each value in an object and must be NULL anywhere else, and
+ *  microhttpd_json_close() ends the innermost object or array. microhttpd_json_end() sends the rest,
+ *  and must be called before the handler returns. Values are serialized straight into a buffer kept
+ *  with the connection; a document that fits (4 KB by default) is sent with its Content-Length, and
+ *  a larger one is sent chunked as the buffer fills. Floating point values are written with the
+ *  given number of decimals (at most 9), and NaN and infinity as null. Each returns 0, or -1 on
+ *  failure or misuse, such as a key out of place. */
+int microhttpd_json_begin(tMicroHttpdClient client, uint16_t code, const char *extra_header_options);
+int microhttpd_json_object(tMicroHttpdClient client, const char *key);
+int microhttpd_json_array(tMicroHttpdClient client, const char *key);
+int microhttpd_json_close(tMicroHttpdClient client);
+int microhttpd_json_string(tMicroHttpdClient client, const char *key, const char *value);
+int microhttpd_json_int(tMicroHttpdClient client, const char *key, int64_t value);
+int microhttpd_json_double(tMicroHttpdClient client, const char *key, double value, uint32_t decimals);
+int microhttpd_json_bool(tMicroHttpdClient client, const char *key, bool value);
+int microhttpd_json_null(tMicroHttpdClient client, const char *key);
+int microhttpd_json_end(tMicroHttpdClient client);
+
+/* Deferred responses. A handler calls microhttpd_defer() to finish without responding; the client
+ *  must not be used after that. Any thread may later call microhttpd_complete() exactly once with
+ *  the response, which is sent from the event loop. The URI and parameters passed to the handler
+ *  remain valid until then. */
+tMicroHttpdDeferred microhttpd_defer(tMicroHttpdClient client);
+int microhttpd_complete(tMicroHttpdDeferred deferred, uint16_t code, const char *content_type,
+   uint32_t content_length, const char *extra_header_options, const char *content);
+
+/* Server-sent events. A GET handler calls microhttpd_event_stream() instead of sending a response to
+ *  turn the connection into a text/event-stream subscribed to the named channel. microhttpd_broadcast()
+ *  sends an event (name optional; multi-line data allowed) to every subscriber and returns how many
+ *  it was queued for, or -1 if the name contains a line break. Call it from the thread running
+ *  microhttpd_process(). */
+int microhttpd_event_stream(tMicroHttpdClient client, const char *channel);
+int microhttpd_broadcast(tMicroHttpdContext context, const char *channel, const char *event,
+   const char *data);
+
+/* WebSockets. A GET handler calls microhttpd_websocket_accept() instead of sending a response to
+ *  complete the upgrade handshake; it fails, leaving the response to the handler, if the request
+ *  is not a valid upgrade. Frames are sent straight from the caller's buffer. Call the send and
+ *  close functions from the thread running microhttpd_process(). */
+int microhttpd_websocket_accept(tMicroHttpdClient client, tMicroHttpdWebSocketHandler handler,
+   void *cookie);
+int microhttpd_websocket_send(tMicroHttpdClient client, uint8_t opcode, const void *data,
+   uint32_t length);
+int microhttpd_websocket_close(tMicroHttpdClient client, uint16_t status);
+
+/* Zero-downtime restart. microhttpd_send_listeners() passes the listening sockets over a connected
+ *  Unix domain socket to a successor, which takes them with microhttpd_receive_listeners() and
+ *  listens on "fd:<n>" for each, in the same order. Both sides accept until microhttpd_drain() is
+ *  called, which stops this one accepting, closes its keep-alive connections as each finishes its
+ *  request in flight, and closes whatever remains after timeout_ms; microhttpd_process() then
+ *  returns 1. Call these from the thread running microhttpd_process(). Each returns -1 on failure;
+ *  receive returns the number of sockets stored in sockets. */
+int microhttpd_send_listeners(tMicroHttpdContext context, int unix_socket);
+int microhttpd_receive_listeners(int unix_socket, int *sockets, uint32_t max_count);
+int microhttpd_drain(tMicroHttpdContext context, uint32_t timeout_ms);
+
+/* Event trace. When the library is built with MICROHTTPD_TRACE, the most recent events of every
+ *  thread (accepts, reads, state machine steps, handler calls, sends and closes) are kept in memory;
+ *  this writes them to fd for tools/trace.c to turn into per-request timelines. Returns the number
+ *  of events written, or -1 on failure or if tracing isn't built in. */
+int microhttpd_trace_dump(int fd);
+
 #if defined(__cplusplus)
 }
 #endif
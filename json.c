@@ -0,0 +1,442 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file json.c
+ *  \brief microhttpd JSON response writer
+ *
+ *  A handler writes a document value by value, and each is serialized straight into a transmit
+ *  buffer with room left in front for the response header. A document that fits goes out in one
+ *  piece with its Content-Length filled in. A larger one is sent chunked each time the buffer
+ *  fills; HTTP/2 streams frame the body themselves, so those pieces go out as they are. Buffers
+ *  that have to wait are queued by reference, and the connection keeps its buffer for the next
+ *  response unless the transmit queue still holds it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "tx.h"
+#include "defer.h"
+#include "json.h"
+
+#define JSON_CONTENT_TYPE   "application/json"
+#define JSON_CHUNK_LINE_MAX 10 /* "ffffffff\r\n" */
+#define JSON_TRAILER_MAX    7  /* "\r\n" after the last chunk, then "0\r\n\r\n" */
+
+static const uint64_t POWERS_OF_TEN[] =
+{
+   1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static struct md_json *microhttpd_JsonWriter(struct md_client *client);
+static bool microhttpd_JsonValue(struct md_client *client, struct md_json *json, const char *key);
+static bool microhttpd_JsonOpen(struct md_client *client, const char *key, char bracket, bool array);
+static bool microhttpd_JsonString(struct md_client *client, struct md_json *json, const char *value);
+static bool microhttpd_JsonPut(struct md_client *client, struct md_json *json, const char *data,
+   uint32_t length);
+static bool microhttpd_JsonFlush(struct md_client *client, struct md_json *json, bool final);
+static bool microhttpd_JsonSend(struct md_client *client, struct md_json *json, uint32_t offset,
+   uint32_t length);
+static bool microhttpd_JsonBuffer(struct md_json *json, uint32_t capacity);
+static char *microhttpd_JsonDigits(char *end, uint64_t value);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+int microhttpd_json_begin(tMicroHttpdClient client, uint16_t code, const char *extra_header_options)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = c->json;
+
+   if(NULL != c->channel || NULL != c->websocket || (NULL != json && json->active))
+   {
+      MH_DBG("%s: Not available for this request\n", __func__);
+      return -1;
+   }
+   if(NULL == json)
+   {
+      json = (struct md_json *) calloc(1, sizeof(*json));
+      if(NULL == json)
+         return -1;
+      c->json = json;
+   }
+
+   json->reserve = microhttpd_ResponseHeaderSize(JSON_CONTENT_TYPE, extra_header_options)
+      + JSON_CHUNK_LINE_MAX;
+   if(!microhttpd_JsonBuffer(json, json->reserve + MICROHTTPD_JSON_BUFFER_SIZE + JSON_TRAILER_MAX))
+      return -1;
+
+   json->length = 0;
+   json->total = 0;
+   json->active = true;
+   json->header_sent = false;
+   json->chunked = false;
+   json->failed = false;
+   json->code = code;
+   json->extra_header_options = extra_header_options;
+   json->depth = 0;
+   json->arrays = 0;
+   json->populated = 0;
+   c->responded = true;
+   return 0;
+}
+
+int microhttpd_json_object(tMicroHttpdClient client, const char *key)
+{
+   return microhttpd_JsonOpen((struct md_client *) client, key, '{', false) ? 0 : -1;
+}
+
+int microhttpd_json_array(tMicroHttpdClient client, const char *key)
+{
+   return microhttpd_JsonOpen((struct md_client *) client, key, '[', true) ? 0 : -1;
+}
+
+int microhttpd_json_close(tMicroHttpdClient client)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = microhttpd_JsonWriter(c);
+   char bracket;
+
+   if(NULL == json || 0 == json->depth)
+      return -1;
+   bracket = (json->arrays & (1u << json->depth)) ? ']' : '}';
+   --(json->depth);
+   return microhttpd_JsonPut(c, json, &bracket, 1) ? 0 : -1;
+}
+
+int microhttpd_json_string(tMicroHttpdClient client, const char *key, const char *value)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = microhttpd_JsonWriter(c);
+
+   if(NULL == json || NULL == value)
+      return -1;
+   return (microhttpd_JsonValue(c, json, key) && microhttpd_JsonString(c, json, value)) ? 0 : -1;
+}
+
+int microhttpd_json_int(tMicroHttpdClient client, const char *key, int64_t value)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = microhttpd_JsonWriter(c);
+   char text[24], *end = &text[sizeof(text)], *start;
+
+   if(NULL == json)
+      return -1;
+   start = microhttpd_JsonDigits(end, (value < 0) ? (uint64_t) -(value + 1) + 1 : (uint64_t) value);
+   if(value < 0)
+      *--start = '-';
+   return (microhttpd_JsonValue(c, json, key) && microhttpd_JsonPut(c, json, start, end - start)) ? 0 : -1;
+}
+
+int microhttpd_json_double(tMicroHttpdClient client, const char *key, double value, uint32_t decimals)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = microhttpd_JsonWriter(c);
+   char text[40], *end = &text[sizeof(text)], *start;
+   double scaled;
+
+   if(NULL == json)
+      return -1;
+   if(!isfinite(value))
+      return microhttpd_json_null(client, key); /* JSON has no NaN or infinity */
+
+   if(decimals >= sizeof(POWERS_OF_TEN) / sizeof(POWERS_OF_TEN[0]))
+      decimals = sizeof(POWERS_OF_TEN) / sizeof(POWERS_OF_TEN[0]) - 1;
+   scaled = value * (double) POWERS_OF_TEN[decimals];
+   if(scaled > -9.0e18 && scaled < 9.0e18)
+   {
+      /* Fixed point: rounded once, then integer and fraction printed as integers */
+      int64_t rounded = (int64_t) (scaled + ((scaled < 0) ? -0.5 : 0.5));
+      uint64_t magnitude = (rounded < 0) ? (uint64_t) -(rounded + 1) + 1 : (uint64_t) rounded;
+      uint64_t fraction = magnitude % POWERS_OF_TEN[decimals];
+
+      start = end;
+      for(uint32_t idx = 0; idx < decimals; ++idx, fraction /= 10)
+         *--start = '0' + (fraction % 10);
+      if(decimals > 0)
+         *--start = '.';
+      start = microhttpd_JsonDigits(start, magnitude / POWERS_OF_TEN[decimals]);
+      if(rounded < 0)
+         *--start = '-';
+   }
+   else
+   {
+      start = text;
+      end = &text[snprintf(text, sizeof(text), "%.17g", value)];
+   }
+   return (microhttpd_JsonValue(c, json, key) && microhttpd_JsonPut(c, json, start, end - start)) ? 0 : -1;
+}
+
+int microhttpd_json_bool(tMicroHttpdClient client, const char *key, bool value)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = microhttpd_JsonWriter(c);
+
+   if(NULL == json)
+      return -1;
+   return (microhttpd_JsonValue(c, json, key)
+      && microhttpd_JsonPut(c, json, value ? "true" : "false", value ? 4 : 5)) ? 0 : -1;
+}
+
+int microhttpd_json_null(tMicroHttpdClient client, const char *key)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = microhttpd_JsonWriter(c);
+
+   if(NULL == json)
+      return -1;
+   return (microhttpd_JsonValue(c, json, key) && microhttpd_JsonPut(c, json, "null", 4)) ? 0 : -1;
+}
+
+int microhttpd_json_end(tMicroHttpdClient client)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_json *json = c->json;
+   bool sent;
+
+   if(NULL == json || !json->active)
+      return -1;
+   if(!json->failed && (json->depth > 0 || 0 == (json->populated & 1)))
+   {
+      MH_DBG("%s: Document incomplete (depth %u)\n", __func__, json->depth);
+      return -1;
+   }
+
+   sent = !json->failed && microhttpd_JsonFlush(c, json, true);
+   json->active = false;
+   json->extra_header_options = NULL;
+   return sent ? 0 : -1;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+void microhttpd_JsonFree(struct md_client *client)
+{
+   if(NULL == client->json)
+      return;
+   microhttpd_BufferRelease(client->json->buffer);
+   free(client->json);
+   client->json = NULL;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! The client's writer, if a document is being written and nothing has failed */
+static struct md_json *microhttpd_JsonWriter(struct md_client *client)
+{
+   struct md_json *json = client->json;
+   return (NULL != json && json->active && !json->failed) ? json : NULL;
+}
+
+/*! Start a value: a comma after its predecessor, and its key within an object. Returns false,
+ *  writing nothing, if a key is missing or out of place, or the document already has its value. */
+static bool microhttpd_JsonValue(struct md_client *client, struct md_json *json, const char *key)
+{
+   uint32_t level = 1u << json->depth;
+
+   if((0 == json->depth) ? (NULL != key || (json->populated & level))
+      : ((NULL == key) != ((json->arrays & level) != 0)))
+   {
+      MH_DBG("%s: Value %s a key at depth %u\n", __func__, (NULL == key) ? "without" : "with", json->depth);
+      return false;
+   }
+
+   if((json->populated & level) && !microhttpd_JsonPut(client, json, ",", 1))
+      return false;
+   json->populated |= level;
+   if(NULL != key && (!microhttpd_JsonString(client, json, key) || !microhttpd_JsonPut(client, json, ":", 1)))
+      return false;
+   return true;
+}
+
+static bool microhttpd_JsonOpen(struct md_client *client, const char *key, char bracket, bool array)
+{
+   struct md_json *json = microhttpd_JsonWriter(client);
+   uint32_t level;
+
+   if(NULL == json || json->depth >= MICROHTTPD_JSON_MAX_DEPTH)
+      return false;
+   if(!microhttpd_JsonValue(client, json, key) || !microhttpd_JsonPut(client, json, &bracket, 1))
+      return false;
+
+   level = 1u << ++(json->depth);
+   json->populated &= ~level;
+   if(array)
+      json->arrays |= level;
+   else
+      json->arrays &= ~level;
+   return true;
+}
+
+/*! Quoted and escaped; runs that need no escaping are copied whole */
+static bool microhttpd_JsonString(struct md_client *client, struct md_json *json, const char *value)
+{
+   static const char HEX[] = "0123456789abcdef";
+   const char *run = value;
+   char escape[6];
+
+   if(!microhttpd_JsonPut(client, json, "\"", 1))
+      return false;
+   for(; '\0' != *value; ++value)
+   {
+      unsigned char ch = (unsigned char) *value;
+      uint32_t length = 2;
+
+      if(ch >= 0x20 && ch != '"' && ch != '\\')
+         continue;
+
+      escape[0] = '\\';
+      switch(ch)
+      {
+         case '"': escape[1] = '"'; break;
+         case '\\': escape[1] = '\\'; break;
+         case '\n': escape[1] = 'n'; break;
+         case '\r': escape[1] = 'r'; break;
+         case '\t': escape[1] = 't'; break;
+         case '\b': escape[1] = 'b'; break;
+         case '\f': escape[1] = 'f'; break;
+         default:
+            memcpy(&escape[1], "u00", 3);
+            escape[4] = HEX[ch >> 4];
+            escape[5] = HEX[ch & 0x0f];
+            length = 6;
+            break;
+      }
+      if(!microhttpd_JsonPut(client, json, run, value - run) || !microhttpd_JsonPut(client, json, escape, length))
+         return false;
+      run = value + 1;
+   }
+   return microhttpd_JsonPut(client, json, run, value - run) && microhttpd_JsonPut(client, json, "\"", 1);
+}
+
+static bool microhttpd_JsonPut(struct md_client *client, struct md_json *json, const char *data,
+   uint32_t length)
+{
+   while(length > 0)
+   {
+      uint32_t room = MICROHTTPD_JSON_BUFFER_SIZE - json->length;
+
+      if(0 == room)
+      {
+         if(!microhttpd_JsonFlush(client, json, false))
+            return false;
+         continue;
+      }
+      if(room > length)
+         room = length;
+      memcpy(&json->buffer->data[json->reserve + json->length], data, room);
+      json->length += room;
+      data += room;
+      length -= room;
+   }
+   return true;
+}
+
+/*! Send what's in the buffer, with the header in front if it hasn't gone yet. The final flush of a
+ *  document that never filled the buffer knows its length; otherwise the body is chunked. */
+static bool microhttpd_JsonFlush(struct md_client *client, struct md_json *json, bool final)
+{
+   char *data = json->buffer->data;
+   uint32_t start = json->reserve, end = json->reserve + json->length;
+   uint32_t header_length = 0, line_length = 0;
+   bool body = (MICROHTTPD_METHOD_HEAD != client->method);
+   char line[JSON_CHUNK_LINE_MAX + 1];
+
+   if(!json->header_sent)
+   {
+      uint32_t content_length = json->length;
+
+      if(!final)
+      {
+         json->chunked = (NULL == client->stream);
+         content_length = json->chunked ? MICROHTTPD_LENGTH_CHUNKED : MICROHTTPD_LENGTH_UNKNOWN;
+      }
+      header_length = microhttpd_FormatResponseHeader(data, json->code, JSON_CONTENT_TYPE, content_length,
+         json->extra_header_options, client->close_after_response);
+      json->header_sent = true;
+   }
+
+   if(!body)
+      end = start;
+   else if(json->chunked)
+   {
+      if(json->length > 0)
+      {
+         line_length = sprintf(line, "%"PRIx32"\r\n", json->length);
+         memcpy(&data[end], "\r\n", 2);
+         end += 2;
+      }
+      if(final)
+      {
+         memcpy(&data[end], "0\r\n\r\n", 5);
+         end += 5;
+      }
+   }
+
+   /* Header and chunk size line end right where the data starts */
+   start -= line_length;
+   memcpy(&data[start], line, line_length);
+   start -= header_length;
+   memmove(&data[start], data, header_length);
+
+   json->total += json->length;
+   json->length = 0;
+   if(end > start && !microhttpd_JsonSend(client, json, start, end - start))
+   {
+      MH_DBG("%s: Failed to send %"PRIu32" bytes\n", __func__, end - start);
+      json->failed = true;
+      return false;
+   }
+   if(!final && !microhttpd_JsonBuffer(json, json->buffer->capacity))
+   {
+      json->failed = true;
+      return false;
+   }
+   return true;
+}
+
+static bool microhttpd_JsonSend(struct md_client *client, struct md_json *json, uint32_t offset,
+   uint32_t length)
+{
+   if(NULL != client->deferred)
+      return microhttpd_DeferredAppend(client->deferred, &json->buffer->data[offset], length);
+
+   json->buffer->length = offset + length;
+   return microhttpd_ClientSendBuffer(client, json->buffer, offset, length) == (int32_t) length;
+}
+
+/*! Make sure the writer has a buffer of at least capacity bytes to itself, replacing one that's too
+ *  small or still queued for sending */
+static bool microhttpd_JsonBuffer(struct md_json *json, uint32_t capacity)
+{
+   if(NULL != json->buffer && (json->buffer->capacity < capacity
+   || atomic_load_explicit(&json->buffer->refcount, memory_order_relaxed) != 1))
+   {
+      microhttpd_BufferRelease(json->buffer);
+      json->buffer = NULL;
+   }
+   if(NULL == json->buffer)
+      json->buffer = microhttpd_BufferAlloc(capacity);
+   if(NULL == json->buffer)
+      return false;
+   json->buffer->length = 0;
+   return true;
+}
+
+/*! Decimal digits of value, written backwards to end at end. Returns where they start. */
+static char *microhttpd_JsonDigits(char *end, uint64_t value)
+{
+   do
+   {
+      *--end = '0' + (value % 10);
+      value /= 10;
+   } while(value > 0);
+   return end;
+}
@@ -0,0 +1,42 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file json.h
+ *  \brief microhttpd JSON response writer
+ */
+#ifndef _MICROHTTPD_JSON_H
+#define _MICROHTTPD_JSON_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if !defined(MICROHTTPD_JSON_BUFFER_SIZE)
+#define MICROHTTPD_JSON_BUFFER_SIZE 4096 /* Larger documents are sent chunked, a buffer at a time */
+#endif
+#define MICROHTTPD_JSON_MAX_DEPTH   31   /* Nested objects and arrays */
+
+struct md_buffer;
+
+struct md_json
+{
+   struct md_buffer *buffer;  /* Header room, then the document; reused while nothing else holds it */
+   uint32_t reserve;          /* Header room: the response header, then a chunk size line */
+   uint32_t length;           /* Document bytes in the buffer */
+   uint32_t total;            /* Document bytes sent before them */
+   bool active;               /* Between microhttpd_json_begin() and microhttpd_json_end() */
+   bool header_sent;
+   bool chunked;              /* Body sent with chunked transfer coding */
+   bool failed;               /* Sending failed; the rest of the document is dropped */
+
+   uint16_t code;
+   const char *extra_header_options;
+
+   /* Nesting; bit n describes level n, where level 0 holds the document's single value */
+   uint8_t depth;
+   uint32_t arrays;           /* Level is an array rather than an object */
+   uint32_t populated;        /* Level has a value, so the next one needs a comma */
+};
+
+void microhttpd_JsonFree(struct md_client *client);
+
+#endif /* _MICROHTTPD_JSON_H */
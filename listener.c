@@ -0,0 +1,389 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file listener.c
+ *  \brief microhttpd listening sockets
+ *
+ *  A context listens on up to MICROHTTPD_MAX_LISTENERS sockets, each IPv4, IPv6 or Unix domain, and
+ *  the event backend accepts from all of them. A listener may also be a socket inherited from the
+ *  parent process or received from a predecessor with microhttpd_receive_listeners(), so a restart
+ *  never leaves the port unbound. Passing sockets to a successor sends them in configuration order
+ *  in a single SCM_RIGHTS message, preceded by one byte holding their count.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <errno.h>
+#if !defined(LWIP_SOCKET)
+#include <arpa/inet.h>
+#endif
+#include "debug.h"
+#include "listener.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#define LISTENER_NAME(config) ((NULL != (config)->address && '\0' != (config)->address[0]) ? (config)->address : "*")
+
+static int microhttpd_ListenerOpen(struct md_listener *listener, const tMicroHttpdListener *config);
+static int microhttpd_ListenerAdopt(struct md_listener *listener, const char *address);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+int microhttpd_send_listeners(tMicroHttpdContext context, int unix_socket)
+{
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS) && defined(SCM_RIGHTS)
+   struct md_context *ctx = (struct md_context *) context;
+   union
+   {
+      struct cmsghdr header; /* For alignment */
+      char buffer[CMSG_SPACE(sizeof(int) * MICROHTTPD_MAX_LISTENERS)];
+   } control;
+   uint8_t count = (uint8_t) ctx->listener_count;
+   struct iovec iov = { &count, 1 };
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   ssize_t result;
+
+   if(0 == count)
+   {
+      MH_DBG("%s: No listening sockets to send\n", __func__);
+      return -1;
+   }
+
+   memset(&msg, 0, sizeof(msg));
+   memset(&control, 0, sizeof(control));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buffer;
+   msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+   for(uint32_t idx = 0; idx < count; ++idx)
+      memcpy(CMSG_DATA(cmsg) + idx * sizeof(int), &ctx->listeners[idx].socket, sizeof(int));
+
+   do
+   {
+      result = sendmsg(unix_socket, &msg, MSG_NOSIGNAL);
+   } while(result < 0 && EINTR == errno);
+   if(result != 1)
+   {
+      MH_DBG("%s: sendmsg failed (errno %d)\n", __func__, errno);
+      return -1;
+   }
+   return 0;
+#else
+   MH_DBG("%s: Not supported on this platform\n", __func__);
+   return -1;
+#endif
+}
+
+int microhttpd_receive_listeners(int unix_socket, int *sockets, uint32_t max_count)
+{
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS) && defined(SCM_RIGHTS)
+   union
+   {
+      struct cmsghdr header;
+      char buffer[CMSG_SPACE(sizeof(int) * MICROHTTPD_MAX_LISTENERS)];
+   } control;
+   uint8_t count = 0;
+   struct iovec iov = { &count, 1 };
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   uint32_t received = 0;
+   ssize_t result;
+   int flags = 0;
+
+#if defined(MSG_CMSG_CLOEXEC)
+   flags |= MSG_CMSG_CLOEXEC;
+#endif
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buffer;
+   msg.msg_controllen = sizeof(control.buffer);
+   do
+   {
+      result = recvmsg(unix_socket, &msg, flags);
+   } while(result < 0 && EINTR == errno);
+   if(result != 1)
+   {
+      MH_DBG("%s: recvmsg failed (%d, errno %d)\n", __func__, (int) result, errno);
+      return -1;
+   }
+
+   /* Keep what fits; close anything else so it isn't leaked */
+   for(cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+   {
+      uint32_t fd_count, idx;
+
+      if(SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type)
+         continue;
+      fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for(idx = 0; idx < fd_count; ++idx)
+      {
+         int fd;
+
+         memcpy(&fd, CMSG_DATA(cmsg) + idx * sizeof(int), sizeof(int));
+         if(received < max_count)
+            sockets[received++] = fd;
+         else
+            close(fd);
+      }
+   }
+   if(received != count || (msg.msg_flags & MSG_CTRUNC))
+   {
+      MH_DBG("%s: Expected %u sockets, kept %"PRIu32"\n", __func__, count, received);
+      while(received > 0)
+         close(sockets[--received]);
+      return -1;
+   }
+   return (int) received;
+#else
+   MH_DBG("%s: Not supported on this platform\n", __func__);
+   return -1;
+#endif
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+int microhttpd_ListenersOpen(struct md_context *ctx)
+{
+   tMicroHttpdListener fallback = { NULL, ctx->params.server_port };
+   const tMicroHttpdListener *config = ctx->params.listeners;
+   uint32_t count = ctx->params.listener_count;
+   uint32_t idx;
+
+   if(0 == count)
+   {
+      config = &fallback;
+      count = 1;
+   }
+   if(count > MICROHTTPD_MAX_LISTENERS)
+   {
+      MH_DBG("%s: Too many listeners (%"PRIu32")\n", __func__, count);
+      return -1;
+   }
+
+   for(idx = 0; idx < count; ++idx)
+   {
+      if(microhttpd_ListenerOpen(&ctx->listeners[idx], &config[idx]) != 0)
+      {
+         microhttpd_ListenersClose(ctx);
+         return -1;
+      }
+      ++(ctx->listener_count);
+   }
+   ctx->params.listeners = NULL; /* Not kept by the caller */
+   return 0;
+}
+
+void microhttpd_ListenersClose(struct md_context *ctx)
+{
+   uint32_t idx;
+
+   for(idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      struct md_listener *listener = &ctx->listeners[idx];
+
+      close(listener->socket);
+      if(NULL != listener->path)
+      {
+         unlink(listener->path);
+         free(listener->path);
+      }
+   }
+   ctx->listener_count = 0;
+}
+
+/*! Close the listening sockets without removing Unix domain socket paths, which a successor may
+ *  now be listening on */
+void microhttpd_ListenersStop(struct md_context *ctx)
+{
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+   {
+      free(ctx->listeners[idx].path);
+      ctx->listeners[idx].path = NULL;
+   }
+   microhttpd_ListenersClose(ctx);
+}
+
+/*! Fill in the socket address for an address as given in a listener's configuration. Returns its
+ *  length, or 0 if the address isn't valid. */
+socklen_t microhttpd_SocketAddress(union md_socket_address *addr, const char *address, uint16_t port)
+{
+   memset(addr, 0, sizeof(*addr));
+   if(NULL == address || '\0' == address[0])
+   {
+      addr->in.sin_family = AF_INET;
+      addr->in.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr->in.sin_port = htons(port);
+      return sizeof(addr->in);
+   }
+
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+   if(strncmp(address, "unix:", 5) == 0)
+   {
+      size_t path_length = strlen(&address[5]);
+
+      if(0 == path_length || path_length >= sizeof(addr->un.sun_path))
+         return 0;
+      addr->un.sun_family = AF_UNIX;
+      memcpy(addr->un.sun_path, &address[5], path_length + 1);
+      return offsetof(struct sockaddr_un, sun_path) + path_length + 1;
+   }
+#endif
+
+#if defined(AF_INET6)
+   if(NULL != strchr(address, ':'))
+   {
+      if(inet_pton(AF_INET6, address, &addr->in6.sin6_addr) != 1)
+         return 0;
+      addr->in6.sin6_family = AF_INET6;
+      addr->in6.sin6_port = htons(port);
+      return sizeof(addr->in6);
+   }
+#endif
+
+   if(inet_pton(AF_INET, address, &addr->in.sin_addr) != 1)
+      return 0;
+   addr->in.sin_family = AF_INET;
+   addr->in.sin_port = htons(port);
+   return sizeof(addr->in);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int microhttpd_ListenerOpen(struct md_listener *listener, const tMicroHttpdListener *config)
+{
+   union md_socket_address addr;
+   socklen_t length;
+   int enable = 1;
+
+   memset(listener, 0, sizeof(*listener));
+   listener->tls = config->tls;
+   if(NULL != config->address && strncmp(config->address, "fd:", 3) == 0)
+      return microhttpd_ListenerAdopt(listener, &config->address[3]);
+
+   length = microhttpd_SocketAddress(&addr, config->address, config->port);
+   if(0 == length)
+   {
+      MH_DBG("%s: Invalid listen address '%s'\n", __func__, LISTENER_NAME(config));
+      return -1;
+   }
+
+   listener->socket = socket(addr.sa.sa_family, SOCK_STREAM, 0);
+   if(listener->socket < 0)
+   {
+      MH_DBG("%s: Failed to create listening socket for '%s'\n", __func__, LISTENER_NAME(config));
+      return -1;
+   }
+
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+   if(AF_UNIX == addr.sa.sa_family)
+   {
+      listener->local = true;
+      unlink(addr.un.sun_path); /* Left behind by a previous run */
+   }
+   else
+#endif
+   if(setsockopt(listener->socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+   {
+      MH_DBG("%s: Failed to enable SO_REUSEADDR\n", __func__); /* Don't treat this as a fatal error */
+   }
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+   /* So "::" and an IPv4 listener can share a port */
+   if(AF_INET6 == addr.sa.sa_family
+   && setsockopt(listener->socket, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable)) < 0)
+   {
+      MH_DBG("%s: Failed to enable IPV6_V6ONLY\n", __func__);
+   }
+#endif
+
+   if(bind(listener->socket, &addr.sa, length) < 0)
+   {
+      MH_DBG("%s: Error binding '%s' port %u\n", __func__, LISTENER_NAME(config), config->port);
+   }
+   else if(fcntl(listener->socket, F_SETFL, fcntl(listener->socket, F_GETFL, 0) | O_NONBLOCK) != 0)
+   {
+      MH_DBG("%s: Failed to set non-blocking mode on listening socket\n", __func__);
+   }
+   else if(listen(listener->socket, MICROHTTPD_MAX_QUEUED_CONNECTIONS))
+   {
+      MH_DBG("%s: Failed to listen on '%s'\n", __func__, LISTENER_NAME(config));
+   }
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+   else if(listener->local && NULL == (listener->path = strdup(addr.un.sun_path)))
+   {
+      MH_DBG("%s: Failed to allocate socket path\n", __func__);
+      unlink(addr.un.sun_path);
+   }
+#endif
+   else
+   {
+      MH_DBG("%s: Server listening on '%s' port %u\n", __func__, LISTENER_NAME(config), config->port);
+      return 0;
+   }
+
+   close(listener->socket);
+   listener->socket = -1;
+   return -1;
+}
+
+/*! Take over an inherited or received socket, given its descriptor number. It is listened on if it
+ *  isn't already. A Unix domain socket's path is left in place when it is closed. */
+static int microhttpd_ListenerAdopt(struct md_listener *listener, const char *address)
+{
+   union md_socket_address addr;
+   socklen_t length = sizeof(addr);
+   int type = 0, accepting = 0;
+   socklen_t option_length = sizeof(type);
+   char *end;
+   long fd = strtol(address, &end, 10);
+
+   if(end == address || '\0' != *end || fd < 0 || fd > INT32_MAX)
+   {
+      MH_DBG("%s: Invalid descriptor 'fd:%s'\n", __func__, address);
+      return -1;
+   }
+   if(getsockopt((int) fd, SOL_SOCKET, SO_TYPE, &type, &option_length) < 0 || SOCK_STREAM != type
+   || getsockname((int) fd, &addr.sa, &length) < 0)
+   {
+      MH_DBG("%s: Descriptor %ld is not a stream socket\n", __func__, fd);
+      return -1;
+   }
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+   listener->local = (AF_UNIX == addr.sa.sa_family);
+#endif
+
+#if defined(SO_ACCEPTCONN)
+   option_length = sizeof(accepting);
+   if(getsockopt((int) fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &option_length) < 0)
+      accepting = 0;
+#endif
+   if(!accepting && listen((int) fd, MICROHTTPD_MAX_QUEUED_CONNECTIONS) != 0)
+   {
+      MH_DBG("%s: Failed to listen on descriptor %ld\n", __func__, fd);
+      return -1;
+   }
+   if(fcntl((int) fd, F_SETFL, fcntl((int) fd, F_GETFL, 0) | O_NONBLOCK) != 0)
+   {
+      MH_DBG("%s: Failed to set non-blocking mode on descriptor %ld\n", __func__, fd);
+      return -1;
+   }
+
+   MH_DBG("%s: Server listening on descriptor %ld\n", __func__, fd);
+   listener->socket = (int) fd;
+   return 0;
+}
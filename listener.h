@@ -0,0 +1,35 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file listener.h
+ *  \brief microhttpd listening sockets
+ */
+#ifndef _MICROHTTPD_LISTENER_H
+#define _MICROHTTPD_LISTENER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if defined(AF_UNIX) && !defined(LWIP_SOCKET)
+#define MICROHTTPD_HAVE_UNIX_SOCKETS
+#include <sys/un.h>
+#endif
+
+union md_socket_address
+{
+   struct sockaddr sa;
+   struct sockaddr_in in;
+#if defined(AF_INET6)
+   struct sockaddr_in6 in6;
+#endif
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+   struct sockaddr_un un;
+#endif
+};
+
+int microhttpd_ListenersOpen(struct md_context *ctx);
+void microhttpd_ListenersClose(struct md_context *ctx);
+void microhttpd_ListenersStop(struct md_context *ctx);
+socklen_t microhttpd_SocketAddress(union md_socket_address *addr, const char *address, uint16_t port);
+
+#endif /* _MICROHTTPD_LISTENER_H */
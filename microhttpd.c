@@ -7,27 +7,54 @@
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
-#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include "debug.h"
 #include "helpers.h"
 #include "client.h"
 #include "post.h"
+#include "transport.h"
+#include "events.h"
+#include "defer.h"
+#include "pool.h"
+#include "sse.h"
+#include "websocket.h"
+#include "h2.h"
+#include "admission.h"
+#include "listener.h"
+#include "assets.h"
+#include "route.h"
+#include "ratelimit.h"
+#include "drain.h"
+#include "proxy.h"
+#include "cache.h"
+#include "trace.h"
 #include "microhttpd_private.h"
 #include "microhttpd/microhttpd.h"
 
 // Forward function declarations
-static int microhttpd_CreateListeningSocket(struct md_context *ctx);
 
 static bool state_ParseHeader(struct md_client *client, uint32_t *consumed, bool *error);
 static bool state_HeaderComplete(struct md_client *client, uint32_t *consumed, bool *error);
 static bool state_HandleOperationGet(struct md_client *client, uint32_t *consumed, bool *error);
-static bool state_HandleOperationUnsupported(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_Deferred(struct md_client *client, uint32_t *consumed, bool *error);
+static bool microhttpd_GetOffloaded(struct md_client *client);
+static void microhttpd_ParseQuery(struct md_client *client, char *query);
+static uint32_t microhttpd_ParamHash(const char *key, uint32_t length);
+static void microhttpd_DispatchGet(struct md_client *client);
+static void microhttpd_DataSet(void **data, tMicroHttpdDataDestructor *destructor, void *new_data,
+   tMicroHttpdDataDestructor new_destructor);
+static uint32_t microhttpd_ProcessTimeout(struct md_context *ctx);
+static int microhttpd_ProcessFinish(struct md_context *ctx, int result);
+static int microhttpd_ExternalFinish(struct md_context *ctx);
 
 static const char *RESPONSE_HEADER = "HTTP/1.1 %u\r\nServer: " MICROHTTPD_SERVER_NAME "\r\n"
-   "Cache-control: no-cache\r\nPragma: no-cache\r\nAccept-Ranges: bytes\r\nContent-Length: %u\r\n";
+   "Cache-control: no-cache\r\nPragma: no-cache\r\nAccept-Ranges: bytes\r\n";
+static const char *CONTENT_LENGTH_FIELD = "Content-Length: %u\r\n";
+static const char *CHUNKED_FIELD = "Transfer-Encoding: chunked\r\n";
 static const char *CONTENT_TYPE_FIELD = "Content-Type: %s\r\n";
+static const char CONTINUE_RESPONSE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+static const char CONNECTION_CLOSE_FIELD[] = "Connection: close\r\n";
 
 /* -------------------------------------------------------------------------------------------------
  * Exported Functions
@@ -52,121 +79,122 @@ tMicroHttpdContext microhttpd_start(tMicroHttpdParams *params)
    memset(ctx, 0, sizeof(*ctx));
    memcpy(&ctx->params, params, sizeof(ctx->params));
 
-   if(microhttpd_CreateListeningSocket(ctx) != 0)
+   if(microhttpd_ProxyInit(ctx) != 0)
+      goto fail_proxy;
+   if(microhttpd_RateLimitInit(ctx) != 0)
+      goto fail_ratelimit;
+   if(microhttpd_ListenersOpen(ctx) != 0)
    {
-      MH_DBG("%s: Failed to create server listening socket on port %u\n",
-         __func__, params->server_port);
-      return NULL;
+      MH_DBG("%s: Failed to open listening sockets\n", __func__);
+      goto fail_listeners;
+   }
+   if(microhttpd_TlsInit(ctx) != 0)
+      goto fail_tls;
+
+   atomic_init(&ctx->completions, NULL);
+   ctx->rx_scratch = malloc(ctx->params.rx_buffer_size);
+   if(NULL == ctx->rx_scratch || microhttpd_WakeInit(ctx) != 0)
+   {
+      MH_DBG("%s: Failed to initialize event handling\n", __func__);
+      goto fail_wake;
+   }
+   if(microhttpd_EventsInit(ctx) != 0 || microhttpd_PoolInit(ctx) != 0)
+   {
+      MH_DBG("%s: No usable event backend or worker pool\n", __func__);
+      goto fail_events;
    }
    ctx->running = true;
 
    return (tMicroHttpdContext) ctx;
+
+   /* A failure undoes the steps that succeeded before it, in reverse order */
+fail_events:
+   microhttpd_PoolShutdown(ctx);
+   if(NULL != ctx->backend && NULL != ctx->backend->shutdown)
+      ctx->backend->shutdown(ctx);
+   microhttpd_WakeShutdown(ctx);
+fail_wake:
+   free(ctx->rx_scratch);
+   microhttpd_TlsShutdown(ctx);
+fail_tls:
+   microhttpd_ListenersClose(ctx);
+fail_listeners:
+   microhttpd_RateLimitShutdown(ctx);
+fail_ratelimit:
+   microhttpd_ProxyShutdown(ctx);
+fail_proxy:
+   free(ctx);
+   return NULL;
 }
 
 int microhttpd_process(tMicroHttpdContext context)
 {
    struct md_context *ctx = (struct md_context *) context;
-   int fd_max, nResult;
-   uint32_t client_count = 0;
-   fd_set fdRead;
-   fd_set fdError;
-   struct md_client *client, **client_list;
-   struct timeval timeout, *pTimeout = NULL;
+   int result;
 
    MH_DBG("%s\n", __func__);
 
    if(!ctx->running)
      return -1;
 
-   if(ctx->params.process_timeout > 0)
-   {
-      timeout.tv_sec = ctx->params.process_timeout / 1000;
-      timeout.tv_usec = (ctx->params.process_timeout % 1000) * 1000;
-      pTimeout = &timeout;
-   }
-   
-   FD_ZERO(&fdRead);
-   FD_SET(ctx->listen_socket, &fdRead);
-   FD_SET(ctx->listen_socket, &fdError);
-   fd_max = ctx->listen_socket;
-   for(client = ctx->client_list; client != NULL; client = (struct md_client *) client->next)
-   {
-      fd_max = MAX(fd_max, client->socket);
-      FD_SET(client->socket, &fdRead);
-      FD_SET(client->socket, &fdError);
-      ++client_count;
-   }
+   result = ctx->backend->process(ctx, microhttpd_ProcessTimeout(ctx));
+   return microhttpd_ProcessFinish(ctx, result);
+}
 
-   // Make a copy of the client list that was used to populate the upcoming select call. This
-   //  is necessary since the client list can change (shrink) as select events are processed.
-   client_list = (struct md_client **) malloc(sizeof(struct md_client *) * client_count);
-   client = ctx->client_list;
-   for(int i = 0; i < client_count; ++i)
-   {
-      client_list[i] = client;
-      client = client->next;
-   }
+int microhttpd_handle_event(tMicroHttpdContext context, int fd, uint32_t events)
+{
+   struct md_context *ctx = (struct md_context *) context;
 
-   MH_DBG("%s: Waiting for %"PRIu32" clients\n", __func__, client_count);
+   if(!ctx->running || &md_events_external != ctx->backend)
+      return -1;
 
-   nResult = select(fd_max + 1, &fdRead, NULL, &fdError, pTimeout);
-   if(nResult == 0)
-   {
-      free(client_list);
-      return 0;  /* Nothing received within timeout */
-   }
-   if(nResult < 0)
-   {
-      MH_DBG("%s: select failed (errno %d)\n", __func__, errno);
-      // Go through the list of clients and prune any closed sockets
-      for(int i = 0; i < client_count; ++i)
-      {
-         if(fcntl(client_list[i]->socket, F_GETFD) != 0)
-            microhttpd_RemoveClient(ctx, client_list[i]);
-      }
-      free(client_list);
+   microhttpd_ExternalEvent(ctx, fd, events);
+   return microhttpd_ExternalFinish(ctx);
+}
+
+int microhttpd_handle_timers(tMicroHttpdContext context)
+{
+   struct md_context *ctx = (struct md_context *) context;
+
+   if(!ctx->running || &md_events_external != ctx->backend)
       return -1;
-   }
 
-   /* First, process any data received from clients */
-   for(int i = 0; i < client_count; ++i)
-   {
-      client = client_list[i];
-      if(FD_ISSET(client->socket, &fdError))
-         microhttpd_HandleClientError(ctx, client);
-      else if(FD_ISSET(client->socket, &fdRead))
-         microhttpd_HandleClientReceive(ctx, client);
-   }
-   free(client_list);
+   return microhttpd_ExternalFinish(ctx);
+}
 
-   /* Finally, accept any new clients */
-   if(FD_ISSET(ctx->listen_socket, &fdRead))
-   {
-      struct sockaddr_in info;
-      socklen_t length = sizeof(info);
-      int nSocket;
+int32_t microhttpd_get_timeout(tMicroHttpdContext context)
+{
+   struct md_context *ctx = (struct md_context *) context;
+   uint32_t timeout_ms;
 
-      nSocket = accept(ctx->listen_socket, (struct sockaddr *) &info, &length);
-      if(nSocket < 0)
-      {
-         MH_DBG("%s: Failed to accept client (%d)\n", __func__, nSocket);
-      }
-      else
-         microhttpd_NewClient(ctx, nSocket, &info);
-   }
+   if(!ctx->running)
+      return -1;
+   timeout_ms = microhttpd_ProcessTimeout(ctx);
+   if(0 == timeout_ms)
+      return -1;
+   return (timeout_ms > INT32_MAX) ? INT32_MAX : (int32_t) timeout_ms;
+}
 
-   return 0; 
+const char *microhttpd_get_event_backend(tMicroHttpdContext context)
+{
+   struct md_context *ctx = (struct md_context *) context;
+   return ctx->backend->name;
 }
 
 int microhttpd_send_data(tMicroHttpdClient client, uint32_t length, const char *content)
 {
    struct md_client *c = (struct md_client *) client;
+   struct iovec iov = { (void *) content, length };
    int32_t result;
 
    if(0 == length || NULL == content)
       return -1;
+   if(MICROHTTPD_METHOD_HEAD == c->method)
+      return 0;
+   if(NULL != c->deferred)
+      return microhttpd_DeferredAppend(c->deferred, content, length) ? 0 : -1;
 
-   result = send(c->socket, content, length, 0);
+   result = microhttpd_ClientSend(c, &iov, 1);
    if(result != length)
    {
       MH_DBG("%s: Failed to send %"PRIu32" byte content (%"PRIi32")\n", __func__, length, result);
@@ -181,45 +209,98 @@ int microhttpd_send_response(tMicroHttpdClient client, uint16_t code, const char
    uint32_t content_length, const char *extra_header_options, const char *content)
 {
    struct md_client *c = (struct md_client *) client;
+   struct iovec iov[2];
    char *tx;
    int32_t length, result;
 
-   length = strlen(RESPONSE_HEADER) + 20;
-   if(NULL != extra_header_options)
-      length += strlen(extra_header_options);
-   if(content_type != NULL)
-      length += strlen(CONTENT_TYPE_FIELD) + strlen(content_type);
+   c->responded = true;
+   if(NULL != c->deferred)
+   {
+      /* Collected and sent by the event loop when the request completes */
+      return microhttpd_DeferredRespond(c->deferred, code, content_type, content_length,
+         extra_header_options, content) ? 0 : -1;
+   }
+
+   length = microhttpd_ResponseHeaderSize(content_type, extra_header_options);
    tx = malloc(length);
    if(NULL == tx)
    {
       MH_DBG("%s: Failed to allocate response buffer (%"PRIi32" bytes)\n", __func__, length);
       return -1;
    }
-   
-   /* Build and send header */
-   length = sprintf(tx, RESPONSE_HEADER, code, content_length);
-   if(NULL != extra_header_options)
-   {
-      strcpy(&tx[length], extra_header_options); 
-      length += strlen(extra_header_options);
-   }
-   if(content_type != NULL)
-      length += sprintf(&tx[length], CONTENT_TYPE_FIELD, content_type);
-   length += sprintf(&tx[length], "\r\n");
-   result = send(c->socket, tx, length, 0);
+   length = microhttpd_FormatResponseHeader(tx, code, content_type, content_length,
+      extra_header_options, c->close_after_response);
+
+   /* Header and content go out in a single gather write */
+   iov[0].iov_base = tx;
+   iov[0].iov_len = length;
+   iov[1].iov_base = (void *) content;
+   iov[1].iov_len = (NULL != content && MICROHTTPD_METHOD_HEAD != c->method) ? content_length : 0;
+   result = microhttpd_ClientSend(c, iov, 2);
    free(tx);
-   if(result != length)
+   if(result < 0)
    {
-      MH_DBG("%s: Failed to send %"PRIi32" byte header (%"PRIi32")\n", __func__, length, result);
+      MH_DBG("%s: Failed to send %"PRIi32" byte header\n", __func__, length);
       /* TODO: close connection? */
       return -1;
    }
 
-   if(content_length > 0 && NULL != content)
-      return microhttpd_send_data(client, content_length, content);
    return 0;
 }
 
+const char *microhttpd_get_param(tMicroHttpdClient client, const char *key, uint32_t *length)
+{
+   struct md_client *c = (struct md_client *) client;
+   uint32_t key_length = strlen(key);
+   uint32_t hash = microhttpd_ParamHash(key, key_length);
+   uint32_t probe;
+
+   for(probe = 0; probe < MICROHTTPD_URI_PARAM_HASH_SIZE; ++probe)
+   {
+      md_param_index idx = c->uri_param_index[(hash + probe) & (MICROHTTPD_URI_PARAM_HASH_SIZE - 1)];
+      struct md_uri_param *param;
+
+      if(0 == idx)
+         return NULL;
+      param = &c->uri_param_info[idx - 1];
+      if(param->hash == hash && param->key_length == key_length
+      && memcmp(c->uri_params[idx - 1], key, key_length) == 0)
+      {
+         if(NULL != length)
+            *length = param->value_length;
+         return param->value;
+      }
+   }
+   return NULL;
+}
+
+const char *microhttpd_get_source_address(tMicroHttpdClient client)
+{
+   return microhttpd_SourceAddress((struct md_client *) client);
+}
+
+void microhttpd_set_request_data(tMicroHttpdClient client, void *data, tMicroHttpdDataDestructor destructor)
+{
+   struct md_client *c = (struct md_client *) client;
+   microhttpd_DataSet(&c->request_data, &c->request_destructor, data, destructor);
+}
+
+void *microhttpd_get_request_data(tMicroHttpdClient client)
+{
+   return ((struct md_client *) client)->request_data;
+}
+
+void microhttpd_set_connection_data(tMicroHttpdClient client, void *data, tMicroHttpdDataDestructor destructor)
+{
+   struct md_client *c = microhttpd_H2Connection((struct md_client *) client);
+   microhttpd_DataSet(&c->connection_data, &c->connection_destructor, data, destructor);
+}
+
+void *microhttpd_get_connection_data(tMicroHttpdClient client)
+{
+   return microhttpd_H2Connection((struct md_client *) client)->connection_data;
+}
+
 /* -------------------------------------------------------------------------------------------------
  * Common Functions
  */
@@ -228,61 +309,162 @@ void microhttpd_ResetState(struct md_client *client)
 {
    string_list_clear(&client->header_entries, &client->header_entry_count);
    string_list_clear(&client->post_header_entries, &client->post_header_entry_count);
+   microhttpd_PostFree(client);
+   microhttpd_CacheCancel(client);
+   microhttpd_RequestFinished(client);
+   client->responded = false;
+   client->continue_sent = false;
+   microhttpd_DataSet(&client->request_data, &client->request_destructor, NULL, NULL);
    client->state = state_ParseHeader;
+#if defined(MICROHTTPD_TRACE)
+   ++(client->trace_request);
+#endif
 }
 
-/* -------------------------------------------------------------------------------------------------
- * Private Helper Functions
- */
-
-static int microhttpd_CreateListeningSocket(struct md_context *ctx)
+/*! Destroy the application data of a connection being freed */
+void microhttpd_ConnectionDataFree(struct md_client *client)
 {
-   struct sockaddr_in sinAddress = {0};
-   int result = -1;
+   microhttpd_DataSet(&client->connection_data, &client->connection_destructor, NULL, NULL);
+}
 
-   ctx->listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-   if(ctx->listen_socket < 0)
+/*! Called once a request's handler has returned. A deferred request keeps its header (and therefore
+ *  URI and parameters) until it is completed; an event stream or WebSocket takes no further requests. */
+void microhttpd_FinishRequest(struct md_client *client)
+{
+   MH_TRACE(client, FINISH, client->pipeline_count);
+   ++(client->pipeline_count);
+   if(NULL != client->channel)
+      client->state = state_EventStream;
+   else if(NULL != client->websocket)
+      client->state = state_WebSocketFrame;
+   else if(NULL != client->deferred)
+      client->state = state_Deferred;
+   else
    {
-      MH_DBG("%s: Failed to create listening socket\n", __func__);
+      microhttpd_ResetState(client);
+      if(NULL != client->stream)
+         client->state = state_H2StreamDone;
    }
-   else
+}
+
+/*! Value of a request header entry, with leading whitespace skipped; name is lower case, without the
+ *  colon. Returns NULL if the request has no such entry. */
+const char *microhttpd_HeaderValue(struct md_client *client, const char *name)
+{
+   uint32_t idx, length = strlen(name);
+
+   for(idx = 1; idx < client->header_entry_count; ++idx)
    {
-      int enable = 1;
-      if(setsockopt(ctx->listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-      {
-         MH_DBG("%s: Failed to enable SO_REUSEADDR\n", __func__); /* Don't treat this as a fatal error */
-      }
+      const char *entry = client->header_entries[idx];
 
-      sinAddress.sin_family = AF_INET;
-      sinAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-      sinAddress.sin_port = htons(ctx->params.server_port);
-      if(bind(ctx->listen_socket, (struct sockaddr*) &sinAddress, sizeof(sinAddress)) < 0)
-      {
-         MH_DBG("%s: Error binding on port %u\n", __func__, ctx->params.server_port); 
-      }
-      else if(fcntl(ctx->listen_socket, F_SETFL, 
-         fcntl(ctx->listen_socket, F_GETFL, 0) | O_NONBLOCK) != 0)
+      if(strncmp(entry, name, length) == 0 && entry[length] == ':')
       {
-         MH_DBG("%s: Failed to set non-blocking mode on listening socket\n", __func__);
-      }
-      else if(listen(ctx->listen_socket, MICROHTTPD_MAX_QUEUED_CONNECTIONS))
-      {
-         MH_DBG("%s: Failed to listen on server socket\n", __func__);
-      }
-      else
-      {
-         MH_DBG("%s: Server running on port %u\n", __func__, ctx->params.server_port);
-         result = 0;
+         entry += length + 1;
+         while(*entry == ' ' || *entry == '\t')
+            ++entry;
+         return entry;
       }
+   }
+
+   return NULL;
+}
 
-      if(result != 0)
+/*! Length of the request body from its Content-Length field, or 0 without one. Returns false if
+ *  where the body ends is in doubt: with Transfer-Encoding, which bodies aren't read by, more than
+ *  one Content-Length, or a value other than a decimal number that fits. Something else on the path
+ *  could read such a request differently, so it's refused and the connection closed. */
+bool microhttpd_ContentLength(struct md_client *client, uint32_t *length)
+{
+   static const char name[] = "content-length:";
+   bool found = false;
+
+   *length = 0;
+   if(NULL != microhttpd_HeaderValue(client, "transfer-encoding"))
+      return false;
+   for(uint32_t idx = 1; idx < client->header_entry_count; ++idx)
+   {
+      const char *value = client->header_entries[idx];
+
+      if(strncmp(value, name, sizeof(name) - 1) != 0)
+         continue;
+      if(found)
+         return false;
+      found = true;
+
+      value += sizeof(name) - 1;
+      while(*value == ' ' || *value == '\t')
+         ++value;
+      if(*value < '0' || *value > '9')
+         return false;
+      for(; *value >= '0' && *value <= '9'; ++value)
       {
-         close(ctx->listen_socket);
-         ctx->listen_socket = -1;
+         if(*length > (UINT32_MAX - (uint32_t) (*value - '0')) / 10)
+            return false;
+         *length = *length * 10 + (uint32_t) (*value - '0');
       }
+      while(*value == ' ' || *value == '\t')
+         ++value;
+      if(*value != '\0')
+         return false;
    }
+   return true;
+}
 
-   return result;
+/*! True if the client sent "Expect: 100-continue" and is owed an answer before sending the body.
+ *  HTTP/1.0 clients and HTTP/2 streams aren't sent the interim response, and a request without a
+ *  body doesn't need one. */
+bool microhttpd_ContinueExpected(struct md_client *client)
+{
+   return NULL == client->stream && client->content_remaining > 0 && !client->continue_sent
+      && strcmp(client->http_version, "HTTP/1.0") != 0
+      && string_has_token(microhttpd_HeaderValue(client, "expect"), "100-continue");
+}
+
+/*! Tell a client waiting for it to go ahead with the body */
+void microhttpd_ExpectContinue(struct md_client *client)
+{
+   struct iovec iov = { (void *) CONTINUE_RESPONSE, sizeof(CONTINUE_RESPONSE) - 1 };
+
+   if(!microhttpd_ContinueExpected(client))
+      return;
+   MH_DBG("%s: Continuing '%s'\n", __func__, client->uri);
+   client->continue_sent = true;
+   if(microhttpd_ClientSend(client, &iov, 1) < 0)
+      MH_DBG("%s: Failed to send response\n", __func__);
+}
+
+/*! Upper bound on the size of a response header, including the terminating blank line */
+uint32_t microhttpd_ResponseHeaderSize(const char *content_type, const char *extra_header_options)
+{
+   uint32_t length = strlen(RESPONSE_HEADER) + strlen(CHUNKED_FIELD) + strlen(CONNECTION_CLOSE_FIELD) + 20;
+   if(NULL != extra_header_options)
+      length += strlen(extra_header_options);
+   if(content_type != NULL)
+      length += strlen(CONTENT_TYPE_FIELD) + strlen(content_type);
+   return length;
+}
+
+int32_t microhttpd_FormatResponseHeader(char *tx, uint16_t code, const char *content_type,
+   uint32_t content_length, const char *extra_header_options, bool close)
+{
+   int32_t length;
+
+   length = sprintf(tx, RESPONSE_HEADER, code);
+   if(MICROHTTPD_LENGTH_CHUNKED == content_length)
+      length += sprintf(&tx[length], "%s", CHUNKED_FIELD);
+   else if(MICROHTTPD_LENGTH_UNKNOWN != content_length)
+      length += sprintf(&tx[length], CONTENT_LENGTH_FIELD, content_length);
+   if(close)
+      length += sprintf(&tx[length], "%s", CONNECTION_CLOSE_FIELD);
+   if(NULL != extra_header_options)
+   {
+      strcpy(&tx[length], extra_header_options); 
+      length += strlen(extra_header_options);
+   }
+   if(content_type != NULL)
+      length += sprintf(&tx[length], CONTENT_TYPE_FIELD, content_type);
+   length += sprintf(&tx[length], "\r\n");
+   return length;
 }
 
 /* -------------------------------------------------------------------------------------------------
@@ -294,11 +476,14 @@ static bool state_ParseHeader(struct md_client *client, uint32_t *consumed, bool
    uint32_t length;
    char *offset;
 
+   MH_TRACE(client, STATE_PARSE_HEADER, client->rx_size);
    offset = string_find(client->rx_buffer, client->rx_size, "\r\n", 2);
    if(offset == NULL)
       return false;  /* Header entry delimiter not found; need more rx data */
 
    length = offset - client->rx_buffer;
+   if(0 == client->header_entry_count && microhttpd_H2PriorKnowledge(client, length))
+      return true;
    if(0 == length)
    {
       MH_DBG("%s: Header parsing complete (%"PRIu32" entries)\n", __func__, client->header_entry_count);
@@ -308,6 +493,11 @@ static bool state_ParseHeader(struct md_client *client, uint32_t *consumed, bool
    }
    MH_DBG("%s: Found header option (length %"PRIu32")\n", __func__, length);
 
+   if(!microhttpd_HeaderReserve(client, length))
+   {
+      *error = true;
+      return false;
+   }
    if(!string_list_add(client->rx_buffer, length, &client->header_entries,
       &client->header_entry_count))
    {
@@ -317,7 +507,7 @@ static bool state_ParseHeader(struct md_client *client, uint32_t *consumed, bool
    }
 
    if(client->header_entry_count > 1)
-      lower(client->header_entries[client->header_entry_count-1]);
+      lower_field_name(client->header_entries[client->header_entry_count-1]);
 
    MH_DBG("%s: Header option %"PRIu32": '%s'\n", __func__, client->header_entry_count,
       client->header_entries[client->header_entry_count-1]);
@@ -331,12 +521,15 @@ static bool state_HeaderComplete(struct md_client *client, uint32_t *consumed, b
    char *offset;
    uint32_t remaining;
 
+   MH_TRACE(client, STATE_HEADER_COMPLETE, client->rx_size);
    if(client->header_entry_count == 0)
    {
       MH_DBG("%s: No header entries\n", __func__);
       *error = true;
       return false;
    }
+   if(microhttpd_H2Upgrade(client))
+      return true;
 
    /* Split-up the first header line into its three parts */
    offset = client->header_entries[0];
@@ -348,52 +541,100 @@ static bool state_HeaderComplete(struct md_client *client, uint32_t *consumed, b
    client->http_version = offset;
    MH_DBG("%s: http version '%s'\n", __func__, client->http_version);
 
-   /* Parse parameters in the URI */
+   if(NULL == client->uri)
+   {
+      MH_DBG("%s: Malformed request line\n", __func__);
+      *error = true;
+      return false;
+   }
+
+   client->uri_param_count = 0;
+   memset(client->uri_param_index, 0, sizeof(client->uri_param_index));
+   client->method = microhttpd_MethodParse(client->operation);
+   if(microhttpd_ProxyMatch(client))
+   {
+      /* Forwarded with the URI as it was received */
+      client->state = state_HandleOperationProxy;
+      if(!microhttpd_AdmitRequest(client))
+         client->state = state_RateLimited;
+      return true;
+   }
+
+   /* Split off and decode the query string, then decode the path; both in place */
    offset = strchr(client->uri, '?');
    if(NULL != offset)
    {
-      bool done = false;
-
       *offset = '\0';
-      ++offset;
-      remaining = strlen(offset);
-      client->uri_param_count = 0;
-      while(!done)
-      {
-         client->uri_params[client->uri_param_count] = string_chop(&offset, &remaining, "&", 1);
-         if(client->uri_params[client->uri_param_count] == NULL
-         || strlen(client->uri_params[client->uri_param_count]) == 0)
-         {
-            client->uri_params[client->uri_param_count] = offset;
-            MH_DBG("%s: Final URI parameter %"PRIu32" '%s'\n", __func__, client->uri_param_count,
-               client->uri_params[client->uri_param_count]);
-            ++(client->uri_param_count);
-            done = true;
-         }
-         else
-         {
-            MH_DBG("%s: URI parameter %"PRIu32" '%s'\n", __func__, client->uri_param_count,
-               client->uri_params[client->uri_param_count]);
-            ++(client->uri_param_count);
-         }
-   
-         if(client->uri_param_count >= ARRAY_SIZE(client->uri_params))
-            done = true;
-      }
-      MH_DBG("%s: Trimmed URI '%s'\n", __func__, client->uri);
+      microhttpd_ParseQuery(client, offset + 1);
    }
+   *string_percent_decode(client->uri, client->uri, client->uri + strlen(client->uri), false) = '\0';
+   MH_DBG("%s: Decoded URI '%s' (%"PRIu32" parameters)\n", __func__, client->uri, client->uri_param_count);
 
-   if(memcmp(client->operation, "GET", 3) == 0)
-      client->state = state_HandleOperationGet;
-   else if(memcmp(client->operation, "POST", 4) == 0)
-      client->state = state_HandleOperationPost;
-   else
-      client->state = state_HandleOperationUnsupported;
+   switch(client->method)
+   {
+      case MICROHTTPD_METHOD_GET:
+      case MICROHTTPD_METHOD_HEAD:
+         client->state = state_HandleOperationGet;
+         break;
+      case MICROHTTPD_METHOD_POST:
+         client->state = (NULL != client->ctx->params.post_handler) ?
+            state_HandleOperationPost : state_MethodNotAllowed;
+         break;
+      case 0:
+         client->state = state_NotImplemented;
+         break;
+      default:
+         client->state = state_HandleOperationRoute;
+         break;
+   }
+   if(!microhttpd_AdmitRequest(client))
+      client->state = state_RateLimited;
 
    return true;
 }
 
 static bool state_HandleOperationGet(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_GET, client->rx_size);
+
+   /* Bundled assets take precedence over the GET handlers, and cached responses over calling them */
+   if(!microhttpd_ServeAsset(client) && !microhttpd_CacheServe(client))
+   {
+      if(NULL != client->ctx->pool && microhttpd_GetOffloaded(client))
+         microhttpd_Offload(client, microhttpd_DispatchGet); /* Any response is cached on completion */
+      else if(NULL != client->cache)
+         microhttpd_CacheFill(client, microhttpd_DispatchGet);
+      else
+         microhttpd_DispatchGet(client);
+   }
+
+   MH_DBG("%s: GET finished\n", __func__);
+   microhttpd_FinishRequest(client);
+   return true;
+}
+
+/*! True if any handler for this request should run on the worker pool */
+static bool microhttpd_GetOffloaded(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+   uint32_t idx;
+   bool matched = false;
+
+   for(idx = 0; idx < ctx->params.get_handler_count; ++idx)
+   {
+      tMicroHttpdGetHandlerEntry *entry = &ctx->params.get_handler_list[idx];
+
+      if(memcmp(entry->uri, client->uri, strlen(entry->uri)) == 0)
+      {
+         if(entry->flags & MICROHTTPD_HANDLER_OFFLOAD)
+            return true;
+         matched = true;
+      }
+   }
+   return !matched && (ctx->params.default_get_handler_flags & MICROHTTPD_HANDLER_OFFLOAD);
+}
+
+static void microhttpd_DispatchGet(struct md_client *client)
 {
    struct md_context *ctx = client->ctx;
    uint32_t idx, match_count = 0;
@@ -405,9 +646,11 @@ static bool state_HandleOperationGet(struct md_client *client, uint32_t *consume
 
       if(memcmp(entry->uri, client->uri, strlen(entry->uri)) == 0)
       {
+         MH_TRACE(client, HANDLER_ENTER, client->method);
          entry->handler((tMicroHttpdClient) client, client->uri,
             (const char **) client->uri_params, client->uri_param_count,
-            client->source_address, entry->cookie);
+            microhttpd_SourceAddress(client), entry->cookie);
+         MH_TRACE(client, HANDLER_EXIT, client->method);
          ++match_count;
       }
    }
@@ -418,21 +661,149 @@ static bool state_HandleOperationGet(struct md_client *client, uint32_t *consume
       if(ctx->params.default_get_handler != NULL)
       {
          MH_DBG("%s: Calling default GET handler\n", __func__);
+         MH_TRACE(client, HANDLER_ENTER, client->method);
          ctx->params.default_get_handler((tMicroHttpdClient) client, client->uri,
             (const char **) client->uri_params, client->uri_param_count,
-            client->source_address, ctx->params.default_get_handler_cookie);
+            microhttpd_SourceAddress(client), ctx->params.default_get_handler_cookie);
+         MH_TRACE(client, HANDLER_EXIT, client->method);
       }
    }
+}
 
-   MH_DBG("%s: GET finished\n", __func__);
-   microhttpd_ResetState(client);
-   return true;
+/*! Decode "key=value&..." in place in one pass. Each parameter is compacted to "key=value" at the
+ *  start of its segment and indexed by key; the first occurrence of a key wins the index. */
+static void microhttpd_ParseQuery(struct md_client *client, char *query)
+{
+   while(*query != '\0')
+   {
+      char *end = strchr(query, '&');
+      char *equals, *out;
+      struct md_uri_param *param;
+      uint32_t probe;
+
+      if(NULL == end)
+         end = query + strlen(query);
+      if(end == query)
+      {
+         ++query; /* Empty parameter */
+         continue;
+      }
+      if(client->uri_param_count >= ARRAY_SIZE(client->uri_params))
+      {
+         MH_DBG("%s: Ignoring parameters beyond %u\n", __func__, MICROHTTPD_MAX_HTTP_URI_PARAMS);
+         break;
+      }
+
+      param = &client->uri_param_info[client->uri_param_count];
+      equals = memchr(query, '=', end - query);
+      out = string_percent_decode(query, query, (NULL != equals) ? equals : end, true);
+      param->key_length = out - query;
+      if(NULL != equals)
+      {
+         *out++ = '=';
+         param->value = out;
+         out = string_percent_decode(out, equals + 1, end, true);
+      }
+      else
+      {
+         param->value = out;
+      }
+      param->value_length = out - param->value;
+      param->hash = microhttpd_ParamHash(query, param->key_length);
+      client->uri_params[client->uri_param_count] = query;
+      MH_DBG("%s: URI parameter %"PRIu32" '%.*s'\n", __func__, client->uri_param_count,
+         (int) (out - query), query);
+
+      for(probe = 0; probe < MICROHTTPD_URI_PARAM_HASH_SIZE; ++probe)
+      {
+         md_param_index *entry =
+            &client->uri_param_index[(param->hash + probe) & (MICROHTTPD_URI_PARAM_HASH_SIZE - 1)];
+         struct md_uri_param *other;
+
+         if(0 == *entry)
+         {
+            *entry = client->uri_param_count + 1;
+            break;
+         }
+         other = &client->uri_param_info[*entry - 1];
+         if(other->hash == param->hash && other->key_length == param->key_length
+         && memcmp(client->uri_params[*entry - 1], query, param->key_length) == 0)
+         {
+            break; /* Duplicate key */
+         }
+      }
+      ++(client->uri_param_count);
+
+      query = ('\0' == *end) ? end : end + 1;
+      *out = '\0';
+   }
 }
 
-static bool state_HandleOperationUnsupported(struct md_client *client, uint32_t *consumed, bool *error)
+/*! FNV-1a */
+static uint32_t microhttpd_ParamHash(const char *key, uint32_t length)
 {
-   MH_DBG("%s: Unsupported HTTP operation '%s'\n", __func__, client->operation);
-   microhttpd_ResetState(client);
-   return true;
+   uint32_t hash = 2166136261u;
+
+   while(length-- > 0)
+   {
+      hash ^= (uint8_t) *key++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+/*! Replace application data, destroying what it replaces */
+static void microhttpd_DataSet(void **data, tMicroHttpdDataDestructor *destructor, void *new_data,
+   tMicroHttpdDataDestructor new_destructor)
+{
+   void *old_data = *data;
+   tMicroHttpdDataDestructor old_destructor = *destructor;
+
+   *data = new_data;
+   *destructor = new_destructor;
+   if(NULL != old_data && old_data != new_data && NULL != old_destructor)
+      old_destructor(old_data);
+}
+
+/*! How long a pass may wait for events; 0 for as long as it takes */
+static uint32_t microhttpd_ProcessTimeout(struct md_context *ctx)
+{
+   return microhttpd_ProxyTimeout(ctx, microhttpd_DrainTimeout(ctx, ctx->params.process_timeout));
 }
 
+/*! Everything a pass does after handling events */
+static int microhttpd_ProcessFinish(struct md_context *ctx, int result)
+{
+   microhttpd_ProcessCompletions(ctx);
+   microhttpd_ProcessPipelined(ctx);
+   microhttpd_WebSocketKeepalive(ctx);
+   microhttpd_ProxyProcess(ctx);
+   if(ctx->draining && microhttpd_DrainProcess(ctx))
+   {
+      MH_DBG("%s: Drained\n", __func__);
+      microhttpd_PoolShutdown(ctx);
+      ctx->running = false;
+      return 1;
+   }
+   if(ctx->pipeline_yielded > 0)
+      microhttpd_WakeSignal(ctx); /* Don't wait for events while requests are buffered */
+   return result;
+}
+
+/*! Each event handled through the application's loop is a pass of its own. Once drained, the
+ *  remaining descriptors are unwatched so the loop doesn't keep reporting them. */
+static int microhttpd_ExternalFinish(struct md_context *ctx)
+{
+   int result = microhttpd_ProcessFinish(ctx, 0);
+
+   if(result > 0)
+      ctx->backend->shutdown(ctx);
+   return result;
+}
+
+
+static bool state_Deferred(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_DEFERRED, client->rx_size);
+   return false; /* Parked until the response is completed; any further input stays buffered */
+}
@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #if defined(LWIP_SOCKET)
 #include <lwip/sockets.h>
 #else
@@ -15,17 +16,86 @@
 #endif
 #if !defined(MICROHTTPD_NO_NETINET_IN_H)
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 #include "microhttpd/microhttpd.h"
 
 #define MICROHTTPD_SERVER_NAME               "microhttpd"
-#define MICROHTTPD_MAX_SOURCE_ADDRESS_LENGTH 30
+#define MICROHTTPD_MAX_SOURCE_ADDRESS_LENGTH 56 /* "[IPv6]:port" */
 #define MICROHTTPD_MAX_QUEUED_CONNECTIONS    10
 #define MICROHTTPD_MAX_HTTP_HEADER_OPTIONS   20
+#if !defined(MICROHTTPD_MAX_HTTP_URI_PARAMS)
 #define MICROHTTPD_MAX_HTTP_URI_PARAMS       20
+#endif
+
+/* Parameter index: the next power of two above twice the parameter limit, so probes stay short */
+#if MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 16
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       16
+#elif MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 32
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       32
+#elif MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 64
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       64
+#elif MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 128
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       128
+#elif MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 256
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       256
+#elif MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 512
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       512
+#elif MICROHTTPD_MAX_HTTP_URI_PARAMS * 2 < 1024
+#define MICROHTTPD_URI_PARAM_HASH_SIZE       1024
+#else
+#error "MICROHTTPD_MAX_HTTP_URI_PARAMS is limited to 511"
+#endif
+#if MICROHTTPD_MAX_HTTP_URI_PARAMS < 255
+typedef uint8_t md_param_index;
+#else
+typedef uint16_t md_param_index;
+#endif
+_Static_assert(MICROHTTPD_MAX_HTTP_URI_PARAMS < (md_param_index) -1,
+   "URI parameter index entries hold the parameter number + 1");
+
+/* content_length for microhttpd_FormatResponseHeader() when the body is sent as it's produced */
+#define MICROHTTPD_LENGTH_CHUNKED            UINT32_MAX       /* Transfer-Encoding: chunked */
+#define MICROHTTPD_LENGTH_UNKNOWN            (UINT32_MAX - 1) /* HTTP/2 streams; the stream's end ends it */
+#if !defined(MICROHTTPD_MAX_LISTENERS)
+#define MICROHTTPD_MAX_LISTENERS             8
+#endif
 
 struct md_client;
 struct md_context;
+struct md_transport;
+struct md_tx_entry;
+struct md_event_backend;
+struct md_deferred;
+struct md_pool;
+struct md_channel;
+struct md_websocket;
+struct md_address;
+struct md_h2;
+struct md_h2_stream;
+struct md_json;
+struct md_proxy;
+struct md_upstream;
+struct md_cache;
+struct md_cache_entry;
+
+/*! Decoded query parameter. The key is the start of the matching uri_params entry, which reads
+ *  "key=value" (or just "key") after decoding. */
+struct md_uri_param
+{
+   const char *value;     /* NUL-terminated; "" when there's no '=' */
+   uint32_t key_length;
+   uint32_t value_length;
+   uint32_t hash;
+};
+
+struct md_listener
+{
+   int socket;
+   bool local;  /* Unix domain socket; no TCP options, and peers have no address */
+   char *path;  /* Unix domain socket path, removed when the listener is closed */
+   bool tls;
+};
 
 typedef bool (*md_state_machine_function)(struct md_client *client, uint32_t *consumed, bool *error);
 
@@ -34,21 +104,84 @@ struct md_client
    struct md_context *ctx;
 
    int socket;
-   struct sockaddr_in socket_info;
-   char source_address[MICROHTTPD_MAX_SOURCE_ADDRESS_LENGTH];
+   struct sockaddr_storage peer;
+   socklen_t peer_length; /* 0 until known; looked up when the source address is first needed */
+   const struct md_transport *transport;
+   void *transport_data;
+   void *backend_data;
+   char source_address[MICROHTTPD_MAX_SOURCE_ADDRESS_LENGTH]; /* "" until formatted */
 
    md_state_machine_function state;
 
-   char *rx_buffer;
+   char *rx_buffer;       /* NULL while idle; allocated only when a partial request is pending */
    uint32_t rx_buffer_size;
    uint32_t rx_size;
+   bool rx_borrowed;      /* rx_buffer refers to memory owned by the caller (scratch or backend) */
+
+   /* Transmit queue */
+   struct md_tx_entry *tx_head, *tx_tail;
+   uint32_t tx_pending;
+
+   struct md_deferred *deferred;  /* Non-NULL while the response is deferred; client is parked */
+   bool responded;                /* A handler has started a response to the current request */
+   bool continue_sent;            /* The current request's client has been told to send the body */
+   bool close_after_response;     /* Response says "Connection: close"; closed once it's written */
+   bool paused;                   /* Not read from while the connection it's relayed to catches up */
+
+   /* Server-sent event stream subscription */
+   struct md_channel *channel;
+   struct md_client *channel_prev, *channel_next;
+
+   struct md_websocket *websocket;  /* Non-NULL once upgraded to a WebSocket */
+
+   /* HTTP/2: a connection has h2 set; each of its streams is a client of its own with stream set */
+   struct md_h2 *h2;
+   struct md_h2_stream *stream;
+
+   /* Pipelining */
+   bool corked;             /* Output is held in the transmit queue until the received data is processed */
+   bool pipeline_yielded;   /* Requests remain buffered after reaching pipeline_max */
+   uint32_t pipeline_count; /* Requests finished in the current pass */
+
+   /* Admission control */
+   uint32_t header_bytes; /* Header and form field storage counted against max_buffered_bytes */
+   bool upload_active;    /* Counted against max_uploads */
+   struct md_address *address; /* Per-address limits; NULL if not limited */
+
+#if defined(MICROHTTPD_TRACE)
+   uint32_t trace_connection;
+   uint32_t trace_request;  /* Incremented as each request starts; 0 before the first */
+#endif
 
    /* HTTP Header */
    char **header_entries;
    uint32_t header_entry_count;
    char *operation, *uri, *http_version;
+   uint32_t method;       /* MICROHTTPD_METHOD_*, 0 if not one of those */
    char *uri_params[MICROHTTPD_MAX_HTTP_URI_PARAMS];
+   struct md_uri_param uri_param_info[MICROHTTPD_MAX_HTTP_URI_PARAMS];
    uint32_t uri_param_count;
+   md_param_index uri_param_index[MICROHTTPD_URI_PARAM_HASH_SIZE]; /* Open addressing; param + 1, 0 empty */
+
+   const tMicroHttpdRouteEntry *route; /* PUT, DELETE, PATCH or OPTIONS route being handled */
+
+   struct md_json *json;  /* JSON response writer; kept for the connection once used */
+
+   /* Application data; the request's is destroyed as each request finishes */
+   void *request_data;
+   tMicroHttpdDataDestructor request_destructor;
+   void *connection_data;
+   tMicroHttpdDataDestructor connection_destructor;
+
+   /* GET response cache */
+   struct md_cache_entry *cache;  /* Entry this request's response fills */
+   struct md_client *cache_next;  /* Next request waiting for the same entry */
+
+   /* Reverse proxy: a forwarded request and its upstream connection refer to each other as peers */
+   struct md_proxy *proxy;        /* Route the request is forwarded on */
+   struct md_upstream *upstream;  /* Non-NULL for a connection to an upstream */
+   struct md_client *proxy_peer;
+   bool proxy_closing;            /* Removed at the end of the pass */
 
    /* POST */
    char *filename;
@@ -59,6 +192,15 @@ struct md_client
    uint32_t content_remaining;
    uint32_t post_header_length;
    uint32_t post_trailer_length;
+   bool post_started;       /* The POST handler's start call has been made */
+
+   /* application/x-www-form-urlencoded body being decoded */
+   char *form_field;        /* Name, NUL, then as much of the value as has been decoded */
+   uint32_t form_length;
+   uint32_t form_name_length;
+   bool form_value;         /* The name is complete */
+   uint8_t form_escape;     /* Characters of a %XX escape seen so far */
+   char form_escape_char;   /* Its first hex digit */
 
    /* Linked list */
    struct md_client *next;
@@ -68,10 +210,57 @@ struct md_context
 {
    tMicroHttpdParams params;
    bool running;
-   int listen_socket;
+   struct md_listener listeners[MICROHTTPD_MAX_LISTENERS];
+   uint32_t listener_count;
    struct md_client *client_list;
+
+   const struct md_event_backend *backend;
+   void *backend_data;
+   char *rx_scratch;  /* Shared receive buffer for idle clients (rx_buffer_size bytes) */
+
+   /* Deferred response completion */
+   int wake_fd[2];    /* Read, write; the same descriptor when using eventfd */
+   _Atomic(struct md_deferred *) completions;
+   struct md_pool *pool;  /* NULL when handlers all run on the event loop */
+
+   struct md_channel *channels;  /* Server-sent event channels */
+   uint64_t websocket_ping_time; /* Monotonic milliseconds of the next keepalive sweep */
+
+   uint32_t pipeline_yielded; /* Clients with buffered requests waiting for another pass */
+
+   /* Admission control */
+   uint32_t client_count;
+   uint32_t buffered_bytes;
+   uint32_t upload_count;
+
+   /* Per-address limits; NULL when there are none */
+   struct md_address *addresses;
+   uint32_t address_mask;
+
+   void *tls;  /* SSL_CTX when a listener uses TLS */
+
+   /* Graceful shutdown */
+   bool draining;
+   uint64_t drain_deadline; /* Monotonic milliseconds */
+
+   /* Reverse proxy routes, one per proxy_list entry */
+   struct md_proxy *proxies;
+   uint32_t upstream_count;   /* Upstream connections; on the client list but not in client_count */
+   uint32_t proxy_closing;    /* Clients with proxy_closing set */
+   uint64_t proxy_deadline;   /* Monotonic milliseconds; no upstream connection times out before this */
+
+   struct md_cache *cache;    /* GET response cache; allocated when first needed */
 };
 
 void microhttpd_ResetState(struct md_client *client);
+void microhttpd_FinishRequest(struct md_client *client);
+void microhttpd_ConnectionDataFree(struct md_client *client);
+const char *microhttpd_HeaderValue(struct md_client *client, const char *name);
+bool microhttpd_ContentLength(struct md_client *client, uint32_t *length);
+bool microhttpd_ContinueExpected(struct md_client *client);
+void microhttpd_ExpectContinue(struct md_client *client);
+uint32_t microhttpd_ResponseHeaderSize(const char *content_type, const char *extra_header_options);
+int32_t microhttpd_FormatResponseHeader(char *tx, uint16_t code, const char *content_type,
+   uint32_t content_length, const char *extra_header_options, bool close);
 
 #endif /* _MICROHTTPD_PRIVATE_H */
@@ -0,0 +1,265 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file pool.c
+ *  \brief microhttpd worker thread pool
+ *
+ *  Offloaded handler invocations are distributed round-robin over bounded per-worker queues, which
+ *  limit how many can wait. Idle workers all wait on one condition variable; whichever is woken
+ *  takes a job from its own queue, or failing that from the next queue that has one. Results return
+ *  to the event loop through the deferred response completion queue.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "defer.h"
+#include "pool.h"
+
+#if !defined(MICROHTTPD_NO_THREADS)
+#include <pthread.h>
+
+struct md_worker
+{
+   struct md_pool *pool;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   struct md_deferred **queue; /* Ring of queue_depth entries */
+   uint32_t head, count;
+};
+
+struct md_pool
+{
+   pthread_mutex_t lock;
+   pthread_cond_t ready;
+   uint32_t pending;           /* Jobs queued across all workers */
+   bool stopping;              /* Workers exit instead of taking more jobs */
+   uint32_t queue_depth;
+   uint32_t worker_count;
+   uint32_t next;              /* Next queue to submit to (event loop only) */
+   struct md_worker workers[];
+};
+
+static bool microhttpd_PoolSubmit(struct md_pool *pool, struct md_deferred *job);
+static struct md_deferred *microhttpd_WorkerTake(struct md_worker *worker);
+static void *microhttpd_WorkerThread(void *arg);
+#endif
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+int microhttpd_PoolInit(struct md_context *ctx)
+{
+#if !defined(MICROHTTPD_NO_THREADS)
+   struct md_pool *pool;
+   uint32_t count = ctx->params.worker_threads;
+   uint32_t idx;
+
+   if(0 == count)
+      return 0; /* Offloaded handlers run on the event loop */
+   if(ctx->wake_fd[1] < 0)
+   {
+      MH_DBG("%s: No completion wakeup available; offloaded handlers run inline\n", __func__);
+      return 0;
+   }
+
+   pool = (struct md_pool *) malloc(sizeof(*pool) + count * sizeof(pool->workers[0]));
+   if(NULL == pool)
+      return -1;
+   memset(pool, 0, sizeof(*pool) + count * sizeof(pool->workers[0]));
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->ready, NULL);
+   pool->queue_depth = (ctx->params.worker_queue_depth > 0) ?
+      ctx->params.worker_queue_depth : MICROHTTPD_DEFAULT_WORKER_QUEUE_DEPTH;
+
+   for(idx = 0; idx < count; ++idx)
+   {
+      struct md_worker *worker = &pool->workers[idx];
+
+      worker->pool = pool;
+      pthread_mutex_init(&worker->lock, NULL);
+      worker->queue = (struct md_deferred **) malloc(pool->queue_depth * sizeof(worker->queue[0]));
+      if(NULL == worker->queue
+      || pthread_create(&worker->thread, NULL, microhttpd_WorkerThread, worker) != 0)
+      {
+         MH_DBG("%s: Failed to start worker %"PRIu32"\n", __func__, idx);
+         free(worker->queue);
+         break;
+      }
+      ++(pool->worker_count);
+   }
+
+   if(0 == pool->worker_count)
+   {
+      free(pool);
+      return -1;
+   }
+   MH_DBG("%s: Started %"PRIu32" workers\n", __func__, pool->worker_count);
+   ctx->pool = pool;
+#endif
+   return 0;
+}
+
+/*! Stop the workers once each finishes the job it's running. Jobs still queued are completed as
+ *  failed without being run, and every completion is then processed, freeing the clients they
+ *  refer to. */
+void microhttpd_PoolShutdown(struct md_context *ctx)
+{
+#if !defined(MICROHTTPD_NO_THREADS)
+   struct md_pool *pool = ctx->pool;
+   struct md_deferred *job;
+   uint32_t idx;
+
+   if(NULL == pool)
+      return;
+
+   pthread_mutex_lock(&pool->lock);
+   pool->stopping = true;
+   pthread_cond_broadcast(&pool->ready);
+   pthread_mutex_unlock(&pool->lock);
+
+   for(idx = 0; idx < pool->worker_count; ++idx)
+      pthread_join(pool->workers[idx].thread, NULL);
+   for(idx = 0; idx < pool->worker_count; ++idx)
+   {
+      struct md_worker *worker = &pool->workers[idx];
+
+      while(NULL != (job = microhttpd_WorkerTake(worker)))
+      {
+         job->failed = true;
+         if(!atomic_flag_test_and_set(&job->completed))
+            microhttpd_DeferredComplete(job);
+         microhttpd_DeferredRelease(job);
+      }
+      free(worker->queue);
+      pthread_mutex_destroy(&worker->lock);
+   }
+   MH_DBG("%s: Stopped %"PRIu32" workers\n", __func__, pool->worker_count);
+
+   pthread_cond_destroy(&pool->ready);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool);
+   ctx->pool = NULL;
+   microhttpd_ProcessCompletions(ctx);
+#endif
+}
+
+void microhttpd_Offload(struct md_client *client, void (*work)(struct md_client *client))
+{
+#if !defined(MICROHTTPD_NO_THREADS)
+   struct md_context *ctx = client->ctx;
+   struct md_deferred *job;
+
+   if(NULL == ctx->pool)
+   {
+      work(client);
+      return;
+   }
+
+   /* One reference for the completion, one for the worker */
+   job = microhttpd_DeferredCreate(client, 2);
+   if(NULL != job)
+   {
+      job->work = work;
+      if(microhttpd_PoolSubmit(ctx->pool, job))
+      {
+         microhttpd_UpdateClient(ctx, client);
+         return;
+      }
+      client->deferred = NULL;
+      free(job);
+   }
+
+   MH_DBG("%s: Worker pool saturated\n", __func__);
+   microhttpd_send_response((tMicroHttpdClient) client, HTTP_SERVICE_UNAVAILABLE, "text/plain", 0,
+      "Retry-After: 1\r\n", NULL);
+#else
+   work(client);
+#endif
+}
+
+#if !defined(MICROHTTPD_NO_THREADS)
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static bool microhttpd_PoolSubmit(struct md_pool *pool, struct md_deferred *job)
+{
+   bool queued = false;
+   uint32_t idx;
+
+   for(idx = 0; idx < pool->worker_count && !queued; ++idx)
+   {
+      struct md_worker *worker = &pool->workers[(pool->next + idx) % pool->worker_count];
+
+      pthread_mutex_lock(&worker->lock);
+      if(worker->count < pool->queue_depth)
+      {
+         worker->queue[(worker->head + worker->count) % pool->queue_depth] = job;
+         ++(worker->count);
+         queued = true;
+      }
+      pthread_mutex_unlock(&worker->lock);
+   }
+   if(!queued)
+      return false;
+   pool->next = (pool->next + idx) % pool->worker_count;
+
+   pthread_mutex_lock(&pool->lock);
+   ++(pool->pending);
+   pthread_cond_signal(&pool->ready);
+   pthread_mutex_unlock(&pool->lock);
+   return true;
+}
+
+static struct md_deferred *microhttpd_WorkerTake(struct md_worker *worker)
+{
+   struct md_deferred *job = NULL;
+
+   pthread_mutex_lock(&worker->lock);
+   if(worker->count > 0)
+   {
+      job = worker->queue[worker->head];
+      worker->head = (worker->head + 1) % worker->pool->queue_depth;
+      --(worker->count);
+   }
+   pthread_mutex_unlock(&worker->lock);
+   return job;
+}
+
+static void *microhttpd_WorkerThread(void *arg)
+{
+   struct md_worker *self = (struct md_worker *) arg;
+   struct md_pool *pool = self->pool;
+   uint32_t self_idx = self - pool->workers;
+
+   for(;;)
+   {
+      struct md_deferred *job;
+
+      /* Claiming one pending job guarantees there is one to take from some queue */
+      pthread_mutex_lock(&pool->lock);
+      while(0 == pool->pending && !pool->stopping)
+         pthread_cond_wait(&pool->ready, &pool->lock);
+      if(pool->stopping)
+      {
+         pthread_mutex_unlock(&pool->lock);
+         break;
+      }
+      --(pool->pending);
+      pthread_mutex_unlock(&pool->lock);
+
+      job = microhttpd_WorkerTake(self);
+      for(uint32_t idx = 1; NULL == job; ++idx)
+         job = microhttpd_WorkerTake(&pool->workers[(self_idx + idx) % pool->worker_count]);
+
+      job->work(job->client);
+      if(!job->user_deferred && !atomic_flag_test_and_set(&job->completed))
+         microhttpd_DeferredComplete(job);
+      microhttpd_DeferredRelease(job);
+   }
+
+   return NULL;
+}
+#endif /* MICROHTTPD_NO_THREADS */
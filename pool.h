@@ -0,0 +1,25 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file pool.h
+ *  \brief microhttpd worker thread pool
+ */
+#ifndef _MICROHTTPD_POOL_H
+#define _MICROHTTPD_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if !defined(MICROHTTPD_DEFAULT_WORKER_QUEUE_DEPTH)
+#define MICROHTTPD_DEFAULT_WORKER_QUEUE_DEPTH 16
+#endif
+
+int microhttpd_PoolInit(struct md_context *ctx);
+void microhttpd_PoolShutdown(struct md_context *ctx);
+
+/*! Run a handler invocation on the worker pool. The client is parked until it finishes; its
+ *  responses are collected and sent by the event loop. Runs the work inline when there is no pool,
+ *  and answers 503 without running it when every worker queue is full. */
+void microhttpd_Offload(struct md_client *client, void (*work)(struct md_client *client));
+
+#endif /* _MICROHTTPD_POOL_H */
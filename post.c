@@ -2,17 +2,45 @@
  *  \license This file is released under the MIT License. See the LICENSE file for details.
  *  \file post.c
  *  \brief microhttpd POST Implementation 
+ *
+ *  multipart/form-data bodies have their part header parsed off and the rest passed to the POST
+ *  handler. Any other body is passed as it is, except that application/x-www-form-urlencoded bodies
+ *  go to the form handler, if there is one, a decoded field at a time. Form fields are decoded
+ *  straight from the receive buffer into a buffer of form_field_size bytes, so neither the body nor
+ *  a whole value is ever held.
+ *
+ *  The handler's start call comes before any of the data, and a response sent from it refuses the
+ *  upload. A client that sent "Expect: 100-continue" is sent 100 Continue only once the upload is
+ *  accepted, so a refused one never sends the body at all; for multipart bodies, that means the start
+ *  call comes before the part header has been read.
  */
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <inttypes.h>
 #include "debug.h"
 #include "helpers.h"
+#include "client.h"
 #include "post.h"
+#include "pool.h"
+#include "admission.h"
+#include "route.h"
+#include "trace.h"
 
 static bool state_HandlePostHeader(struct md_client *client, uint32_t *consumed, bool *error);
 static bool state_HandlePostHeaderComplete(struct md_client *client, uint32_t *consumed, bool *error);
 static bool state_HandlePostData(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_HandlePostForm(struct md_client *client, uint32_t *consumed, bool *error);
+static bool microhttpd_FormStart(struct md_client *client);
+static bool microhttpd_FormDecode(struct md_client *client, char c);
+static bool microhttpd_FormLiteral(struct md_client *client);
+static bool microhttpd_FormChar(struct md_client *client, char c);
+static bool microhttpd_FormAppend(struct md_client *client, char c);
+static void microhttpd_FormField(struct md_client *client, bool complete);
+static uint32_t microhttpd_FormFieldSize(struct md_context *ctx);
+static void microhttpd_PostStart(struct md_client *client);
+static void microhttpd_PostComplete(struct md_client *client);
+static void microhttpd_PostFinish(struct md_client *client);
 
 /* ------------------------------------------------------------------------------------------
  * Exported Functions
@@ -20,25 +48,60 @@ static bool state_HandlePostData(struct md_client *client, uint32_t *consumed, b
 
 bool state_HandleOperationPost(struct md_client *client, uint32_t *consumed, bool *error)
 {
-   uint32_t idx, content_length = 0;
-   bool found;
+   const char *content_type;
 
-   for(idx = 0, found = false; idx < client->header_entry_count && !found; ++idx)
+   MH_TRACE(client, STATE_POST, client->rx_size);
+   if(!microhttpd_ContentLength(client, &client->content_length))
+   {
+      microhttpd_RejectFraming(client);
+      return true;
+   }
+   if(!microhttpd_AdmitUpload(client))
+   {
+      microhttpd_Shed(client);
+      *error = true;
+      return false;
+   }
+
+   client->content_remaining = client->content_length;
+   client->post_started = false;
+
+   content_type = microhttpd_HeaderValue(client, "content-type");
+   if(NULL != content_type && strncasecmp(content_type, "multipart/", 10) == 0)
+   {
+      client->state = state_HandlePostHeader;
+      /* The part header is body too, so a client waiting to send it gets its answer first */
+      if(microhttpd_ContinueExpected(client))
+         microhttpd_PostStart(client);
+      return true;
+   }
+
+   /* Not multipart; there's no part header, and the whole body is data */
+   client->filename = NULL;
+   client->post_header_length = 0;
+   client->post_trailer_length = 0;
+   client->state = state_HandlePostData;
+   if(NULL != client->ctx->params.form_handler && NULL != content_type
+   && strncasecmp(content_type, "application/x-www-form-urlencoded", 33) == 0)
    {
-      char *option = client->header_entries[idx];
-      if(memcmp(option, "content-length: ", 16) == 0)
+      if(!microhttpd_FormStart(client))
       {
-         content_length = strtoul(&option[16], NULL, 10);
-         found = true;
+         *error = true;
+         return false;
       }
+      client->state = state_HandlePostForm;
    }
-
-   client->content_length = content_length;
-   client->content_remaining = content_length;
-   client->state = state_HandlePostHeader;
+   microhttpd_PostStart(client);
    return true;
 }
 
+/*! Free a request's form field buffer. Its size is released with the header storage. */
+void microhttpd_PostFree(struct md_client *client)
+{
+   free(client->form_field);
+   client->form_field = NULL;
+}
+
 /* ------------------------------------------------------------------------------------------
  * Private Functions 
  */
@@ -48,6 +111,7 @@ static bool state_HandlePostHeader(struct md_client *client, uint32_t *consumed,
    uint32_t length;
    char *offset;
 
+   MH_TRACE(client, STATE_POST_HEADER, client->rx_size);
    offset = string_find(client->rx_buffer, client->rx_size, "\r\n", 2);
    if(offset == NULL)
       return false;  /* Header entry delimiter not found; need more rx data */
@@ -64,6 +128,11 @@ static bool state_HandlePostHeader(struct md_client *client, uint32_t *consumed,
    }
    MH_DBG("%s: Found header option (length %"PRIu32")\n", __func__, length);
 
+   if(!microhttpd_HeaderReserve(client, length))
+   {
+      *error = true;
+      return false;
+   }
    if(!string_list_add(client->rx_buffer, length, &client->post_header_entries,
       &client->post_header_entry_count))
    {
@@ -82,10 +151,10 @@ static bool state_HandlePostHeader(struct md_client *client, uint32_t *consumed,
 
 static bool state_HandlePostHeaderComplete(struct md_client *client, uint32_t *consumed, bool *error)
 {
-   struct md_context *ctx = client->ctx;
    uint32_t idx;
    bool found;
 
+   MH_TRACE(client, STATE_POST_HEADER_COMPLETE, client->rx_size);
    client->post_boundary = NULL;
    for(idx = 0, found = false; idx < client->header_entry_count && !found; ++idx)
    {
@@ -115,7 +184,7 @@ static bool state_HandlePostHeaderComplete(struct md_client *client, uint32_t *c
    }
 
    client->post_header_length = client->content_length - client->content_remaining;
-   client->post_trailer_length = strlen(client->post_boundary);
+   client->post_trailer_length = (NULL != client->post_boundary) ? strlen(client->post_boundary) : 0;
    if(client->content_length < (client->post_header_length + client->post_trailer_length))
    {
       MH_DBG("%s: Invalid post data length (total %"PRIu32", header %"PRIu32", footer %"PRIu32"\n", __func__,
@@ -128,14 +197,8 @@ static bool state_HandlePostHeaderComplete(struct md_client *client, uint32_t *c
          client->content_length, client->post_header_length, client->post_trailer_length);
    }
 
-   if(ctx->params.post_handler != NULL) /* POST start handler */
-   {
-      ctx->params.post_handler((tMicroHttpdClient) client, client->uri, client->filename,
-         (const char **) client->uri_params, client->uri_param_count, client->source_address,
-         ctx->params.post_handler_cookie, true, false, NULL, 0, client->content_length);
-   }
-
    client->state = state_HandlePostData;
+   microhttpd_PostStart(client);
    return true;
 }
 
@@ -144,6 +207,7 @@ static bool state_HandlePostData(struct md_client *client, uint32_t *consumed, b
    struct md_context *ctx = client->ctx;
    uint32_t handled_length, data_length;
 
+   MH_TRACE(client, STATE_POST_DATA, client->rx_size);
    handled_length = client->content_remaining;
    if(handled_length > client->rx_size)
       handled_length = client->rx_size;
@@ -158,28 +222,254 @@ static bool state_HandlePostData(struct md_client *client, uint32_t *consumed, b
    if(data_length > 0 && ctx->params.post_handler != NULL)
    {
       MH_DBG("%s: Sending %"PRIu32" bytes of data to application\n", __func__, data_length);
+      MH_TRACE(client, HANDLER_ENTER, client->method);
       ctx->params.post_handler((tMicroHttpdClient) client, client->uri, client->filename,
          (const char **) client->uri_params, client->uri_param_count,
-         client->source_address, ctx->params.post_handler_cookie,
+         microhttpd_SourceAddress(client), ctx->params.post_handler_cookie,
          false, false, client->rx_buffer, data_length, client->content_length);
+      MH_TRACE(client, HANDLER_EXIT, client->method);
    }
 
    *consumed = handled_length; 
    if(0 == client->content_remaining)
    {
       MH_DBG("%s: POST finished\n", __func__);
+      microhttpd_PostComplete(client);
+      return true;
+   }
 
-      /* Post complete handler */
-      if(ctx->params.post_handler != NULL)
+   return false; /* need more rx data */
+}
+
+/*! Decode as much of an application/x-www-form-urlencoded body as has arrived */
+static bool state_HandlePostForm(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   uint32_t idx, length = (client->rx_size < client->content_remaining) ?
+      client->rx_size : client->content_remaining;
+
+   MH_TRACE(client, STATE_POST_FORM, client->rx_size);
+   if(0 == length && client->content_remaining > 0)
+      return false; /* Need more rx data */
+
+   for(idx = 0; idx < length; ++idx)
+   {
+      if(!microhttpd_FormDecode(client, client->rx_buffer[idx]))
       {
-         ctx->params.post_handler((tMicroHttpdClient) client, client->uri, client->filename,
-            (const char **) client->uri_params, client->uri_param_count, client->source_address,
-            ctx->params.post_handler_cookie, false, true, NULL, 0, client->content_length);
+         *error = true;
+         return false;
       }
+   }
 
-      microhttpd_ResetState(client);
+   client->content_remaining -= length;
+   *consumed = length;
+   if(client->content_remaining > 0)
       return true;
+
+   /* The body ends the last field, and any escape cut short by it is taken literally */
+   if((client->form_escape > 0 && !microhttpd_FormLiteral(client)) || !microhttpd_FormChar(client, '&'))
+   {
+      *error = true;
+      return false;
    }
+   MH_DBG("%s: Form finished\n", __func__);
+   microhttpd_PostComplete(client);
+   return true;
+}
 
-   return false; /* need more rx data */
+/*! Set up the field buffer for a form; its size is counted as header storage. When over budget,
+ *  the client has been sent a 503 and should be dropped. */
+static bool microhttpd_FormStart(struct md_client *client)
+{
+   uint32_t size = microhttpd_FormFieldSize(client->ctx) + 2; /* Name and value are NUL-terminated */
+
+   if(!microhttpd_BudgetReserve(client->ctx, size))
+   {
+      microhttpd_Shed(client);
+      return false;
+   }
+   client->form_field = malloc(size);
+   if(NULL == client->form_field)
+   {
+      MH_DBG("%s: Failed to allocate form field buffer\n", __func__);
+      microhttpd_BudgetRelease(client->ctx, size);
+      return false;
+   }
+   client->header_bytes += size;
+   client->form_length = 0;
+   client->form_name_length = 0;
+   client->form_value = false;
+   client->form_escape = 0;
+   return true;
+}
+
+/*! Decode one byte of the body. Returns false if the request must be dropped. */
+static bool microhttpd_FormDecode(struct md_client *client, char c)
+{
+   int high, low;
+
+   if(client->form_escape > 0)
+   {
+      low = hex_digit(c);
+      if(1 == client->form_escape && low >= 0)
+      {
+         client->form_escape_char = c;
+         client->form_escape = 2;
+         return true;
+      }
+      high = hex_digit(client->form_escape_char);
+      if(2 == client->form_escape && low >= 0 && (high | low) != 0)
+      {
+         client->form_escape = 0;
+         return microhttpd_FormAppend(client, (char) ((high << 4) | low));
+      }
+
+      /* Malformed, or %00 */
+      if(!microhttpd_FormLiteral(client))
+         return false;
+   }
+
+   if('%' == c)
+   {
+      client->form_escape = 1;
+      return true;
+   }
+   return microhttpd_FormChar(client, c);
+}
+
+/*! Take the escape in progress literally, as string_percent_decode() does */
+static bool microhttpd_FormLiteral(struct md_client *client)
+{
+   uint8_t escape = client->form_escape;
+
+   client->form_escape = 0;
+   return microhttpd_FormAppend(client, '%')
+      && (escape < 2 || microhttpd_FormAppend(client, client->form_escape_char));
+}
+
+/*! Handle an unescaped byte, which may end the name or the field */
+static bool microhttpd_FormChar(struct md_client *client, char c)
+{
+   if('&' == c)
+   {
+      if(!client->form_value)
+      {
+         if(0 == client->form_length)
+            return true; /* Empty field */
+         client->form_name_length = client->form_length;
+         client->form_field[client->form_length++] = '\0';
+      }
+      microhttpd_FormField(client, true);
+      client->form_length = 0;
+      client->form_value = false;
+      return true;
+   }
+   if('=' == c && !client->form_value)
+   {
+      client->form_name_length = client->form_length;
+      client->form_field[client->form_length++] = '\0';
+      client->form_value = true;
+      return true;
+   }
+   return microhttpd_FormAppend(client, ('+' == c) ? ' ' : c);
+}
+
+/*! Add a decoded byte to the name or value. A full buffer passes on the value so far; a name that
+ *  fills it can't be handled. */
+static bool microhttpd_FormAppend(struct md_client *client, char c)
+{
+   uint32_t size = microhttpd_FormFieldSize(client->ctx);
+
+   if(client->form_value)
+   {
+      if(client->form_length > size)
+      {
+         microhttpd_FormField(client, false);
+         client->form_length = client->form_name_length + 1;
+      }
+   }
+   else if(client->form_length + 1 >= size)
+   {
+      MH_DBG("%s: Form field name longer than %"PRIu32" bytes\n", __func__, size - 1);
+      return false;
+   }
+   client->form_field[client->form_length++] = c;
+   return true;
+}
+
+static void microhttpd_FormField(struct md_client *client, bool complete)
+{
+   struct md_context *ctx = client->ctx;
+   uint32_t value = client->form_name_length + 1;
+
+   client->form_field[client->form_length] = '\0';
+   MH_DBG("%s: Form field '%s' (%"PRIu32" bytes%s)\n", __func__, client->form_field,
+      client->form_length - value, complete ? "" : ", more to come");
+   MH_TRACE(client, HANDLER_ENTER, client->method);
+   ctx->params.form_handler((tMicroHttpdClient) client, client->form_field, &client->form_field[value],
+      client->form_length - value, complete, ctx->params.form_handler_cookie);
+   MH_TRACE(client, HANDLER_EXIT, client->method);
+}
+
+static uint32_t microhttpd_FormFieldSize(struct md_context *ctx)
+{
+   return (ctx->params.form_field_size > 1) ?
+      ctx->params.form_field_size : MICROHTTPD_DEFAULT_FORM_FIELD_SIZE;
+}
+
+/*! Call the POST handler's start, once. A response sent from it refuses the upload: the rest of the
+ *  body is skipped and the handler isn't called again. Otherwise a client waiting to send the body is
+ *  told to go ahead. */
+static void microhttpd_PostStart(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   if(client->post_started)
+      return;
+   client->post_started = true;
+   /* A refusal sent before 100 Continue closes the connection (see microhttpd_DiscardBody) */
+   client->close_after_response = microhttpd_ContinueExpected(client);
+   if(ctx->params.post_handler != NULL)
+   {
+      MH_TRACE(client, HANDLER_ENTER, client->method);
+      ctx->params.post_handler((tMicroHttpdClient) client, client->uri, client->filename,
+         (const char **) client->uri_params, client->uri_param_count, microhttpd_SourceAddress(client),
+         ctx->params.post_handler_cookie, true, false, NULL, 0, client->content_length);
+      MH_TRACE(client, HANDLER_EXIT, client->method);
+   }
+
+   if(client->responded)
+   {
+      MH_DBG("%s: Upload to '%s' refused (%"PRIu32" bytes skipped)\n", __func__, client->uri,
+         client->content_remaining);
+      microhttpd_DiscardBody(client);
+      return;
+   }
+   client->close_after_response = false;
+   microhttpd_ExpectContinue(client);
+}
+
+/*! Call the POST handler's finish, which sends the response, and end the request */
+static void microhttpd_PostComplete(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   if(ctx->params.post_handler != NULL)
+   {
+      if(ctx->params.post_handler_flags & MICROHTTPD_HANDLER_OFFLOAD)
+         microhttpd_Offload(client, microhttpd_PostFinish);
+      else
+         microhttpd_PostFinish(client);
+   }
+   microhttpd_FinishRequest(client);
+}
+
+static void microhttpd_PostFinish(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   MH_TRACE(client, HANDLER_ENTER, client->method);
+   ctx->params.post_handler((tMicroHttpdClient) client, client->uri, client->filename,
+      (const char **) client->uri_params, client->uri_param_count, microhttpd_SourceAddress(client),
+      ctx->params.post_handler_cookie, false, true, NULL, 0, client->content_length);
+   MH_TRACE(client, HANDLER_EXIT, client->method);
 }
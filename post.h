@@ -10,6 +10,11 @@
 #include <stdbool.h>
 #include "microhttpd_private.h"
 
+#if !defined(MICROHTTPD_DEFAULT_FORM_FIELD_SIZE)
+#define MICROHTTPD_DEFAULT_FORM_FIELD_SIZE 256
+#endif
+
 bool state_HandleOperationPost(struct md_client *client, uint32_t *consumed, bool *error);
+void microhttpd_PostFree(struct md_client *client);
 
 #endif /* _MICROHTTPD_POST_H */
@@ -0,0 +1,1071 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file proxy.c
+ *  \brief microhttpd reverse proxy routes
+ *
+ *  A request matching a proxy_list entry is forwarded on a connection from that entry's pool: the
+ *  most recently used idle one, or else a new non-blocking connect. Each upstream connection is a
+ *  client of its own, on the client list and driven by the event backend like any other, but
+ *  running the upstream states below instead of the request parser; while an exchange is in
+ *  progress, the request and its connection refer to each other as peers. The request body is
+ *  relayed straight from the receive buffer as it arrives, and the response as it's received,
+ *  with whichever side gets ahead paused (no longer read from) until the other has written what it
+ *  has queued. A response of unknown length is passed on with chunked coding, or ended with the
+ *  stream for HTTP/2. Connections that can't be reused are closed at the end of the pass, never
+ *  while another client is being handled.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "tx.h"
+#include "events.h"
+#include "admission.h"
+#include "route.h"
+#include "trace.h"
+#include "proxy.h"
+
+#define PROXY_HEADER_MIN   1024
+#define PROXY_CHUNK_LINE   10   /* "ffffffff\r\n" */
+
+static const char PROXY_BUSY[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                 "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Retry-After: 1\r\n"
+                                 "\r\n";
+static const char BAD_GATEWAY[] = "HTTP/1.1 502 Bad Gateway\r\n"
+                                  "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "\r\n";
+static const char GATEWAY_TIMEOUT[] = "HTTP/1.1 504 Gateway Timeout\r\n"
+                                      "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                      "Content-Length: 0\r\n"
+                                      "\r\n";
+
+/* Hop-by-hop fields, which describe a single connection and aren't forwarded. Responses keep their
+ *  framing fields, which are relayed along with the body they describe; requests are sent on with a
+ *  Content-Length of the proxy's own. */
+static const char *const HOP_FIELDS[] =
+{
+   "connection", "keep-alive", "proxy-connection", "upgrade", "te", "trailer", "transfer-encoding",
+   "content-length"
+};
+#define RESPONSE_HOP_FIELDS 4
+
+static bool state_ProxyRequestBody(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_ProxyWait(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_ProxyDiscard(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_ProxyClosed(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_UpstreamIdle(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_UpstreamHeader(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_UpstreamBody(struct md_client *client, uint32_t *consumed, bool *error);
+static bool microhttpd_UpstreamField(struct md_upstream *upstream, char *line);
+static bool microhttpd_UpstreamHeaderEnd(struct md_client *client, uint32_t *consumed);
+static bool microhttpd_UpstreamChunked(struct md_client *client, uint32_t *consumed, bool *done);
+static bool microhttpd_UpstreamAppend(struct md_upstream *upstream, const char *data, uint32_t length);
+static void microhttpd_UpstreamFinish(struct md_client *client);
+static struct md_client *microhttpd_ProxyAcquire(struct md_proxy *proxy, struct md_context *ctx);
+static struct md_upstream *microhttpd_ProxyConnect(struct md_proxy *proxy, struct md_context *ctx);
+static bool microhttpd_ProxyForward(struct md_client *client, struct md_client *upstream);
+static bool microhttpd_ProxyRelay(struct md_client *client, struct iovec *iov, uint32_t count);
+static void microhttpd_ProxyRespond(struct md_client *client, const char *response, uint32_t length);
+static void microhttpd_ProxyFail(struct md_client *client, const char *response, uint32_t length);
+static void microhttpd_ProxyContinue(struct md_client *client);
+static void microhttpd_ProxyDrop(struct md_client *client);
+static void microhttpd_ProxyUnlink(struct md_client *client);
+static void microhttpd_ProxyIdle(struct md_upstream *upstream);
+static void microhttpd_ProxyClose(struct md_client *client);
+static void microhttpd_ProxyPause(struct md_client *client, bool paused);
+static void microhttpd_ProxyDeadline(struct md_upstream *upstream, uint32_t timeout_ms);
+static bool microhttpd_ProxyHopField(const char *name, uint32_t name_length, uint32_t count);
+static uint64_t microhttpd_ProxyClock(void);
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+int microhttpd_ProxyInit(struct md_context *ctx)
+{
+   uint32_t idx;
+
+   ctx->proxy_deadline = UINT64_MAX;
+   if(0 == ctx->params.proxy_count)
+      return 0;
+
+   ctx->proxies = (struct md_proxy *) calloc(ctx->params.proxy_count, sizeof(*ctx->proxies));
+   if(NULL == ctx->proxies)
+   {
+      MH_DBG("%s: Failed to allocate %"PRIu32" proxy routes\n", __func__, ctx->params.proxy_count);
+      return -1;
+   }
+   for(idx = 0; idx < ctx->params.proxy_count; ++idx)
+   {
+      const tMicroHttpdProxyEntry *entry = &ctx->params.proxy_list[idx];
+      struct md_proxy *proxy = &ctx->proxies[idx];
+
+      proxy->entry = entry;
+      if(NULL != entry->upstream && '\0' != entry->upstream[0])
+         proxy->address_length = microhttpd_SocketAddress(&proxy->address, entry->upstream, entry->port);
+      if(NULL == entry->uri || 0 == proxy->address_length)
+      {
+         MH_DBG("%s: Invalid proxy route %"PRIu32" (upstream '%s')\n", __func__, idx,
+            (NULL != entry->upstream) ? entry->upstream : "");
+         microhttpd_ProxyShutdown(ctx);
+         return -1;
+      }
+#if defined(MICROHTTPD_HAVE_UNIX_SOCKETS)
+      proxy->local = (AF_UNIX == proxy->address.sa.sa_family);
+#endif
+      proxy->max_connections = (entry->max_connections > 0) ?
+         entry->max_connections : MICROHTTPD_PROXY_DEFAULT_CONNECTIONS;
+      proxy->timeout = (entry->timeout > 0) ? entry->timeout : MICROHTTPD_PROXY_DEFAULT_TIMEOUT;
+      proxy->idle_timeout = (entry->idle_timeout > 0) ?
+         entry->idle_timeout : MICROHTTPD_PROXY_DEFAULT_IDLE_TIMEOUT;
+   }
+   return 0;
+}
+
+/*! Once every client has been removed */
+void microhttpd_ProxyShutdown(struct md_context *ctx)
+{
+   free(ctx->proxies);
+   ctx->proxies = NULL;
+}
+
+/*! Look for a proxy route for a request whose method is known and URI not yet decoded */
+bool microhttpd_ProxyMatch(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   for(uint32_t idx = 0; NULL != ctx->proxies && idx < ctx->params.proxy_count; ++idx)
+   {
+      struct md_proxy *proxy = &ctx->proxies[idx];
+
+      if((proxy->entry->methods & client->method)
+      && strncmp(proxy->entry->uri, client->uri, strlen(proxy->entry->uri)) == 0)
+      {
+         client->proxy = proxy;
+         return true;
+      }
+   }
+   return false;
+}
+
+bool state_HandleOperationProxy(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_proxy *proxy = client->proxy;
+   struct md_client *upstream;
+
+   MH_TRACE(client, STATE_PROXY, client->rx_size);
+   if(!microhttpd_ContentLength(client, &client->content_length))
+   {
+      microhttpd_RejectFraming(client);
+      return true;
+   }
+
+   client->content_remaining = client->content_length;
+   if(client->content_length > 0 && !microhttpd_AdmitUpload(client))
+   {
+      microhttpd_Shed(client);
+      *error = true;
+      return false;
+   }
+
+   if(proxy->active >= proxy->max_connections)
+   {
+      MH_DBG("%s: '%s' has %"PRIu32" requests in flight\n", __func__, proxy->entry->uri, proxy->active);
+      microhttpd_ProxyRespond(client, PROXY_BUSY, sizeof(PROXY_BUSY) - 1);
+      microhttpd_SkipBody(client);
+      return true;
+   }
+
+   upstream = microhttpd_ProxyAcquire(proxy, client->ctx);
+   if(NULL == upstream || !microhttpd_ProxyForward(client, upstream))
+   {
+      MH_DBG("%s: Failed to forward %s '%s'\n", __func__, client->operation, client->uri);
+      if(NULL != upstream)
+         microhttpd_ProxyClose(upstream);
+      microhttpd_ProxyRespond(client, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1);
+      microhttpd_SkipBody(client);
+      return true;
+   }
+
+   MH_DBG("%s: %s '%s' forwarded (%"PRIu32" byte body)\n", __func__, client->operation, client->uri,
+      client->content_length);
+   client->proxy_peer = upstream;
+   upstream->proxy_peer = client;
+   if(client->content_remaining > 0)
+      client->state = state_ProxyRequestBody;
+   else
+   {
+      client->state = state_ProxyWait;
+      microhttpd_ProxyPause(client, true);
+   }
+   return true;
+}
+
+/*! Called as any client is removed. The other side of an exchange in progress is told: a request
+ *  whose connection is lost gets an error response, or, once its response has started, is ended
+ *  (when the connection closing is what ends it) or dropped. */
+void microhttpd_ProxyRemoved(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+   struct md_upstream *upstream = client->upstream, **link;
+   struct md_client *peer = client->proxy_peer;
+
+   if(client->proxy_closing)
+   {
+      client->proxy_closing = false;
+      --(ctx->proxy_closing);
+   }
+   if(NULL != peer)
+      microhttpd_ProxyUnlink(client);
+   if(NULL == upstream)
+   {
+      if(NULL != peer)
+         microhttpd_ProxyClose(peer); /* Can't be reused with the request unfinished */
+      return;
+   }
+
+   for(link = &upstream->proxy->connections; NULL != *link && *link != upstream; link = &(*link)->next)
+      ;
+   if(NULL != *link)
+      *link = upstream->next;
+   if(upstream->busy)
+   {
+      upstream->busy = false;
+      --(upstream->proxy->active);
+   }
+   --(ctx->upstream_count);
+
+   if(NULL == peer)
+      return;
+   if(!upstream->started)
+   {
+      if(upstream->timed_out)
+         microhttpd_ProxyFail(peer, GATEWAY_TIMEOUT, sizeof(GATEWAY_TIMEOUT) - 1);
+      else
+         microhttpd_ProxyFail(peer, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1);
+   }
+   else if(UPSTREAM_BODY_CLOSE == upstream->body && !upstream->timed_out)
+   {
+      struct iovec iov = { "0\r\n\r\n", 5 };
+
+      MH_DBG("%s: Response ended by the upstream closing\n", __func__);
+      if(upstream->rechunk)
+         microhttpd_ProxyRelay(peer, &iov, 1);
+      microhttpd_ProxyContinue(peer);
+   }
+   else
+   {
+      MH_DBG("%s: Response incomplete\n", __func__);
+      microhttpd_ProxyDrop(peer);
+   }
+}
+
+void microhttpd_ProxyFree(struct md_client *client)
+{
+   if(NULL == client->upstream)
+      return;
+   free(client->upstream->header);
+   free(client->upstream);
+   client->upstream = NULL;
+}
+
+/*! A client's transmit queue has shrunk; read from its peer again once most of it is written */
+void microhttpd_ProxyDrained(struct md_client *client)
+{
+   struct md_client *peer = client->proxy_peer;
+
+   if(!peer->paused || state_ProxyWait == peer->state || client->tx_pending > MICROHTTPD_PROXY_WINDOW / 2)
+      return;
+   if(NULL != peer->upstream)
+      microhttpd_ProxyDeadline(peer->upstream, peer->upstream->proxy->timeout);
+   microhttpd_ProxyPause(peer, false);
+}
+
+/*! How long the backend may wait for events, shortened so no upstream connection outlives its
+ *  deadline */
+uint32_t microhttpd_ProxyTimeout(struct md_context *ctx, uint32_t timeout_ms)
+{
+   uint64_t now;
+
+   if(ctx->proxy_closing > 0)
+      return 1;
+   if(UINT64_MAX == ctx->proxy_deadline)
+      return timeout_ms;
+   now = microhttpd_ProxyClock();
+   if(now >= ctx->proxy_deadline)
+      return 1;
+   if(0 == timeout_ms || ctx->proxy_deadline - now < timeout_ms)
+      return (uint32_t) (ctx->proxy_deadline - now);
+   return timeout_ms;
+}
+
+/*! Called after each pass: close the connections given up on during it, then any that have made no
+ *  progress (or sat idle) for too long */
+void microhttpd_ProxyProcess(struct md_context *ctx)
+{
+   struct md_client *client, *next;
+   uint64_t now;
+
+   for(client = ctx->client_list; NULL != client && ctx->proxy_closing > 0; client = next)
+   {
+      next = client->next;
+      if(client->proxy_closing)
+         microhttpd_RemoveClient(ctx, client);
+   }
+
+   if(UINT64_MAX == ctx->proxy_deadline || (now = microhttpd_ProxyClock()) < ctx->proxy_deadline)
+      return;
+   ctx->proxy_deadline = UINT64_MAX;
+   for(uint32_t idx = 0; idx < ctx->params.proxy_count; ++idx)
+   {
+      struct md_upstream *upstream, *next_upstream;
+
+      for(upstream = ctx->proxies[idx].connections; NULL != upstream; upstream = next_upstream)
+      {
+         next_upstream = upstream->next;
+         if(upstream->client->proxy_closing)
+            continue;
+         if(upstream->deadline <= now)
+         {
+            MH_DBG("%s: Closing %s upstream connection\n", __func__, upstream->busy ? "stalled" : "idle");
+            upstream->timed_out = upstream->busy;
+            microhttpd_RemoveClient(ctx, upstream->client);
+         }
+         else if(upstream->deadline < ctx->proxy_deadline)
+            ctx->proxy_deadline = upstream->deadline;
+      }
+   }
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Request States
+ */
+
+/*! Relay the body to the upstream as it arrives */
+static bool state_ProxyRequestBody(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_client *upstream = client->proxy_peer;
+   struct iovec iov;
+
+   iov.iov_base = client->rx_buffer;
+   iov.iov_len = (client->rx_size < client->content_remaining) ? client->rx_size : client->content_remaining;
+   MH_TRACE(client, STATE_PROXY_BODY, client->rx_size);
+   if(0 == iov.iov_len)
+      return false;
+
+   *consumed = iov.iov_len;
+   client->content_remaining -= iov.iov_len;
+   if(!microhttpd_ProxyRelay(upstream, &iov, 1))
+   {
+      MH_DBG("%s: Failed to relay request body\n", __func__);
+      microhttpd_ProxyUnlink(client);
+      microhttpd_ProxyClose(upstream);
+      microhttpd_ProxyRespond(client, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1);
+      if(client->content_remaining > 0)
+         client->state = state_ProxyDiscard;
+      else
+         microhttpd_FinishRequest(client);
+      return true;
+   }
+   microhttpd_ProxyDeadline(upstream->upstream, upstream->upstream->proxy->timeout);
+
+   if(0 == client->content_remaining)
+   {
+      client->state = state_ProxyWait;
+      microhttpd_ProxyPause(client, true);
+   }
+   else if(upstream->tx_pending > MICROHTTPD_PROXY_WINDOW)
+      microhttpd_ProxyPause(client, true); /* Until the upstream catches up */
+   return true;
+}
+
+/*! The request has been forwarded; the connection isn't read from until the response is relayed */
+static bool state_ProxyWait(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   return false; /* Anything pipelined behind it stays buffered */
+}
+
+/*! The response is complete, but the upstream didn't take all of the body */
+static bool state_ProxyDiscard(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   uint32_t length = (client->rx_size < client->content_remaining) ?
+      client->rx_size : client->content_remaining;
+
+   MH_TRACE(client, STATE_DISCARD_BODY, client->rx_size);
+   if(0 == length)
+      return false;
+
+   client->content_remaining -= length;
+   *consumed = length;
+   if(0 == client->content_remaining)
+      microhttpd_FinishRequest(client);
+   return true;
+}
+
+/*! Waiting to be closed; anything received is ignored */
+static bool state_ProxyClosed(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   *consumed = client->rx_size;
+   return false;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Upstream States
+ */
+
+/*! In the pool; nothing is expected until a request is forwarded */
+static bool state_UpstreamIdle(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   if(client->rx_size > 0)
+   {
+      MH_DBG("%s: %"PRIu32" bytes received outside a response\n", __func__, client->rx_size);
+      *error = true;
+   }
+   return false;
+}
+
+/*! Collect the response header a line at a time, leaving out the hop-by-hop fields */
+static bool state_UpstreamHeader(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_upstream *upstream = client->upstream;
+   char *line = client->rx_buffer, *end;
+   uint32_t length;
+
+   MH_TRACE(client, STATE_UPSTREAM_HEADER, client->rx_size);
+   end = (client->rx_size > 0) ? (char *) memchr(line, '\n', client->rx_size) : NULL;
+   if(NULL == end)
+      return false;  /* Need more rx data */
+
+   *consumed = end + 1 - line;
+   length = end - line;
+   if(length > 0 && '\r' == line[length - 1])
+      --length;
+   line[length] = '\0';
+
+   if(0 == upstream->status)
+   {
+      if(length < 12 || strncmp(line, "HTTP/1.", 7) != 0 || ' ' != line[8]
+      || line[9] < '1' || line[9] > '5' || line[10] < '0' || line[10] > '9'
+      || line[11] < '0' || line[11] > '9')
+      {
+         MH_DBG("%s: Invalid status line\n", __func__);
+         *error = true;
+         return false;
+      }
+      upstream->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+      upstream->keep_alive = ('1' == line[7]);
+   }
+   else if(0 == length)
+   {
+      if(!microhttpd_UpstreamHeaderEnd(client, consumed))
+      {
+         *error = true;
+         return false;
+      }
+      return true;
+   }
+   else if(!microhttpd_UpstreamField(upstream, line))
+      return true;
+
+   if(!microhttpd_UpstreamAppend(upstream, line, length) || !microhttpd_UpstreamAppend(upstream, "\r\n", 2))
+   {
+      *error = true;
+      return false;
+   }
+   return true;
+}
+
+/*! Relay the body as it's received */
+static bool state_UpstreamBody(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_upstream *upstream = client->upstream;
+   struct md_client *peer = client->proxy_peer;
+   struct iovec iov[3];
+   char line[PROXY_CHUNK_LINE + 1];
+   bool done = false;
+
+   MH_TRACE(client, STATE_UPSTREAM_BODY, client->rx_size);
+   if(0 == client->rx_size)
+      return false;
+
+   if(UPSTREAM_BODY_CHUNKED == upstream->body)
+   {
+      if(!microhttpd_UpstreamChunked(client, consumed, &done))
+      {
+         *error = true;
+         return false;
+      }
+      if(0 == *consumed)
+         return false;  /* Need the rest of a line */
+   }
+   else
+   {
+      iov[0].iov_base = client->rx_buffer;
+      iov[0].iov_len = client->rx_size;
+      if(UPSTREAM_BODY_LENGTH == upstream->body)
+      {
+         if(iov[0].iov_len > upstream->remaining)
+            iov[0].iov_len = upstream->remaining;
+         upstream->remaining -= iov[0].iov_len;
+         done = (0 == upstream->remaining);
+      }
+      *consumed = iov[0].iov_len;
+      if(upstream->rechunk)
+      {
+         iov[2] = iov[0];
+         iov[0].iov_base = line;
+         iov[0].iov_len = sprintf(line, "%"PRIx32"\r\n", (uint32_t) iov[2].iov_len);
+         iov[1] = iov[2];
+         iov[2].iov_base = "\r\n";
+         iov[2].iov_len = 2;
+      }
+      if(!microhttpd_ProxyRelay(peer, iov, upstream->rechunk ? 3 : 1))
+      {
+         *error = true;
+         return false;
+      }
+   }
+   microhttpd_ProxyDeadline(upstream, upstream->proxy->timeout);
+
+   if(done)
+      microhttpd_UpstreamFinish(client);
+   else if(NULL == peer->stream && peer->tx_pending > MICROHTTPD_PROXY_WINDOW)
+   {
+      /* Until the client catches up; a slow client isn't the upstream stalling */
+      upstream->deadline = UINT64_MAX;
+      microhttpd_ProxyPause(client, true);
+   }
+   return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! Take note of a response header field. Returns false if it isn't relayed. */
+static bool microhttpd_UpstreamField(struct md_upstream *upstream, char *line)
+{
+   char *colon = strchr(line, ':'), *value;
+
+   if(NULL == colon)
+      return false;
+   lower_field_name(line);
+   value = colon + 1;
+   while(' ' == *value || '\t' == *value)
+      ++value;
+
+   if(strncmp(line, "connection:", 11) == 0 && string_has_token(value, "close"))
+      upstream->keep_alive = false;
+   if(microhttpd_ProxyHopField(line, colon - line, RESPONSE_HOP_FIELDS))
+      return false;
+   if(strncmp(line, "content-length:", 15) == 0)
+   {
+      upstream->body = UPSTREAM_BODY_LENGTH;
+      upstream->remaining = strtoul(value, NULL, 10);
+   }
+   else if(strncmp(line, "transfer-encoding:", 18) == 0 && string_has_token(value, "chunked"))
+      upstream->body = UPSTREAM_BODY_CHUNKED;
+   return true;
+}
+
+/*! The blank line ending the response header. An informational response is relayed and another
+ *  header follows; otherwise the header is relayed along with as much of the body as is here. */
+static bool microhttpd_UpstreamHeaderEnd(struct md_client *client, uint32_t *consumed)
+{
+   struct md_upstream *upstream = client->upstream;
+   struct md_client *peer = client->proxy_peer;
+   struct iovec iov[2];
+   uint32_t count = 1;
+
+   if(101 == upstream->status)
+   {
+      MH_DBG("%s: Upgrades aren't relayed\n", __func__);
+      return false;
+   }
+   if(upstream->status >= 200)
+   {
+      if(MICROHTTPD_METHOD_HEAD == peer->method || 204 == upstream->status || 304 == upstream->status
+      || (UPSTREAM_BODY_LENGTH == upstream->body && 0 == upstream->remaining))
+         upstream->body = UPSTREAM_BODY_NONE;
+      else if(UPSTREAM_BODY_NONE == upstream->body)
+      {
+         /* Ended by the connection closing */
+         upstream->body = UPSTREAM_BODY_CLOSE;
+         upstream->keep_alive = false;
+         upstream->rechunk = (NULL == peer->stream); /* HTTP/2 ends the stream instead */
+         if(upstream->rechunk && !microhttpd_UpstreamAppend(upstream, "Transfer-Encoding: chunked\r\n", 28))
+            return false;
+      }
+   }
+   if(!microhttpd_UpstreamAppend(upstream, "\r\n", 2))
+      return false;
+
+   iov[0].iov_base = upstream->header;
+   iov[0].iov_len = upstream->header_length;
+   if(upstream->status >= 200 && UPSTREAM_BODY_LENGTH == upstream->body && client->rx_size > *consumed)
+   {
+      /* The body, or the start of it, goes out in the same write */
+      iov[1].iov_base = &client->rx_buffer[*consumed];
+      iov[1].iov_len = client->rx_size - *consumed;
+      if(iov[1].iov_len > upstream->remaining)
+         iov[1].iov_len = upstream->remaining;
+      upstream->remaining -= iov[1].iov_len;
+      *consumed += iov[1].iov_len;
+      count = 2;
+   }
+   if(!microhttpd_ProxyRelay(peer, iov, count))
+      return false;
+   upstream->header_length = 0;
+
+   if(upstream->status < 200)
+   {
+      upstream->status = 0;
+      upstream->body = UPSTREAM_BODY_NONE;
+      return true;
+   }
+   MH_DBG("%s: %u response relayed\n", __func__, upstream->status);
+   upstream->started = true;
+   if(UPSTREAM_BODY_NONE == upstream->body || (UPSTREAM_BODY_LENGTH == upstream->body && 0 == upstream->remaining))
+      microhttpd_UpstreamFinish(client);
+   else
+      client->state = state_UpstreamBody;
+   return true;
+}
+
+/*! Follow the chunked coding through the received data. HTTP/1.1 clients are sent everything
+ *  consumed as it is, in one write; HTTP/2 streams only the data. Returns false if the coding is
+ *  invalid or the client has failed. */
+static bool microhttpd_UpstreamChunked(struct md_client *client, uint32_t *consumed, bool *done)
+{
+   struct md_upstream *upstream = client->upstream;
+   struct md_client *peer = client->proxy_peer;
+   bool verbatim = (NULL == peer->stream);
+   char *data = client->rx_buffer;
+   uint32_t offset = 0;
+   struct iovec iov;
+
+   while(offset < client->rx_size && !*done)
+   {
+      uint32_t available = client->rx_size - offset, length;
+      char *line, *end;
+
+      if(UPSTREAM_CHUNK_DATA == upstream->chunk)
+      {
+         iov.iov_base = &data[offset];
+         iov.iov_len = (available < upstream->remaining) ? available : upstream->remaining;
+         if(!verbatim && !microhttpd_ProxyRelay(peer, &iov, 1))
+            return false;
+         offset += iov.iov_len;
+         upstream->remaining -= iov.iov_len;
+         if(0 == upstream->remaining)
+            upstream->chunk = UPSTREAM_CHUNK_DATA_END;
+         continue;
+      }
+
+      line = &data[offset];
+      end = (char *) memchr(line, '\n', available);
+      if(NULL == end)
+         break;  /* Need the rest of the line */
+      offset = end + 1 - data;
+      length = end - line;
+      if(length > 0 && '\r' == line[length - 1])
+         --length;
+
+      if(UPSTREAM_CHUNK_SIZE == upstream->chunk)
+      {
+         uint64_t size = 0;
+         uint32_t idx;
+         int digit;
+
+         for(idx = 0; idx < length && (digit = hex_digit(line[idx])) >= 0 && size <= UINT32_MAX; ++idx)
+            size = (size << 4) | digit;
+         if(0 == idx || size > UINT32_MAX)
+         {
+            MH_DBG("%s: Invalid chunk size\n", __func__);
+            return false;
+         }
+         upstream->remaining = (uint32_t) size;
+         upstream->chunk = (size > 0) ? UPSTREAM_CHUNK_DATA : UPSTREAM_CHUNK_TRAILER;
+      }
+      else if(UPSTREAM_CHUNK_DATA_END == upstream->chunk)
+      {
+         if(length > 0)
+         {
+            MH_DBG("%s: Chunk longer than its size\n", __func__);
+            return false;
+         }
+         upstream->chunk = UPSTREAM_CHUNK_SIZE;
+      }
+      else if(0 == length)
+         *done = true;  /* Blank line after the trailer fields */
+   }
+
+   iov.iov_base = data;
+   iov.iov_len = offset;
+   if(verbatim && offset > 0 && !microhttpd_ProxyRelay(peer, &iov, 1))
+      return false;
+   *consumed = offset;
+   return true;
+}
+
+static bool microhttpd_UpstreamAppend(struct md_upstream *upstream, const char *data, uint32_t length)
+{
+   uint32_t needed = upstream->header_length + length;
+
+   if(needed > upstream->header_capacity)
+   {
+      uint32_t capacity = (upstream->header_capacity > 0) ? upstream->header_capacity : PROXY_HEADER_MIN;
+      char *header;
+
+      while(capacity < needed)
+         capacity *= 2;
+      if(needed > MICROHTTPD_PROXY_MAX_HEADER)
+      {
+         MH_DBG("%s: Response header too large\n", __func__);
+         return false;
+      }
+      if(capacity > MICROHTTPD_PROXY_MAX_HEADER)
+         capacity = MICROHTTPD_PROXY_MAX_HEADER;
+      header = (char *) realloc(upstream->header, capacity);
+      if(NULL == header)
+         return false;
+      upstream->header = header;
+      upstream->header_capacity = capacity;
+   }
+   memcpy(&upstream->header[upstream->header_length], data, length);
+   upstream->header_length = needed;
+   return true;
+}
+
+/*! The response has been relayed in full. The connection goes back to the pool if it can be
+ *  reused, and the client continues with its next request. */
+static void microhttpd_UpstreamFinish(struct md_client *client)
+{
+   struct md_upstream *upstream = client->upstream;
+   struct md_client *peer = client->proxy_peer;
+
+   microhttpd_ProxyUnlink(client);
+   if(upstream->keep_alive && 0 == peer->content_remaining && !client->ctx->draining)
+      microhttpd_ProxyIdle(upstream);
+   else
+      microhttpd_ProxyClose(client);
+   microhttpd_ProxyContinue(peer);
+}
+
+/*! An upstream connection for a request: the most recently used idle one, or a new one */
+static struct md_client *microhttpd_ProxyAcquire(struct md_proxy *proxy, struct md_context *ctx)
+{
+   struct md_upstream *upstream;
+
+   for(upstream = proxy->connections; NULL != upstream; upstream = upstream->next)
+   {
+      if(!upstream->busy && !upstream->client->proxy_closing)
+         break;
+   }
+   if(NULL == upstream && NULL == (upstream = microhttpd_ProxyConnect(proxy, ctx)))
+      return NULL;
+
+   upstream->busy = true;
+   ++(proxy->active);
+   upstream->timed_out = false;
+   upstream->keep_alive = true;
+   upstream->status = 0;
+   upstream->started = false;
+   upstream->body = UPSTREAM_BODY_NONE;
+   upstream->chunk = UPSTREAM_CHUNK_SIZE;
+   upstream->rechunk = false;
+   upstream->remaining = 0;
+   upstream->header_length = 0;
+   upstream->client->state = state_UpstreamHeader;
+   microhttpd_ProxyDeadline(upstream, proxy->timeout);
+   return upstream->client;
+}
+
+static struct md_upstream *microhttpd_ProxyConnect(struct md_proxy *proxy, struct md_context *ctx)
+{
+   const struct md_transport *transport = (NULL != ctx->backend->transport) ?
+      ctx->backend->transport : &md_transport_socket;
+   struct md_upstream *upstream;
+   struct md_client *client;
+   int fd, enable = 1;
+
+   fd = socket(proxy->address.sa.sa_family, SOCK_STREAM, 0);
+   if(fd < 0)
+   {
+      MH_DBG("%s: Failed to create socket (errno %d)\n", __func__, errno);
+      return NULL;
+   }
+   if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0
+   || (connect(fd, &proxy->address.sa, proxy->address_length) < 0 && EINPROGRESS != errno))
+   {
+      MH_DBG("%s: Failed to connect to '%s' (errno %d)\n", __func__, proxy->entry->upstream, errno);
+      close(fd);
+      return NULL;
+   }
+   if(!proxy->local && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+   {
+      MH_DBG("%s: Failed to enable TCP_NODELAY\n", __func__); /* Don't treat this as a fatal error */
+   }
+
+   upstream = (struct md_upstream *) calloc(1, sizeof(*upstream));
+   client = (struct md_client *) calloc(1, sizeof(*client));
+   if(NULL == upstream || NULL == client)
+   {
+      MH_DBG("%s: Failed to allocate connection\n", __func__);
+      free(upstream);
+      free(client);
+      close(fd);
+      return NULL;
+   }
+   client->ctx = ctx;
+   client->socket = fd;
+   client->transport = transport;
+   client->rx_buffer_size = ctx->params.rx_buffer_size;
+   client->state = state_UpstreamIdle;
+   client->upstream = upstream;
+   upstream->proxy = proxy;
+   upstream->client = client;
+#if defined(MICROHTTPD_TRACE)
+   client->trace_connection = microhttpd_TraceConnection();
+#endif
+   MH_TRACE(client, UPSTREAM_CONNECT, fd);
+
+   if(NULL != ctx->backend->add_client && ctx->backend->add_client(ctx, client) != 0)
+   {
+      MH_DBG("%s: Event backend failed to add connection\n", __func__);
+      free(upstream);
+      free(client);
+      close(fd);
+      return NULL;
+   }
+   client->next = ctx->client_list;
+   ctx->client_list = client;
+   ++(ctx->upstream_count);
+   upstream->next = proxy->connections;
+   proxy->connections = upstream;
+   MH_DBG("%s: Connecting to '%s' (%"PRIu32" connections)\n", __func__, proxy->entry->upstream,
+      ctx->upstream_count);
+   return upstream;
+}
+
+/*! Send the request header on, as HTTP/1.1 with the URI as it was received. The client's framing
+ *  fields aren't; the body is described by a Content-Length of the proxy's own. */
+static bool microhttpd_ProxyForward(struct md_client *client, struct md_client *upstream)
+{
+   const char *source = microhttpd_SourceAddress(client);
+   bool known = ('[' == source[0] || (source[0] >= '0' && source[0] <= '9'));
+   struct iovec iov;
+   uint32_t length, idx;
+   char *head;
+   bool result;
+
+   length = strlen(client->operation) + strlen(client->uri) + sizeof(" HTTP/1.1\r\n")
+          + sizeof("Content-Length: 4294967295\r\n")
+          + sizeof("Forwarded: for=\"\"\r\n") + strlen(source) + 2;
+   for(idx = 1; idx < client->header_entry_count; ++idx)
+      length += strlen(client->header_entries[idx]) + 2;
+   head = (char *) malloc(length);
+   if(NULL == head)
+      return false;
+
+   length = sprintf(head, "%s %s HTTP/1.1\r\n", client->operation, client->uri);
+   for(idx = 1; idx < client->header_entry_count; ++idx)
+   {
+      const char *entry = client->header_entries[idx];
+      const char *colon = strchr(entry, ':');
+
+      if(NULL == colon || microhttpd_ProxyHopField(entry, colon - entry, ARRAY_SIZE(HOP_FIELDS)))
+         continue;
+      length += sprintf(&head[length], "%s\r\n", entry);
+   }
+   if(client->content_length > 0)
+      length += sprintf(&head[length], "Content-Length: %"PRIu32"\r\n", client->content_length);
+   if(known)
+      length += sprintf(&head[length], "Forwarded: for=\"%s\"\r\n\r\n", source);
+   else
+      length += sprintf(&head[length], "Forwarded: for=unknown\r\n\r\n");
+
+   iov.iov_base = head;
+   iov.iov_len = length;
+   result = microhttpd_ProxyRelay(upstream, &iov, 1);
+   free(head);
+   return result;
+}
+
+/*! Pass data on to the other side of an exchange without waiting; whatever its transport doesn't
+ *  take now is queued. Returns false if the connection has failed. */
+static bool microhttpd_ProxyRelay(struct md_client *client, struct iovec *iov, uint32_t count)
+{
+   int32_t written = 0;
+   bool queued = false;
+
+   if(!client->corked && 0 == client->tx_pending)
+   {
+      written = client->transport->writev(client, iov, count);
+      if(written < 0)
+      {
+         if(EAGAIN != errno && EWOULDBLOCK != errno)
+         {
+            MH_DBG("%s: Write failed (errno %d)\n", __func__, errno);
+            return false;
+         }
+         written = 0;
+      }
+      MH_TRACE(client, SEND, written);
+   }
+
+   for(uint32_t idx = 0; idx < count; ++idx)
+   {
+      if((uint32_t) written >= iov[idx].iov_len)
+      {
+         written -= iov[idx].iov_len;
+         continue;
+      }
+      if(!microhttpd_TxQueueCopy(client, (const char *) iov[idx].iov_base + written,
+         iov[idx].iov_len - written))
+         return false;
+      written = 0;
+      queued = true;
+   }
+   if(queued && !client->corked)
+      microhttpd_UpdateClient(client->ctx, client);
+   return true;
+}
+
+static void microhttpd_ProxyRespond(struct md_client *client, const char *response, uint32_t length)
+{
+   struct iovec iov = { (void *) response, length };
+
+   if(microhttpd_ClientSend(client, &iov, 1) < 0)
+      MH_DBG("%s: Failed to send response\n", __func__);
+}
+
+/*! Answer a request whose upstream connection was lost before the response started */
+static void microhttpd_ProxyFail(struct md_client *client, const char *response, uint32_t length)
+{
+   MH_DBG("%s: %.3s for %s '%s'\n", __func__, &response[9], client->operation, client->uri);
+   microhttpd_ProxyRespond(client, response, length);
+   microhttpd_ProxyContinue(client);
+}
+
+/*! The exchange is over for a request that isn't being processed. Any of its body the upstream
+ *  didn't take is skipped; requests pipelined behind it are processed after this pass, like those
+ *  left for pipeline_max. A stream carries a single request, so it's removed. */
+static void microhttpd_ProxyContinue(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   if(NULL != client->stream)
+   {
+      microhttpd_RemoveClient(ctx, client);
+      return;
+   }
+   if(client->content_remaining > 0)
+      client->state = state_ProxyDiscard;
+   else
+      microhttpd_FinishRequest(client);
+   microhttpd_ProxyPause(client, false);
+   if(client->rx_size > 0 && !client->pipeline_yielded)
+   {
+      client->pipeline_yielded = true;
+      ++(ctx->pipeline_yielded);
+   }
+}
+
+/*! Abandon a request whose response was cut short */
+static void microhttpd_ProxyDrop(struct md_client *client)
+{
+   if(NULL != client->stream)
+      microhttpd_RemoveClient(client->ctx, client); /* Reset; its connection carries on */
+   else
+      microhttpd_ProxyClose(client);
+}
+
+static void microhttpd_ProxyUnlink(struct md_client *client)
+{
+   client->proxy_peer->proxy_peer = NULL;
+   client->proxy_peer = NULL;
+}
+
+/*! Return a connection to the pool once its response is complete */
+static void microhttpd_ProxyIdle(struct md_upstream *upstream)
+{
+   struct md_proxy *proxy = upstream->proxy;
+   struct md_upstream **link;
+
+   upstream->busy = false;
+   --(proxy->active);
+   free(upstream->header);
+   upstream->header = NULL;
+   upstream->header_length = upstream->header_capacity = 0;
+   upstream->client->state = state_UpstreamIdle;
+   microhttpd_ProxyPause(upstream->client, false);
+   microhttpd_ProxyDeadline(upstream, proxy->idle_timeout);
+
+   /* Most recently used first, so the oldest are left to time out */
+   for(link = &proxy->connections; *link != upstream; link = &(*link)->next)
+      ;
+   *link = upstream->next;
+   upstream->next = proxy->connections;
+   proxy->connections = upstream;
+}
+
+/*! Remove a client at the end of the pass; until then, anything it receives is ignored */
+static void microhttpd_ProxyClose(struct md_client *client)
+{
+   if(client->proxy_closing)
+      return;
+   client->proxy_closing = true;
+   ++(client->ctx->proxy_closing);
+   client->state = state_ProxyClosed;
+   if(NULL != client->upstream && client->upstream->busy)
+   {
+      client->upstream->busy = false;
+      --(client->upstream->proxy->active);
+   }
+}
+
+/*! Stop or resume reading from a client. HTTP/2 streams are given whatever their connection
+ *  receives. */
+static void microhttpd_ProxyPause(struct md_client *client, bool paused)
+{
+   if(NULL != client->stream || client->paused == paused)
+      return;
+   client->paused = paused;
+   microhttpd_UpdateClient(client->ctx, client);
+}
+
+static void microhttpd_ProxyDeadline(struct md_upstream *upstream, uint32_t timeout_ms)
+{
+   struct md_context *ctx = upstream->client->ctx;
+
+   upstream->deadline = microhttpd_ProxyClock() + timeout_ms;
+   if(upstream->deadline < ctx->proxy_deadline)
+      ctx->proxy_deadline = upstream->deadline;
+}
+
+static bool microhttpd_ProxyHopField(const char *name, uint32_t name_length, uint32_t count)
+{
+   for(uint32_t idx = 0; idx < count; ++idx)
+   {
+      if(strlen(HOP_FIELDS[idx]) == name_length && strncmp(HOP_FIELDS[idx], name, name_length) == 0)
+         return true;
+   }
+   return false;
+}
+
+static uint64_t microhttpd_ProxyClock(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
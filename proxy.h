@@ -0,0 +1,87 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file proxy.h
+ *  \brief microhttpd reverse proxy routes
+ */
+#ifndef _MICROHTTPD_PROXY_H
+#define _MICROHTTPD_PROXY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+#include "listener.h"
+
+#if !defined(MICROHTTPD_PROXY_DEFAULT_CONNECTIONS)
+#define MICROHTTPD_PROXY_DEFAULT_CONNECTIONS  8
+#endif
+#if !defined(MICROHTTPD_PROXY_DEFAULT_TIMEOUT)
+#define MICROHTTPD_PROXY_DEFAULT_TIMEOUT      30000 /* milliseconds */
+#endif
+#if !defined(MICROHTTPD_PROXY_DEFAULT_IDLE_TIMEOUT)
+#define MICROHTTPD_PROXY_DEFAULT_IDLE_TIMEOUT 30000 /* milliseconds */
+#endif
+#if !defined(MICROHTTPD_PROXY_MAX_HEADER)
+#define MICROHTTPD_PROXY_MAX_HEADER           (16 * 1024) /* Larger upstream response headers get 502 */
+#endif
+#if !defined(MICROHTTPD_PROXY_WINDOW)
+#define MICROHTTPD_PROXY_WINDOW               (64 * 1024) /* Queued for one side before the other is paused */
+#endif
+
+/* Upstream response body framing */
+#define UPSTREAM_BODY_NONE      0
+#define UPSTREAM_BODY_LENGTH    1  /* Content-Length */
+#define UPSTREAM_BODY_CHUNKED   2
+#define UPSTREAM_BODY_CLOSE     3  /* Ends when the upstream closes the connection */
+
+/* Position within a chunked body */
+#define UPSTREAM_CHUNK_SIZE     0
+#define UPSTREAM_CHUNK_DATA     1
+#define UPSTREAM_CHUNK_DATA_END 2  /* Line break after the data */
+#define UPSTREAM_CHUNK_TRAILER  3
+
+/*! One proxy_list entry and its pool of connections */
+struct md_proxy
+{
+   const tMicroHttpdProxyEntry *entry;
+   union md_socket_address address;
+   socklen_t address_length;
+   bool local;                       /* Unix domain socket; no TCP options */
+   uint32_t max_connections;
+   uint32_t timeout, idle_timeout;
+   struct md_upstream *connections;  /* Most recently used first */
+   uint32_t active;                  /* With a request in flight */
+};
+
+struct md_upstream
+{
+   struct md_proxy *proxy;
+   struct md_client *client;    /* The connection */
+   uint64_t deadline;           /* Monotonic milliseconds: for progress on the request, or end of idling */
+   bool busy;                   /* Request in flight; otherwise idle in the pool */
+   bool timed_out;
+   bool keep_alive;
+
+   /* Response */
+   char *header;                /* Collected, then relayed in one piece */
+   uint32_t header_length, header_capacity;
+   uint16_t status;
+   bool started;                /* Final response header relayed */
+   uint8_t body;                /* UPSTREAM_BODY_* */
+   uint8_t chunk;               /* UPSTREAM_CHUNK_* */
+   bool rechunk;                /* Relayed with chunked coding, since its length isn't known */
+   uint32_t remaining;          /* Body or chunk bytes */
+
+   struct md_upstream *next;
+};
+
+int microhttpd_ProxyInit(struct md_context *ctx);
+void microhttpd_ProxyShutdown(struct md_context *ctx);
+bool microhttpd_ProxyMatch(struct md_client *client);
+bool state_HandleOperationProxy(struct md_client *client, uint32_t *consumed, bool *error);
+void microhttpd_ProxyRemoved(struct md_client *client);
+void microhttpd_ProxyFree(struct md_client *client);
+void microhttpd_ProxyDrained(struct md_client *client);
+uint32_t microhttpd_ProxyTimeout(struct md_context *ctx, uint32_t timeout_ms);
+void microhttpd_ProxyProcess(struct md_context *ctx);
+
+#endif /* _MICROHTTPD_PROXY_H */
@@ -0,0 +1,245 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file ratelimit.c
+ *  \brief microhttpd per-address connection and request rate limits
+ *
+ *  Each peer address has a slot in a fixed-size, linearly probed hash table keyed on the binary
+ *  address. The slot counts the address's connections, checked at accept, and holds a token bucket
+ *  that each request draws from, checked before the request is dispatched. Lookups search at most
+ *  MICROHTTPD_ADDRESS_PROBE_MAX slots; an address that finds no room is simply not limited. Unix
+ *  domain socket clients are never limited. Everything here runs on the event loop thread.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "route.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "trace.h"
+
+#define TOKEN 1000 /* Bucket units per request */
+
+static const char RATE_LIMITED_RESPONSE[] = "HTTP/1.1 429 Too Many Requests\r\n"
+                                            "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                            "Content-Length: 0\r\n"
+                                            "Retry-After: 1\r\n"
+                                            "\r\n";
+
+static bool microhttpd_AddressKey(struct md_client *client, uint8_t key[16]);
+static struct md_address *microhttpd_AddressFind(struct md_context *ctx, const uint8_t key[16],
+   uint64_t now);
+static void microhttpd_AddressRefill(struct md_context *ctx, struct md_address *entry, uint64_t now);
+static uint32_t microhttpd_RateLimitBurst(struct md_context *ctx);
+static const char *microhttpd_RateLimitResponse(struct md_context *ctx);
+static uint64_t microhttpd_RateLimitClock(void);
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+int microhttpd_RateLimitInit(struct md_context *ctx)
+{
+   uint32_t size = 1;
+
+   if(0 == ctx->params.max_connections_per_address && 0 == ctx->params.requests_per_second)
+      return 0;
+
+   while(size < ctx->params.address_table_size)
+      size <<= 1;
+   if(0 == ctx->params.address_table_size)
+      size = MICROHTTPD_DEFAULT_ADDRESS_TABLE_SIZE;
+
+   ctx->addresses = (struct md_address *) calloc(size, sizeof(ctx->addresses[0]));
+   if(NULL == ctx->addresses)
+   {
+      MH_DBG("%s: Failed to allocate %"PRIu32" entry address table\n", __func__, size);
+      return -1;
+   }
+   ctx->address_mask = size - 1;
+   return 0;
+}
+
+void microhttpd_RateLimitShutdown(struct md_context *ctx)
+{
+   free(ctx->addresses);
+   ctx->addresses = NULL;
+}
+
+/*! Count a new connection against its address. When refused, the response has been sent if the
+ *  transport can take it yet (see microhttpd_Refuse()), and the caller closes the connection. */
+bool microhttpd_AdmitAddress(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+   struct md_address *entry;
+   uint8_t key[16];
+
+   if(NULL == ctx->addresses || !microhttpd_AddressKey(client, key))
+      return true;
+
+   entry = microhttpd_AddressFind(ctx, key, microhttpd_RateLimitClock());
+   if(NULL == entry)
+   {
+      MH_DBG("%s: Address table full; %s not limited\n", __func__, microhttpd_SourceAddress(client));
+      return true;
+   }
+   if(0 != ctx->params.max_connections_per_address
+   && entry->connections >= ctx->params.max_connections_per_address)
+   {
+      const char *response = microhttpd_RateLimitResponse(ctx);
+
+      MH_DBG("%s: Refusing %s (%"PRIu32" connections)\n", __func__, microhttpd_SourceAddress(client),
+         entry->connections);
+      microhttpd_Refuse(client, response, strlen(response));
+      return false;
+   }
+
+   ++(entry->connections);
+   client->address = entry;
+   return true;
+}
+
+void microhttpd_ReleaseAddress(struct md_client *client)
+{
+   if(NULL == client->address)
+      return;
+   MH_ASSERT(client->address->connections > 0);
+   --(client->address->connections);
+   client->address = NULL;
+}
+
+/*! Take a token for a request that's about to be dispatched. Returns false if the address's bucket
+ *  is empty. */
+bool microhttpd_AdmitRequest(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+   struct md_address *entry = client->address;
+
+   if(NULL == entry || 0 == ctx->params.requests_per_second)
+      return true;
+
+   microhttpd_AddressRefill(ctx, entry, microhttpd_RateLimitClock());
+   if(entry->tokens < TOKEN)
+   {
+      MH_DBG("%s: %s over %"PRIu32" requests per second\n", __func__, microhttpd_SourceAddress(client),
+         ctx->params.requests_per_second);
+      return false;
+   }
+   entry->tokens -= TOKEN;
+   return true;
+}
+
+bool state_RateLimited(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   const char *response = microhttpd_RateLimitResponse(client->ctx);
+   struct iovec iov = { (void *) response, strlen(response) };
+
+   MH_TRACE(client, STATE_RATE_LIMITED, client->rx_size);
+   if(microhttpd_ClientSend(client, &iov, 1) < 0)
+      MH_DBG("%s: Failed to send response\n", __func__);
+   microhttpd_SkipBody(client);
+   return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! The peer's address as IPv6, with IPv4 mapped. Returns false if it has no IP address. */
+static bool microhttpd_AddressKey(struct md_client *client, uint8_t key[16])
+{
+   const struct sockaddr_storage *peer = microhttpd_ClientPeer(client);
+
+   if(AF_INET == peer->ss_family)
+   {
+      memset(key, 0, 10);
+      key[10] = key[11] = 0xff;
+      memcpy(&key[12], &((const struct sockaddr_in *) peer)->sin_addr, 4);
+      return true;
+   }
+#if defined(AF_INET6)
+   if(AF_INET6 == peer->ss_family)
+   {
+      memcpy(key, &((const struct sockaddr_in6 *) peer)->sin6_addr, 16);
+      return true;
+   }
+#endif
+   return false;
+}
+
+/*! The address's slot, claiming an empty or idle one if it has none. Returns NULL if every slot the
+ *  address may use is busy with another. */
+static struct md_address *microhttpd_AddressFind(struct md_context *ctx, const uint8_t key[16],
+   uint64_t now)
+{
+   struct md_address *entry, *claim = NULL;
+   uint32_t hash = 2166136261u;
+   uint32_t idx;
+
+   for(idx = 0; idx < 16; ++idx)
+   {
+      hash ^= key[idx];
+      hash *= 16777619u;
+   }
+
+   for(idx = 0; idx < MICROHTTPD_ADDRESS_PROBE_MAX; ++idx)
+   {
+      entry = &ctx->addresses[(hash + idx) & ctx->address_mask];
+      if(!entry->used)
+      {
+         if(NULL == claim)
+            claim = entry;
+         break; /* End of the probe sequence */
+      }
+      if(memcmp(entry->address, key, sizeof(entry->address)) == 0)
+         return entry;
+      if(NULL == claim && 0 == entry->connections)
+      {
+         /* Idle once its bucket is full again; forgetting it then changes nothing */
+         microhttpd_AddressRefill(ctx, entry, now);
+         if(0 == ctx->params.requests_per_second
+         || entry->tokens >= TOKEN * microhttpd_RateLimitBurst(ctx))
+            claim = entry;
+      }
+   }
+   if(NULL == claim)
+      return NULL;
+
+   memcpy(claim->address, key, sizeof(claim->address));
+   claim->used = true;
+   claim->connections = 0;
+   claim->tokens = TOKEN * microhttpd_RateLimitBurst(ctx);
+   claim->refill_time = now;
+   return claim;
+}
+
+static void microhttpd_AddressRefill(struct md_context *ctx, struct md_address *entry, uint64_t now)
+{
+   uint32_t burst = microhttpd_RateLimitBurst(ctx);
+   uint64_t tokens;
+
+   /* requests_per_second tokens per second is that many bucket units per millisecond */
+   tokens = entry->tokens + (now - entry->refill_time) * ctx->params.requests_per_second;
+   entry->tokens = (tokens < (uint64_t) TOKEN * burst) ? (uint32_t) tokens : TOKEN * burst;
+   entry->refill_time = now;
+}
+
+static uint32_t microhttpd_RateLimitBurst(struct md_context *ctx)
+{
+   return (0 != ctx->params.request_burst) ? ctx->params.request_burst : ctx->params.requests_per_second;
+}
+
+static const char *microhttpd_RateLimitResponse(struct md_context *ctx)
+{
+   return (NULL != ctx->params.rate_limit_response) ?
+      ctx->params.rate_limit_response : RATE_LIMITED_RESPONSE;
+}
+
+static uint64_t microhttpd_RateLimitClock(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
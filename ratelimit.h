@@ -0,0 +1,38 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file ratelimit.h
+ *  \brief microhttpd per-address connection and request rate limits
+ */
+#ifndef _MICROHTTPD_RATELIMIT_H
+#define _MICROHTTPD_RATELIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if !defined(MICROHTTPD_DEFAULT_ADDRESS_TABLE_SIZE)
+#define MICROHTTPD_DEFAULT_ADDRESS_TABLE_SIZE 256
+#endif
+#if !defined(MICROHTTPD_ADDRESS_PROBE_MAX)
+#define MICROHTTPD_ADDRESS_PROBE_MAX          16 /* Slots searched per lookup; bounds the cost when the table is full */
+#endif
+
+/*! Limits state for one peer address. A slot stays in its probe sequence once used; it is reused
+ *  for another address when no connections remain and the bucket has refilled. */
+struct md_address
+{
+   uint8_t address[16];   /* IPv6, or IPv4-mapped IPv6 */
+   bool used;
+   uint32_t connections;
+   uint32_t tokens;       /* Thousandths of a request */
+   uint64_t refill_time;  /* Monotonic milliseconds */
+};
+
+int microhttpd_RateLimitInit(struct md_context *ctx);
+void microhttpd_RateLimitShutdown(struct md_context *ctx);
+bool microhttpd_AdmitAddress(struct md_client *client);
+void microhttpd_ReleaseAddress(struct md_client *client);
+bool microhttpd_AdmitRequest(struct md_client *client);
+bool state_RateLimited(struct md_client *client, uint32_t *consumed, bool *error);
+
+#endif /* _MICROHTTPD_RATELIMIT_H */
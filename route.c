@@ -0,0 +1,313 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file route.c
+ *  \brief microhttpd method dispatch
+ *
+ *  PUT, DELETE, PATCH and OPTIONS requests go to the first route whose URI prefix and methods match.
+ *  A request nothing will handle is answered right away from pre-serialized status lines: 405 (or
+ *  204 for OPTIONS) when the method is known, 501 when it isn't, both listing the methods the URI
+ *  does allow. Any body it has is skipped without being buffered.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "admission.h"
+#include "assets.h"
+#include "route.h"
+#include "trace.h"
+
+#define ROUTE_METHODS (MICROHTTPD_METHOD_PUT | MICROHTTPD_METHOD_DELETE | MICROHTTPD_METHOD_PATCH | \
+                       MICROHTTPD_METHOD_OPTIONS)
+
+typedef struct
+{
+   const char *name;
+   uint32_t method;
+} tMethodName;
+
+static const tMethodName METHODS[] =
+{
+   { "GET", MICROHTTPD_METHOD_GET },
+   { "HEAD", MICROHTTPD_METHOD_HEAD },
+   { "POST", MICROHTTPD_METHOD_POST },
+   { "PUT", MICROHTTPD_METHOD_PUT },
+   { "DELETE", MICROHTTPD_METHOD_DELETE },
+   { "PATCH", MICROHTTPD_METHOD_PATCH },
+   { "OPTIONS", MICROHTTPD_METHOD_OPTIONS }
+};
+
+/* Followed by the Allow list and the blank line */
+static const char METHOD_NOT_ALLOWED[] = "HTTP/1.1 405 Method Not Allowed\r\n"
+                                         "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                         "Content-Length: 0\r\n"
+                                         "Allow: ";
+static const char NOT_IMPLEMENTED[] = "HTTP/1.1 501 Not Implemented\r\n"
+                                      "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                      "Content-Length: 0\r\n"
+                                      "Allow: ";
+static const char OPTIONS_ALLOWED[] = "HTTP/1.1 204 No Content\r\n"
+                                      "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                      "Allow: ";
+static const char BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\n"
+                                  "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n"
+                                  "\r\n";
+
+static bool state_RouteBody(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_DiscardBody(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_Closing(struct md_client *client, uint32_t *consumed, bool *error);
+static void microhttpd_CloseAfterResponse(struct md_client *client);
+static const tMicroHttpdRouteEntry *microhttpd_RouteFind(struct md_client *client);
+static uint32_t microhttpd_AllowedMethods(struct md_client *client);
+static bool microhttpd_Reject(struct md_client *client, const char *status, uint32_t status_length);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+const char *microhttpd_get_method(tMicroHttpdClient client)
+{
+   return ((struct md_client *) client)->operation;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! MICROHTTPD_METHOD_* for a request line's method, or 0 if it isn't one of those */
+uint32_t microhttpd_MethodParse(const char *operation)
+{
+   for(uint32_t idx = 0; idx < sizeof(METHODS) / sizeof(METHODS[0]); ++idx)
+   {
+      if(strcmp(operation, METHODS[idx].name) == 0)
+         return METHODS[idx].method;
+   }
+   return 0;
+}
+
+bool state_HandleOperationRoute(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   const tMicroHttpdRouteEntry *route = microhttpd_RouteFind(client);
+
+   MH_TRACE(client, STATE_ROUTE, client->rx_size);
+   if(NULL == route)
+   {
+      if(MICROHTTPD_METHOD_OPTIONS == client->method)
+         return microhttpd_Reject(client, OPTIONS_ALLOWED, sizeof(OPTIONS_ALLOWED) - 1);
+      return state_MethodNotAllowed(client, consumed, error);
+   }
+
+   if(!microhttpd_ContentLength(client, &client->content_length))
+   {
+      microhttpd_RejectFraming(client);
+      return true;
+   }
+   client->content_remaining = client->content_length;
+   if(client->content_length > 0 && !microhttpd_AdmitUpload(client))
+   {
+      microhttpd_Shed(client);
+      *error = true;
+      return false;
+   }
+
+   MH_DBG("%s: %s '%s' (%"PRIu32" byte body)\n", __func__, client->operation, client->uri,
+      client->content_length);
+   client->route = route;
+   client->state = state_RouteBody;
+   microhttpd_ExpectContinue(client); /* There's no call ahead of the body to refuse it from */
+   return true;
+}
+
+bool state_MethodNotAllowed(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_METHOD_NOT_ALLOWED, client->rx_size);
+   MH_DBG("%s: %s not allowed for '%s'\n", __func__, client->operation, client->uri);
+   return microhttpd_Reject(client, METHOD_NOT_ALLOWED, sizeof(METHOD_NOT_ALLOWED) - 1);
+}
+
+bool state_NotImplemented(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_NOT_IMPLEMENTED, client->rx_size);
+   MH_DBG("%s: Unsupported HTTP operation '%s'\n", __func__, client->operation);
+   return microhttpd_Reject(client, NOT_IMPLEMENTED, sizeof(NOT_IMPLEMENTED) - 1);
+}
+
+/*! Finish a request that has been answered without being handled, skipping any body it has. If
+ *  where that body ends is in doubt, the connection is closed instead. */
+void microhttpd_SkipBody(struct md_client *client)
+{
+   if(microhttpd_ContentLength(client, &client->content_remaining))
+      microhttpd_DiscardBody(client);
+   else
+      microhttpd_CloseAfterResponse(client);
+}
+
+/*! Answer a request whose body can't be delimited (see microhttpd_ContentLength()) with 400. The
+ *  start of the next request is in doubt as well, so the connection is closed once that's sent. */
+void microhttpd_RejectFraming(struct md_client *client)
+{
+   struct iovec iov = { (void *) BAD_REQUEST, sizeof(BAD_REQUEST) - 1 };
+
+   MH_DBG("%s: Refusing %s '%s' with ambiguous body framing\n", __func__, client->operation, client->uri);
+   if(microhttpd_ClientSend(client, &iov, 1) < 0)
+      MH_DBG("%s: Failed to send response\n", __func__);
+   microhttpd_CloseAfterResponse(client);
+}
+
+/*! Finish a request that has been answered, skipping the content_remaining bytes of body left. A
+ *  client still waiting for 100 Continue may never send the body, so there's no telling where its
+ *  next request would start; that connection is closed once the response is written instead. */
+void microhttpd_DiscardBody(struct md_client *client)
+{
+   if(microhttpd_ContinueExpected(client))
+   {
+      MH_DBG("%s: Closing after refusing '%s'\n", __func__, client->uri);
+      microhttpd_CloseAfterResponse(client);
+   }
+   else if(client->content_remaining > 0)
+      client->state = state_DiscardBody;
+   else
+      microhttpd_FinishRequest(client);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! Pass the body to the route's handler as it arrives, straight from the receive buffer */
+static bool state_RouteBody(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   const tMicroHttpdRouteEntry *route = client->route;
+   uint32_t length = (client->rx_size < client->content_remaining) ?
+      client->rx_size : client->content_remaining;
+   bool start = (client->content_remaining == client->content_length);
+
+   MH_TRACE(client, STATE_ROUTE_BODY, client->rx_size);
+   if(0 == length && client->content_remaining > 0)
+      return false; /* Need more rx data */
+
+   client->content_remaining -= length;
+   *consumed = length;
+   MH_TRACE(client, HANDLER_ENTER, client->method);
+   route->handler((tMicroHttpdClient) client, client->operation, client->uri,
+      (const char **) client->uri_params, client->uri_param_count, microhttpd_SourceAddress(client),
+      route->cookie, start, 0 == client->content_remaining, client->rx_buffer, length,
+      client->content_length);
+   MH_TRACE(client, HANDLER_EXIT, client->method);
+
+   if(0 == client->content_remaining)
+   {
+      client->route = NULL;
+      microhttpd_FinishRequest(client);
+   }
+   return true;
+}
+
+static bool state_DiscardBody(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   uint32_t length = (client->rx_size < client->content_remaining) ?
+      client->rx_size : client->content_remaining;
+
+   MH_TRACE(client, STATE_DISCARD_BODY, client->rx_size);
+   if(0 == length)
+      return false;
+
+   client->content_remaining -= length;
+   *consumed = length;
+   if(0 == client->content_remaining)
+      microhttpd_FinishRequest(client);
+   return true;
+}
+
+/*! Take nothing more from the connection, and close it once the response is written. An HTTP/2
+ *  stream just ends; the connection carrying it frames each stream's body itself. */
+static void microhttpd_CloseAfterResponse(struct md_client *client)
+{
+   if(NULL != client->stream)
+   {
+      microhttpd_FinishRequest(client);
+      return;
+   }
+   client->close_after_response = true;
+   client->state = state_Closing;
+}
+
+/*! Waiting for the response to be written before the connection is closed; input is ignored */
+static bool state_Closing(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_CLOSING, client->rx_size);
+   *consumed = client->rx_size;
+   return false;
+}
+
+static const tMicroHttpdRouteEntry *microhttpd_RouteFind(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+
+   for(uint32_t idx = 0; idx < ctx->params.route_count; ++idx)
+   {
+      const tMicroHttpdRouteEntry *route = &ctx->params.route_list[idx];
+
+      if((route->methods & client->method) && NULL != route->handler
+      && strncmp(route->uri, client->uri, strlen(route->uri)) == 0)
+         return route;
+   }
+   return NULL;
+}
+
+static uint32_t microhttpd_AllowedMethods(struct md_client *client)
+{
+   struct md_context *ctx = client->ctx;
+   uint32_t methods = MICROHTTPD_METHOD_OPTIONS; /* Always answered */
+   uint32_t idx;
+
+   if(NULL != ctx->params.default_get_handler
+   || NULL != microhttpd_AssetFind(ctx->params.assets, client->uri))
+      methods |= MICROHTTPD_METHOD_GET | MICROHTTPD_METHOD_HEAD;
+   for(idx = 0; idx < ctx->params.get_handler_count; ++idx)
+   {
+      if(strncmp(ctx->params.get_handler_list[idx].uri, client->uri,
+         strlen(ctx->params.get_handler_list[idx].uri)) == 0)
+         methods |= MICROHTTPD_METHOD_GET | MICROHTTPD_METHOD_HEAD;
+   }
+   if(NULL != ctx->params.post_handler)
+      methods |= MICROHTTPD_METHOD_POST;
+   for(idx = 0; idx < ctx->params.route_count; ++idx)
+   {
+      const tMicroHttpdRouteEntry *route = &ctx->params.route_list[idx];
+
+      if(NULL != route->handler && strncmp(route->uri, client->uri, strlen(route->uri)) == 0)
+         methods |= route->methods & ROUTE_METHODS;
+   }
+   return methods;
+}
+
+/*! Answer the request with a status line and header ending in "Allow: ", then skip its body */
+static bool microhttpd_Reject(struct md_client *client, const char *status, uint32_t status_length)
+{
+   uint32_t methods = microhttpd_AllowedMethods(client);
+   char allow[64];
+   uint32_t length = 0;
+   struct iovec iov[3];
+
+   for(uint32_t idx = 0; idx < sizeof(METHODS) / sizeof(METHODS[0]); ++idx)
+   {
+      if(methods & METHODS[idx].method)
+         length += sprintf(&allow[length], "%s%s", (0 == length) ? "" : ", ", METHODS[idx].name);
+   }
+
+   iov[0].iov_base = (void *) status;
+   iov[0].iov_len = status_length;
+   iov[1].iov_base = allow;
+   iov[1].iov_len = length;
+   iov[2].iov_base = "\r\n\r\n";
+   iov[2].iov_len = 4;
+   if(microhttpd_ClientSend(client, iov, 3) < 0)
+      MH_DBG("%s: Failed to send response\n", __func__);
+
+   microhttpd_SkipBody(client);
+   return true;
+}
@@ -0,0 +1,21 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file route.h
+ *  \brief microhttpd method dispatch
+ */
+#ifndef _MICROHTTPD_ROUTE_H
+#define _MICROHTTPD_ROUTE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+uint32_t microhttpd_MethodParse(const char *operation);
+bool state_HandleOperationRoute(struct md_client *client, uint32_t *consumed, bool *error);
+bool state_MethodNotAllowed(struct md_client *client, uint32_t *consumed, bool *error);
+bool state_NotImplemented(struct md_client *client, uint32_t *consumed, bool *error);
+void microhttpd_SkipBody(struct md_client *client);
+void microhttpd_DiscardBody(struct md_client *client);
+void microhttpd_RejectFraming(struct md_client *client);
+
+#endif /* _MICROHTTPD_ROUTE_H */
@@ -0,0 +1,198 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file sse.c
+ *  \brief microhttpd server-sent events
+ *
+ *  A GET handler turns its connection into a text/event-stream subscribed to a named channel. Each
+ *  broadcast is formatted once into a shared buffer, and every subscriber's transmit queue holds a
+ *  reference to that same buffer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "client.h"
+#include "tx.h"
+#include "sse.h"
+#include "trace.h"
+
+#define EVENT_STREAM_HEADER "HTTP/1.1 200 OK\r\n" \
+                            "Server: " MICROHTTPD_SERVER_NAME "\r\n" \
+                            "Content-Type: text/event-stream\r\n" \
+                            "Cache-Control: no-cache\r\n" \
+                            "\r\n"
+
+static struct md_channel *microhttpd_ChannelFind(struct md_context *ctx, const char *name, bool create);
+static uint32_t microhttpd_EventFormat(char *out, const char *event, const char *data);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+int microhttpd_event_stream(tMicroHttpdClient client, const char *channel_name)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct md_channel *channel;
+
+   if(NULL != c->deferred || NULL != c->channel || NULL != c->stream || MICROHTTPD_METHOD_GET != c->method)
+   {
+      MH_DBG("%s: Only available for HTTP/1.1 GET requests, not deferred or offloaded\n", __func__);
+      return -1;
+   }
+
+   channel = microhttpd_ChannelFind(c->ctx, channel_name, true);
+   if(NULL == channel || !microhttpd_TxQueueCopy(c, EVENT_STREAM_HEADER, sizeof(EVENT_STREAM_HEADER) - 1))
+      return -1;
+
+   c->channel = channel;
+   c->channel_prev = NULL;
+   c->channel_next = channel->subscribers;
+   if(NULL != channel->subscribers)
+      channel->subscribers->channel_prev = c;
+   channel->subscribers = c;
+   ++(channel->subscriber_count);
+   MH_DBG("%s: %s subscribed to '%s' (%"PRIu32" subscribers)\n", __func__, microhttpd_SourceAddress(c),
+      channel->name, channel->subscriber_count);
+
+   microhttpd_UpdateClient(c->ctx, c);
+   return 0;
+}
+
+int microhttpd_broadcast(tMicroHttpdContext context, const char *channel_name, const char *event,
+   const char *data)
+{
+   struct md_context *ctx = (struct md_context *) context;
+   struct md_channel *channel;
+   struct md_client *client, *next;
+   struct md_buffer *buffer;
+   uint32_t length;
+   int count = 0;
+
+   if(NULL != event && strpbrk(event, "\r\n") != NULL)
+   {
+      MH_DBG("%s: Line break in event name\n", __func__);
+      return -1; /* It would end the field, letting the rest pose as fields or events of its own */
+   }
+   channel = microhttpd_ChannelFind(ctx, channel_name, false);
+   if(NULL == channel || NULL == channel->subscribers)
+      return 0;
+   if(NULL == data)
+      data = "";
+
+   length = microhttpd_EventFormat(NULL, event, data);
+   buffer = microhttpd_BufferAlloc(length);
+   if(NULL == buffer)
+      return -1;
+   buffer->length = microhttpd_EventFormat(buffer->data, event, data);
+
+   for(client = channel->subscribers; NULL != client; client = next)
+   {
+      next = client->channel_next;
+      if(client->tx_pending + length > MICROHTTPD_STREAM_MAX_PENDING
+      || !microhttpd_TxQueueBuffer(client, buffer, 0, length))
+      {
+         MH_DBG("%s: Dropping subscriber %s (%"PRIu32" bytes unsent)\n", __func__,
+            microhttpd_SourceAddress(client), client->tx_pending);
+         microhttpd_RemoveClient(ctx, client); /* The browser reconnects and catches up */
+         continue;
+      }
+      microhttpd_UpdateClient(ctx, client);
+      ++count;
+   }
+
+   microhttpd_BufferRelease(buffer);
+   return count;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Anything the client sends on an event stream is ignored */
+bool state_EventStream(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_EVENT_STREAM, client->rx_size);
+   *consumed = client->rx_size;
+   return false;
+}
+
+void microhttpd_ChannelLeave(struct md_client *client)
+{
+   struct md_channel *channel = client->channel;
+
+   if(NULL == channel)
+      return;
+
+   if(NULL != client->channel_prev)
+      client->channel_prev->channel_next = client->channel_next;
+   else
+      channel->subscribers = client->channel_next;
+   if(NULL != client->channel_next)
+      client->channel_next->channel_prev = client->channel_prev;
+   --(channel->subscriber_count);
+
+   client->channel = NULL;
+   client->channel_prev = client->channel_next = NULL;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static struct md_channel *microhttpd_ChannelFind(struct md_context *ctx, const char *name, bool create)
+{
+   struct md_channel *channel;
+
+   for(channel = ctx->channels; NULL != channel; channel = channel->next)
+   {
+      if(strcmp(channel->name, name) == 0)
+         return channel;
+   }
+   if(!create)
+      return NULL;
+
+   channel = (struct md_channel *) malloc(sizeof(*channel) + strlen(name) + 1);
+   if(NULL == channel)
+   {
+      MH_DBG("%s: Failed to allocate channel '%s'\n", __func__, name);
+      return NULL;
+   }
+   memset(channel, 0, sizeof(*channel));
+   channel->name = (char *) &channel[1];
+   strcpy(channel->name, name);
+   channel->next = ctx->channels;
+   ctx->channels = channel;
+   return channel;
+}
+
+/*! Format an event, one data field per line of data, where lines end as EventSource ends them: at
+ *  "\r\n", "\r" or "\n". With out NULL, only returns the length. */
+static uint32_t microhttpd_EventFormat(char *out, const char *event, const char *data)
+{
+   uint32_t length = 0;
+   const char *line = data;
+
+#define EVENT_APPEND(text, size) do { if(NULL != out) memcpy(&out[length], text, size); length += size; } while(0)
+   if(NULL != event)
+   {
+      EVENT_APPEND("event: ", 7);
+      EVENT_APPEND(event, strlen(event));
+      EVENT_APPEND("\n", 1);
+   }
+   do
+   {
+      uint32_t line_length = strcspn(line, "\r\n");
+      const char *end = &line[line_length];
+
+      EVENT_APPEND("data: ", 6);
+      EVENT_APPEND(line, line_length);
+      EVENT_APPEND("\n", 1);
+      if('\r' == end[0] && '\n' == end[1])
+         ++end;
+      line = ('\0' != *end) ? end + 1 : NULL;
+   } while(NULL != line);
+   EVENT_APPEND("\n", 1);
+#undef EVENT_APPEND
+
+   return length;
+}
@@ -0,0 +1,30 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file sse.h
+ *  \brief microhttpd server-sent events
+ */
+#ifndef _MICROHTTPD_SSE_H
+#define _MICROHTTPD_SSE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if !defined(MICROHTTPD_STREAM_MAX_PENDING)
+/* Output the kernel has not accepted before a subscriber is dropped. With io_uring, sends are
+ *  submitted once per pass, so this also bounds what is broadcast between microhttpd_process() calls. */
+#define MICROHTTPD_STREAM_MAX_PENDING (64 * 1024)
+#endif
+
+struct md_channel
+{
+   char *name;
+   struct md_client *subscribers;
+   uint32_t subscriber_count;
+   struct md_channel *next;
+};
+
+bool state_EventStream(struct md_client *client, uint32_t *consumed, bool *error);
+void microhttpd_ChannelLeave(struct md_client *client);
+
+#endif /* _MICROHTTPD_SSE_H */
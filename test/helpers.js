@@ -54,6 +54,18 @@ function getValue(parameterName, valueDefault, callback) {
     return valueResult;
 }
 
+function subscribe(url, names) {
+  var source = new EventSource(url);
+  names.forEach((name) => {
+    source.addEventListener(name, function(e) {
+      var el = document.getElementById(name + "_display");
+      if(el != null)
+         el.innerHTML = e.data;
+    });
+  });
+  return source;
+}
+
 function display_ajax(result) {
   var url = new URL(result.responseURL);
   var e = "";
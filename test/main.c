@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <sys/time.h>
 #include "microhttpd/microhttpd.h"
@@ -23,27 +24,53 @@ static void handle_ajax(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
 static void handle_file(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
+static void handle_events(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
+static void broadcast_sensors(tMicroHttpdContext ctx);
+static void handle_websocket(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
+static void handle_settings(tMicroHttpdClient client, const char *method, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length);
 static void post_handler(tMicroHttpdClient client, const char *uri, const char *filename,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
    bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length);
+static tMicroHttpdRouteEntry route_list[] =
+{
+   { MICROHTTPD_METHOD_PUT | MICROHTTPD_METHOD_DELETE, "/settings", handle_settings, NULL }
+};
+extern const tMicroHttpdAssetTable test_assets; /* index.html and helpers.js, bundled at build time */
+
 static tMicroHttpdGetHandlerEntry get_handler_list[] =
 {
    { "/ajax", handle_ajax, NULL },
+   { "/events", handle_events, NULL },
+   { "/ws", handle_websocket, NULL },
    { "/test", handle_test, NULL }
 };
 
 int main(int argc, char *argv[])
 {
+   static const tMicroHttpdListener listeners[] =
+   {
+      { "0.0.0.0", SERVER_PORT },
+      { "::", SERVER_PORT }
+   };
    tMicroHttpdParams params = {0};
    tMicroHttpdContext ctx;
 
-   params.server_port = SERVER_PORT;
-   params.process_timeout = 0;
+   params.listeners = listeners;
+   params.listener_count = ARRAY_SIZE(listeners);
+   params.process_timeout = 1000;
    params.rx_buffer_size = 2048;
    params.post_handler = post_handler;
    params.get_handler_list = get_handler_list;
    params.get_handler_count = ARRAY_SIZE(get_handler_list);
    params.default_get_handler = handle_file;
+   params.assets = &test_assets;
+   params.route_list = route_list;
+   params.route_count = ARRAY_SIZE(route_list);
+   params.websocket_ping_interval = 30000;
 
    ctx = microhttpd_start(&params);
    if(NULL == ctx)
@@ -53,7 +80,8 @@ int main(int argc, char *argv[])
    }
 
    DBG("Server started\n");
-   while(microhttpd_process(ctx) == 0);
+   while(microhttpd_process(ctx) == 0)
+      broadcast_sensors(ctx);
    DBG("Server terminated\n");
    return 0;
 }
@@ -68,6 +96,8 @@ static void ajax_PVVoltage(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
 static void ajax_PVCurrent(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
+static void ajax_Status(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie);
 
 typedef struct sAjaxRegistry
 {
@@ -81,6 +111,7 @@ static tAjaxRegistry ajaxRegistry[] =
   { "Load_Current", ajax_LoadCurrent },
   { "PV_Voltage", ajax_PVVoltage },
   { "PV_Current", ajax_PVCurrent },
+  { "status", ajax_Status },
 };
 
 typedef struct sUriRename
@@ -139,7 +170,7 @@ static void handle_ajax(tMicroHttpdClient client, const char *uri,
       for(int i = 0; !found && i < ARRAY_SIZE(ajaxRegistry); ++i)
       {
          tAjaxRegistry *r = &ajaxRegistry[i];
-         if(strcmp(param_list[0], r->name) == 0)
+         if(NULL != microhttpd_get_param(client, r->name, NULL))
          {
             DBG("%s: Handling AJAX parameter '%s'\n", __func__, r->name);
             r->handler(client, uri, param_list, param_count, source_address, cookie);
@@ -222,6 +253,75 @@ static void handle_file(tMicroHttpdClient client, const char *uri,
    fclose(pFile);
 }
 
+/* ---------------------------------------------------------------------------------------------
+ * Server-sent events
+ */
+
+static void handle_events(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   DBG("%s: %s subscribed to sensor updates\n", __func__, source_address);
+   if(microhttpd_event_stream(client, "sensors") != 0)
+      send_not_found(client, uri);
+}
+
+static uint32_t loadVoltage = 0;
+static uint32_t loadCurrent = 0;
+static uint32_t pvVoltage = 0;
+static uint32_t pvCurrent = 0;
+
+static void broadcast_sensors(tMicroHttpdContext ctx)
+{
+   static time_t last_update = 0;
+   char content[40];
+   time_t curtime = time(NULL);
+
+   if(curtime == last_update)
+      return;
+   last_update = curtime;
+
+   strftime(content, sizeof(content), "%m-%d-%Y %T", localtime(&curtime));
+   microhttpd_broadcast(ctx, "sensors", "update_time", content);
+   snprintf(content, sizeof(content), "%u", ++loadVoltage);
+   microhttpd_broadcast(ctx, "sensors", "Load_Voltage", content);
+   snprintf(content, sizeof(content), "%u", ++loadCurrent);
+   microhttpd_broadcast(ctx, "sensors", "Load_Current", content);
+   snprintf(content, sizeof(content), "%u", ++pvVoltage);
+   microhttpd_broadcast(ctx, "sensors", "PV_Voltage", content);
+   snprintf(content, sizeof(content), "%u", ++pvCurrent);
+   microhttpd_broadcast(ctx, "sensors", "PV_Current", content);
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * WebSocket
+ */
+
+static void websocket_echo(tMicroHttpdClient client, uint8_t opcode, const char *data, uint32_t length,
+   void *cookie)
+{
+   uint32_t *messages = microhttpd_get_connection_data(client);
+
+   if(MICROHTTPD_WEBSOCKET_CLOSE == opcode)
+   {
+      DBG("%s: WebSocket closed after %u messages\n", __func__, (NULL != messages) ? *messages : 0);
+      return;
+   }
+   if(NULL != messages)
+      ++(*messages);
+   DBG("%s: Echoing %u byte message\n", __func__, length);
+   microhttpd_websocket_send(client, opcode, data, length);
+}
+
+static void handle_websocket(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   DBG("%s: WebSocket upgrade from %s\n", __func__, source_address);
+   if(microhttpd_websocket_accept(client, websocket_echo, NULL) != 0)
+      microhttpd_send_response(client, HTTP_BAD_REQUEST, "text/plain", 0, NULL, NULL);
+   else
+      microhttpd_set_connection_data(client, calloc(1, sizeof(uint32_t)), free); /* Message count */
+}
+
 /* ---------------------------------------------------------------------------------------------
  * AJAX
  */
@@ -240,7 +340,6 @@ static void ajax_UpdateTime(tMicroHttpdClient client, const char *uri,
    microhttpd_send_response(client, HTTP_OK, "text/html", strlen(content), NULL, content);
 }
 
-static uint32_t loadVoltage = 0;
 static void ajax_LoadVoltage(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
 {
@@ -251,7 +350,6 @@ static void ajax_LoadVoltage(tMicroHttpdClient client, const char *uri,
    microhttpd_send_response(client, HTTP_OK, "text/html", strlen(content), NULL, content);
 }
 
-static uint32_t loadCurrent = 0;
 static void ajax_LoadCurrent(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
 {
@@ -262,7 +360,6 @@ static void ajax_LoadCurrent(tMicroHttpdClient client, const char *uri,
    microhttpd_send_response(client, HTTP_OK, "text/html", strlen(content), NULL, content);
 }
 
-static uint32_t pvVoltage = 0;
 static void ajax_PVVoltage(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
 {
@@ -273,7 +370,6 @@ static void ajax_PVVoltage(tMicroHttpdClient client, const char *uri,
    microhttpd_send_response(client, HTTP_OK, "text/html", strlen(content), NULL, content);
 }
 
-static uint32_t pvCurrent = 0;
 static void ajax_PVCurrent(tMicroHttpdClient client, const char *uri,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
 {
@@ -284,35 +380,91 @@ static void ajax_PVCurrent(tMicroHttpdClient client, const char *uri,
    microhttpd_send_response(client, HTTP_OK, "text/html", strlen(content), NULL, content);
 }
 
+static void ajax_Status(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   microhttpd_json_begin(client, HTTP_OK, NULL);
+   microhttpd_json_object(client, NULL);
+   microhttpd_json_int(client, "time", time(NULL));
+   microhttpd_json_object(client, "load");
+   microhttpd_json_int(client, "voltage", loadVoltage);
+   microhttpd_json_int(client, "current", loadCurrent);
+   microhttpd_json_close(client);
+   microhttpd_json_object(client, "pv");
+   microhttpd_json_int(client, "voltage", pvVoltage);
+   microhttpd_json_int(client, "current", pvCurrent);
+   microhttpd_json_close(client);
+   microhttpd_json_close(client);
+   if(microhttpd_json_end(client) != 0)
+      DBG("%s: Failed to send status\n", __func__);
+}
+
+/* -----------------------------------------------------------------------------------------------------
+ * PUT/DELETE
+ */
+
+static char settings[64];
+static uint32_t settingsLength = 0;
+
+static void handle_settings(tMicroHttpdClient client, const char *method, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length)
+{
+   if(strcmp(method, "DELETE") == 0)
+      settingsLength = 0;
+   else
+   {
+      if(start)
+         settingsLength = 0;
+      for(uint32_t i = 0; i < data_length && settingsLength < sizeof(settings); ++i)
+         settings[settingsLength++] = data[i];
+   }
+
+   if(finish)
+   {
+      DBG("%s: %s settings (%u bytes)\n", __func__, method, settingsLength);
+      microhttpd_send_response(client, HTTP_OK, "text/plain", settingsLength, NULL, settings);
+   }
+}
+
 /* -----------------------------------------------------------------------------------------------------
  * POST
  */
 
-static bool fileInProgress = false;
-static uint32_t currentFileLength = 0;
+typedef struct sUpload
+{
+   uint32_t length; /* Received so far */
+} tUpload;
 
 static void post_handler(tMicroHttpdClient client, const char *uri, const char *filename,
    const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
    bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length)
 {
+   tUpload *upload = microhttpd_get_request_data(client);
+
    if(start)
    {
-      DBG("Starting upload of %s, length %u (current %u)\n", filename, total_length, data_length);
-      currentFileLength = 0;
-      fileInProgress = true;
+      DBG("Starting upload of %s, length %u (current %u)\n", (NULL != filename) ? filename : "",
+         total_length, data_length);
+      upload = calloc(1, sizeof(*upload));
+      if(NULL == upload)
+      {
+         microhttpd_send_response(client, HTTP_SERVICE_UNAVAILABLE, "text/plain", 0, NULL, NULL);
+         return;
+      }
+      microhttpd_set_request_data(client, upload, free); /* Freed when the request finishes */
    }
 
    for(int i = 0; i < param_count; ++i)
    {
       DBG("Parameter %u: %s\n", i, param_list[i]);
    }
-   currentFileLength += data_length;
-   DBG("Length: current %u, total %u\n", data_length, currentFileLength);
+   upload->length += data_length;
+   DBG("Length: current %u, total %u\n", data_length, upload->length);
 
    if(finish)
    {
-      char *content = "/index.html";
-      DBG("Finished upload of %s, length %u bytes\n", filename, total_length);
+      DBG("Finished upload of %s, length %u bytes\n", (NULL != filename) ? filename : "", upload->length);
       microhttpd_send_response(client, HTTP_URI_FOUND, "text/html", 0, "Location: /upgrade_done\r\n", NULL);
    }
 }
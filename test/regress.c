@@ -0,0 +1,870 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file regress.c
+ *  \brief microhttpd regression tests
+ *
+ *  Each test plays a recorded byte stream from a misbehaving client into the client state machine
+ *  through the in-memory transport, then checks what the server sent back and how it left the
+ *  connection. Build with -fsanitize=address to catch memory errors as well.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+#include "client.h"
+#include "transport.h"
+#include "proxy.h"
+#include "sse.h"
+#include "hpack.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
+
+#define REGRESS_RX_BUFFER_SIZE 4096
+#define REGRESS_TX_LOG_SIZE    4096
+
+typedef struct
+{
+   struct md_context ctx;
+   struct md_memory_stream stream;
+   struct md_client *client;
+   char tx_log[REGRESS_TX_LOG_SIZE + 1];
+} tRegressConnection;
+
+typedef struct
+{
+   const char *name;
+   bool (*run)(tRegressConnection *conn);
+} tRegressTest;
+
+/* Decoded header fields, one "name: value" line each */
+typedef struct
+{
+   char text[512];
+   uint32_t length;
+} tRegressFields;
+
+/* A header block and the fields and dynamic table size it must leave */
+typedef struct
+{
+   const char *block;
+   uint32_t block_length;
+   const char *fields;
+   uint32_t table_size;
+} tRegressHpackBlock;
+
+static uint32_t get_count, route_count, websocket_message_count;
+static bool params_found;
+static tRegressFields form_fields;
+
+/* ---------------------------------------------------------------------------------------------
+ * Handlers
+ */
+
+static void handle_websocket_message(tMicroHttpdClient client, uint8_t opcode, const char *data,
+   uint32_t length, void *cookie)
+{
+   if(MICROHTTPD_WEBSOCKET_CLOSE != opcode)
+      ++websocket_message_count;
+}
+
+static void handle_get(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   ++get_count;
+   microhttpd_send_response(client, HTTP_OK, "text/plain", 2, NULL, "ok");
+}
+
+/*! Finds the first and last of the parameters that fit, and not one that doesn't */
+static void handle_params(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   char key[16];
+   uint32_t length;
+   const char *value = microhttpd_get_param(client, "p0", &length);
+
+   params_found = (NULL != value && 2 == length && strncmp(value, "v0", 2) == 0);
+   snprintf(key, sizeof(key), "p%u", MICROHTTPD_MAX_HTTP_URI_PARAMS - 1);
+   params_found = params_found && NULL != microhttpd_get_param(client, key, NULL);
+   snprintf(key, sizeof(key), "p%u", MICROHTTPD_MAX_HTTP_URI_PARAMS);
+   params_found = params_found && NULL == microhttpd_get_param(client, key, NULL)
+      && NULL == microhttpd_get_param(client, "missing", NULL);
+   microhttpd_send_response(client, HTTP_OK, "text/plain", 2, NULL, "ok");
+}
+
+/*! Refuses uploads from its start call, except forms posted to /form, which are answered once
+ *  they're finished */
+static void handle_post(tMicroHttpdClient client, const char *uri, const char *filename,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length)
+{
+   if(strcmp(uri, "/form") == 0)
+   {
+      if(finish)
+         microhttpd_send_response(client, HTTP_OK, "text/plain", 2, NULL, "ok");
+   }
+   else if(start)
+      microhttpd_send_response(client, HTTP_PAYLOAD_TOO_LARGE, "text/plain", 2, NULL, "no");
+}
+
+/*! Logs each field as "name=value", marking the pieces of a value that's passed in pieces */
+static void handle_form(tMicroHttpdClient client, const char *name, const char *value,
+   const uint32_t value_length, bool complete, void *cookie)
+{
+   int length = snprintf(&form_fields.text[form_fields.length], sizeof(form_fields.text) - form_fields.length,
+      "%s=%s%s\n", name, value, complete ? "" : " (more)");
+
+   if(length > 0 && form_fields.length + length < sizeof(form_fields.text))
+      form_fields.length += length;
+}
+
+static void handle_route(tMicroHttpdClient client, const char *method, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie,
+   bool start, bool finish, const char *data, const uint32_t data_length, const uint32_t total_length)
+{
+   ++route_count;
+   if(finish)
+      microhttpd_send_response(client, HTTP_OK, "text/plain", 2, NULL, "ok");
+}
+
+static void handle_events(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   microhttpd_event_stream(client, "events");
+}
+
+static void handle_websocket(tMicroHttpdClient client, const char *uri,
+   const char *param_list[], const uint32_t param_count, const char *source_address, void *cookie)
+{
+   microhttpd_websocket_accept(client, handle_websocket_message, NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Helpers
+ */
+
+/* One asset with a gzip variant; each response names itself in its body */
+#define ASSET_RESPONSE(body) "HTTP/1.1 200 OK\r\n\r\n" body
+#define ASSET_NOT_MODIFIED(name) "HTTP/1.1 304 Not Modified\r\nX-Variant: " name "\r\n\r\n"
+static const tMicroHttpdAsset regress_assets[] =
+{
+   { "/app.js",
+     (const uint8_t *) ASSET_RESPONSE("identity"), sizeof(ASSET_RESPONSE("identity")) - 1, 19,
+     (const uint8_t *) ASSET_RESPONSE("gzip"), sizeof(ASSET_RESPONSE("gzip")) - 1, 19,
+     (const uint8_t *) ASSET_NOT_MODIFIED("identity"), sizeof(ASSET_NOT_MODIFIED("identity")) - 1,
+     (const uint8_t *) ASSET_NOT_MODIFIED("gzip"), sizeof(ASSET_NOT_MODIFIED("gzip")) - 1,
+     "\"0123456789abcdef\"", "\"0123456789abcdef-gz\"" }
+};
+static const uint32_t regress_asset_seeds[] = { 0 };
+static const tMicroHttpdAssetTable regress_asset_table =
+   { regress_assets, ARRAY_SIZE(regress_assets), regress_asset_seeds, ARRAY_SIZE(regress_asset_seeds) };
+
+static bool regress_Connect(tRegressConnection *conn)
+{
+   static tMicroHttpdGetHandlerEntry get_handler_list[] =
+   {
+      { "/params", handle_params, NULL },
+      { "/", handle_get, NULL },
+      { "/ws", handle_websocket, NULL },
+      { "/events", handle_events, NULL }
+   };
+   static tMicroHttpdRouteEntry route_list[] =
+   {
+      { MICROHTTPD_METHOD_PUT | MICROHTTPD_METHOD_PATCH, "/store", handle_route, NULL }
+   };
+   /* Requests that are refused never get as far as connecting */
+   static const tMicroHttpdProxyEntry proxy_list[] =
+   {
+      { MICROHTTPD_METHOD_GET | MICROHTTPD_METHOD_POST, "/upstream", "127.0.0.1", 9, 0, 0, 0 }
+   };
+   struct sockaddr_in info = {0};
+
+   memset(&conn->ctx, 0, sizeof(conn->ctx));
+   conn->ctx.params.rx_buffer_size = REGRESS_RX_BUFFER_SIZE;
+   conn->ctx.params.get_handler_list = get_handler_list;
+   conn->ctx.params.get_handler_count = ARRAY_SIZE(get_handler_list);
+   conn->ctx.params.post_handler = handle_post;
+   conn->ctx.params.form_handler = handle_form;
+   conn->ctx.params.route_list = route_list;
+   conn->ctx.params.route_count = ARRAY_SIZE(route_list);
+   conn->ctx.params.proxy_list = proxy_list;
+   conn->ctx.params.proxy_count = ARRAY_SIZE(proxy_list);
+   conn->ctx.params.assets = &regress_asset_table;
+   conn->ctx.wake_fd[0] = conn->ctx.wake_fd[1] = -1;
+   conn->ctx.rx_scratch = malloc(REGRESS_RX_BUFFER_SIZE);
+   conn->ctx.running = true;
+
+   info.sin_family = AF_INET;
+   info.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   microhttpd_MemoryStreamReset(&conn->stream, NULL, 0, 0);
+   conn->stream.tx_log = conn->tx_log;
+   conn->stream.tx_log_size = REGRESS_TX_LOG_SIZE;
+   if(NULL == conn->ctx.rx_scratch || microhttpd_ProxyInit(&conn->ctx) != 0
+   || microhttpd_NewClient(&conn->ctx, -1, (struct sockaddr *) &info,
+      sizeof(info), &md_transport_memory, &conn->stream) != 0)
+   {
+      fprintf(stderr, "Failed to create in-memory client\n");
+      microhttpd_ProxyShutdown(&conn->ctx);
+      free(conn->ctx.rx_scratch);
+      return false;
+   }
+   conn->client = conn->ctx.client_list;
+   get_count = route_count = websocket_message_count = 0;
+   params_found = false;
+   form_fields.text[0] = '\0';
+   form_fields.length = 0;
+   return true;
+}
+
+static void regress_Disconnect(tRegressConnection *conn)
+{
+   if(!conn->stream.closed)
+      microhttpd_RemoveClient(&conn->ctx, conn->client);
+   microhttpd_ProxyShutdown(&conn->ctx);
+   while(NULL != conn->ctx.channels)
+   {
+      struct md_channel *channel = conn->ctx.channels;
+      conn->ctx.channels = channel->next;
+      free(channel);
+   }
+   free(conn->ctx.rx_scratch);
+}
+
+/*! Deliver bytes from the client, stopping early if the server closes the connection. What the
+ *  server sends in response replaces the transmit log. */
+static void regress_Send(tRegressConnection *conn, const void *data, uint32_t length)
+{
+   struct md_memory_stream *stream = &conn->stream;
+
+   stream->rx = (const char *) data;
+   stream->rx_length = length;
+   stream->rx_offset = 0;
+   stream->tx_log_length = 0;
+   while(!stream->closed && stream->rx_offset < length)
+   {
+      if(microhttpd_HandleClientReceive(&conn->ctx, conn->client) != 0)
+         break;
+   }
+   conn->tx_log[stream->tx_log_length] = '\0';
+}
+
+static bool regress_Sent(tRegressConnection *conn, const void *expected, uint32_t length)
+{
+   for(uint32_t offset = 0; offset + length <= conn->stream.tx_log_length; ++offset)
+   {
+      if(memcmp(&conn->tx_log[offset], expected, length) == 0)
+         return true;
+   }
+   return false;
+}
+
+/*! Broadcast on the channel the event stream at /events subscribes to, logging only what's sent */
+static int regress_Broadcast(tRegressConnection *conn, const char *event, const char *data)
+{
+   int result;
+
+   conn->stream.tx_log_length = 0;
+   result = microhttpd_broadcast((tMicroHttpdContext) &conn->ctx, "events", event, data);
+   conn->tx_log[conn->stream.tx_log_length] = '\0';
+   return result;
+}
+
+/*! Request the asset with the given extra header lines, and check which response was sent */
+static bool regress_AssetSent(tRegressConnection *conn, const char *headers, const char *expected)
+{
+   char request[256];
+   int length = snprintf(request, sizeof(request), "GET /app.js HTTP/1.1\r\nHost: device\r\n%s\r\n",
+      headers);
+
+   regress_Send(conn, request, length);
+   return strcmp(conn->tx_log, expected) == 0;
+}
+
+static void regress_HpackField(void *cookie, const char *name, uint32_t name_length, const char *value,
+   uint32_t value_length)
+{
+   tRegressFields *fields = (tRegressFields *) cookie;
+   int length = snprintf(&fields->text[fields->length], sizeof(fields->text) - fields->length, "%s: %s\n",
+      name, value);
+
+   if(length > 0 && fields->length + length < sizeof(fields->text))
+      fields->length += length;
+}
+
+/*! Decode consecutive header blocks with one table, as a connection would */
+static bool regress_HpackBlocks(const tRegressHpackBlock *blocks, uint32_t count, uint32_t table_size)
+{
+   struct md_hpack_table table;
+   bool passed = true;
+
+   microhttpd_HpackInit(&table, table_size);
+   for(uint32_t i = 0; i < count && passed; ++i)
+   {
+      tRegressFields fields = { "", 0 };
+
+      passed = microhttpd_HpackDecode(&table, (const uint8_t *) blocks[i].block, blocks[i].block_length,
+            regress_HpackField, &fields) == 0
+         && strcmp(fields.text, blocks[i].fields) == 0 && table.size == blocks[i].table_size;
+   }
+   microhttpd_HpackFree(&table);
+   return passed;
+}
+
+static bool regress_HpackMalformed(const char *block, uint32_t length)
+{
+   struct md_hpack_table table;
+   tRegressFields fields = { "", 0 };
+   int result;
+
+   microhttpd_HpackInit(&table, MICROHTTPD_HPACK_TABLE_SIZE);
+   result = microhttpd_HpackDecode(&table, (const uint8_t *) block, length, regress_HpackField, &fields);
+   microhttpd_HpackFree(&table);
+   return result < 0;
+}
+
+static uint32_t regress_H2Frame(uint8_t *out, uint8_t type, uint8_t flags, uint32_t stream_id,
+   const void *payload, uint32_t length)
+{
+   out[0] = (uint8_t) (length >> 16);
+   out[1] = (uint8_t) (length >> 8);
+   out[2] = (uint8_t) length;
+   out[3] = type;
+   out[4] = flags;
+   for(int shift = 24, idx = 5; shift >= 0; shift -= 8, ++idx)
+      out[idx] = (uint8_t) (stream_id >> shift);
+   if(length > 0)
+      memcpy(&out[9], payload, length);
+   return 9 + length;
+}
+
+/*! The server's first frame of a type on a stream, if it sent one */
+static const uint8_t *regress_H2Sent(tRegressConnection *conn, uint8_t type, uint32_t stream_id,
+   uint32_t *length, uint8_t *flags)
+{
+   const uint8_t *frame = (const uint8_t *) conn->tx_log, *end = frame + conn->stream.tx_log_length;
+
+   while(end - frame >= 9)
+   {
+      uint32_t frame_length = ((uint32_t) frame[0] << 16) | ((uint32_t) frame[1] << 8) | frame[2];
+      uint32_t frame_stream = ((uint32_t) frame[5] << 24) | ((uint32_t) frame[6] << 16)
+         | ((uint32_t) frame[7] << 8) | frame[8];
+
+      if(frame_length > (uint32_t) (end - frame) - 9)
+         break;
+      if(frame[3] == type && frame_stream == stream_id)
+      {
+         *length = frame_length;
+         *flags = frame[4];
+         return &frame[9];
+      }
+      frame += 9 + frame_length;
+   }
+   return NULL;
+}
+
+/*! Open an HTTP/2 connection with prior knowledge and send it frames, returning the error code of
+ *  the GOAWAY the server answered with, or -1 if it didn't */
+static int32_t regress_H2Send(tRegressConnection *conn, const uint8_t *frames, uint32_t length)
+{
+   static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+   uint8_t request[512];
+   const uint8_t *goaway;
+   uint32_t request_length, goaway_length;
+   uint8_t flags;
+
+   conn->ctx.params.http2 = true;
+   memcpy(request, preface, sizeof(preface) - 1);
+   request_length = sizeof(preface) - 1;
+   request_length += regress_H2Frame(&request[request_length], 0x4 /* SETTINGS */, 0, 0, NULL, 0);
+   memcpy(&request[request_length], frames, length);
+   regress_Send(conn, request, request_length + length);
+
+   goaway = regress_H2Sent(conn, 0x7 /* GOAWAY */, 0, &goaway_length, &flags);
+   if(NULL == goaway || goaway_length < 8)
+      return -1;
+   return ((int32_t) goaway[4] << 24) | ((int32_t) goaway[5] << 16) | ((int32_t) goaway[6] << 8) | goaway[7];
+}
+
+/*! Post a form to /form, checking it's answered and returning the fields the form handler got */
+static const char *regress_Form(tRegressConnection *conn, const char *body)
+{
+   char request[512];
+   int length = snprintf(request, sizeof(request), "POST /form HTTP/1.1\r\nHost: device\r\n"
+      "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %u\r\n\r\n%s",
+      (unsigned) strlen(body), body);
+
+   form_fields.text[0] = '\0';
+   form_fields.length = 0;
+   regress_Send(conn, request, length);
+   return (strncmp(conn->tx_log, "HTTP/1.1 200", 12) == 0) ? form_fields.text : "";
+}
+
+static bool regress_WebSocketUpgrade(tRegressConnection *conn)
+{
+   static const char request[] =
+      "GET /ws HTTP/1.1\r\nHost: device\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+
+   regress_Send(conn, request, sizeof(request) - 1);
+   return strstr(conn->tx_log, "101 Switching Protocols") != NULL && NULL != conn->client->websocket;
+}
+
+/* Masked frame header, with the 64-bit length form when length doesn't fit in 16 bits */
+static uint32_t regress_WebSocketFrame(uint8_t *frame, uint8_t first, uint64_t length)
+{
+   uint32_t header_length = 2;
+
+   frame[0] = first;
+   if(length < 126)
+      frame[1] = 0x80 | (uint8_t) length;
+   else if(length <= 0xffff)
+   {
+      frame[1] = 0x80 | 126;
+      frame[header_length++] = (uint8_t) (length >> 8);
+      frame[header_length++] = (uint8_t) length;
+   }
+   else
+   {
+      frame[1] = 0x80 | 127;
+      for(int shift = 56; shift >= 0; shift -= 8)
+         frame[header_length++] = (uint8_t) (length >> shift);
+   }
+   memset(&frame[header_length], 0x5a, 4); /* Masking key */
+   return header_length + 4;
+}
+
+/*! A fragment followed by a continuation frame with the given length, and some of its payload */
+static void regress_WebSocketOversized(tRegressConnection *conn, uint64_t length)
+{
+   static uint8_t frames[2048];
+   uint32_t size;
+
+   size = regress_WebSocketFrame(frames, MICROHTTPD_WEBSOCKET_TEXT, 16); /* fin clear */
+   memset(&frames[size], 'a', 16);
+   size += 16;
+   size += regress_WebSocketFrame(&frames[size], 0x80, length);
+   memset(&frames[size], 'b', 1500);
+   size += 1500;
+   regress_Send(conn, frames, size);
+}
+
+/*! A request whose body something else on the path might frame differently is refused, and since
+ *  where its body ends is in doubt, so is the rest of the connection */
+static bool regress_FramingRefused(tRegressConnection *conn, const char *request_line, const char *framing)
+{
+   char request[256];
+   uint32_t length;
+
+   length = snprintf(request, sizeof(request), "%s HTTP/1.1\r\nHost: device\r\n%s\r\n"
+      "5\r\nhello\r\n0\r\n\r\nGET / HTTP/1.1\r\nHost: device\r\n\r\n", request_line, framing);
+   regress_Send(conn, request, length);
+   return strstr(conn->tx_log, "HTTP/1.1 400") == conn->tx_log
+      && strstr(conn->tx_log, "\r\nConnection: close\r\n") != NULL
+      && conn->stream.closed && 0 == get_count && 0 == route_count;
+}
+
+/* ---------------------------------------------------------------------------------------------
+ * Tests
+ */
+
+/*! A continuation length that wraps the message length when added to it must not be accepted */
+static bool test_WebSocketLengthMsb(tRegressConnection *conn)
+{
+   static const uint8_t protocol_error[] = { 0x88, 0x02, 0x03, 0xea }; /* Close, 1002 */
+
+   if(!regress_WebSocketUpgrade(conn))
+      return false;
+   regress_WebSocketOversized(conn, 0ULL - 16 + 8);
+   return regress_Sent(conn, protocol_error, sizeof(protocol_error)) && 0 == websocket_message_count;
+}
+
+static bool test_WebSocketLengthTooBig(tRegressConnection *conn)
+{
+   static const uint8_t too_big[] = { 0x88, 0x02, 0x03, 0xf1 }; /* Close, 1009 */
+
+   if(!regress_WebSocketUpgrade(conn))
+      return false;
+   regress_WebSocketOversized(conn, (1ULL << 63) - 16 + 8);
+   return regress_Sent(conn, too_big, sizeof(too_big)) && 0 == websocket_message_count;
+}
+
+/*! An upload refused before 100 Continue never gets its body, so the connection can't be reused */
+static bool test_ExpectRefusedCloses(tRegressConnection *conn)
+{
+   static const char requests[] =
+      "POST /upload HTTP/1.1\r\nHost: device\r\nContent-Type: application/octet-stream\r\n"
+      "Content-Length: 5000000\r\nExpect: 100-continue\r\n\r\n"
+      "GET / HTTP/1.1\r\nHost: device\r\n\r\n";
+
+   regress_Send(conn, requests, sizeof(requests) - 1);
+   return strstr(conn->tx_log, "HTTP/1.1 413") == conn->tx_log
+      && strstr(conn->tx_log, "100 Continue") == NULL
+      && strstr(conn->tx_log, "\r\nConnection: close\r\n") != NULL
+      && conn->stream.closed && 0 == get_count;
+}
+
+/*! Without Expect, the refused body is skipped and the connection serves the next request */
+static bool test_RefusedBodySkipped(tRegressConnection *conn)
+{
+   static const char requests[] =
+      "POST /upload HTTP/1.1\r\nHost: device\r\nContent-Type: application/octet-stream\r\n"
+      "Content-Length: 10\r\n\r\n0123456789"
+      "GET / HTTP/1.1\r\nHost: device\r\n\r\n";
+
+   regress_Send(conn, requests, sizeof(requests) - 1);
+   return strstr(conn->tx_log, "HTTP/1.1 413") == conn->tx_log
+      && strstr(conn->tx_log, "Connection: close") == NULL
+      && !conn->stream.closed && 1 == get_count;
+}
+
+/*! Lookups end, found or not, with more parameters than are kept */
+static bool test_ParamLookup(tRegressConnection *conn)
+{
+   char request[REGRESS_RX_BUFFER_SIZE];
+   uint32_t length;
+
+   length = sprintf(request, "GET /params?");
+   for(uint32_t idx = 0; idx < MICROHTTPD_MAX_HTTP_URI_PARAMS + 4; ++idx)
+      length += sprintf(&request[length], "p%u=v%u&", idx, idx);
+   length += sprintf(&request[length], " HTTP/1.1\r\nHost: device\r\n\r\n");
+   regress_Send(conn, request, length);
+   return strstr(conn->tx_log, "HTTP/1.1 200") == conn->tx_log && params_found;
+}
+
+static bool test_ProxyDuplicateLength(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "POST /upstream", "Content-Length: 5\r\nContent-Length: 31\r\n");
+}
+
+static bool test_ProxyLengthNotNumber(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "POST /upstream", "Content-Length: +5\r\n");
+}
+
+static bool test_ProxyLengthTooBig(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "POST /upstream", "Content-Length: 4294967301\r\n");
+}
+
+static bool test_ProxyTransferEncoding(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "POST /upstream", "Content-Length: 5\r\nTransfer-Encoding: chunked\r\n");
+}
+
+/*! A body with a plain length still goes to the route, and the next request follows it */
+static bool test_RouteBody(tRegressConnection *conn)
+{
+   static const char requests[] =
+      "PUT /store HTTP/1.1\r\nHost: device\r\nContent-Length:  5 \r\n\r\nhello"
+      "GET / HTTP/1.1\r\nHost: device\r\n\r\n";
+
+   regress_Send(conn, requests, sizeof(requests) - 1);
+   return strstr(conn->tx_log, "HTTP/1.1 200") == conn->tx_log && route_count > 0 && 1 == get_count
+      && !conn->stream.closed;
+}
+
+/*! An event name can't carry a line break, which would end its field and start others */
+static bool test_EventNameLineBreak(tRegressConnection *conn)
+{
+   static const char request[] = "GET /events HTTP/1.1\r\nHost: device\r\n\r\n";
+
+   regress_Send(conn, request, sizeof(request) - 1);
+   if(strstr(conn->tx_log, "text/event-stream") == NULL)
+      return false;
+   return regress_Broadcast(conn, "update\ndata: forged", "x") < 0 && 0 == conn->stream.tx_log_length
+      && regress_Broadcast(conn, "update\r", "x") < 0
+      && 1 == regress_Broadcast(conn, "update", "x")
+      && strcmp(conn->tx_log, "event: update\ndata: x\n\n") == 0;
+}
+
+/*! Data lines end wherever EventSource ends them, each becoming a field of its own */
+static bool test_EventDataLines(tRegressConnection *conn)
+{
+   static const char request[] = "GET /events HTTP/1.1\r\nHost: device\r\n\r\n";
+
+   regress_Send(conn, request, sizeof(request) - 1);
+   return 1 == regress_Broadcast(conn, NULL, "one\rtwo\r\nthree\nfour\r")
+      && strcmp(conn->tx_log, "data: one\ndata: two\ndata: three\ndata: four\ndata: \n\n") == 0;
+}
+
+/*! Accept-Encoding is read as a list of codings with weights, not searched for "gzip" */
+static bool test_AssetAcceptEncoding(tRegressConnection *conn)
+{
+   return regress_AssetSent(conn, "Accept-Encoding: deflate, GZIP;q=0.5\r\n", ASSET_RESPONSE("gzip"))
+      && regress_AssetSent(conn, "Accept-Encoding: *;q=0.1\r\n", ASSET_RESPONSE("gzip"))
+      && regress_AssetSent(conn, "", ASSET_RESPONSE("identity"))
+      && regress_AssetSent(conn, "Accept-Encoding: x-gzip-foo, gzipped\r\n", ASSET_RESPONSE("identity"))
+      && regress_AssetSent(conn, "Accept-Encoding: gzip;q=0\r\n", ASSET_RESPONSE("identity"))
+      && regress_AssetSent(conn, "Accept-Encoding: gzip ; Q=0.000\r\n", ASSET_RESPONSE("identity"))
+      && regress_AssetSent(conn, "Accept-Encoding: *, gzip;q=0\r\n", ASSET_RESPONSE("identity"))
+      && regress_AssetSent(conn, "Accept-Encoding: gzip;q=2\r\n", ASSET_RESPONSE("identity"));
+}
+
+/*! Each variant validates against its own ETag, so a cached copy of one never stands in for the other */
+static bool test_AssetVariantETag(tRegressConnection *conn)
+{
+   return regress_AssetSent(conn, "Accept-Encoding: gzip\r\nIf-None-Match: \"0123456789abcdef-gz\"\r\n",
+         ASSET_NOT_MODIFIED("gzip"))
+      && regress_AssetSent(conn, "Accept-Encoding: gzip\r\nIf-None-Match: \"0123456789abcdef\"\r\n",
+         ASSET_RESPONSE("gzip"))
+      && regress_AssetSent(conn, "If-None-Match: \"0123456789abcdef-gz\"\r\n", ASSET_RESPONSE("identity"))
+      && regress_AssetSent(conn, "If-None-Match: \"0123456789abcdef\"\r\n", ASSET_NOT_MODIFIED("identity"));
+}
+
+/*! RFC 7541 C.3 and C.4: requests sharing a dynamic table, without and with Huffman coding */
+static bool test_HpackRequests(tRegressConnection *conn)
+{
+   static const char first[] = "\x82\x86\x84\x41\x0f" "www.example.com";
+   static const char second[] = "\x82\x86\x84\xbe\x58\x08" "no-cache";
+   static const char third[] = "\x82\x87\x85\xbf\x40\x0a" "custom-key" "\x0c" "custom-value";
+   static const char first_huffman[] = "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff";
+   static const char second_huffman[] = "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf";
+   static const char third_huffman[] = "\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f"
+      "\x89\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf";
+#define FIRST_FIELDS  ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+#define SECOND_FIELDS FIRST_FIELDS "cache-control: no-cache\n"
+#define THIRD_FIELDS  ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n" \
+   "custom-key: custom-value\n"
+   static const tRegressHpackBlock blocks[] =
+   {
+      { first, sizeof(first) - 1, FIRST_FIELDS, 57 },
+      { second, sizeof(second) - 1, SECOND_FIELDS, 110 },
+      { third, sizeof(third) - 1, THIRD_FIELDS, 164 }
+   };
+   static const tRegressHpackBlock huffman_blocks[] =
+   {
+      { first_huffman, sizeof(first_huffman) - 1, FIRST_FIELDS, 57 },
+      { second_huffman, sizeof(second_huffman) - 1, SECOND_FIELDS, 110 },
+      { third_huffman, sizeof(third_huffman) - 1, THIRD_FIELDS, 164 }
+   };
+#undef FIRST_FIELDS
+#undef SECOND_FIELDS
+#undef THIRD_FIELDS
+
+   return regress_HpackBlocks(blocks, ARRAY_SIZE(blocks), MICROHTTPD_HPACK_TABLE_SIZE)
+      && regress_HpackBlocks(huffman_blocks, ARRAY_SIZE(huffman_blocks), MICROHTTPD_HPACK_TABLE_SIZE);
+}
+
+/*! RFC 7541 C.5 and C.6: responses in a 256 byte table, which evicts the oldest entries to make room */
+static bool test_HpackEviction(tRegressConnection *conn)
+{
+   static const char first[] = "\x48\x03" "302" "\x58\x07" "private"
+      "\x61\x1d" "Mon, 21 Oct 2013 20:13:21 GMT" "\x6e\x17" "https://www.example.com";
+   static const char second[] = "\x48\x03" "307" "\xc1\xc0\xbf";
+   static const char third[] = "\x88\xc1\x61\x1d" "Mon, 21 Oct 2013 20:13:22 GMT" "\xc0\x5a\x04" "gzip"
+      "\x77\x38" "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1";
+   static const char first_huffman[] = "\x48\x82\x64\x02\x58\x85\xae\xc3\x77\x1a\x4b\x61\x96\xd0"
+      "\x7a\xbe\x94\x10\x54\xd4\x44\xa8\x20\x05\x95\x04\x0b\x81\x66\xe0\x82\xa6\x2d\x1b\xff\x6e"
+      "\x91\x9d\x29\xad\x17\x18\x63\xc7\x8f\x0b\x97\xc8\xe9\xae\x82\xae\x43\xd3";
+   static const char second_huffman[] = "\x48\x83\x64\x0e\xff\xc1\xc0\xbf";
+   static const char third_huffman[] = "\x88\xc1\x61\x96\xd0\x7a\xbe\x94\x10\x54\xd4\x44\xa8\x20"
+      "\x05\x95\x04\x0b\x81\x66\xe0\x84\xa6\x2d\x1b\xff\xc0\x5a\x83\x9b\xd9\xab\x77\xad\x94\xe7"
+      "\x82\x1d\xd7\xf2\xe6\xc7\xb3\x35\xdf\xdf\xcd\x5b\x39\x60\xd5\xaf\x27\x08\x7f\x36\x72\xc1"
+      "\xab\x27\x0f\xb5\x29\x1f\x95\x87\x31\x60\x65\xc0\x03\xed\x4e\xe5\xb1\x06\x3d\x50\x07";
+#define FIRST_FIELDS  ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n" \
+   "location: https://www.example.com\n"
+#define SECOND_FIELDS ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n" \
+   "location: https://www.example.com\n"
+#define THIRD_FIELDS  ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n" \
+   "location: https://www.example.com\ncontent-encoding: gzip\n" \
+   "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"
+   static const tRegressHpackBlock blocks[] =
+   {
+      { first, sizeof(first) - 1, FIRST_FIELDS, 222 },
+      { second, sizeof(second) - 1, SECOND_FIELDS, 222 },
+      { third, sizeof(third) - 1, THIRD_FIELDS, 215 }
+   };
+   static const tRegressHpackBlock huffman_blocks[] =
+   {
+      { first_huffman, sizeof(first_huffman) - 1, FIRST_FIELDS, 222 },
+      { second_huffman, sizeof(second_huffman) - 1, SECOND_FIELDS, 222 },
+      { third_huffman, sizeof(third_huffman) - 1, THIRD_FIELDS, 215 }
+   };
+#undef FIRST_FIELDS
+#undef SECOND_FIELDS
+#undef THIRD_FIELDS
+
+   return regress_HpackBlocks(blocks, ARRAY_SIZE(blocks), 256)
+      && regress_HpackBlocks(huffman_blocks, ARRAY_SIZE(huffman_blocks), 256);
+}
+
+/*! Huffman padding must be under 8 bits and all ones, and integers can't run past 2^28 */
+static bool test_HpackMalformed(tRegressConnection *conn)
+{
+   static const char zero_padding[] = "\x41\x81\x00";             /* '0', then 3 zero bits */
+   static const char long_padding[] = "\x41\x82\x07\xff";         /* '0', then 11 one bits */
+   static const char huge_index[] = "\xff\xff\xff\xff\xff\x0f";   /* Indexed, 2^35 or so */
+   static const char truncated_index[] = "\xff\x80";
+
+   return regress_HpackMalformed(zero_padding, sizeof(zero_padding) - 1)
+      && regress_HpackMalformed(long_padding, sizeof(long_padding) - 1)
+      && regress_HpackMalformed(huge_index, sizeof(huge_index) - 1)
+      && regress_HpackMalformed(truncated_index, sizeof(truncated_index) - 1);
+}
+
+/*! A GET over HTTP/2 with prior knowledge reaches the GET handler, and its response comes back as
+ *  HEADERS and DATA on the request's stream */
+static bool test_H2PriorKnowledge(tRegressConnection *conn)
+{
+   static const char block[] = "\x82\x86\x84\x41\x06" "device";
+   struct md_hpack_table table;
+   tRegressFields fields = { "", 0 };
+   uint8_t frames[64], flags;
+   const uint8_t *payload;
+   uint32_t length;
+   bool passed;
+
+   length = regress_H2Frame(frames, 0x1 /* HEADERS */, 0x05 /* END_STREAM | END_HEADERS */, 1, block,
+      sizeof(block) - 1);
+   if(regress_H2Send(conn, frames, length) >= 0 || 1 != get_count)
+      return false;
+   if(NULL == regress_H2Sent(conn, 0x4 /* SETTINGS */, 0, &length, &flags))
+      return false;
+
+   payload = regress_H2Sent(conn, 0x1 /* HEADERS */, 1, &length, &flags);
+   if(NULL == payload || !(flags & 0x04))
+      return false;
+   microhttpd_HpackInit(&table, MICROHTTPD_HPACK_TABLE_SIZE);
+   passed = microhttpd_HpackDecode(&table, payload, length, regress_HpackField, &fields) == 0
+      && strncmp(fields.text, ":status: 200\n", 13) == 0
+      && strstr(fields.text, "content-length: 2\n") != NULL;
+   microhttpd_HpackFree(&table);
+
+   payload = regress_H2Sent(conn, 0x0 /* DATA */, 1, &length, &flags);
+   return passed && NULL != payload && 2 == length && memcmp(payload, "ok", 2) == 0 && (flags & 0x01);
+}
+
+/*! HEADERS padding that runs past the end of the frame is a connection error */
+static bool test_H2BadPadding(tRegressConnection *conn)
+{
+   static const char payload[] = "\x08\x82\x86\x84"; /* 8 bytes of padding after a 3 byte block */
+   uint8_t frames[64];
+   uint32_t length;
+
+   length = regress_H2Frame(frames, 0x1 /* HEADERS */, 0x0d /* END_STREAM | END_HEADERS | PADDED */, 1,
+      payload, sizeof(payload) - 1);
+   return 0x1 /* PROTOCOL_ERROR */ == regress_H2Send(conn, frames, length) && 0 == get_count;
+}
+
+/*! A header block must be finished on the stream it started on */
+static bool test_H2ContinuationStream(tRegressConnection *conn)
+{
+   static const char block[] = "\x82\x86\x84\x41\x06" "device";
+   uint8_t frames[128];
+   uint32_t length;
+
+   length = regress_H2Frame(frames, 0x1 /* HEADERS */, 0x01 /* END_STREAM */, 1, block, 3);
+   length += regress_H2Frame(&frames[length], 0x9 /* CONTINUATION */, 0x04 /* END_HEADERS */, 3, &block[3],
+      sizeof(block) - 4);
+   return 0x1 /* PROTOCOL_ERROR */ == regress_H2Send(conn, frames, length) && 0 == get_count;
+}
+
+static bool test_RouteChunked(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "PUT /store", "Transfer-Encoding: chunked\r\n");
+}
+
+static bool test_RouteDuplicateLength(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "PATCH /store", "Content-Length: 0\r\nContent-Length: 5\r\n");
+}
+
+static bool test_PostLengthNotNumber(tRegressConnection *conn)
+{
+   return regress_FramingRefused(conn, "POST /upload", "Content-Length: 5x\r\n");
+}
+
+/*! Escapes and separators are decoded wherever the reads happen to split them */
+static bool test_FormSplitReads(tRegressConnection *conn)
+{
+   conn->stream.fragment_size = 1;
+   return strcmp(regress_Form(conn, "a=1%2B2+3&b=%41%4a&&c"), "a=1+2 3\nb=AJ\nc=\n") == 0
+      && !conn->stream.closed;
+}
+
+/*! Malformed and truncated escapes, and %00, are taken literally */
+static bool test_FormMalformedEscapes(tRegressConnection *conn)
+{
+   return strcmp(regress_Form(conn, "a=%G1&b=%4&c=%00&d=100%"), "a=%G1\nb=%4\nc=%00\nd=100%\n") == 0
+      && strcmp(regress_Form(conn, "e=%4"), "e=%4\n") == 0;
+}
+
+/*! A value that doesn't fit in form_field_size bytes with its name is passed in pieces; a name that
+ *  doesn't fit drops the connection */
+static bool test_FormLongValue(tRegressConnection *conn)
+{
+   conn->ctx.params.form_field_size = 8;
+   if(strcmp(regress_Form(conn, "n=abcdefghijklmnop&m=1"),
+      "n=abcdefg (more)\nn=hijklmn (more)\nn=op\nm=1\n") != 0)
+      return false;
+   regress_Form(conn, "abcdefghijk=1");
+   return conn->stream.closed && 0 == conn->stream.tx_log_length;
+}
+
+/*! The POST handler answers a form, so without one, forms are refused like any other POST */
+static bool test_FormWithoutPostHandler(tRegressConnection *conn)
+{
+   static const char request[] = "POST /form HTTP/1.1\r\nHost: device\r\n"
+      "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: 3\r\n\r\na=1";
+
+   conn->ctx.params.post_handler = NULL;
+   regress_Send(conn, request, sizeof(request) - 1);
+   return strncmp(conn->tx_log, "HTTP/1.1 405", 12) == 0 && 0 == form_fields.length;
+}
+
+static const tRegressTest tests[] =
+{
+   { "websocket_length_msb", test_WebSocketLengthMsb },
+   { "websocket_length_too_big", test_WebSocketLengthTooBig },
+   { "expect_refused_closes", test_ExpectRefusedCloses },
+   { "refused_body_skipped", test_RefusedBodySkipped },
+   { "param_lookup", test_ParamLookup },
+   { "proxy_duplicate_length", test_ProxyDuplicateLength },
+   { "proxy_length_not_number", test_ProxyLengthNotNumber },
+   { "proxy_length_too_big", test_ProxyLengthTooBig },
+   { "proxy_transfer_encoding", test_ProxyTransferEncoding },
+   { "event_name_line_break", test_EventNameLineBreak },
+   { "event_data_lines", test_EventDataLines },
+   { "route_body", test_RouteBody },
+   { "route_chunked", test_RouteChunked },
+   { "route_duplicate_length", test_RouteDuplicateLength },
+   { "post_length_not_number", test_PostLengthNotNumber },
+   { "form_split_reads", test_FormSplitReads },
+   { "form_malformed_escapes", test_FormMalformedEscapes },
+   { "form_long_value", test_FormLongValue },
+   { "form_without_post_handler", test_FormWithoutPostHandler },
+   { "asset_accept_encoding", test_AssetAcceptEncoding },
+   { "asset_variant_etag", test_AssetVariantETag },
+   { "hpack_requests", test_HpackRequests },
+   { "hpack_eviction", test_HpackEviction },
+   { "hpack_malformed", test_HpackMalformed },
+   { "h2_prior_knowledge", test_H2PriorKnowledge },
+   { "h2_bad_padding", test_H2BadPadding },
+   { "h2_continuation_stream", test_H2ContinuationStream },
+};
+
+/* ---------------------------------------------------------------------------------------------
+ * Main
+ */
+
+int main(int argc, char *argv[])
+{
+   static tRegressConnection conn;
+   uint32_t failures = 0;
+
+   for(uint32_t i = 0; i < ARRAY_SIZE(tests); ++i)
+   {
+      bool passed;
+
+      if(!regress_Connect(&conn))
+         return -1;
+      passed = tests[i].run(&conn);
+      regress_Disconnect(&conn);
+      printf("%s: %s\n", tests[i].name, passed ? "PASS" : "FAIL");
+      if(!passed)
+         ++failures;
+   }
+
+   return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,640 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file assets.c
+ *  \brief microhttpd asset bundler
+ *
+ *  Host tool that converts a directory of web assets into a C source file defining a
+ *  tMicroHttpdAssetTable. Each asset's 200 and 304 responses (and, when it's smaller, a gzip-encoded
+ *  variant of both, with an ETag of its own) are serialized here, and a minimal perfect hash from URI
+ *  to asset is computed, so the server does no formatting or searching at run time.
+ *
+ *  Usage: microhttpd_assets [-G] -n <symbol> -o <output.c> <directory> [file...]
+ *
+ *  With no files listed, every file under the directory is bundled, except those whose names start
+ *  with '.'. A file's URI is its path relative to the directory; index.html also answers for the
+ *  directory itself. -G disables gzip variants.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(MICROHTTPD_ASSETS_GZIP)
+#include <zlib.h>
+#endif
+#include "assets.h"
+
+#define GZIP_MIN_SAVING  10      /* Percent; a smaller gzip variant isn't worth the table space */
+#define MAX_SEED_SEARCH  (1u << 24)
+
+typedef struct
+{
+   char *path;             /* Relative to the asset directory */
+   uint8_t *data;
+   uint32_t length;
+   uint8_t *gzip_data;     /* NULL if not worth compressing */
+   uint32_t gzip_length;
+   const char *content_type;
+   char etag[20];          /* Quoted 64-bit FNV-1a of the content */
+   char gzip_etag[23];     /* etag with "-gz" inside the quotes, since the encoded bytes differ */
+} tAssetFile;
+
+typedef struct
+{
+   char *uri;
+   uint32_t file;          /* Index into the file list */
+} tAssetUri;
+
+typedef struct
+{
+   const char *extension;
+   const char *content_type;
+   bool compress;
+} tContentType;
+
+static const tContentType content_types[] =
+{
+   { "html",  "text/html", true },
+   { "htm",   "text/html", true },
+   { "css",   "text/css", true },
+   { "js",    "text/javascript", true },
+   { "mjs",   "text/javascript", true },
+   { "json",  "application/json", true },
+   { "map",   "application/json", true },
+   { "xml",   "application/xml", true },
+   { "txt",   "text/plain", true },
+   { "csv",   "text/csv", true },
+   { "svg",   "image/svg+xml", true },
+   { "ico",   "image/x-icon", true },
+   { "wasm",  "application/wasm", true },
+   { "png",   "image/png", false },
+   { "jpg",   "image/jpeg", false },
+   { "jpeg",  "image/jpeg", false },
+   { "gif",   "image/gif", false },
+   { "webp",  "image/webp", false },
+   { "woff",  "font/woff", false },
+   { "woff2", "font/woff2", false },
+   { "pdf",   "application/pdf", false },
+};
+
+static tAssetFile *files;
+static uint32_t file_count;
+static tAssetUri *uris;
+static uint32_t uri_count;
+
+static int assets_AddDirectory(const char *root, const char *relative);
+static int assets_AddFile(const char *root, const char *relative);
+static int assets_AddUri(const char *uri, uint32_t file);
+static int assets_BuildHash(uint32_t bucket_count, uint32_t **seeds_out, uint32_t **slots_out);
+static const tContentType *assets_ContentType(const char *path);
+static void assets_Compress(tAssetFile *file, bool compress);
+static int assets_CompareUri(const void *a, const void *b);
+static int assets_ComparePath(const void *a, const void *b);
+static void assets_WriteString(FILE *out, const char *s);
+static void assets_WriteBytes(FILE *out, const uint8_t *data, uint32_t length, bool last);
+static uint32_t assets_WriteResponse(FILE *out, const char *name, const tAssetFile *file,
+   const uint8_t *body, uint32_t body_length, bool gzip);
+static void assets_WriteNotModified(FILE *out, const char *name, const tAssetFile *file, bool gzip);
+
+/* -------------------------------------------------------------------------------------------------
+ * Main
+ */
+
+static void usage(const char *program)
+{
+   fprintf(stderr, "Usage: %s [-G] -n <symbol> -o <output.c> <directory> [file...]\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *symbol = NULL, *output = NULL, *root;
+   uint32_t *seeds = NULL, *slots = NULL, bucket_count = 0, idx;
+   bool gzip = true;
+   FILE *out;
+   int opt;
+
+   while((opt = getopt(argc, argv, "Gn:o:")) != -1)
+   {
+      switch(opt)
+      {
+         case 'G': gzip = false; break;
+         case 'n': symbol = optarg; break;
+         case 'o': output = optarg; break;
+         default: usage(argv[0]); return 1;
+      }
+   }
+   if(NULL == symbol || NULL == output || optind >= argc)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   root = argv[optind++];
+
+   if(optind == argc)
+   {
+      if(assets_AddDirectory(root, "") != 0)
+         return 1;
+   }
+   for(; optind < argc; ++optind)
+   {
+      if(assets_AddFile(root, argv[optind]) != 0)
+         return 1;
+   }
+
+   /* Sorted, so that the output doesn't depend on directory order */
+   qsort(files, file_count, sizeof(files[0]), assets_ComparePath);
+   for(idx = 0; idx < file_count; ++idx)
+   {
+      const char *path = files[idx].path;
+      const char *name = strrchr(path, '/');
+      char *uri = malloc(strlen(path) + 2);
+
+      if(NULL == uri)
+         return 1;
+      sprintf(uri, "/%s", path);
+      if(assets_AddUri(uri, idx) != 0)
+         return 1;
+
+      name = (NULL != name) ? name + 1 : path;
+      if(strcmp(name, "index.html") == 0)
+      {
+         uri[strlen(uri) - strlen(name)] = '\0'; /* "/dir/" */
+         if(assets_AddUri(uri, idx) != 0)
+            return 1;
+      }
+      free(uri);
+      assets_Compress(&files[idx], gzip);
+   }
+   qsort(uris, uri_count, sizeof(uris[0]), assets_CompareUri);
+   for(idx = 1; idx < uri_count; ++idx)
+   {
+      if(strcmp(uris[idx - 1].uri, uris[idx].uri) == 0)
+      {
+         fprintf(stderr, "Duplicate asset URI '%s'\n", uris[idx].uri);
+         return 1;
+      }
+   }
+
+   /* Two keys per bucket on average; sparser tables only if a seed can't be found */
+   if(uri_count > 0)
+   {
+      for(bucket_count = (uri_count + 1) / 2; ; bucket_count *= 2)
+      {
+         if(assets_BuildHash(bucket_count, &seeds, &slots) == 0)
+            break;
+         if(bucket_count >= uri_count)
+         {
+            fprintf(stderr, "Failed to build a perfect hash for %"PRIu32" assets\n", uri_count);
+            return 1;
+         }
+      }
+   }
+
+   out = fopen(output, "w");
+   if(NULL == out)
+   {
+      fprintf(stderr, "Failed to create '%s'\n", output);
+      return 1;
+   }
+
+   fprintf(out, "/* Generated by microhttpd_assets from %s; do not edit */\n", root);
+   fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n#include \"microhttpd/microhttpd.h\"\n\n");
+
+   for(idx = 0; idx < file_count; ++idx)
+   {
+      tAssetFile *file = &files[idx];
+      char name[48];
+
+      fprintf(out, "/* %s */\n", file->path);
+      sprintf(name, "asset_%"PRIu32, idx);
+      assets_WriteResponse(out, name, file, file->data, file->length, false);
+      if(NULL != file->gzip_data)
+      {
+         sprintf(name, "asset_%"PRIu32"_gzip", idx);
+         assets_WriteResponse(out, name, file, file->gzip_data, file->gzip_length, true);
+         sprintf(name, "asset_%"PRIu32"_gzip_not_modified", idx);
+         assets_WriteNotModified(out, name, file, true);
+      }
+      sprintf(name, "asset_%"PRIu32"_not_modified", idx);
+      assets_WriteNotModified(out, name, file, false);
+      fputc('\n', out);
+   }
+
+   /* Assets in hash slot order */
+   fprintf(out, "static const tMicroHttpdAsset assets[] =\n{\n");
+   for(idx = 0; idx < uri_count; ++idx)
+   {
+      tAssetUri *uri = &uris[slots[idx]];
+      tAssetFile *file = &files[uri->file];
+      uint32_t header_length, gzip_header_length = 0;
+
+      header_length = assets_WriteResponse(NULL, NULL, file, file->data, file->length, false);
+      if(NULL != file->gzip_data)
+      {
+         gzip_header_length = assets_WriteResponse(NULL, NULL, file, file->gzip_data, file->gzip_length,
+            true);
+      }
+
+      fprintf(out, "   { ");
+      assets_WriteString(out, uri->uri);
+      fprintf(out, ",\n     asset_%"PRIu32", sizeof(asset_%"PRIu32"), %"PRIu32",\n", uri->file, uri->file,
+         header_length);
+      if(NULL != file->gzip_data)
+      {
+         fprintf(out, "     asset_%"PRIu32"_gzip, sizeof(asset_%"PRIu32"_gzip), %"PRIu32",\n", uri->file,
+            uri->file, gzip_header_length);
+      }
+      else
+         fprintf(out, "     NULL, 0, 0,\n");
+      fprintf(out, "     (const uint8_t *) asset_%"PRIu32"_not_modified, "
+         "sizeof(asset_%"PRIu32"_not_modified) - 1,\n", uri->file, uri->file);
+      if(NULL != file->gzip_data)
+      {
+         fprintf(out, "     (const uint8_t *) asset_%"PRIu32"_gzip_not_modified, "
+            "sizeof(asset_%"PRIu32"_gzip_not_modified) - 1,\n", uri->file, uri->file);
+      }
+      else
+         fprintf(out, "     NULL, 0,\n");
+      fprintf(out, "     ");
+      assets_WriteString(out, file->etag);
+      fprintf(out, ", ");
+      if(NULL != file->gzip_data)
+         assets_WriteString(out, file->gzip_etag);
+      else
+         fprintf(out, "NULL");
+      fprintf(out, " }%s\n", (idx + 1 < uri_count) ? "," : "");
+   }
+   if(0 == uri_count)
+      fprintf(out, "   { \"\", NULL, 0, 0, NULL, 0, 0, NULL, 0, NULL, 0, \"\", NULL }\n");
+   fprintf(out, "};\n\n");
+
+   fprintf(out, "static const uint32_t seeds[] =\n{\n");
+   for(idx = 0; idx < bucket_count; ++idx)
+      fprintf(out, "%s%"PRIu32"%s", (idx % 8 == 0) ? "   " : " ", seeds[idx],
+         (idx + 1 == bucket_count) ? "\n" : ((idx % 8 == 7) ? ",\n" : ","));
+   if(0 == bucket_count)
+      fprintf(out, "   0\n");
+   fprintf(out, "};\n\n");
+
+   fprintf(out, "const tMicroHttpdAssetTable %s =\n{\n"
+      "   assets, %"PRIu32",\n   seeds, %"PRIu32"\n};\n", symbol, uri_count,
+      (bucket_count > 0) ? bucket_count : 1);
+
+   free(seeds);
+   free(slots);
+   if(fclose(out) != 0)
+   {
+      fprintf(stderr, "Failed to write '%s'\n", output);
+      return 1;
+   }
+   return 0;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int assets_AddDirectory(const char *root, const char *relative)
+{
+   char *path = malloc(strlen(root) + strlen(relative) + 2);
+   struct dirent *entry;
+   DIR *dir;
+   int result = 0;
+
+   if(NULL == path)
+      return -1;
+   sprintf(path, "%s/%s", root, relative);
+   dir = opendir(path);
+   if(NULL == dir)
+   {
+      fprintf(stderr, "Failed to open directory '%s'\n", path);
+      free(path);
+      return -1;
+   }
+
+   while(0 == result && NULL != (entry = readdir(dir)))
+   {
+      char *child;
+      struct stat info;
+
+      if('.' == entry->d_name[0])
+         continue;
+      child = malloc(strlen(relative) + strlen(entry->d_name) + 2);
+      if(NULL == child)
+      {
+         result = -1;
+         break;
+      }
+      sprintf(child, "%s%s%s", relative, ('\0' == *relative) ? "" : "/", entry->d_name);
+
+      free(path);
+      path = malloc(strlen(root) + strlen(child) + 2);
+      if(NULL == path)
+         result = -1;
+      else
+      {
+         sprintf(path, "%s/%s", root, child);
+         if(stat(path, &info) != 0)
+            result = -1;
+         else if(S_ISDIR(info.st_mode))
+            result = assets_AddDirectory(root, child);
+         else if(S_ISREG(info.st_mode))
+            result = assets_AddFile(root, child);
+      }
+      free(child);
+   }
+
+   closedir(dir);
+   free(path);
+   return result;
+}
+
+static int assets_AddFile(const char *root, const char *relative)
+{
+   tAssetFile *file;
+   char *path;
+   FILE *in;
+   long length;
+   uint64_t hash = 14695981039346656037ull;
+
+   files = realloc(files, (file_count + 1) * sizeof(files[0]));
+   path = malloc(strlen(root) + strlen(relative) + 2);
+   if(NULL == files || NULL == path)
+      return -1;
+   file = &files[file_count];
+   memset(file, 0, sizeof(*file));
+   sprintf(path, "%s/%s", root, relative);
+
+   in = fopen(path, "rb");
+   if(NULL == in)
+   {
+      fprintf(stderr, "Failed to open '%s'\n", path);
+      free(path);
+      return -1;
+   }
+   fseek(in, 0, SEEK_END);
+   length = ftell(in);
+   rewind(in);
+   file->data = malloc((length > 0) ? length : 1);
+   if(length < 0 || length > UINT32_MAX / 2 || NULL == file->data
+   || fread(file->data, 1, length, in) != (size_t) length)
+   {
+      fprintf(stderr, "Failed to read '%s'\n", path);
+      fclose(in);
+      free(path);
+      return -1;
+   }
+   fclose(in);
+   free(path);
+
+   while('/' == *relative)
+      ++relative;
+   file->path = strdup(relative);
+   file->length = (uint32_t) length;
+   file->content_type = assets_ContentType(relative)->content_type;
+   for(uint32_t idx = 0; idx < file->length; ++idx)
+   {
+      hash ^= file->data[idx];
+      hash *= 1099511628211ull;
+   }
+   sprintf(file->etag, "\"%016"PRIx64"\"", hash);
+   sprintf(file->gzip_etag, "\"%016"PRIx64"-gz\"", hash);
+
+   ++file_count;
+   return (NULL != file->path) ? 0 : -1;
+}
+
+static int assets_AddUri(const char *uri, uint32_t file)
+{
+   uris = realloc(uris, (uri_count + 1) * sizeof(uris[0]));
+   if(NULL == uris)
+      return -1;
+   uris[uri_count].uri = strdup(uri);
+   uris[uri_count].file = file;
+   ++uri_count;
+   return (NULL != uris[uri_count - 1].uri) ? 0 : -1;
+}
+
+/*! Hash and displace: assign keys to buckets with seed 0, then, largest bucket first, search for a
+ *  seed that sends all of the bucket's keys to free slots. slots_out maps slot to URI index. */
+static int assets_BuildHash(uint32_t bucket_count, uint32_t **seeds_out, uint32_t **slots_out)
+{
+   uint32_t *bucket_of = malloc(uri_count * sizeof(uint32_t));
+   uint32_t *order = malloc(bucket_count * sizeof(uint32_t));
+   uint32_t *size = calloc(bucket_count, sizeof(uint32_t));
+   uint32_t *seeds = calloc(bucket_count, sizeof(uint32_t));
+   uint32_t *slots = malloc(uri_count * sizeof(uint32_t));
+   uint32_t *pending = malloc(uri_count * sizeof(uint32_t));
+   bool *used = calloc(uri_count, sizeof(bool));
+   uint32_t idx, b;
+   int result = -1;
+
+   if(NULL == bucket_of || NULL == order || NULL == size || NULL == seeds || NULL == slots
+   || NULL == pending || NULL == used)
+      goto done;
+
+   for(idx = 0; idx < uri_count; ++idx)
+   {
+      bucket_of[idx] = microhttpd_AssetHash(0, uris[idx].uri) % bucket_count;
+      ++size[bucket_of[idx]];
+   }
+   for(b = 0; b < bucket_count; ++b)
+      order[b] = b;
+   for(b = 1; b < bucket_count; ++b) /* Insertion sort, largest first; tables are small */
+   {
+      uint32_t value = order[b], i = b;
+      for(; i > 0 && size[order[i - 1]] < size[value]; --i)
+         order[i] = order[i - 1];
+      order[i] = value;
+   }
+
+   for(b = 0; b < bucket_count && size[order[b]] > 0; ++b)
+   {
+      uint32_t bucket = order[b], seed, count;
+
+      for(seed = 1; seed < MAX_SEED_SEARCH; ++seed)
+      {
+         count = 0;
+         for(idx = 0; idx < uri_count; ++idx)
+         {
+            uint32_t slot, i;
+
+            if(bucket_of[idx] != bucket)
+               continue;
+            slot = microhttpd_AssetHash(seed, uris[idx].uri) % uri_count;
+            for(i = 0; i < count && slots[pending[i]] != slot; ++i);
+            if(used[slot] || i < count)
+               break;
+            pending[count++] = idx;
+            slots[idx] = slot;
+         }
+         if(idx == uri_count)
+            break;
+      }
+      if(seed == MAX_SEED_SEARCH)
+         goto done;
+
+      seeds[bucket] = seed;
+      for(idx = 0; idx < count; ++idx)
+         used[slots[pending[idx]]] = true;
+   }
+
+   /* Invert: URI index by slot */
+   for(idx = 0; idx < uri_count; ++idx)
+      pending[slots[idx]] = idx;
+   *seeds_out = seeds;
+   *slots_out = pending;
+   seeds = pending = NULL;
+   result = 0;
+
+done:
+   free(bucket_of);
+   free(order);
+   free(size);
+   free(seeds);
+   free(slots);
+   free(pending);
+   free(used);
+   return result;
+}
+
+static const tContentType *assets_ContentType(const char *path)
+{
+   static const tContentType unknown = { "", "application/octet-stream", false };
+   const char *extension = strrchr(path, '.');
+
+   if(NULL != extension && NULL == strchr(extension, '/'))
+   {
+      for(uint32_t idx = 0; idx < sizeof(content_types) / sizeof(content_types[0]); ++idx)
+      {
+         if(strcasecmp(&extension[1], content_types[idx].extension) == 0)
+            return &content_types[idx];
+      }
+   }
+   return &unknown;
+}
+
+static void assets_Compress(tAssetFile *file, bool compress)
+{
+#if defined(MICROHTTPD_ASSETS_GZIP)
+   z_stream stream;
+   uLong capacity;
+
+   if(!compress || !assets_ContentType(file->path)->compress || 0 == file->length)
+      return;
+
+   memset(&stream, 0, sizeof(stream));
+   if(deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16 /* gzip wrapper */, 9,
+      Z_DEFAULT_STRATEGY) != Z_OK)
+      return;
+   capacity = deflateBound(&stream, file->length);
+   file->gzip_data = malloc(capacity);
+   if(NULL != file->gzip_data)
+   {
+      stream.next_in = file->data;
+      stream.avail_in = file->length;
+      stream.next_out = file->gzip_data;
+      stream.avail_out = capacity;
+      if(deflate(&stream, Z_FINISH) == Z_STREAM_END
+      && stream.total_out * 100 <= (uint64_t) file->length * (100 - GZIP_MIN_SAVING))
+         file->gzip_length = stream.total_out;
+      else
+      {
+         free(file->gzip_data);
+         file->gzip_data = NULL;
+      }
+   }
+   deflateEnd(&stream);
+#else
+   (void) file;
+   (void) compress;
+#endif
+}
+
+static int assets_CompareUri(const void *a, const void *b)
+{
+   return strcmp(((const tAssetUri *) a)->uri, ((const tAssetUri *) b)->uri);
+}
+
+static int assets_ComparePath(const void *a, const void *b)
+{
+   return strcmp(((const tAssetFile *) a)->path, ((const tAssetFile *) b)->path);
+}
+
+static void assets_WriteString(FILE *out, const char *s)
+{
+   fputc('"', out);
+   for(; '\0' != *s; ++s)
+   {
+      if('"' == *s || '\\' == *s)
+         fprintf(out, "\\%c", *s);
+      else if(*s < 0x20 || *s >= 0x7f)
+         fprintf(out, "\\%03o", (uint8_t) *s);
+      else
+         fputc(*s, out);
+   }
+   fputc('"', out);
+}
+
+static void assets_WriteBytes(FILE *out, const uint8_t *data, uint32_t length, bool last)
+{
+   for(uint32_t idx = 0; idx < length; ++idx)
+   {
+      bool end = last && idx + 1 == length;
+      fprintf(out, "%s0x%02x%s", (idx % 16 == 0) ? "   " : "", data[idx],
+         end ? "\n" : ((idx % 16 == 15) ? ",\n" : ","));
+   }
+   if(!last && length % 16 != 0)
+      fputc('\n', out);
+}
+
+/*! Write a 200 response as a byte array; with out NULL, only returns the header length */
+static uint32_t assets_WriteResponse(FILE *out, const char *name, const tAssetFile *file,
+   const uint8_t *body, uint32_t body_length, bool gzip)
+{
+   char header[512];
+   int length;
+
+   length = snprintf(header, sizeof(header),
+      "HTTP/1.1 200 OK\r\n"
+      "Server: %s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %"PRIu32"\r\n"
+      "ETag: %s\r\n"
+      "Cache-Control: no-cache\r\n"
+      "%s%s"
+      "\r\n",
+      MICROHTTPD_SERVER_NAME, file->content_type, body_length, gzip ? file->gzip_etag : file->etag,
+      (NULL != file->gzip_data) ? "Vary: Accept-Encoding\r\n" : "",
+      gzip ? "Content-Encoding: gzip\r\n" : "");
+
+   if(NULL != out)
+   {
+      fprintf(out, "static const uint8_t %s[] =\n{\n", name);
+      assets_WriteBytes(out, (const uint8_t *) header, length, 0 == body_length);
+      assets_WriteBytes(out, body, body_length, true);
+      fprintf(out, "};\n");
+   }
+   return length;
+}
+
+/*! Write the 304 response for a variant as a string; it repeats the 200's Vary, as RFC 9110 asks */
+static void assets_WriteNotModified(FILE *out, const char *name, const tAssetFile *file, bool gzip)
+{
+   char not_modified[192];
+
+   snprintf(not_modified, sizeof(not_modified), "HTTP/1.1 304 Not Modified\r\n"
+      "Server: %s\r\n"
+      "ETag: %s\r\n"
+      "%s"
+      "\r\n", MICROHTTPD_SERVER_NAME, gzip ? file->gzip_etag : file->etag,
+      (NULL != file->gzip_data) ? "Vary: Accept-Encoding\r\n" : "");
+   fprintf(out, "static const char %s[] =\n   ", name);
+   assets_WriteString(out, not_modified);
+   fprintf(out, ";\n");
+}
@@ -0,0 +1,203 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file trace.c
+ *  \brief microhttpd event trace decoder
+ *
+ *  Host tool that prints a dump written by microhttpd_trace_dump() as a timeline per request: each
+ *  connection's events, split at request boundaries, with times relative to the start of the
+ *  request and to the previous event. Request 0 holds the connection's events from before its first
+ *  request. With -t, all events are printed as a single timeline instead.
+ *
+ *  Usage: microhttpd_trace [-t] [-c <connection>] <dump>
+ *
+ *  The dump must have been written on a machine with the same byte order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "trace.h"
+
+typedef struct
+{
+   const char *name;
+   const char *arg;
+} tEventName;
+
+static const tEventName event_names[] =
+{
+#define MICROHTTPD_TRACE_NAME(id, name, arg) { name, arg },
+   MICROHTTPD_TRACE_EVENTS(MICROHTTPD_TRACE_NAME)
+#undef MICROHTTPD_TRACE_NAME
+};
+
+static struct md_trace_record *records;
+
+static int trace_Read(const char *path, uint32_t *count_out);
+static void trace_Print(const struct md_trace_record *record, uint64_t start, uint64_t previous);
+static int trace_CompareRequest(const void *a, const void *b);
+static int trace_CompareTime(const void *a, const void *b);
+
+/* -------------------------------------------------------------------------------------------------
+ * Main
+ */
+
+static void usage(const char *program)
+{
+   fprintf(stderr, "Usage: %s [-t] [-c <connection>] <dump>\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+   uint32_t *order, count, idx, end, connection = 0;
+   bool timeline = false;
+   int opt;
+
+   while((opt = getopt(argc, argv, "tc:")) != -1)
+   {
+      switch(opt)
+      {
+         case 't': timeline = true; break;
+         case 'c': connection = strtoul(optarg, NULL, 10); break;
+         default: usage(argv[0]); return 1;
+      }
+   }
+   if(optind + 1 != argc)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   if(trace_Read(argv[optind], &count) != 0)
+      return 1;
+
+   /* Sort indices rather than records, so that events with equal times stay in the order each
+    *  thread wrote them */
+   order = (uint32_t *) malloc((count + 1) * sizeof(order[0]));
+   if(NULL == order)
+   {
+      fprintf(stderr, "Out of memory\n");
+      free(records);
+      return 1;
+   }
+   for(idx = 0, end = 0; idx < count; ++idx)
+   {
+      if(0 == connection || records[idx].connection == connection)
+         order[end++] = idx;
+   }
+   count = end;
+   qsort(order, count, sizeof(order[0]), timeline ? trace_CompareTime : trace_CompareRequest);
+
+   for(idx = 0; idx < count; idx = end)
+   {
+      const struct md_trace_record *first = &records[order[idx]];
+      uint64_t previous = first->time;
+
+      if(timeline)
+         end = count;
+      else
+      {
+         for(end = idx + 1; end < count; ++end)
+         {
+            if(records[order[end]].connection != first->connection
+            || records[order[end]].request != first->request)
+               break;
+         }
+         printf("connection %"PRIu32" request %"PRIu32": %"PRIu32" events, %.3f us\n", first->connection,
+            first->request, end - idx, (records[order[end - 1]].time - first->time) / 1000.0);
+      }
+      for(uint32_t next = idx; next < end; ++next)
+      {
+         trace_Print(&records[order[next]], first->time, previous);
+         previous = records[order[next]].time;
+      }
+      if(!timeline)
+         printf("\n");
+   }
+
+   free(order);
+   free(records);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int trace_Read(const char *path, uint32_t *count_out)
+{
+   struct md_trace_header header;
+   FILE *in = fopen(path, "rb");
+
+   if(NULL == in)
+   {
+      fprintf(stderr, "Failed to open '%s'\n", path);
+      return -1;
+   }
+   if(fread(&header, sizeof(header), 1, in) != 1
+   || memcmp(header.magic, MICROHTTPD_TRACE_MAGIC, sizeof(MICROHTTPD_TRACE_MAGIC)) != 0)
+   {
+      fprintf(stderr, "'%s' is not a microhttpd trace\n", path);
+      fclose(in);
+      return -1;
+   }
+   if(header.version != MICROHTTPD_TRACE_VERSION || header.record_size != sizeof(records[0]))
+   {
+      fprintf(stderr, "'%s' is trace version %"PRIu32" with %"PRIu32" byte records; expected version %u "
+         "with %zu\n", path, header.version, header.record_size, MICROHTTPD_TRACE_VERSION,
+         sizeof(records[0]));
+      fclose(in);
+      return -1;
+   }
+
+   records = (struct md_trace_record *) malloc((header.record_count + 1) * sizeof(records[0]));
+   if(NULL == records || fread(records, sizeof(records[0]), header.record_count, in) != header.record_count)
+   {
+      fprintf(stderr, "Failed to read %"PRIu32" records from '%s'\n", header.record_count, path);
+      free(records);
+      fclose(in);
+      return -1;
+   }
+   fclose(in);
+
+   *count_out = header.record_count;
+   return 0;
+}
+
+static void trace_Print(const struct md_trace_record *record, uint64_t start, uint64_t previous)
+{
+   const tEventName *name = (record->event < MH_TRACE_EVENT_COUNT) ? &event_names[record->event] : NULL;
+
+   printf("  %12.3f us %+10.3f  t%-3"PRIu16" c%-6"PRIu32" %-26s", (record->time - start) / 1000.0,
+      (record->time - previous) / 1000.0, record->thread, record->connection,
+      (NULL != name) ? name->name : "?");
+   if(NULL == name)
+      printf("event %"PRIu16" %"PRIu32"\n", record->event, record->arg);
+   else if('\0' != name->arg[0])
+      printf("%s %"PRIu32"\n", name->arg, record->arg);
+   else
+      printf("\n");
+}
+
+static int trace_CompareRequest(const void *a, const void *b)
+{
+   const struct md_trace_record *ra = &records[*(const uint32_t *) a];
+   const struct md_trace_record *rb = &records[*(const uint32_t *) b];
+
+   if(ra->connection != rb->connection)
+      return (ra->connection < rb->connection) ? -1 : 1;
+   if(ra->request != rb->request)
+      return (ra->request < rb->request) ? -1 : 1;
+   return trace_CompareTime(a, b);
+}
+
+static int trace_CompareTime(const void *a, const void *b)
+{
+   uint32_t ia = *(const uint32_t *) a, ib = *(const uint32_t *) b;
+
+   if(records[ia].time != records[ib].time)
+      return (records[ia].time < records[ib].time) ? -1 : 1;
+   return (ia < ib) ? -1 : (ia > ib);
+}
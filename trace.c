@@ -0,0 +1,170 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file trace.c
+ *  \brief microhttpd binary event trace
+ *
+ *  Each thread writes its own ring, allocated on its first event and kept for the life of the
+ *  process so a dump still has the events of threads that have exited. Writing a record takes no
+ *  locks and no atomic read-modify-write; the ring's head is published with a release store, which
+ *  is all a dump needs to find the records. A dump taken while threads are busy may include a few
+ *  records that are overwritten as they're copied.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "debug.h"
+#include "trace.h"
+#include "microhttpd/microhttpd.h"
+
+#if defined(MICROHTTPD_TRACE)
+#include <time.h>
+#include <stdatomic.h>
+
+#if (MICROHTTPD_TRACE_RING_SIZE & (MICROHTTPD_TRACE_RING_SIZE - 1)) != 0
+#error "MICROHTTPD_TRACE_RING_SIZE must be a power of two"
+#endif
+
+struct md_trace_ring
+{
+   struct md_trace_ring *next;
+   _Atomic uint32_t head;  /* Records written; the ring holds the most recent of them */
+   uint32_t dump_head;     /* head when the dump being written was started */
+   uint16_t thread;
+   struct md_trace_record records[MICROHTTPD_TRACE_RING_SIZE];
+};
+
+static _Atomic(struct md_trace_ring *) trace_rings;
+static _Atomic uint32_t trace_threads;
+static _Atomic uint32_t trace_connections;
+static _Thread_local struct md_trace_ring *trace_self;
+
+static struct md_trace_ring *microhttpd_TraceRingCreate(void);
+static bool microhttpd_TraceWrite(int fd, const void *data, size_t length);
+#endif
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+int microhttpd_trace_dump(int fd)
+{
+#if defined(MICROHTTPD_TRACE)
+   struct md_trace_header header;
+   struct md_trace_ring *ring, *rings = atomic_load_explicit(&trace_rings, memory_order_acquire);
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, MICROHTTPD_TRACE_MAGIC, sizeof(MICROHTTPD_TRACE_MAGIC));
+   header.version = MICROHTTPD_TRACE_VERSION;
+   header.record_size = sizeof(struct md_trace_record);
+   for(ring = rings; NULL != ring; ring = ring->next)
+   {
+      ring->dump_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      header.record_count += (ring->dump_head < MICROHTTPD_TRACE_RING_SIZE) ?
+         ring->dump_head : MICROHTTPD_TRACE_RING_SIZE;
+   }
+   if(!microhttpd_TraceWrite(fd, &header, sizeof(header)))
+      return -1;
+
+   for(ring = rings; NULL != ring; ring = ring->next)
+   {
+      uint32_t count = (ring->dump_head < MICROHTTPD_TRACE_RING_SIZE) ?
+         ring->dump_head : MICROHTTPD_TRACE_RING_SIZE;
+      uint32_t start = (ring->dump_head - count) & (MICROHTTPD_TRACE_RING_SIZE - 1);
+      uint32_t first = (start + count <= MICROHTTPD_TRACE_RING_SIZE) ?
+         count : MICROHTTPD_TRACE_RING_SIZE - start;
+
+      if(!microhttpd_TraceWrite(fd, &ring->records[start], first * sizeof(ring->records[0]))
+      || !microhttpd_TraceWrite(fd, &ring->records[0], (count - first) * sizeof(ring->records[0])))
+         return -1;
+   }
+   return (int) header.record_count;
+#else
+   MH_DBG("%s: Built without MICROHTTPD_TRACE\n", __func__);
+   return -1;
+#endif
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+#if defined(MICROHTTPD_TRACE)
+void microhttpd_Trace(uint16_t event, uint32_t connection, uint32_t request, uint32_t arg)
+{
+   struct md_trace_ring *ring = trace_self;
+   struct md_trace_record *record;
+   struct timespec now;
+   uint32_t head;
+
+   if(NULL == ring)
+   {
+      ring = microhttpd_TraceRingCreate();
+      if(NULL == ring)
+         return;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   head = atomic_load_explicit(&ring->head, memory_order_relaxed); /* Only this thread writes it */
+   record = &ring->records[head & (MICROHTTPD_TRACE_RING_SIZE - 1)];
+   record->time = (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+   record->connection = connection;
+   record->request = request;
+   record->arg = arg;
+   record->event = event;
+   record->thread = ring->thread;
+   atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*! Number for a newly accepted connection */
+uint32_t microhttpd_TraceConnection(void)
+{
+   return atomic_fetch_add_explicit(&trace_connections, 1, memory_order_relaxed) + 1;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static struct md_trace_ring *microhttpd_TraceRingCreate(void)
+{
+   struct md_trace_ring *ring = (struct md_trace_ring *) malloc(sizeof(*ring));
+
+   if(NULL == ring)
+   {
+      MH_DBG("%s: Failed to allocate trace ring\n", __func__);
+      return NULL;
+   }
+   atomic_init(&ring->head, 0);
+   ring->thread = (uint16_t) atomic_fetch_add_explicit(&trace_threads, 1, memory_order_relaxed);
+   ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+   while(!atomic_compare_exchange_weak_explicit(&trace_rings, &ring->next, ring, memory_order_release,
+      memory_order_relaxed))
+   {
+      /* ring->next has been updated to the current list; try again */
+   }
+   trace_self = ring;
+   return ring;
+}
+
+static bool microhttpd_TraceWrite(int fd, const void *data, size_t length)
+{
+   const char *next = (const char *) data;
+
+   while(length > 0)
+   {
+      ssize_t result = write(fd, next, length);
+
+      if(result < 0 && EINTR == errno)
+         continue;
+      if(result <= 0)
+      {
+         MH_DBG("%s: Write failed (errno %d)\n", __func__, errno);
+         return false;
+      }
+      next += result;
+      length -= result;
+   }
+   return true;
+}
+#endif /* MICROHTTPD_TRACE */
@@ -0,0 +1,107 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file trace.h
+ *  \brief microhttpd binary event trace
+ *
+ *  Built with MICROHTTPD_TRACE, MH_TRACE() records fixed-size, timestamped events into a ring per
+ *  thread; otherwise it compiles to nothing. The record and dump formats here are shared with the
+ *  decoder (tools/trace.c), which must be rebuilt if they or the event list change.
+ */
+#ifndef _MICROHTTPD_TRACE_H
+#define _MICROHTTPD_TRACE_H
+
+#include <stdint.h>
+
+#if !defined(MICROHTTPD_TRACE_RING_SIZE)
+#define MICROHTTPD_TRACE_RING_SIZE 4096 /* Records kept per thread; a power of two */
+#endif
+
+#define MICROHTTPD_TRACE_MAGIC   "MHTRACE"
+#define MICROHTTPD_TRACE_VERSION 1
+
+/* Event ID, name, and what the argument holds */
+#define MICROHTTPD_TRACE_EVENTS(X) \
+   X(ACCEPT,                     "accept",                "socket") \
+   X(READ,                       "read",                  "bytes") \
+   X(SEND,                       "send",                  "bytes") \
+   X(WRITE,                      "write queued",          "bytes") \
+   X(CLOSE,                      "close",                 "") \
+   X(HANDLER_ENTER,              "handler enter",         "method") \
+   X(HANDLER_EXIT,               "handler exit",          "method") \
+   X(DEFER,                      "defer",                 "") \
+   X(COMPLETE,                   "complete",              "bytes") \
+   X(FINISH,                     "finish",                "pipelined") \
+   X(STATE_PARSE_HEADER,         "ParseHeader",           "rx bytes") \
+   X(STATE_HEADER_COMPLETE,      "HeaderComplete",        "rx bytes") \
+   X(STATE_GET,                  "HandleOperationGet",    "rx bytes") \
+   X(STATE_DEFERRED,             "Deferred",              "rx bytes") \
+   X(STATE_POST,                 "HandleOperationPost",   "rx bytes") \
+   X(STATE_POST_HEADER,          "HandlePostHeader",      "rx bytes") \
+   X(STATE_POST_HEADER_COMPLETE, "HandlePostHeaderComplete", "rx bytes") \
+   X(STATE_POST_DATA,            "HandlePostData",        "rx bytes") \
+   X(STATE_ROUTE,                "HandleOperationRoute",  "rx bytes") \
+   X(STATE_ROUTE_BODY,           "RouteBody",             "rx bytes") \
+   X(STATE_DISCARD_BODY,         "DiscardBody",           "rx bytes") \
+   X(STATE_METHOD_NOT_ALLOWED,   "MethodNotAllowed",      "rx bytes") \
+   X(STATE_NOT_IMPLEMENTED,      "NotImplemented",        "rx bytes") \
+   X(STATE_RATE_LIMITED,         "RateLimited",           "rx bytes") \
+   X(STATE_EVENT_STREAM,         "EventStream",           "rx bytes") \
+   X(STATE_WEBSOCKET_FRAME,      "WebSocketFrame",        "rx bytes") \
+   X(STATE_WEBSOCKET_PAYLOAD,    "WebSocketPayload",      "rx bytes") \
+   X(STATE_WEBSOCKET_CLOSING,    "WebSocketClosing",      "rx bytes") \
+   X(STATE_H2_PREFACE,           "H2Preface",             "rx bytes") \
+   X(STATE_H2_FRAME,             "H2Frame",               "rx bytes") \
+   X(STATE_H2_DATA,              "H2Data",                "rx bytes") \
+   X(STATE_H2_CLOSING,           "H2Closing",             "rx bytes") \
+   X(H2_STREAM,                  "h2 stream",             "stream id") \
+   X(STATE_POST_FORM,            "HandlePostForm",        "rx bytes") \
+   X(STATE_PROXY,                "HandleOperationProxy",  "rx bytes") \
+   X(STATE_PROXY_BODY,           "ProxyRequestBody",      "rx bytes") \
+   X(STATE_UPSTREAM_HEADER,      "UpstreamHeader",        "rx bytes") \
+   X(STATE_UPSTREAM_BODY,        "UpstreamBody",          "rx bytes") \
+   X(UPSTREAM_CONNECT,           "upstream connect",      "socket") \
+   X(CACHE_HIT,                  "cache hit",             "bytes") \
+   X(CACHE_STORE,                "cache store",           "bytes") \
+   X(STATE_CLOSING,              "Closing",               "rx bytes")
+
+enum
+{
+#define MICROHTTPD_TRACE_ID(id, name, arg) MH_TRACE_##id,
+   MICROHTTPD_TRACE_EVENTS(MICROHTTPD_TRACE_ID)
+#undef MICROHTTPD_TRACE_ID
+   MH_TRACE_EVENT_COUNT
+};
+
+/*! One event. Requests are numbered from 1 within their connection; 0 is the connection itself. */
+struct md_trace_record
+{
+   uint64_t time;       /* Monotonic nanoseconds */
+   uint32_t connection; /* Numbered from 1 in order of acceptance */
+   uint32_t request;
+   uint32_t arg;
+   uint16_t event;
+   uint16_t thread;     /* Numbered from 0 in order of first event */
+};
+
+/*! A dump is this header followed by record_count records, oldest first per thread, in the
+ *  writer's byte order */
+struct md_trace_header
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t record_size;
+   uint32_t record_count;
+   uint32_t reserved;
+};
+
+#if defined(MICROHTTPD_TRACE)
+#define MH_TRACE(client, event, arg) \
+   microhttpd_Trace(MH_TRACE_##event, (client)->trace_connection, (client)->trace_request, (arg))
+#else
+#define MH_TRACE(client, event, arg)
+#endif
+
+void microhttpd_Trace(uint16_t event, uint32_t connection, uint32_t request, uint32_t arg);
+uint32_t microhttpd_TraceConnection(void);
+
+#endif /* _MICROHTTPD_TRACE_H */
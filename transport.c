@@ -0,0 +1,170 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file transport.c
+ *  \brief microhttpd socket transport
+ */
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "transport.h"
+#include "trace.h"
+#include "microhttpd_private.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+#if !defined(MSG_DONTWAIT)
+#define MSG_DONTWAIT 0
+#endif
+
+static bool microhttpd_TransportWaitWritable(struct md_client *client);
+
+static int32_t transport_SocketRecv(struct md_client *client, void *buffer, uint32_t length);
+static int32_t transport_SocketSend(struct md_client *client, const void *buffer, uint32_t length);
+static int32_t transport_SocketWritev(struct md_client *client, const struct iovec *iov, uint32_t count);
+static void transport_SocketClose(struct md_client *client);
+
+const struct md_transport md_transport_socket =
+{
+   "socket",
+   transport_SocketRecv,
+   transport_SocketSend,
+   transport_SocketWritev,
+   transport_SocketClose,
+   NULL
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Common Functions
+ */
+
+/*! Write as much as the transport accepts without waiting. Returns the number of bytes written,
+ *  which may be none, or -1 on failure. */
+int32_t microhttpd_TransportWrite(struct md_client *client, const struct iovec *iov, uint32_t count)
+{
+   int32_t result = client->transport->writev(client, iov, count);
+
+   if(result < 0)
+   {
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+         MH_DBG("%s: Write failed (errno %d)\n", __func__, errno);
+         return -1;
+      }
+      result = 0;
+   }
+   MH_TRACE(client, SEND, result);
+   return result;
+}
+
+/*! Write everything, for a transport's send. Waits for the transport to accept more, but fails if
+ *  it takes nothing for MICROHTTPD_SEND_TIMEOUT, so the caller can drop a client that's stopped
+ *  reading. */
+int32_t microhttpd_TransportWriteAll(struct md_client *client, struct iovec *iov, uint32_t count)
+{
+   int32_t total = 0, result;
+
+   while(count > 0)
+   {
+      if(iov->iov_len == 0)
+      {
+         ++iov;
+         --count;
+         continue;
+      }
+
+      result = client->transport->writev(client, iov, count);
+      if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+      && microhttpd_TransportWaitWritable(client))
+         continue;
+      if(result <= 0)
+      {
+         MH_DBG("%s: Write failed (%"PRIi32")\n", __func__, result);
+         return -1;
+      }
+      MH_TRACE(client, SEND, result);
+      total += result;
+
+      /* Skip past whatever was written */
+      while(count > 0 && (uint32_t) result >= iov->iov_len)
+      {
+         result -= iov->iov_len;
+         ++iov;
+         --count;
+      }
+      if(count > 0)
+      {
+         iov->iov_base = (char *) iov->iov_base + result;
+         iov->iov_len -= result;
+      }
+   }
+
+   return total;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Socket Transport
+ */
+
+static int32_t transport_SocketRecv(struct md_client *client, void *buffer, uint32_t length)
+{
+   return read(client->socket, buffer, length);
+}
+
+/* Client sockets are blocking, so this goes through the non-blocking writev and waits with a timeout
+ *  rather than letting send() block for as long as the peer doesn't read */
+static int32_t transport_SocketSend(struct md_client *client, const void *buffer, uint32_t length)
+{
+   struct iovec iov = { (void *) buffer, length };
+   return microhttpd_TransportWriteAll(client, &iov, 1);
+}
+
+static int32_t transport_SocketWritev(struct md_client *client, const struct iovec *iov, uint32_t count)
+{
+   struct msghdr msg = {0};
+   int32_t result;
+
+   msg.msg_iov = (struct iovec *) iov;
+   msg.msg_iovlen = count;
+   do
+   {
+      result = sendmsg(client->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+   } while(result < 0 && errno == EINTR);
+
+   return result;
+}
+
+static void transport_SocketClose(struct md_client *client)
+{
+   if(client->socket >= 0)
+      close(client->socket);
+   client->socket = -1;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static bool microhttpd_TransportWaitWritable(struct md_client *client)
+{
+   struct timeval timeout;
+   fd_set fdWrite;
+   int result;
+
+   if(client->socket < 0)
+      return false;
+   do
+   {
+      FD_ZERO(&fdWrite);
+      FD_SET(client->socket, &fdWrite);
+      timeout.tv_sec = MICROHTTPD_SEND_TIMEOUT / 1000;
+      timeout.tv_usec = (MICROHTTPD_SEND_TIMEOUT % 1000) * 1000;
+      result = select(client->socket + 1, NULL, &fdWrite, NULL, &timeout);
+   } while(result < 0 && errno == EINTR);
+   if(0 == result)
+      MH_DBG("%s: Not writable after %u ms\n", __func__, MICROHTTPD_SEND_TIMEOUT);
+   return result > 0;
+}
@@ -0,0 +1,73 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file transport.h
+ *  \brief microhttpd client transport interface
+ */
+#ifndef _MICROHTTPD_TRANSPORT_H
+#define _MICROHTTPD_TRANSPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+struct md_client;
+struct md_context;
+
+#if !defined(MICROHTTPD_SEND_TIMEOUT)
+#define MICROHTTPD_SEND_TIMEOUT 5000 /* milliseconds a transport's send waits for the peer to read */
+#endif
+
+/*! Byte-stream operations used by the client state machine. recv returns the number of bytes
+ *  received (0 on orderly shutdown, negative on error, or -1 with errno set to EAGAIN when there's
+ *  nothing for the caller yet). send transmits the complete buffer, failing if the peer takes none
+ *  of it for MICROHTTPD_SEND_TIMEOUT. writev performs a single gather write without blocking and
+ *  returns the number of bytes written, which may be less than requested, or -1 with errno set to
+ *  EAGAIN when nothing can be written. pending, if set, reports data the transport has already
+ *  taken from the socket, which recv returns without waiting. */
+struct md_transport
+{
+   const char *name;
+   int32_t (*recv)(struct md_client *client, void *buffer, uint32_t length);
+   int32_t (*send)(struct md_client *client, const void *buffer, uint32_t length);
+   int32_t (*writev)(struct md_client *client, const struct iovec *iov, uint32_t count);
+   void (*close)(struct md_client *client);
+   bool (*pending)(struct md_client *client);
+};
+
+/* Default transport; operates on client->socket */
+extern const struct md_transport md_transport_socket;
+
+/* TLS over client->socket; client->transport_data is the session */
+#if defined(MICROHTTPD_TLS)
+extern const struct md_transport md_transport_tls;
+#endif
+int microhttpd_TlsInit(struct md_context *ctx);
+void microhttpd_TlsShutdown(struct md_context *ctx);
+
+/* In-memory transport; client->transport_data is a struct md_memory_stream */
+struct md_memory_stream
+{
+   const char *rx;
+   uint32_t rx_length;
+   uint32_t rx_offset;
+   uint32_t fragment_size;  /* Maximum bytes returned per recv; 0 for no limit */
+
+   uint64_t tx_bytes;
+   uint64_t tx_hash;        /* FNV-1a of all transmitted bytes */
+   char *tx_log;            /* If set, transmitted bytes are also copied here until it's full */
+   uint32_t tx_log_size;
+   uint32_t tx_log_length;
+   bool closed;
+};
+extern const struct md_transport md_transport_memory;
+
+/* HTTP/2 stream; client->transport_data is a struct md_h2_stream */
+extern const struct md_transport md_transport_h2;
+
+void microhttpd_MemoryStreamReset(struct md_memory_stream *stream, const char *rx, uint32_t rx_length,
+   uint32_t fragment_size);
+
+int32_t microhttpd_TransportWrite(struct md_client *client, const struct iovec *iov, uint32_t count);
+int32_t microhttpd_TransportWriteAll(struct md_client *client, struct iovec *iov, uint32_t count);
+
+#endif /* _MICROHTTPD_TRANSPORT_H */
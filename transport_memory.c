@@ -0,0 +1,108 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file transport_memory.c
+ *  \brief microhttpd in-memory transport, used to drive the client state machine without sockets
+ */
+#include <string.h>
+#include "debug.h"
+#include "transport.h"
+#include "microhttpd_private.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+static int32_t transport_MemoryRecv(struct md_client *client, void *buffer, uint32_t length);
+static int32_t transport_MemorySend(struct md_client *client, const void *buffer, uint32_t length);
+static int32_t transport_MemoryWritev(struct md_client *client, const struct iovec *iov, uint32_t count);
+static void transport_MemoryClose(struct md_client *client);
+
+const struct md_transport md_transport_memory =
+{
+   "memory",
+   transport_MemoryRecv,
+   transport_MemorySend,
+   transport_MemoryWritev,
+   transport_MemoryClose,
+   NULL
+};
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+void microhttpd_MemoryStreamReset(struct md_memory_stream *stream, const char *rx, uint32_t rx_length,
+   uint32_t fragment_size)
+{
+   stream->rx = rx;
+   stream->rx_length = rx_length;
+   stream->rx_offset = 0;
+   stream->fragment_size = fragment_size;
+   stream->tx_bytes = 0;
+   stream->tx_hash = FNV_OFFSET_BASIS;
+   stream->tx_log = NULL;
+   stream->tx_log_size = stream->tx_log_length = 0;
+   stream->closed = false;
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static int32_t transport_MemoryRecv(struct md_client *client, void *buffer, uint32_t length)
+{
+   struct md_memory_stream *stream = (struct md_memory_stream *) client->transport_data;
+   uint32_t available = stream->rx_length - stream->rx_offset;
+
+   if(stream->closed)
+      return -1;
+   if(length > available)
+      length = available;
+   if(stream->fragment_size > 0 && length > stream->fragment_size)
+      length = stream->fragment_size;
+
+   memcpy(buffer, &stream->rx[stream->rx_offset], length);
+   stream->rx_offset += length;
+   return length;
+}
+
+static int32_t transport_MemorySend(struct md_client *client, const void *buffer, uint32_t length)
+{
+   struct md_memory_stream *stream = (struct md_memory_stream *) client->transport_data;
+   const uint8_t *data = (const uint8_t *) buffer;
+   uint64_t hash = stream->tx_hash;
+
+   if(stream->closed)
+      return -1;
+   for(uint32_t i = 0; i < length; ++i)
+      hash = (hash ^ data[i]) * FNV_PRIME;
+   stream->tx_hash = hash;
+   stream->tx_bytes += length;
+   if(NULL != stream->tx_log && length > 0)
+   {
+      uint32_t copy = stream->tx_log_size - stream->tx_log_length;
+      if(copy > length)
+         copy = length;
+      memcpy(&stream->tx_log[stream->tx_log_length], buffer, copy);
+      stream->tx_log_length += copy;
+   }
+   return length;
+}
+
+static int32_t transport_MemoryWritev(struct md_client *client, const struct iovec *iov, uint32_t count)
+{
+   int32_t total = 0;
+
+   for(uint32_t i = 0; i < count; ++i)
+   {
+      if(transport_MemorySend(client, iov[i].iov_base, iov[i].iov_len) < 0)
+         return -1;
+      total += iov[i].iov_len;
+   }
+   return total;
+}
+
+static void transport_MemoryClose(struct md_client *client)
+{
+   struct md_memory_stream *stream = (struct md_memory_stream *) client->transport_data;
+   stream->closed = true;
+}
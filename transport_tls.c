@@ -0,0 +1,294 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file transport_tls.c
+ *  \brief microhttpd TLS transport (OpenSSL)
+ *
+ *  Built with MICROHTTPD_TLS, clients of a listener with tls set use this transport. Each gets an
+ *  SSL object on its first read, which also runs the handshake without blocking: until application
+ *  data arrives, recv fails with EAGAIN and the client waits for the socket as usual. recv reads
+ *  until the buffer is full or the socket is empty; anything OpenSSL still holds is reported by
+ *  pending, so the client is read again before waiting on the socket, whose readiness doesn't
+ *  reflect it. Gathered writes are copied into a single record where they fit.
+ *
+ *  Servers resume sessions from an in-process cache, or from a ticket, whose key can be set so
+ *  that it survives a restart. Where OpenSSL and the kernel support it, record encryption is
+ *  offloaded to kTLS after the handshake. OpenSSL writes to the socket itself, without
+ *  MSG_NOSIGNAL, so the application must ignore SIGPIPE.
+ */
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "debug.h"
+#include "transport.h"
+#include "microhttpd_private.h"
+
+#if defined(MICROHTTPD_TLS)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_RECORD_SIZE 16384 /* Largest plaintext a record carries */
+
+static SSL *microhttpd_TlsSession(struct md_client *client);
+#if defined(DEBUG)
+static void microhttpd_TlsInfo(const SSL *ssl, int where, int ret);
+#endif
+
+static int32_t transport_TlsRecv(struct md_client *client, void *buffer, uint32_t length);
+static int32_t transport_TlsSend(struct md_client *client, const void *buffer, uint32_t length);
+static int32_t transport_TlsWritev(struct md_client *client, const struct iovec *iov, uint32_t count);
+static void transport_TlsClose(struct md_client *client);
+static bool transport_TlsPending(struct md_client *client);
+
+const struct md_transport md_transport_tls =
+{
+   "tls",
+   transport_TlsRecv,
+   transport_TlsSend,
+   transport_TlsWritev,
+   transport_TlsClose,
+   transport_TlsPending
+};
+#endif
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+/*! Load the certificate and key if any listener uses TLS. Returns 0 if there's nothing to do. */
+int microhttpd_TlsInit(struct md_context *ctx)
+{
+   bool needed = false;
+
+   for(uint32_t idx = 0; idx < ctx->listener_count; ++idx)
+      needed |= ctx->listeners[idx].tls;
+   if(!needed)
+      return 0;
+
+#if defined(MICROHTTPD_TLS)
+   SSL_CTX *tls = SSL_CTX_new(TLS_server_method());
+
+   if(NULL == tls)
+   {
+      MH_DBG("%s: Failed to create TLS context\n", __func__);
+      return -1;
+   }
+   if(NULL == ctx->params.tls_certificate || NULL == ctx->params.tls_private_key
+   || SSL_CTX_use_certificate_chain_file(tls, ctx->params.tls_certificate) != 1
+   || SSL_CTX_use_PrivateKey_file(tls, ctx->params.tls_private_key, SSL_FILETYPE_PEM) != 1
+   || SSL_CTX_check_private_key(tls) != 1)
+   {
+      MH_DBG("%s: Failed to load certificate '%s' and key '%s'\n", __func__,
+         (NULL != ctx->params.tls_certificate) ? ctx->params.tls_certificate : "",
+         (NULL != ctx->params.tls_private_key) ? ctx->params.tls_private_key : "");
+      ERR_clear_error();
+      SSL_CTX_free(tls);
+      return -1;
+   }
+
+   SSL_CTX_set_min_proto_version(tls, TLS1_2_VERSION);
+   /* Partial writes suit the transmit queue, which retries from where a write stopped but may gather
+    *  a different buffer to do it; idle connections don't keep record buffers */
+   SSL_CTX_set_mode(tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+      | SSL_MODE_RELEASE_BUFFERS);
+
+   /* Resumption: sessions cached here, and tickets for clients that prefer them */
+   SSL_CTX_set_session_cache_mode(tls, SSL_SESS_CACHE_SERVER);
+   SSL_CTX_set_session_id_context(tls, (const unsigned char *) MICROHTTPD_SERVER_NAME,
+      sizeof(MICROHTTPD_SERVER_NAME) - 1);
+   if(ctx->params.tls_session_cache_size > 0)
+      SSL_CTX_sess_set_cache_size(tls, ctx->params.tls_session_cache_size);
+   if(NULL != ctx->params.tls_ticket_key
+   && SSL_CTX_set_tlsext_ticket_keys(tls, (void *) ctx->params.tls_ticket_key,
+      MICROHTTPD_TLS_TICKET_KEY_LENGTH) != 1)
+   {
+      MH_DBG("%s: Failed to set the ticket key\n", __func__);
+      SSL_CTX_free(tls);
+      return -1;
+   }
+
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+   SSL_CTX_set_options(tls, SSL_OP_IGNORE_UNEXPECTED_EOF); /* HTTP framing already tells truncation apart */
+#endif
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(MICROHTTPD_NO_KTLS)
+   SSL_CTX_set_options(tls, SSL_OP_ENABLE_KTLS); /* Used only if the kernel and cipher allow */
+#endif
+#if defined(DEBUG)
+   SSL_CTX_set_info_callback(tls, microhttpd_TlsInfo);
+#endif
+
+   ctx->tls = tls;
+   return 0;
+#else
+   MH_DBG("%s: TLS listener, but built without MICROHTTPD_TLS\n", __func__);
+   return -1;
+#endif
+}
+
+void microhttpd_TlsShutdown(struct md_context *ctx)
+{
+#if defined(MICROHTTPD_TLS)
+   SSL_CTX_free((SSL_CTX *) ctx->tls);
+   ctx->tls = NULL;
+#endif
+}
+
+#if defined(MICROHTTPD_TLS)
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+static SSL *microhttpd_TlsSession(struct md_client *client)
+{
+   SSL *ssl = (SSL *) client->transport_data;
+
+   if(NULL != ssl)
+      return ssl;
+   /* recv reads until OpenSSL reports it would block */
+   if(fcntl(client->socket, F_SETFL, fcntl(client->socket, F_GETFL, 0) | O_NONBLOCK) != 0)
+   {
+      MH_DBG("%s: Failed to set non-blocking mode\n", __func__);
+      return NULL;
+   }
+   ssl = SSL_new((SSL_CTX *) client->ctx->tls);
+   if(NULL == ssl || SSL_set_fd(ssl, client->socket) != 1)
+   {
+      MH_DBG("%s: Failed to create TLS session\n", __func__);
+      SSL_free(ssl);
+      ERR_clear_error();
+      return NULL;
+   }
+   SSL_set_accept_state(ssl);
+   client->transport_data = ssl;
+   return ssl;
+}
+
+#if defined(DEBUG)
+static void microhttpd_TlsInfo(const SSL *ssl, int where, int ret)
+{
+   if(where & SSL_CB_HANDSHAKE_DONE)
+   {
+      MH_DBG("%s: %s handshake done with %s (%s; kTLS send %d, receive %d)\n", __func__,
+         SSL_get_version(ssl), SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? "resumed" : "full",
+         (int) BIO_get_ktls_send(SSL_get_wbio(ssl)), (int) BIO_get_ktls_recv(SSL_get_rbio(ssl)));
+   }
+}
+#endif
+
+/* -------------------------------------------------------------------------------------------------
+ * Transport
+ */
+
+static int32_t transport_TlsRecv(struct md_client *client, void *buffer, uint32_t length)
+{
+   SSL *ssl = microhttpd_TlsSession(client);
+   uint32_t total = 0;
+   int result;
+
+   if(NULL == ssl)
+      return -1;
+
+   while(total < length)
+   {
+      result = SSL_read(ssl, (char *) buffer + total, length - total);
+      if(result > 0)
+      {
+         total += result;
+         continue;
+      }
+      switch(SSL_get_error(ssl, result))
+      {
+         case SSL_ERROR_WANT_READ:
+         case SSL_ERROR_WANT_WRITE:
+            if(0 == total)
+            {
+               errno = EAGAIN; /* Handshake in progress, or a partial record */
+               return -1;
+            }
+            return total;
+         case SSL_ERROR_ZERO_RETURN:
+            return total; /* Peer sent close_notify */
+         default:
+            MH_DBG("%s: TLS receive failed\n", __func__);
+            ERR_clear_error();
+            return (total > 0) ? (int32_t) total : -1;
+      }
+   }
+   return total;
+}
+
+static int32_t transport_TlsSend(struct md_client *client, const void *buffer, uint32_t length)
+{
+   struct iovec iov = { (void *) buffer, length };
+   return microhttpd_TransportWriteAll(client, &iov, 1);
+}
+
+static int32_t transport_TlsWritev(struct md_client *client, const struct iovec *iov, uint32_t count)
+{
+   SSL *ssl = microhttpd_TlsSession(client);
+   char record[TLS_RECORD_SIZE];
+   const void *data = iov[0].iov_base;
+   uint32_t length = iov[0].iov_len;
+   int result;
+
+   if(NULL == ssl)
+      return -1;
+   if(count > 1 && length < sizeof(record))
+   {
+      /* Several small pieces, such as a header and body, go out as one record */
+      length = 0;
+      for(uint32_t idx = 0; idx < count && length < sizeof(record); ++idx)
+      {
+         uint32_t chunk = sizeof(record) - length;
+
+         if(chunk > iov[idx].iov_len)
+            chunk = iov[idx].iov_len;
+         memcpy(&record[length], iov[idx].iov_base, chunk);
+         length += chunk;
+      }
+      data = record;
+   }
+   if(0 == length)
+      return 0;
+
+   result = SSL_write(ssl, data, length);
+   if(result > 0)
+      return result;
+   switch(SSL_get_error(ssl, result))
+   {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+         errno = EAGAIN;
+         break;
+      default:
+         MH_DBG("%s: TLS send failed\n", __func__);
+         ERR_clear_error();
+         errno = EIO;
+         break;
+   }
+   return -1;
+}
+
+static void transport_TlsClose(struct md_client *client)
+{
+   SSL *ssl = (SSL *) client->transport_data;
+
+   if(NULL != ssl)
+   {
+      if(SSL_is_init_finished(ssl))
+         SSL_shutdown(ssl); /* Sends close_notify if there's room; doesn't wait for the peer's */
+      SSL_free(ssl);
+      ERR_clear_error();
+      client->transport_data = NULL;
+   }
+   if(client->socket >= 0)
+      close(client->socket);
+   client->socket = -1;
+}
+
+static bool transport_TlsPending(struct md_client *client)
+{
+   SSL *ssl = (SSL *) client->transport_data;
+   return NULL != ssl && SSL_has_pending(ssl);
+}
+#endif /* MICROHTTPD_TLS */
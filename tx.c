@@ -0,0 +1,196 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file tx.c
+ *  \brief microhttpd client transmit queue
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "debug.h"
+#include "helpers.h"
+#include "tx.h"
+#include "transport.h"
+#include "trace.h"
+#include "proxy.h"
+#include "microhttpd_private.h"
+
+#define MICROHTTPD_TX_MIN_BUFFER  1024
+#define MICROHTTPD_TX_MAX_IOV     16
+
+/* -------------------------------------------------------------------------------------------------
+ * Buffers
+ */
+
+struct md_buffer *microhttpd_BufferAlloc(uint32_t capacity)
+{
+   struct md_buffer *buffer;
+
+   buffer = (struct md_buffer *) malloc(sizeof(*buffer) + capacity);
+   if(NULL == buffer)
+   {
+      MH_DBG("%s: Failed to allocate %"PRIu32" byte buffer\n", __func__, capacity);
+      return NULL;
+   }
+   atomic_init(&buffer->refcount, 1);
+   buffer->capacity = capacity;
+   buffer->length = 0;
+   return buffer;
+}
+
+struct md_buffer *microhttpd_BufferRef(struct md_buffer *buffer)
+{
+   atomic_fetch_add_explicit(&buffer->refcount, 1, memory_order_relaxed);
+   return buffer;
+}
+
+void microhttpd_BufferRelease(struct md_buffer *buffer)
+{
+   if(NULL == buffer)
+      return;
+   if(atomic_fetch_sub_explicit(&buffer->refcount, 1, memory_order_acq_rel) == 1)
+      free(buffer);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Queue
+ */
+
+bool microhttpd_TxQueueBuffer(struct md_client *client, struct md_buffer *buffer, uint32_t offset,
+   uint32_t length)
+{
+   struct md_tx_entry *entry;
+
+   if(0 == length)
+      return true;
+
+   entry = (struct md_tx_entry *) malloc(sizeof(*entry));
+   if(NULL == entry)
+   {
+      MH_DBG("%s: Failed to allocate queue entry\n", __func__);
+      return false;
+   }
+   entry->buffer = microhttpd_BufferRef(buffer);
+   entry->offset = offset;
+   entry->length = length;
+   entry->next = NULL;
+
+   if(NULL == client->tx_tail)
+      client->tx_head = entry;
+   else
+      client->tx_tail->next = entry;
+   client->tx_tail = entry;
+   client->tx_pending += length;
+   return true;
+}
+
+bool microhttpd_TxQueueCopy(struct md_client *client, const void *data, uint32_t length)
+{
+   struct md_tx_entry *tail = client->tx_tail;
+   struct md_buffer *buffer;
+   uint32_t room;
+   bool result;
+
+   if(0 == length)
+      return true;
+
+   /* Small writes are appended to the last queued buffer when it is private to this client */
+   if(NULL != tail && atomic_load_explicit(&tail->buffer->refcount, memory_order_relaxed) == 1
+   && tail->offset + tail->length == tail->buffer->length)
+   {
+      buffer = tail->buffer;
+      room = buffer->capacity - buffer->length;
+      if(room > length)
+         room = length;
+      memcpy(&buffer->data[buffer->length], data, room);
+      buffer->length += room;
+      tail->length += room;
+      client->tx_pending += room;
+      data = (const char *) data + room;
+      length -= room;
+      if(0 == length)
+         return true;
+   }
+
+   buffer = microhttpd_BufferAlloc((length > MICROHTTPD_TX_MIN_BUFFER) ? length : MICROHTTPD_TX_MIN_BUFFER);
+   if(NULL == buffer)
+      return false;
+   memcpy(buffer->data, data, length);
+   buffer->length = length;
+   result = microhttpd_TxQueueBuffer(client, buffer, 0, length);
+   microhttpd_BufferRelease(buffer);
+   return result;
+}
+
+uint32_t microhttpd_TxFill(struct md_client *client, struct iovec *iov, uint32_t max_count)
+{
+   struct md_tx_entry *entry;
+   uint32_t count = 0;
+
+   for(entry = client->tx_head; NULL != entry && count < max_count; entry = entry->next, ++count)
+   {
+      iov[count].iov_base = &entry->buffer->data[entry->offset];
+      iov[count].iov_len = entry->length;
+   }
+   return count;
+}
+
+void microhttpd_TxConsume(struct md_client *client, uint32_t length)
+{
+   MH_ASSERT(length <= client->tx_pending);
+
+   client->tx_pending -= length;
+   while(length > 0 && NULL != client->tx_head)
+   {
+      struct md_tx_entry *entry = client->tx_head;
+      if(length < entry->length)
+      {
+         entry->offset += length;
+         entry->length -= length;
+         break;
+      }
+
+      length -= entry->length;
+      client->tx_head = entry->next;
+      if(NULL == client->tx_head)
+         client->tx_tail = NULL;
+      microhttpd_BufferRelease(entry->buffer);
+      free(entry);
+   }
+   if(NULL != client->proxy_peer)
+      microhttpd_ProxyDrained(client);
+}
+
+/*! Write as much queued data as the transport accepts. Returns 0 when the queue is empty, 1 when
+ *  data remains queued, and -1 on a transport error. */
+int microhttpd_TxFlush(struct md_client *client)
+{
+   struct iovec iov[MICROHTTPD_TX_MAX_IOV];
+   uint32_t count;
+   int32_t result;
+
+   while(client->tx_pending > 0)
+   {
+      count = microhttpd_TxFill(client, iov, ARRAY_SIZE(iov));
+      result = client->transport->writev(client, iov, count);
+      if(result < 0)
+      {
+         if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+         MH_DBG("%s: Write failed (errno %d)\n", __func__, errno);
+         return -1;
+      }
+      if(0 == result)
+         return 1;
+      MH_TRACE(client, WRITE, result);
+      microhttpd_TxConsume(client, result);
+   }
+
+   return 0;
+}
+
+void microhttpd_TxClear(struct md_client *client)
+{
+   microhttpd_TxConsume(client, client->tx_pending);
+   MH_ASSERT(NULL == client->tx_head);
+}
@@ -0,0 +1,46 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file tx.h
+ *  \brief microhttpd client transmit queue
+ */
+#ifndef _MICROHTTPD_TX_H
+#define _MICROHTTPD_TX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+struct md_client;
+
+/*! Reference-counted output data. A buffer can be queued to any number of clients without being
+ *  copied; it is freed when the last reference is released. */
+struct md_buffer
+{
+   atomic_uint refcount;
+   uint32_t capacity;
+   uint32_t length;
+   char data[];
+};
+
+struct md_tx_entry
+{
+   struct md_buffer *buffer;
+   uint32_t offset;  /* Start of unsent data within buffer */
+   uint32_t length;  /* Remaining unsent bytes */
+   struct md_tx_entry *next;
+};
+
+struct md_buffer *microhttpd_BufferAlloc(uint32_t capacity);
+struct md_buffer *microhttpd_BufferRef(struct md_buffer *buffer);
+void microhttpd_BufferRelease(struct md_buffer *buffer);
+
+bool microhttpd_TxQueueBuffer(struct md_client *client, struct md_buffer *buffer, uint32_t offset,
+   uint32_t length);
+bool microhttpd_TxQueueCopy(struct md_client *client, const void *data, uint32_t length);
+uint32_t microhttpd_TxFill(struct md_client *client, struct iovec *iov, uint32_t max_count);
+void microhttpd_TxConsume(struct md_client *client, uint32_t length);
+int microhttpd_TxFlush(struct md_client *client);
+void microhttpd_TxClear(struct md_client *client);
+
+#endif /* _MICROHTTPD_TX_H */
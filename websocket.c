@@ -0,0 +1,577 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file websocket.c
+ *  \brief microhttpd WebSockets (RFC 6455)
+ *
+ *  A GET handler upgrades its connection with microhttpd_websocket_accept(). Frames are then parsed
+ *  incrementally by the client state machine. A message that arrives whole in the receive buffer is
+ *  unmasked in place and handed to the handler without being copied; fragmented or partially
+ *  received messages are collected in a per-connection buffer first.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/uio.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#include <arm_neon.h>
+#define MICROHTTPD_WEBSOCKET_NEON
+#endif
+#include "debug.h"
+#include "helpers.h"
+#include "client.h"
+#include "websocket.h"
+#include "trace.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_KEY_LENGTH 24    /* Base64 of a 16 byte nonce */
+#define WEBSOCKET_ACCEPT_LENGTH 28 /* Base64 of a SHA-1 digest */
+
+#define WEBSOCKET_STATUS_PROTOCOL_ERROR 1002
+#define WEBSOCKET_STATUS_TOO_BIG        1009
+
+static const char *HANDSHAKE_RESPONSE = "HTTP/1.1 101 Switching Protocols\r\n"
+                                        "Server: " MICROHTTPD_SERVER_NAME "\r\n"
+                                        "Upgrade: websocket\r\n"
+                                        "Connection: Upgrade\r\n"
+                                        "Sec-WebSocket-Accept: %s\r\n"
+                                        "\r\n";
+
+static bool state_WebSocketPayload(struct md_client *client, uint32_t *consumed, bool *error);
+static bool state_WebSocketClosing(struct md_client *client, uint32_t *consumed, bool *error);
+static bool microhttpd_WebSocketControl(struct md_client *client, uint8_t opcode, const uint8_t *payload,
+   uint32_t length, bool *error);
+static bool microhttpd_WebSocketFail(struct md_client *client, uint16_t status);
+static int microhttpd_WebSocketSendClose(struct md_client *client, const uint8_t *payload, uint32_t length);
+static uint64_t microhttpd_WebSocketClock(void);
+static void microhttpd_Sha1(const uint8_t *data, uint32_t length, uint8_t digest[20]);
+static void microhttpd_Base64(const uint8_t *data, uint32_t length, char *out);
+
+/* -------------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+int microhttpd_websocket_accept(tMicroHttpdClient client, tMicroHttpdWebSocketHandler handler,
+   void *cookie)
+{
+   struct md_client *c = (struct md_client *) client;
+   const char *upgrade, *connection, *version, *key;
+   char input[WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID)];
+   char accept[WEBSOCKET_ACCEPT_LENGTH + 1];
+   char response[160];
+   uint8_t digest[20];
+   struct md_websocket *ws;
+   struct iovec iov;
+
+   if(NULL == handler || NULL != c->deferred || NULL != c->channel || NULL != c->websocket
+   || NULL != c->stream || MICROHTTPD_METHOD_GET != c->method)
+   {
+      MH_DBG("%s: Only available for HTTP/1.1 GET requests, not deferred, offloaded or already upgraded\n",
+         __func__);
+      return -1;
+   }
+
+   upgrade = microhttpd_HeaderValue(c, "upgrade");
+   connection = microhttpd_HeaderValue(c, "connection");
+   version = microhttpd_HeaderValue(c, "sec-websocket-version");
+   key = microhttpd_HeaderValue(c, "sec-websocket-key");
+   if(NULL == upgrade || !string_has_token(upgrade, "websocket")
+   || NULL == connection || !string_has_token(connection, "upgrade")
+   || NULL == version || strncmp(version, "13", 2) != 0
+   || NULL == key || strspn(key, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=")
+      != WEBSOCKET_KEY_LENGTH)
+   {
+      MH_DBG("%s: Not a valid WebSocket upgrade request\n", __func__);
+      return -1;
+   }
+
+   memcpy(input, key, WEBSOCKET_KEY_LENGTH);
+   memcpy(&input[WEBSOCKET_KEY_LENGTH], WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+   microhttpd_Sha1((const uint8_t *) input, sizeof(input) - 1, digest);
+   microhttpd_Base64(digest, sizeof(digest), accept);
+
+   ws = (struct md_websocket *) malloc(sizeof(*ws));
+   if(NULL == ws)
+   {
+      MH_DBG("%s: Failed to allocate WebSocket state\n", __func__);
+      return -1;
+   }
+   memset(ws, 0, sizeof(*ws));
+   ws->handler = handler;
+   ws->cookie = cookie;
+   ws->active = true;
+
+   iov.iov_base = response;
+   iov.iov_len = snprintf(response, sizeof(response), HANDSHAKE_RESPONSE, accept);
+   if(microhttpd_ClientSend(c, &iov, 1) < 0)
+   {
+      MH_DBG("%s: Failed to send handshake response\n", __func__);
+      free(ws);
+      return -1;
+   }
+
+   MH_DBG("%s: %s upgraded to WebSocket\n", __func__, microhttpd_SourceAddress(c));
+   c->websocket = ws;
+   return 0;
+}
+
+int microhttpd_websocket_send(tMicroHttpdClient client, uint8_t opcode, const void *data,
+   uint32_t length)
+{
+   struct md_client *c = (struct md_client *) client;
+   struct iovec iov[2];
+   uint8_t header[10];
+   uint32_t header_length = 2;
+
+   if(NULL == c->websocket || c->websocket->close_sent)
+      return -1;
+   if(opcode >= MICROHTTPD_WEBSOCKET_CLOSE && length > 125)
+      return -1; /* Control frames can't be fragmented */
+
+   header[0] = 0x80 | (opcode & 0x0f);
+   if(length < 126)
+   {
+      header[1] = length;
+   }
+   else if(length <= 0xffff)
+   {
+      header[1] = 126;
+      header[2] = length >> 8;
+      header[3] = length;
+      header_length = 4;
+   }
+   else
+   {
+      header[1] = 127;
+      memset(&header[2], 0, 4);
+      header[6] = length >> 24;
+      header[7] = length >> 16;
+      header[8] = length >> 8;
+      header[9] = length;
+      header_length = 10;
+   }
+
+   /* The payload goes out straight from the caller's buffer unless it has to be queued */
+   iov[0].iov_base = header;
+   iov[0].iov_len = header_length;
+   iov[1].iov_base = (void *) data;
+   iov[1].iov_len = (NULL != data) ? length : 0;
+   if(microhttpd_ClientSend(c, iov, 2) < 0)
+   {
+      MH_DBG("%s: Failed to send %"PRIu32" byte frame\n", __func__, length);
+      return -1;
+   }
+
+   return 0;
+}
+
+int microhttpd_websocket_close(tMicroHttpdClient client, uint16_t status)
+{
+   uint8_t payload[2] = { status >> 8, status & 0xff };
+   return microhttpd_WebSocketSendClose((struct md_client *) client, payload, (0 != status) ? 2 : 0);
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Internal Functions
+ */
+
+bool state_WebSocketFrame(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_websocket *ws = client->websocket;
+   uint8_t *rx = (uint8_t *) client->rx_buffer;
+   uint32_t header_length = 6; /* Two fixed bytes plus the masking key */
+   uint64_t length;
+   uint8_t opcode, *payload;
+   bool fin;
+
+   MH_TRACE(client, STATE_WEBSOCKET_FRAME, client->rx_size);
+   if(client->rx_size < 2)
+      return false;
+   fin = (rx[0] & 0x80) != 0;
+   opcode = rx[0] & 0x0f;
+   length = rx[1] & 0x7f;
+   if(126 == length)
+      header_length += 2;
+   else if(127 == length)
+      header_length += 8;
+   if(client->rx_size < header_length)
+      return false;
+
+   if(126 == length)
+   {
+      length = ((uint32_t) rx[2] << 8) | rx[3];
+   }
+   else if(127 == length)
+   {
+      length = 0;
+      for(uint32_t idx = 2; idx < 10; ++idx)
+         length = (length << 8) | rx[idx];
+   }
+
+   if((rx[0] & 0x70) != 0 || (rx[1] & 0x80) == 0)
+   {
+      MH_DBG("%s: Reserved bits set or frame not masked\n", __func__);
+      return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_PROTOCOL_ERROR);
+   }
+   if(length & (1ULL << 63))
+   {
+      MH_DBG("%s: Most significant bit of 64-bit length set\n", __func__);
+      return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_PROTOCOL_ERROR);
+   }
+   if(opcode >= MICROHTTPD_WEBSOCKET_CLOSE)
+   {
+      if(!fin || length > 125)
+         return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_PROTOCOL_ERROR);
+      if(header_length + length > client->rx_buffer_size)
+         return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_TOO_BIG);
+      if(client->rx_size < header_length + length)
+         return false; /* Control frames are handled whole */
+   }
+   else if((0 == opcode) ? (0 == ws->message_opcode)
+      : (opcode > MICROHTTPD_WEBSOCKET_BINARY || 0 != ws->message_opcode))
+   {
+      MH_DBG("%s: Unexpected opcode %u\n", __func__, opcode);
+      return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_PROTOCOL_ERROR);
+   }
+   else if(length > MICROHTTPD_WEBSOCKET_MAX_MESSAGE - ws->message_length) /* Can't wrap */
+   {
+      MH_DBG("%s: %"PRIu64" byte frame exceeds message limit\n", __func__, length);
+      return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_TOO_BIG);
+   }
+
+   memcpy(ws->mask, &rx[header_length - 4], 4);
+   ws->active = true;
+   payload = &rx[header_length];
+
+   if(opcode >= MICROHTTPD_WEBSOCKET_CLOSE)
+   {
+      microhttpd_WebSocketUnmask(payload, length, ws->mask, 0);
+      *consumed = header_length + length;
+      return microhttpd_WebSocketControl(client, opcode, payload, length, error);
+   }
+
+   if(fin && 0 != opcode && client->rx_size >= header_length + length)
+   {
+      /* Complete message in the receive buffer; deliver it from there */
+      microhttpd_WebSocketUnmask(payload, length, ws->mask, 0);
+      *consumed = header_length + length;
+      MH_TRACE(client, HANDLER_ENTER, client->method);
+      ws->handler((tMicroHttpdClient) client, opcode, (const char *) payload, length, ws->cookie);
+      MH_TRACE(client, HANDLER_EXIT, client->method);
+      return true;
+   }
+
+   if(ws->message_length + length > ws->message_capacity)
+   {
+      char *message = realloc(ws->message, ws->message_length + length);
+      if(NULL == message)
+      {
+         MH_DBG("%s: Failed to allocate %"PRIu64" byte message buffer\n", __func__,
+            ws->message_length + length);
+         *error = true;
+         return false;
+      }
+      ws->message = message;
+      ws->message_capacity = ws->message_length + length;
+   }
+   if(0 != opcode)
+      ws->message_opcode = opcode;
+   ws->frame_fin = fin;
+   ws->frame_remaining = length;
+   ws->frame_offset = 0;
+
+   *consumed = header_length;
+   client->state = state_WebSocketPayload;
+   return true;
+}
+
+/*! Release WebSocket state when its connection is removed, telling the handler it's gone */
+void microhttpd_WebSocketRemoved(struct md_client *client)
+{
+   struct md_websocket *ws = client->websocket;
+
+   if(NULL == ws)
+      return;
+
+   client->websocket = NULL; /* The handler can no longer send */
+   MH_TRACE(client, HANDLER_ENTER, client->method);
+   ws->handler((tMicroHttpdClient) client, MICROHTTPD_WEBSOCKET_CLOSE, NULL, 0, ws->cookie);
+   MH_TRACE(client, HANDLER_EXIT, client->method);
+   free(ws->message);
+   free(ws);
+}
+
+/*! Ping every WebSocket once per interval; close those that sent nothing since the previous ping */
+void microhttpd_WebSocketKeepalive(struct md_context *ctx)
+{
+   struct md_client *client, *next;
+   uint64_t now;
+
+   if(0 == ctx->params.websocket_ping_interval)
+      return;
+   now = microhttpd_WebSocketClock();
+   if(now < ctx->websocket_ping_time)
+      return;
+   ctx->websocket_ping_time = now + ctx->params.websocket_ping_interval;
+
+   for(client = ctx->client_list; NULL != client; client = next)
+   {
+      struct md_websocket *ws = client->websocket;
+
+      next = client->next;
+      if(NULL == ws)
+         continue;
+      if(!ws->active && (ws->ping_outstanding || ws->close_sent))
+      {
+         MH_DBG("%s: Closing unresponsive WebSocket %s\n", __func__, microhttpd_SourceAddress(client));
+         microhttpd_RemoveClient(ctx, client);
+         continue;
+      }
+      ws->active = false;
+      ws->ping_outstanding = (microhttpd_websocket_send((tMicroHttpdClient) client,
+         MICROHTTPD_WEBSOCKET_PING, NULL, 0) == 0);
+   }
+}
+
+void microhttpd_WebSocketUnmask(uint8_t *data, uint32_t length, const uint8_t mask[4], uint32_t offset)
+{
+   uint8_t key[4];
+   uint32_t key32, idx = 0;
+   uint64_t key64;
+
+   for(idx = 0; idx < 4; ++idx)
+      key[idx] = mask[(offset + idx) & 3];
+   memcpy(&key32, key, sizeof(key32));
+   idx = 0;
+
+   /* Every block is a multiple of 4 bytes, so the key stays in phase */
+#if defined(__SSE2__)
+   {
+      __m128i key128 = _mm_set1_epi32((int) key32);
+      for(; idx + 16 <= length; idx += 16)
+      {
+         __m128i block = _mm_loadu_si128((const __m128i *) &data[idx]);
+         _mm_storeu_si128((__m128i *) &data[idx], _mm_xor_si128(block, key128));
+      }
+   }
+#elif defined(MICROHTTPD_WEBSOCKET_NEON)
+   {
+      uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+      for(; idx + 16 <= length; idx += 16)
+         vst1q_u8(&data[idx], veorq_u8(vld1q_u8(&data[idx]), key128));
+   }
+#endif
+   key64 = ((uint64_t) key32 << 32) | key32;
+   for(; idx + 8 <= length; idx += 8)
+   {
+      uint64_t block;
+      memcpy(&block, &data[idx], sizeof(block));
+      block ^= key64;
+      memcpy(&data[idx], &block, sizeof(block));
+   }
+   for(; idx < length; ++idx)
+      data[idx] ^= key[idx & 3];
+}
+
+/* -------------------------------------------------------------------------------------------------
+ * Private Functions
+ */
+
+/*! After a closing frame has been sent or echoed, anything else the peer sends is ignored */
+static bool state_WebSocketClosing(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   MH_TRACE(client, STATE_WEBSOCKET_CLOSING, client->rx_size);
+   *consumed = client->rx_size;
+   return false;
+}
+
+/*! Collect the payload of a frame that didn't arrive whole, delivering the message once complete */
+static bool state_WebSocketPayload(struct md_client *client, uint32_t *consumed, bool *error)
+{
+   struct md_websocket *ws = client->websocket;
+   uint32_t chunk = ws->frame_remaining;
+
+   MH_TRACE(client, STATE_WEBSOCKET_PAYLOAD, client->rx_size);
+   if(chunk > client->rx_size)
+      chunk = client->rx_size;
+   if(0 == chunk && ws->frame_remaining > 0)
+      return false;
+
+   memcpy(&ws->message[ws->message_length], client->rx_buffer, chunk);
+   microhttpd_WebSocketUnmask((uint8_t *) &ws->message[ws->message_length], chunk, ws->mask,
+      ws->frame_offset);
+   ws->message_length += chunk;
+   ws->frame_offset += chunk;
+   ws->frame_remaining -= chunk;
+   *consumed = chunk;
+   if(ws->frame_remaining > 0)
+      return true;
+
+   client->state = state_WebSocketFrame;
+   if(ws->frame_fin)
+   {
+      MH_TRACE(client, HANDLER_ENTER, client->method);
+      ws->handler((tMicroHttpdClient) client, ws->message_opcode, ws->message, ws->message_length,
+         ws->cookie);
+      MH_TRACE(client, HANDLER_EXIT, client->method);
+
+      /* Large messages are rare; don't keep their buffer around */
+      free(ws->message);
+      ws->message = NULL;
+      ws->message_length = ws->message_capacity = 0;
+      ws->message_opcode = 0;
+   }
+   return true;
+}
+
+static bool microhttpd_WebSocketControl(struct md_client *client, uint8_t opcode, const uint8_t *payload,
+   uint32_t length, bool *error)
+{
+   switch(opcode)
+   {
+      case MICROHTTPD_WEBSOCKET_PING:
+         microhttpd_websocket_send((tMicroHttpdClient) client, MICROHTTPD_WEBSOCKET_PONG, payload, length);
+         break;
+      case MICROHTTPD_WEBSOCKET_PONG:
+         client->websocket->ping_outstanding = false;
+         break;
+      case MICROHTTPD_WEBSOCKET_CLOSE:
+         MH_DBG("%s: Close received from %s\n", __func__, microhttpd_SourceAddress(client));
+         if(client->websocket->close_sent)
+         {
+            *error = true; /* Reply to our close; the closing handshake is complete */
+            return false;
+         }
+         microhttpd_WebSocketSendClose(client, payload, (length >= 2) ? 2 : 0); /* Echo the status */
+         client->state = state_WebSocketClosing;
+         break;
+      default:
+         return microhttpd_WebSocketFail(client, WEBSOCKET_STATUS_PROTOCOL_ERROR);
+   }
+   return true;
+}
+
+/*! The closing frame may still be queued, so the connection isn't dropped here; the peer closes it
+ *  once it has read the frame, or the keepalive sweep does. */
+static bool microhttpd_WebSocketFail(struct md_client *client, uint16_t status)
+{
+   MH_DBG("%s: Closing WebSocket %s (status %u)\n", __func__, microhttpd_SourceAddress(client), status);
+   microhttpd_websocket_close((tMicroHttpdClient) client, status);
+   client->state = state_WebSocketClosing;
+   return true;
+}
+
+static int microhttpd_WebSocketSendClose(struct md_client *client, const uint8_t *payload, uint32_t length)
+{
+   int result;
+
+   if(NULL == client->websocket || client->websocket->close_sent)
+      return -1;
+   result = microhttpd_websocket_send((tMicroHttpdClient) client, MICROHTTPD_WEBSOCKET_CLOSE, payload,
+      length);
+   client->websocket->close_sent = true;
+   return result;
+}
+
+static uint64_t microhttpd_WebSocketClock(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#define SHA1_ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*! SHA-1, needed only for the handshake's Sec-WebSocket-Accept value */
+static void microhttpd_Sha1(const uint8_t *data, uint32_t length, uint8_t digest[20])
+{
+   uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+   uint64_t bits = (uint64_t) length * 8;
+   uint32_t total = ((length + 8) / 64 + 1) * 64; /* Message, 0x80, padding and length */
+   uint32_t block, idx;
+
+   for(block = 0; block < total; block += 64)
+   {
+      uint32_t w[80], a, b, c, d, e;
+
+      for(idx = 0; idx < 64; ++idx)
+      {
+         uint32_t pos = block + idx;
+         uint8_t byte;
+
+         if(pos < length)
+            byte = data[pos];
+         else if(pos == length)
+            byte = 0x80;
+         else if(pos >= total - 8)
+            byte = bits >> (8 * (total - 1 - pos));
+         else
+            byte = 0;
+         if(0 == (idx & 3))
+            w[idx / 4] = 0;
+         w[idx / 4] |= (uint32_t) byte << (8 * (3 - (idx & 3)));
+      }
+      for(idx = 16; idx < 80; ++idx)
+         w[idx] = SHA1_ROTATE(w[idx - 3] ^ w[idx - 8] ^ w[idx - 14] ^ w[idx - 16], 1);
+
+      a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+      for(idx = 0; idx < 80; ++idx)
+      {
+         uint32_t f, k, temp;
+
+         if(idx < 20)
+         {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+         }
+         else if(idx < 40)
+         {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+         }
+         else if(idx < 60)
+         {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+         }
+         else
+         {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+         }
+         temp = SHA1_ROTATE(a, 5) + f + e + k + w[idx];
+         e = d;
+         d = c;
+         c = SHA1_ROTATE(b, 30);
+         b = a;
+         a = temp;
+      }
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+   }
+
+   for(idx = 0; idx < 20; ++idx)
+      digest[idx] = h[idx / 4] >> (8 * (3 - (idx & 3)));
+}
+
+static void microhttpd_Base64(const uint8_t *data, uint32_t length, char *out)
+{
+   static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   uint32_t idx;
+
+   for(idx = 0; idx < length; idx += 3)
+   {
+      uint32_t group = (uint32_t) data[idx] << 16;
+      if(idx + 1 < length)
+         group |= (uint32_t) data[idx + 1] << 8;
+      if(idx + 2 < length)
+         group |= data[idx + 2];
+
+      *out++ = alphabet[(group >> 18) & 0x3f];
+      *out++ = alphabet[(group >> 12) & 0x3f];
+      *out++ = (idx + 1 < length) ? alphabet[(group >> 6) & 0x3f] : '=';
+      *out++ = (idx + 2 < length) ? alphabet[group & 0x3f] : '=';
+   }
+   *out = '\0';
+}
@@ -0,0 +1,46 @@
+/*! \copyright 2023 Zorxx Software. All rights reserved.
+ *  \license This file is released under the MIT License. See the LICENSE file for details.
+ *  \file websocket.h
+ *  \brief microhttpd WebSockets (RFC 6455)
+ */
+#ifndef _MICROHTTPD_WEBSOCKET_H
+#define _MICROHTTPD_WEBSOCKET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "microhttpd_private.h"
+
+#if !defined(MICROHTTPD_WEBSOCKET_MAX_MESSAGE)
+#define MICROHTTPD_WEBSOCKET_MAX_MESSAGE (64 * 1024) /* Larger messages close the connection (1009) */
+#endif
+
+struct md_websocket
+{
+   tMicroHttpdWebSocketHandler handler;
+   void *cookie;
+
+   /* Frame whose payload is being received */
+   uint8_t mask[4];
+   bool frame_fin;
+   uint32_t frame_remaining;
+   uint32_t frame_offset;     /* Payload bytes already received; selects the mask phase */
+
+   /* Message reassembled from fragments, or from a frame that didn't arrive in one piece */
+   uint8_t message_opcode;    /* 0 when no message is in progress */
+   char *message;
+   uint32_t message_length, message_capacity;
+
+   /* Keepalive */
+   bool active;               /* A frame arrived since the last ping */
+   bool ping_outstanding;
+   bool close_sent;
+};
+
+bool state_WebSocketFrame(struct md_client *client, uint32_t *consumed, bool *error);
+void microhttpd_WebSocketRemoved(struct md_client *client);
+void microhttpd_WebSocketKeepalive(struct md_context *ctx);
+
+/*! XOR data with the 4-byte masking key, starting at the given payload offset */
+void microhttpd_WebSocketUnmask(uint8_t *data, uint32_t length, const uint8_t mask[4], uint32_t offset);
+
+#endif /* _MICROHTTPD_WEBSOCKET_H */